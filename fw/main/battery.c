@@ -5,6 +5,7 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <stdio.h> // snprintf
+#include <stdlib.h> // atof
 #include <driver/adc.h> // adc2_get_raw
 #include <driver/gpio.h> // gpio_pullup_en
 #include <esp_log.h> // ESP_LOGI
@@ -22,8 +23,31 @@ battery_format(void *data, char *buf, int size)
     return snprintf(buf, size, "\"battery\":%.3f", *fvalue);
 }
 
-static const struct datalog_type_s battery_info = {
+// Voltage is stored as a 16bit millivolt value
+static int
+battery_pack(void *data, uint8_t *buf, uint64_t *ptime)
+{
+    float *fvalue = data;
+    int mv = *fvalue * 1000.0f + 0.5f;
+    mv = mv < 0 ? 0 : (mv > 0xffff ? 0xffff : mv);
+    buf[0] = mv;
+    buf[1] = mv >> 8;
+    return 2;
+}
+
+static int
+battery_unpack(uint8_t *buf, void *data, uint64_t *ptime)
+{
+    float *fvalue = data;
+    *fvalue = ((buf[1] << 8) | buf[0]) / 1000.0f;
+    return 2;
+}
+
+const struct datalog_type_s battery_info = {
+    .id = DLT_BATTERY,
     .length = sizeof(float),
+    .pack = battery_pack,
+    .unpack = battery_unpack,
     .format = battery_format,
 };
 
@@ -4,15 +4,40 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <string.h> // memcpy
 #include <driver/i2c.h> // i2c_param_config
 #include <esp_attr.h> // RTC_DATA_ATTR
 #include <esp_log.h> // ESP_LOGW
+#include <esp_timer.h> // esp_timer_get_time
+#include <esp32/rom/ets_sys.h> // ets_delay_us
+#include <soc/gpio_reg.h> // GPIO_IN_REG
+#include <soc/gpio_sig_map.h> // SIG_GPIO_OUT_IDX
+#include <soc/io_mux_reg.h> // PIN_FUNC_SELECT
 #include "bme280.h" // bme280_sense
 #include "datalog.h" // datalog_append
 #include "deepsleep.h" // deepsleep_is_wake_from_sleep
+#include "timing.h" // timing_note
 #include "sdkconfig.h" // CONFIG_BME280_SDA_GPIO
 
-#define I2C_FREQUENCY 100000
+#define I2C_FREQUENCY 400000
+
+// Register settings for a "forced mode" measurement
+#define BME280_CTRL_HUM CONFIG_BME280_OSRS_H
+#define BME280_CTRL_MEAS ((CONFIG_BME280_OSRS_T << 5)           \
+                          | (CONFIG_BME280_OSRS_P << 2) | 0x1)
+#define BME280_CONFIG (CONFIG_BME280_IIR_FILTER << 2)
+#define BME280_DATA_SIZE 8
+
+// Measurement time in us (from the bme280 datasheet, section 9.1)
+#define OSRS_MULT(osrs) ((osrs) ? 1 << ((osrs) - 1) : 0)
+#define MEAS_TIME(base, per, extra)                                     \
+    ((base) + (per) * OSRS_MULT(CONFIG_BME280_OSRS_T)                   \
+     + (CONFIG_BME280_OSRS_P ? (per) * OSRS_MULT(CONFIG_BME280_OSRS_P)  \
+        + (extra) : 0)                                                  \
+     + (per) * OSRS_MULT(CONFIG_BME280_OSRS_H) + (extra))
+#define BME280_MEAS_TYPICAL MEAS_TIME(1000, 2000, 500)
+#define BME280_MEAS_MAX MEAS_TIME(1250, 2300, 575)
+#define BME280_POLL_TIME 250
 
 static const char *TAG = "BME280";
 
@@ -39,15 +64,15 @@ i2c_init(void)
     return i2c_param_config(I2C_NUM_0, &conf);
 }
 
+// Write a list of register/value pairs in a single transaction
 static int
-i2c_write(uint8_t reg, uint8_t data)
+i2c_write(uint8_t *data, int len)
 {
     int i2c_addr = CONFIG_BME280_I2C_ADDR;
     i2c_cmd_handle_t cmd = i2c_cmd_link_create();
     i2c_master_start(cmd);
     i2c_master_write_byte(cmd, i2c_addr << 1 | I2C_MASTER_WRITE, 1);
-    i2c_master_write_byte(cmd, reg, 1);
-    i2c_master_write_byte(cmd, data, 1);
+    i2c_master_write(cmd, data, len, 1);
     i2c_master_stop(cmd);
     esp_err_t ret = i2c_master_cmd_begin(I2C_NUM_0, cmd, 50 / portTICK_RATE_MS);
     i2c_cmd_link_delete(cmd);
@@ -135,13 +160,6 @@ bme280_configure(void)
     calib.dig_H4 = (data[3] << 4) | (data[4] & 0x0f);
     calib.dig_H5 = (data[4] >> 4) | (data[5] << 4);
     calib.dig_H6 = data[6];
-
-    // Setup humidity control
-    uint8_t ctrl_hum = 0x1;
-    ret = i2c_write(0xf2, ctrl_hum);
-    if (ret)
-        goto fail;
-
     return 0;
 
 fail:
@@ -174,6 +192,9 @@ static float
 bme280_calc_pressure(int32_t t_fine, uint8_t *data)
 {
     int32_t adc_P = (data[0] << 12) | (data[1] << 4) | (data[2] >> 4);
+    if (adc_P == 0x80000)
+        // Pressure measurement skipped
+        return 0.;
     int64_t dig_P1 = calib.dig_P1, dig_P2 = calib.dig_P2, dig_P3 = calib.dig_P3;
     int64_t dig_P4 = calib.dig_P4, dig_P5 = calib.dig_P5, dig_P6 = calib.dig_P6;
     int64_t dig_P7 = calib.dig_P7, dig_P8 = calib.dig_P8, dig_P9 = calib.dig_P9;
@@ -230,26 +251,163 @@ static int
 bme280_format(void *data, char *buf, int size)
 {
     struct bme280_s *b = data;
+    if (!b->pressure)
+        return snprintf(buf, size, "\"temperature\":%.2f,\"humidity\":%.1f"
+                        , b->temperature, b->humidity);
     return snprintf(buf, size
                     , "\"temperature\":%.2f,\"pressure\":%.1f,\"humidity\":%.1f"
                     , b->temperature, b->pressure, b->humidity);
 }
 
-static const struct datalog_type_s bme280_info = {
+// Measurements are stored as 16bit fixed point values
+static inline int
+pack_fixed(float v, float scale, int min, int max)
+{
+    int iv = v * scale + (v < 0.0f ? -0.5f : 0.5f);
+    return iv < min ? min : (iv > max ? max : iv);
+}
+
+static inline void
+put_short(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static int
+bme280_pack(void *data, uint8_t *buf, uint64_t *ptime)
+{
+    struct bme280_s *b = data;
+    put_short(&buf[0], pack_fixed(b->temperature, 100.0f, -32768, 32767));
+    put_short(&buf[2], pack_fixed(b->pressure, 10.0f, 0, 65535));
+    put_short(&buf[4], pack_fixed(b->humidity, 100.0f, 0, 65535));
+    return 6;
+}
+
+static int
+bme280_unpack(uint8_t *buf, void *data, uint64_t *ptime)
+{
+    struct bme280_s *b = data;
+    b->temperature = (int16_t)load_short(&buf[0]) / 100.0f;
+    b->pressure = load_short(&buf[2]) / 10.0f;
+    b->humidity = load_short(&buf[4]) / 100.0f;
+    return 6;
+}
+
+const struct datalog_type_s bme280_info = {
+    .id = DLT_BME280,
     .length = sizeof(struct bme280_s),
+    .pack = bme280_pack,
+    .unpack = bme280_unpack,
     .format = bme280_format,
 };
 
+// Calculate calibrated values from the raw sensor registers
+static void
+bme280_compensate(uint8_t *data, struct bme280_s *b)
+{
+    int32_t t_fine = bme280_calc_t_fine(data);
+    b->temperature = bme280_calc_temperature(t_fine);
+    b->pressure = bme280_calc_pressure(t_fine, data);
+    b->humidity = bme280_calc_humidity(t_fine, data);
+}
+
+// Measurements taken from the wake stub (or with
+// CONFIG_BME280_STORE_RAW) store the raw sensor registers and are
+// calibrated when formatted
+struct bme280_raw_s {
+    uint8_t data[BME280_DATA_SIZE];
+};
+
+static int
+bme280_raw_format(void *data, char *buf, int size)
+{
+    struct bme280_raw_s *r = data;
+#if CONFIG_BME280_PUBLISH_RAW
+    // Calibration is performed on the host (see scripts/decode_raw.py)
+    uint8_t *d = r->data;
+    return snprintf(buf, size
+                    , "\"bme280_raw\":\"%02x%02x%02x%02x%02x%02x%02x%02x\""
+                    , d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]);
+#else
+    struct bme280_s b;
+    bme280_compensate(r->data, &b);
+    return bme280_format(&b, buf, size);
+#endif
+}
+
+const struct datalog_type_s bme280_raw_info = {
+    .id = DLT_BME280_RAW,
+    .length = sizeof(struct bme280_raw_s),
+    .format = bme280_raw_format,
+};
+
 
 /****************************************************************
  * Sensing
  ****************************************************************/
 
 static RTC_DATA_ATTR uint8_t did_init;
+static uint8_t last_data[BME280_DATA_SIZE];
+static int have_reading;
+
+// Report the measurement taken during this wake
+int
+bme280_get_reading(float *temperature, float *humidity)
+{
+    if (!have_reading)
+        return -1;
+    struct bme280_s b;
+    bme280_compensate(last_data, &b);
+    *temperature = b.temperature;
+    *humidity = b.humidity;
+    return 0;
+}
+
+// Report the sensor calibration (needed to decode raw measurements)
+int
+bme280_format_calibration(char *buf, int size)
+{
+    if (!did_init)
+        return -1;
+    struct bme280_calibration_s *c = &calib;
+    return snprintf(buf, size
+                    , "{\"T\":[%u,%d,%d],\"P\":[%u,%d,%d,%d,%d,%d,%d,%d,%d]"
+                    ",\"H\":[%u,%d,%u,%d,%d,%d]}"
+                    , c->dig_T1, c->dig_T2, c->dig_T3
+                    , c->dig_P1, c->dig_P2, c->dig_P3, c->dig_P4, c->dig_P5
+                    , c->dig_P6, c->dig_P7, c->dig_P8, c->dig_P9
+                    , c->dig_H1, c->dig_H2, c->dig_H3, c->dig_H4, c->dig_H5
+                    , c->dig_H6);
+}
+
+// Wait for a measurement to complete and read it (the status register
+// is read along with the data so that polling needs no extra requests)
+static int
+bme280_read_measurement(uint8_t *data)
+{
+    ets_delay_us(BME280_MEAS_TYPICAL);
+    uint8_t regs[0xfe - 0xf3 + 1];
+    int waited = BME280_MEAS_TYPICAL;
+    for (;;) {
+        int ret = i2c_read(0xf3, regs, sizeof(regs));
+        if (ret)
+            return ret;
+        if (!(regs[0] & 0x08))
+            break;
+        if (waited > BME280_MEAS_MAX)
+            return -1;
+        ets_delay_us(BME280_POLL_TIME);
+        waited += BME280_POLL_TIME;
+    }
+    memcpy(data, &regs[0xf7 - 0xf3], BME280_DATA_SIZE);
+    return 0;
+}
 
 void
 bme280_sense(void)
 {
+    int64_t start_time = esp_timer_get_time();
     int ret = i2c_init();
     if (ret)
         goto fail;
@@ -261,32 +419,215 @@ bme280_sense(void)
         did_init = 1;
     }
 
-    // XXX - configure oversampling?
-
-    // Request measurement
-    uint8_t cmd = (0x1 << 2) | (0x1 << 5) | 0x1;
-    ret = i2c_write(0xf4, cmd);
+    // Request measurement (ctrl_hum only takes effect after ctrl_meas)
+    uint8_t cmd[] = {
+        0xf2, BME280_CTRL_HUM, 0xf5, BME280_CONFIG, 0xf4, BME280_CTRL_MEAS
+    };
+    ret = i2c_write(cmd, sizeof(cmd));
     if (ret)
         goto fail;
-    vTaskDelay(18 / portTICK_PERIOD_MS); // XXX
 
     // Read data from sensor
-    uint8_t data[8];
-    ret = i2c_read(0xf7, data, sizeof(data));
+    uint8_t data[BME280_DATA_SIZE];
+    ret = bme280_read_measurement(data);
     if (ret)
         goto fail;
 
+#if CONFIG_BME280_STORE_RAW
+    // Store raw data (calibration is performed when uploaded)
+    datalog_append(&bme280_raw_info, data);
+#else
     // Calculate calibrated data and add to datalog
     struct bme280_s b;
-    int32_t t_fine = bme280_calc_t_fine(data);
-    b.temperature = bme280_calc_temperature(t_fine);
-    b.pressure = bme280_calc_pressure(t_fine, data);
-    b.humidity = bme280_calc_humidity(t_fine, data);
+    bme280_compensate(data, &b);
     ESP_LOGW(TAG, "append %.2f %.1f %.1f"
              , b.temperature, b.pressure, b.humidity);
     datalog_append(&bme280_info, &b);
+#endif
+    timing_note(TP_BME280, start_time);
+    memcpy(last_data, data, sizeof(last_data));
+    have_reading = 1;
     return;
 
 fail:
     ESP_LOGW(TAG, "bme280_sense error %d", ret);
 }
+
+
+/****************************************************************
+ * Wake stub sensing
+ ****************************************************************/
+
+#if CONFIG_WAKE_STUB
+
+// The deep sleep wake stub can not use the i2c driver (nor any code
+// or constant data in flash), so it accesses the sensor by toggling
+// the gpio registers directly. A line is driven low by enabling its
+// output (which is always low) and released by disabling the output
+// so that the pullup can bring it high.
+
+#if CONFIG_BME280_SDA_GPIO >= 32 || CONFIG_BME280_SCL_GPIO >= 32
+#error "The wake stub requires the BME280 to be on gpio 0-31"
+#endif
+
+#define SDA_BIT (1 << CONFIG_BME280_SDA_GPIO)
+#define SCL_BIT (1 << CONFIG_BME280_SCL_GPIO)
+#define STUB_I2C_DELAY 5 // ~100Khz
+#define _MUX_REG(pin) IO_MUX_GPIO ## pin ## _REG
+#define MUX_REG(pin) _MUX_REG(pin)
+
+static void RTC_IRAM_ATTR
+stub_line(uint32_t bit, int high)
+{
+    REG_WRITE(high ? GPIO_ENABLE_W1TC_REG : GPIO_ENABLE_W1TS_REG, bit);
+    ets_delay_us(STUB_I2C_DELAY);
+}
+
+static void RTC_IRAM_ATTR
+stub_scl_release(void)
+{
+    REG_WRITE(GPIO_ENABLE_W1TC_REG, SCL_BIT);
+    // Allow the sensor to stretch the clock
+    for (int i=0; i<1000 && !(REG_READ(GPIO_IN_REG) & SCL_BIT); i++)
+        ets_delay_us(1);
+    ets_delay_us(STUB_I2C_DELAY);
+}
+
+static int RTC_IRAM_ATTR
+stub_sda_read(void)
+{
+    return !!(REG_READ(GPIO_IN_REG) & SDA_BIT);
+}
+
+static void RTC_IRAM_ATTR
+stub_i2c_init(void)
+{
+    REG_WRITE(GPIO_ENABLE_W1TC_REG, SDA_BIT | SCL_BIT);
+    REG_WRITE(GPIO_OUT_W1TC_REG, SDA_BIT | SCL_BIT);
+    REG_WRITE(GPIO_FUNC0_OUT_SEL_CFG_REG + CONFIG_BME280_SDA_GPIO * 4
+              , SIG_GPIO_OUT_IDX);
+    REG_WRITE(GPIO_FUNC0_OUT_SEL_CFG_REG + CONFIG_BME280_SCL_GPIO * 4
+              , SIG_GPIO_OUT_IDX);
+    PIN_FUNC_SELECT(MUX_REG(CONFIG_BME280_SDA_GPIO), PIN_FUNC_GPIO);
+    PIN_FUNC_SELECT(MUX_REG(CONFIG_BME280_SCL_GPIO), PIN_FUNC_GPIO);
+    PIN_INPUT_ENABLE(MUX_REG(CONFIG_BME280_SDA_GPIO));
+    PIN_INPUT_ENABLE(MUX_REG(CONFIG_BME280_SCL_GPIO));
+    PIN_PULLUP_EN(MUX_REG(CONFIG_BME280_SDA_GPIO));
+    PIN_PULLUP_EN(MUX_REG(CONFIG_BME280_SCL_GPIO));
+}
+
+// Send an i2c start (or repeated start) condition
+static void RTC_IRAM_ATTR
+stub_i2c_start(void)
+{
+    stub_line(SDA_BIT, 1);
+    stub_scl_release();
+    stub_line(SDA_BIT, 0);
+    stub_line(SCL_BIT, 0);
+}
+
+static void RTC_IRAM_ATTR
+stub_i2c_stop(void)
+{
+    stub_line(SDA_BIT, 0);
+    stub_scl_release();
+    stub_line(SDA_BIT, 1);
+}
+
+// Transmit a byte - returns non-zero if the byte was not acknowledged
+static int RTC_IRAM_ATTR
+stub_i2c_write_byte(uint8_t data)
+{
+    for (int i=0; i<8; i++, data <<= 1) {
+        stub_line(SDA_BIT, data & 0x80);
+        stub_scl_release();
+        stub_line(SCL_BIT, 0);
+    }
+    stub_line(SDA_BIT, 1);
+    stub_scl_release();
+    int nack = stub_sda_read();
+    stub_line(SCL_BIT, 0);
+    return nack;
+}
+
+static uint8_t RTC_IRAM_ATTR
+stub_i2c_read_byte(int ack)
+{
+    uint8_t data = 0;
+    stub_line(SDA_BIT, 1);
+    for (int i=0; i<8; i++) {
+        stub_scl_release();
+        data = (data << 1) | stub_sda_read();
+        stub_line(SCL_BIT, 0);
+    }
+    stub_line(SDA_BIT, !ack);
+    stub_scl_release();
+    stub_line(SCL_BIT, 0);
+    return data;
+}
+
+static int RTC_IRAM_ATTR
+stub_i2c_write(uint8_t reg, uint8_t data)
+{
+    int i2c_addr = CONFIG_BME280_I2C_ADDR;
+    stub_i2c_start();
+    int ret = (stub_i2c_write_byte(i2c_addr << 1) || stub_i2c_write_byte(reg)
+               || stub_i2c_write_byte(data));
+    stub_i2c_stop();
+    return ret;
+}
+
+static int RTC_IRAM_ATTR
+stub_i2c_read(uint8_t reg, uint8_t *data, int len)
+{
+    int i2c_addr = CONFIG_BME280_I2C_ADDR;
+    stub_i2c_start();
+    int ret = stub_i2c_write_byte(i2c_addr << 1) || stub_i2c_write_byte(reg);
+    if (!ret) {
+        stub_i2c_start();
+        ret = stub_i2c_write_byte(i2c_addr << 1 | 1);
+    }
+    for (int i=0; !ret && i<len; i++)
+        data[i] = stub_i2c_read_byte(i < len - 1);
+    stub_i2c_stop();
+    return ret;
+}
+
+// Take a measurement from the deep sleep wake stub and add it to the
+// pending datalog record
+int RTC_IRAM_ATTR
+bme280_stub_sense(void)
+{
+    if (!did_init)
+        // Calibration not yet loaded - need a full boot
+        return -1;
+    stub_i2c_init();
+
+    // Request measurement and wait for it to complete (the humidity
+    // and filter settings are retained from the last full boot)
+    int ret = stub_i2c_write(0xf4, BME280_CTRL_MEAS);
+    if (ret)
+        return ret;
+    ets_delay_us(BME280_MEAS_TYPICAL);
+    for (int waited = BME280_MEAS_TYPICAL; ; waited += BME280_POLL_TIME) {
+        uint8_t status;
+        ret = stub_i2c_read(0xf3, &status, 1);
+        if (ret)
+            return ret;
+        if (!(status & 0x08))
+            break;
+        if (waited > BME280_MEAS_MAX)
+            return -1;
+        ets_delay_us(BME280_POLL_TIME);
+    }
+
+    // Store the raw sensor registers in the datalog
+    uint8_t entry[1 + BME280_DATA_SIZE];
+    entry[0] = DLT_BME280_RAW;
+    ret = stub_i2c_read(0xf7, &entry[1], BME280_DATA_SIZE);
+    if (ret)
+        return ret;
+    return datalog_append_raw(entry, sizeof(entry), datalog_get_pending_time());
+}
+
+#endif // CONFIG_WAKE_STUB
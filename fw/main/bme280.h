@@ -2,5 +2,8 @@
 #define BME280_H
 
 void bme280_sense(void);
+int bme280_get_reading(float *temperature, float *humidity);
+int bme280_format_calibration(char *buf, int size);
+int bme280_stub_sense(void);
 
 #endif // bme280.h
@@ -7,119 +7,403 @@
 #include <stdint.h> // uint8_t
 #include <string.h> // memcpy
 #include <esp_attr.h> // RTC_DATA_ATTR
-#include <esp_log.h> // ESP_LOGI
+#include <esp_log.h> // ESP_LOGW
 #include "datalog.h" // datalog_init
+#include "sdkconfig.h" // CONFIG_DATALOG_SIZE
 
-static RTC_DATA_ATTR uint8_t log_storage[3600];
+static const char *TAG = "DATALOG";
+
+// The log sizes may be overridden when compiling on a host (see
+// scripts/host/datalog_bench.c)
+#ifndef DATALOG_SIZE
+#define DATALOG_SIZE CONFIG_DATALOG_SIZE
+#endif
+#if !defined(DATALOG_FAST_SIZE) && CONFIG_DATALOG_FAST_SIZE
+#define DATALOG_FAST_SIZE CONFIG_DATALOG_FAST_SIZE
+#endif
+#ifndef DATALOG_FAST_SIZE
+#define DATALOG_FAST_SIZE 0
+#endif
+
+// The ring buffer is stored in rtc slow memory, optionally followed by
+// a second segment in rtc fast memory
+#define LOG_SIZE (DATALOG_SIZE + DATALOG_FAST_SIZE)
+_Static_assert(LOG_SIZE <= 0xffff, "Log positions must fit in 16 bits");
+
+static RTC_DATA_ATTR uint8_t log_storage[DATALOG_SIZE];
+#if DATALOG_FAST_SIZE
+static RTC_FAST_ATTR uint8_t log_fast[DATALOG_FAST_SIZE];
+#endif
 static RTC_DATA_ATTR uint16_t log_first, log_end;
+// Running timestamp (for delta encoding) prior to log_first and log_end
+static RTC_DATA_ATTR uint64_t log_first_time, log_end_time;
+// Running timestamp of the pending record (may be set from the wake stub)
+static RTC_DATA_ATTR uint64_t pending_time;
+static RTC_DATA_ATTR uint8_t pending_open;
+static uint64_t format_time;
+
+// Registry of record types (indexed by type id)
+static const struct datalog_type_s * const datalog_types[DLT_MAX] = {
+    [DLT_APPWAKE] = &appwake_info,
+    [DLT_BATTERY] = &battery_info,
+    [DLT_BME280] = &bme280_info,
+    [DLT_BME280_RAW] = &bme280_raw_info,
+    [DLT_TIMING] = &timing_info,
+    [DLT_COUNTER] = &counter_info,
+};
 
 struct log_header_s {
     uint8_t length;
 };
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+#define MAX_RECORD 255
+#define MAX_DATA 64
 
-static inline int pos_wrap(int pos) {
-    return pos < ARRAY_SIZE(log_storage) ? pos : pos - ARRAY_SIZE(log_storage);
+FORCE_INLINE_ATTR int pos_wrap(int pos) {
+    return pos < LOG_SIZE ? pos : pos - LOG_SIZE;
 }
-static inline int log_avail(void) {
+FORCE_INLINE_ATTR int log_avail(void) {
     int used = log_end - log_first;
-    return used >= 0 ? ARRAY_SIZE(log_storage) - used : -(used + 1);
+    return used >= 0 ? LOG_SIZE - used - 1 : -(used + 1);
+}
+// Return the storage for a log position
+FORCE_INLINE_ATTR uint8_t *log_ptr(int pos) {
+#if DATALOG_FAST_SIZE
+    if (pos >= DATALOG_SIZE)
+        return &log_fast[pos - DATALOG_SIZE];
+#endif
+    return &log_storage[pos];
+}
+// Return the number of bytes stored sequentially from a log position
+FORCE_INLINE_ATTR int log_seq_space(int pos) {
+    return (pos < DATALOG_SIZE ? DATALOG_SIZE : LOG_SIZE) - pos;
 }
 
-void
-datalog_expire(void)
+
+
+/****************************************************************
+ * Compact encoding helpers
+ ****************************************************************/
+
+// Store an integer using a variable length encoding
+int RTC_IRAM_ATTR
+datalog_put_varint(uint8_t *buf, uint64_t v)
 {
-    if (log_first != log_end)
-        log_first = pos_wrap(log_first + log_storage[log_first]);
+    int len = 0;
+    while (v >= 0x80) {
+        buf[len++] = v | 0x80;
+        v >>= 7;
+    }
+    buf[len++] = v;
+    return len;
 }
 
-void
-datalog_finalize(void)
+// Load an integer stored with datalog_put_varint()
+int
+datalog_get_varint(uint8_t *buf, uint64_t *pv)
 {
-    log_end = pos_wrap(log_end + log_storage[log_end]);
+    uint64_t v = 0;
+    int len = 0, shift = 0;
+    for (;;) {
+        uint8_t c = buf[len++];
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80) || shift >= 63)
+            break;
+        shift += 7;
+    }
+    *pv = v;
+    return len;
 }
 
-static void
+
+/****************************************************************
+ * Ring buffer storage
+ ****************************************************************/
+
+static int RTC_IRAM_ATTR
 raw_append(int log_pending, void *data, int len)
 {
     int new_len = log_pending + len;
-    if (new_len > 255)
-        return;
+    if (new_len > MAX_RECORD)
+        return -1;
     while (log_avail() < new_len)
         datalog_expire();
     int dest_pos = pos_wrap(log_end + log_pending);
-    int seq_space = ARRAY_SIZE(log_storage) - dest_pos;
-    if (len > seq_space) {
-        memcpy(&log_storage[dest_pos], data, seq_space);
-        data += seq_space;
-        len -= seq_space;
-        dest_pos = 0;
+    while (len) {
+        int seq_space = log_seq_space(dest_pos);
+        int copy = len < seq_space ? len : seq_space;
+        memcpy(log_ptr(dest_pos), data, copy);
+        data += copy;
+        len -= copy;
+        dest_pos = pos_wrap(dest_pos + copy);
     }
-    memcpy(&log_storage[dest_pos], data, len);
-    log_storage[log_end] = new_len;
+    *log_ptr(log_end) = new_len;
+    return 0;
 }
 
 static void
 raw_pull(void *dest, int src_pos, int len)
 {
-    int seq_space = ARRAY_SIZE(log_storage) - src_pos;
-    if (len > seq_space) {
-        memcpy(dest, &log_storage[src_pos], seq_space);
-        dest += seq_space;
-        len -= seq_space;
-        src_pos = 0;
+    while (len) {
+        int seq_space = log_seq_space(src_pos);
+        int copy = len < seq_space ? len : seq_space;
+        memcpy(dest, log_ptr(src_pos), copy);
+        dest += copy;
+        len -= copy;
+        src_pos = pos_wrap(src_pos + copy);
+    }
+}
+
+// Return the length of the record at a log position
+static int
+record_len(int pos)
+{
+    return *log_ptr(pos);
+}
+
+
+/****************************************************************
+ * Record encoding
+ ****************************************************************/
+
+// Decode a single entry - returns number of bytes consumed
+static int
+entry_unpack(uint8_t *p, const struct datalog_type_s **pdt, void *data
+             , uint64_t *ptime)
+{
+    uint8_t id = p[0];
+    const struct datalog_type_s *dt = id < DLT_MAX ? datalog_types[id] : NULL;
+    if (!dt || dt->length > MAX_DATA)
+        return -1;
+    int len = dt->length;
+    if (dt->unpack)
+        len = dt->unpack(&p[1], data, ptime);
+    else
+        memcpy(data, &p[1], len);
+    *pdt = dt;
+    return len < 0 ? -1 : 1 + len;
+}
+
+// Make space for len more bytes in a format stream
+static int
+stream_reserve(struct datalog_stream_s *ds, int len)
+{
+    if (ds->len + len <= ds->size)
+        return 0;
+    if (!ds->reserve)
+        return -1;
+    return ds->reserve(ds, len);
+}
+
+// Walk the entries of a record, formatting them into a stream. Returns
+// the number of bytes added to the stream, or 0 if the record could
+// not be formatted (the stream is then left unchanged).
+int
+datalog_decode_stream(uint8_t *rec, int len, uint64_t *ptime
+                      , struct datalog_stream_s *ds)
+{
+    int start = ds->len;
+    int overflow = stream_reserve(ds, 2);
+    if (!overflow)
+        ds->buf[ds->len++] = '{';
+    int pos = 1;
+    while (pos < len) {
+        const struct datalog_type_s *dt;
+        uint8_t __aligned(sizeof(uint64_t)) data[MAX_DATA];
+        int ret = entry_unpack(&rec[pos], &dt, data, ptime);
+        if (ret < 0) {
+            ds->len = start;
+            return 0;
+        }
+        pos += ret;
+        if (overflow)
+            continue;
+        int avail = ds->size - ds->len;
+        ret = dt->format(data, &ds->buf[ds->len], avail);
+        if (ret >= avail) {
+            // Entry did not fit - grow the stream and format it again
+            if (stream_reserve(ds, ret + 2)) {
+                overflow = 1;
+                continue;
+            }
+            dt->format(data, &ds->buf[ds->len], ds->size - ds->len);
+        }
+        ds->len += ret;
+        ds->buf[ds->len++] = ',';
     }
-    memcpy(dest, &log_storage[src_pos], len);
+    if (overflow) {
+        ds->len = start;
+        return 0;
+    }
+    if (ds->len - start == 1)
+        // Empty record
+        ds->buf[ds->len++] = '}';
+    else
+        ds->buf[ds->len - 1] = '}';
+    return ds->len - start;
+}
+
+// Walk the entries of a record, optionally formatting them into buf
+int
+datalog_decode(uint8_t *rec, int len, uint64_t *ptime, char *buf, int size)
+{
+    struct datalog_stream_s ds = { .buf = buf, .size = buf ? size : 0 };
+    return datalog_decode_stream(rec, len, ptime, &ds);
+}
+
+// Copy a record into a linear buffer - returns record length
+static int
+record_pull(int pos, uint8_t *rec)
+{
+    int len = record_len(pos);
+    raw_pull(rec, pos, len);
+    return len;
 }
 
+
+/****************************************************************
+ * Interface
+ ****************************************************************/
+
 void
+datalog_expire(void)
+{
+    if (log_first == log_end)
+        return;
+    uint8_t rec[MAX_RECORD + 1];
+    int len = record_pull(log_first, rec);
+    datalog_decode(rec, len, &log_first_time, NULL, 0);
+    log_first = pos_wrap(log_first + len);
+}
+
+void RTC_IRAM_ATTR
+datalog_finalize(void)
+{
+    log_end = pos_wrap(log_end + *log_ptr(log_end));
+    log_end_time = pending_time;
+    pending_open = 0;
+}
+
+// Add an already encoded entry (type id followed by its packed data)
+// to the pending record. This may be called from the wake stub.
+int RTC_IRAM_ATTR
+datalog_append_raw(uint8_t *entry, int len, uint64_t ptime)
+{
+    if (!pending_open)
+        // Record already finalized
+        return -1;
+    int ret = raw_append(*log_ptr(log_end), entry, len);
+    if (!ret)
+        pending_time = ptime;
+    return ret;
+}
+
+// Return the running timestamp for entries added to the pending record
+uint64_t RTC_IRAM_ATTR
+datalog_get_pending_time(void)
+{
+    return pending_time;
+}
+
+int
 datalog_append(const struct datalog_type_s *dt, void *data)
 {
-    int dt_len = dt->length, log_pending = log_storage[log_end];
-    raw_append(log_pending, &dt, sizeof(dt));
-    raw_append(log_pending + sizeof(dt), data, dt_len);
+    uint8_t buf[MAX_RECORD + 1];
+    uint64_t ptime = pending_time;
+    int len = dt->length;
+    buf[0] = dt->id;
+    if (dt->pack)
+        len = dt->pack(data, &buf[1], &ptime);
+    else
+        memcpy(&buf[1], data, len);
+    return datalog_append_raw(buf, 1 + len, ptime);
 }
 
+// Format the next record into a stream - returns the number of bytes
+// added, 0 if the record could not be formatted, or -1 at the end
 int
-datalog_format(int *ppos, char *buf, int size)
+datalog_format_stream(int *ppos, struct datalog_stream_s *ds)
 {
     int pos = *ppos;
-    if (pos < 0)
+    if (pos < 0) {
         pos = log_first;
+        format_time = log_first_time;
+    }
     if (pos == log_end)
         return -1;
-    int len = log_storage[pos];
+    uint8_t rec[MAX_RECORD + 1];
+    int len = record_pull(pos, rec);
     *ppos = pos_wrap(pos + len);
-    if (size < 2)
-        return 0;
-    pos++;
-    len--;
-    char *orig_buf = buf;
-    *buf++ = '{';
-    size--;
-    while (len > 0) {
-        const struct datalog_type_s *dt;
-        raw_pull(&dt, pos_wrap(pos), sizeof(dt));
-        int dt_len = dt->length;
-        uint8_t __aligned(sizeof(void*)) data[dt_len];
-        raw_pull(data, pos_wrap(pos + sizeof(dt)), dt_len);
-        int ret = dt->format(data, buf, size);
-        if (ret >= size)
-            return 0;
-        buf += ret;
-        *buf++ = ',';
-        size -= ret + 1;
-        pos += sizeof(dt) + dt_len;
-        len -= sizeof(dt) + dt_len;
+    int ret = datalog_decode_stream(rec, len, &format_time, ds);
+    if (!ret)
+        ESP_LOGW(TAG, "Unable to format record at %d (length %d)", pos, len);
+    return ret;
+}
+
+int
+datalog_format(int *ppos, char *buf, int size)
+{
+    struct datalog_stream_s ds = { .buf = buf, .size = size };
+    return datalog_format_stream(ppos, &ds);
+}
+
+// Copy the oldest records into buf (so they may be stored elsewhere).
+// The most recent record is never copied so that it remains available
+// to be uploaded as the latest measurement.
+int
+datalog_export(uint8_t *buf, int size, uint64_t *ptime, int *pcount)
+{
+    int pos = log_first, len = 0, count = 0;
+    *ptime = log_first_time;
+    while (pos != log_end && !datalog_is_last(pos)) {
+        int rec_len = record_len(pos);
+        if (len + rec_len > size)
+            break;
+        raw_pull(&buf[len], pos, rec_len);
+        len += rec_len;
+        count++;
+        pos = pos_wrap(pos + rec_len);
     }
-    buf[-1] = '}';
-    return buf - orig_buf;
+    *pcount = count;
+    return len;
 }
 
-void
+// Return the number of bytes available for new records
+int RTC_IRAM_ATTR
+datalog_free(void)
+{
+    return log_avail();
+}
+
+// Return the percentage of the log that is in use
+int RTC_IRAM_ATTR
+datalog_fill(void)
+{
+    return 100 - log_avail() * 100 / LOG_SIZE;
+}
+
+// Check if the given datalog_format() position is past the last record
+int
+datalog_is_end(int pos)
+{
+    return (pos < 0 ? log_first : pos) == log_end;
+}
+
+// Check if the given datalog_format() position is at the last record
+int
+datalog_is_last(int pos)
+{
+    if (pos < 0)
+        pos = log_first;
+    return pos != log_end && pos_wrap(pos + record_len(pos)) == log_end;
+}
+
+void RTC_IRAM_ATTR
 datalog_init(void)
 {
     struct log_header_s hdr = { .length = 1 };
+    pending_time = log_end_time;
     raw_append(0, &hdr, sizeof(hdr));
+    pending_open = 1;
 }
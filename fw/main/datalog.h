@@ -1,15 +1,66 @@
 #ifndef DATALOG_H
 #define DATALOG_H
 
+#include <stdint.h> // uint8_t
+#include <esp_attr.h> // FORCE_INLINE_ATTR
+
+// Record type ids (stored in the log - do not renumber)
+enum {
+    DLT_APPWAKE = 1, DLT_BATTERY, DLT_BME280, DLT_BME280_RAW, DLT_TIMING,
+    DLT_COUNTER, DLT_MAX
+};
+
 struct datalog_type_s {
+    uint8_t id;
     int length;
+    // Optional compact encoding of data (ptime is a running timestamp
+    // that may be used for delta encoding)
+    int (*pack)(void *data, uint8_t *buf, uint64_t *ptime);
+    int (*unpack)(uint8_t *buf, void *data, uint64_t *ptime);
     int (*format)(void *data, char *buf, int size);
 };
 
+// Output buffer for the streaming formatters. Data is added at
+// buf[len]. If more than size-len bytes are needed then the optional
+// reserve callback is invoked to make at least 'len' more bytes
+// available (it may move buf, but must keep the existing contents).
+struct datalog_stream_s {
+    char *buf;
+    int len, size;
+    int (*reserve)(struct datalog_stream_s *ds, int len);
+};
+
+extern const struct datalog_type_s appwake_info, battery_info, bme280_info;
+extern const struct datalog_type_s bme280_raw_info, timing_info;
+extern const struct datalog_type_s counter_info;
+
+int datalog_put_varint(uint8_t *buf, uint64_t v);
+int datalog_get_varint(uint8_t *buf, uint64_t *pv);
+
+// The helpers below are forced inline so that they may be used from
+// the deep sleep wake stub.
+FORCE_INLINE_ATTR uint64_t datalog_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+FORCE_INLINE_ATTR int64_t datalog_unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
 void datalog_expire(void);
 void datalog_finalize(void);
-void datalog_append(const struct datalog_type_s *dt, void *data);
+int datalog_append_raw(uint8_t *entry, int len, uint64_t ptime);
+uint64_t datalog_get_pending_time(void);
+int datalog_append(const struct datalog_type_s *dt, void *data);
+int datalog_format_stream(int *ppos, struct datalog_stream_s *ds);
 int datalog_format(int *ppos, char *buf, int size);
+int datalog_is_end(int pos);
+int datalog_is_last(int pos);
+int datalog_decode_stream(uint8_t *rec, int len, uint64_t *ptime
+                          , struct datalog_stream_s *ds);
+int datalog_decode(uint8_t *rec, int len, uint64_t *ptime, char *buf, int size);
+int datalog_export(uint8_t *buf, int size, uint64_t *ptime, int *pcount);
+int datalog_free(void);
+int datalog_fill(void);
 void datalog_init(void);
 
-#endif // battery.h
+#endif // datalog.h
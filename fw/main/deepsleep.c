@@ -4,15 +4,29 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <inttypes.h> // PRIu64
+#include <stdio.h> // snprintf
 #include <sys/time.h> // gettimeofday
 #include <driver/rtc_io.h> // rtc_gpio_isolate
+#include <esp_attr.h> // RTC_IRAM_ATTR
+#include <esp_log.h> // ESP_LOGW
 #include <esp_sleep.h> // esp_deep_sleep_start
 #include <esp_wifi.h> // esp_wifi_stop
+#include <esp32/rom/ets_sys.h> // ets_delay_us
+#include <esp32/rom/rtc.h> // RTC_ENTRY_ADDR_REG
 #include <freertos/FreeRTOS.h> // xTaskCreate
 #include <freertos/task.h> // xTaskCreate
+#include <soc/rtc.h> // RTC_CLK_CAL_FRACT
+#include <soc/rtc_cntl_reg.h> // RTC_CNTL_STATE0_REG
+#include "bme280.h" // bme280_stub_sense
+#include "datalog.h" // datalog_append
 #include "deepsleep.h" // deepsleep_init
+#include "spool.h" // SPOOL_FLUSH_THRESHOLD
+#include "timing.h" // timing_note_deferred
 #include "sdkconfig.h" // CONFIG_MEASURE_INTERVAL
 
+static const char *TAG = "DEEPSLEEP";
+
 // Time (in us) of last deep sleep enter time
 static RTC_DATA_ATTR uint64_t last_deepsleep_time;
 // Time (in us) of last wake up time
@@ -47,6 +61,319 @@ get_usecs(void)
     return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
 }
 
+/****************************************************************
+ * Wake scheduling
+ ****************************************************************/
+
+// Measurements are taken on a regular grid of sample slots (every
+// CONFIG_MEASURE_INTERVAL seconds) and each sleep lasts until the next
+// slot, so the time spent awake does not delay later measurements.
+// When the wall time is learned during an upload (see network.c) the
+// slots are aligned to multiples of the interval in wall time. The rtc
+// clock may drift by hundreds of ppm (and more as the temperature
+// changes), so its rate is also compared to the wall time and the slot
+// spacing is corrected by the measured drift.
+
+// Minimum time (in us) between wall times used to measure the drift
+#define DRIFT_MIN_TIME (60 * 60 * 1000000ULL)
+// Drift measurements (in ppb) beyond this are discarded
+#define DRIFT_MAX 50000000
+// Weight of previous drift measurements (temperature changes the drift)
+#define DRIFT_SMOOTH 4
+
+struct wakesched_s {
+    // Rtc time (in us) of the next slot and the rtc time between slots
+    uint64_t next_slot;
+    uint32_t slot_interval;
+    // Last wall time (rtc time and wall time in us)
+    uint64_t sync_local, sync_wall;
+    // Start of the current drift measurement
+    uint64_t ref_local, ref_wall;
+    // Wall time drift relative to the rtc clock (in ppb)
+    int32_t drift;
+    uint8_t have_sync, have_drift;
+};
+
+static RTC_DATA_ATTR struct wakesched_s wakesched;
+
+// Estimate the wall time (in us) at the given rtc time
+static uint64_t
+wall_time(uint64_t local)
+{
+    struct wakesched_s *ws = &wakesched;
+    double delta = (int64_t)(local - ws->sync_local);
+    return ws->sync_wall + (int64_t)(delta * (1. + ws->drift * 1e-9));
+}
+
+// Note the current wall time (in us since 1970)
+void
+deepsleep_note_wall_time(uint64_t wall)
+{
+    struct wakesched_s *ws = &wakesched;
+    uint64_t local = get_usecs();
+    ws->sync_local = local;
+    ws->sync_wall = wall;
+    if (!ws->have_sync) {
+        ws->have_sync = 1;
+        ws->ref_local = local;
+        ws->ref_wall = wall;
+        return;
+    }
+    uint64_t elapsed = local - ws->ref_local;
+    if (elapsed < DRIFT_MIN_TIME)
+        return;
+    double wall_elapsed = (int64_t)(wall - ws->ref_wall);
+    double drift = (wall_elapsed / elapsed - 1.) * 1e9;
+    ws->ref_local = local;
+    ws->ref_wall = wall;
+    if (drift > DRIFT_MAX || drift < -DRIFT_MAX) {
+        ESP_LOGW(TAG, "Discarding clock drift measurement");
+        return;
+    }
+    if (ws->have_drift)
+        drift = ws->drift + (drift - ws->drift) / DRIFT_SMOOTH;
+    ws->drift = drift;
+    ws->have_drift = 1;
+    ESP_LOGI(TAG, "Clock drift %d ppb", ws->drift);
+}
+
+// Calculate the rtc time of the next slot
+static uint64_t
+wakesched_next_slot(uint64_t curtime)
+{
+    struct wakesched_s *ws = &wakesched;
+    uint64_t interval = CONFIG_MEASURE_INTERVAL * 1000000ULL;
+    double rate = 1. + ws->drift * 1e-9;
+    ws->slot_interval = interval / rate;
+    uint64_t slot;
+    if (ws->have_sync) {
+        uint64_t wall = wall_time(curtime);
+        uint64_t wall_slot = (wall / interval + 1) * interval;
+        slot = curtime + (uint64_t)((wall_slot - wall) / rate);
+    } else {
+        slot = (curtime / ws->slot_interval + 1) * ws->slot_interval;
+    }
+    // Don't repeat a slot if the wake was early (or skip a slot if
+    // it is nearly over)
+    while (slot < curtime + ws->slot_interval / 4)
+        slot += ws->slot_interval;
+    ws->next_slot = slot;
+    return slot;
+}
+
+
+/****************************************************************
+ * Wake and sleep time reports
+ ****************************************************************/
+
+struct appwake_s {
+    uint64_t waketime, sleeptime;
+};
+
+static int
+appwake_format(void *data, char *buf, int size)
+{
+    struct appwake_s *aw = data;
+    const char *latest = "";
+    char clock[64] = "";
+    if (aw->waketime == deepsleep_get_wake_time()) {
+        latest = ",\"latest\":1";
+        // Report the wall time so the host need not use the receive time
+        struct wakesched_s *ws = &wakesched;
+        if (ws->have_sync)
+            snprintf(clock, sizeof(clock), ",\"wall_time\":%" PRIu64
+                     ",\"clock_drift\":%d"
+                     , wall_time(aw->waketime), ws->drift);
+    }
+    if (!aw->sleeptime)
+        return snprintf(buf, size, "\"boot_time\":%" PRIu64 "%s%s"
+                        , aw->waketime, latest, clock);
+    return snprintf(buf, size, "\"wake_time\":%" PRIu64
+                    ",\"last_sleep_time\":%" PRIu64 "%s%s"
+                    , aw->waketime, aw->sleeptime, latest, clock);
+}
+
+// Times are stored as deltas from the previous record's wake time
+static int RTC_IRAM_ATTR
+appwake_pack(void *data, uint8_t *buf, uint64_t *ptime)
+{
+    struct appwake_s *aw = data;
+    uint64_t sleep_delta = 0;
+    if (aw->sleeptime)
+        sleep_delta = datalog_zigzag(aw->sleeptime - *ptime) + 1;
+    int len = datalog_put_varint(buf, datalog_zigzag(aw->waketime - *ptime));
+    len += datalog_put_varint(&buf[len], sleep_delta);
+    *ptime = aw->waketime;
+    return len;
+}
+
+static int
+appwake_unpack(uint8_t *buf, void *data, uint64_t *ptime)
+{
+    struct appwake_s *aw = data;
+    uint64_t wake_delta, sleep_delta;
+    int len = datalog_get_varint(buf, &wake_delta);
+    len += datalog_get_varint(&buf[len], &sleep_delta);
+    aw->waketime = *ptime + datalog_unzigzag(wake_delta);
+    aw->sleeptime = 0;
+    if (sleep_delta)
+        aw->sleeptime = *ptime + datalog_unzigzag(sleep_delta - 1);
+    *ptime = aw->waketime;
+    return len;
+}
+
+const struct datalog_type_s appwake_info = {
+    .id = DLT_APPWAKE,
+    .length = sizeof(struct appwake_s),
+    .pack = appwake_pack,
+    .unpack = appwake_unpack,
+    .format = appwake_format,
+};
+
+void
+deepsleep_sense(void)
+{
+    struct appwake_s aw = {
+        .waketime = deepsleep_get_wake_time(),
+        .sleeptime = deepsleep_get_sleep_time(),
+    };
+    datalog_append(&appwake_info, &aw);
+}
+
+
+
+/****************************************************************
+ * Deep sleep wake stub
+ ****************************************************************/
+
+#if CONFIG_WAKE_STUB
+
+// When enabled, the wake stub takes measurements without performing a
+// full boot of the application (which is much faster and uses less
+// power). It runs from rtc memory directly after the chip wakes, so
+// it may only use code marked RTC_IRAM_ATTR, rom functions, and data
+// marked RTC_DATA_ATTR. It must not alter RTC_FAST_ATTR memory as the
+// rom verifies a checksum of that memory before running the stub.
+
+// Don't measure from the stub if the log needs to be moved to flash
+#define STUB_MIN_FREE (SPOOL_FLUSH_THRESHOLD + 64)
+
+// Time (in us) that the wake stub must next perform a full boot
+static RTC_DATA_ATTR uint64_t stub_boot_time;
+
+// Read the rtc slow clock counter
+static uint64_t RTC_IRAM_ATTR
+stub_get_ticks(void)
+{
+    SET_PERI_REG_MASK(RTC_CNTL_TIME_UPDATE_REG, RTC_CNTL_TIME_UPDATE);
+    while (!GET_PERI_REG_MASK(RTC_CNTL_TIME_UPDATE_REG, RTC_CNTL_TIME_VALID))
+        ets_delay_us(1);
+    SET_PERI_REG_MASK(RTC_CNTL_INT_CLR_REG, RTC_CNTL_TIME_VALID_INT_CLR);
+    uint64_t ticks = READ_PERI_REG(RTC_CNTL_TIME0_REG);
+    return ticks | ((uint64_t)READ_PERI_REG(RTC_CNTL_TIME1_REG) << 32);
+}
+
+// Report the same time as get_usecs() (the esp-idf gettimeofday()
+// implementation adds the rtc clock to a boot time stored in rtc
+// registers)
+static uint64_t RTC_IRAM_ATTR
+stub_get_usecs(void)
+{
+    uint64_t cal = REG_READ(RTC_SLOW_CLK_CAL_REG);
+    uint64_t boot_time = REG_READ(RTC_BOOT_TIME_LOW_REG);
+    boot_time |= (uint64_t)REG_READ(RTC_BOOT_TIME_HIGH_REG) << 32;
+    return boot_time + ((stub_get_ticks() * cal) >> RTC_CLK_CAL_FRACT);
+}
+
+// Add a measurement to the datalog - returns non-zero if a full boot
+// is needed instead
+static int RTC_IRAM_ATTR
+stub_measure(uint64_t waketime)
+{
+    if (waketime >= stub_boot_time || datalog_free() < STUB_MIN_FREE)
+        return -1;
+    if (CONFIG_UPLOAD_LOG_FILL && datalog_fill() >= CONFIG_UPLOAD_LOG_FILL)
+        return -1;
+
+    datalog_init();
+    struct appwake_s aw = {
+        .waketime = waketime,
+        .sleeptime = last_deepsleep_time,
+    };
+    uint8_t entry[1 + 2 * 10];
+    uint64_t ptime = datalog_get_pending_time();
+    entry[0] = DLT_APPWAKE;
+    int len = appwake_pack(&aw, &entry[1], &ptime);
+    int ret = datalog_append_raw(entry, 1 + len, ptime);
+    if (ret)
+        return ret;
+    ret = bme280_stub_sense();
+    if (ret)
+        // The unfinished record is discarded by the full boot
+        return ret;
+    datalog_finalize();
+    return 0;
+}
+
+// Reenter deep sleep (and run the stub again on the next wake)
+static void RTC_IRAM_ATTR
+stub_sleep(void)
+{
+    // Advance to the next slot (see wakesched_next_slot())
+    struct wakesched_s *ws = &wakesched;
+    uint64_t curtime = stub_get_usecs(), slot = ws->next_slot;
+    while (slot < curtime + ws->slot_interval / 4)
+        slot += ws->slot_interval;
+    ws->next_slot = slot;
+
+    uint64_t cal = REG_READ(RTC_SLOW_CLK_CAL_REG);
+    uint64_t ticks = ((slot - curtime) << RTC_CLK_CAL_FRACT) / cal;
+    uint64_t now = stub_get_ticks();
+    last_deepsleep_time = curtime;
+    WRITE_PERI_REG(RTC_CNTL_SLP_TIMER0_REG, (now + ticks) & UINT32_MAX);
+    WRITE_PERI_REG(RTC_CNTL_SLP_TIMER1_REG, (now + ticks) >> 32);
+    REG_WRITE(RTC_ENTRY_ADDR_REG, (uint32_t)&esp_wake_deep_sleep);
+    CLEAR_PERI_REG_MASK(RTC_CNTL_STATE0_REG, RTC_CNTL_SLEEP_EN);
+    SET_PERI_REG_MASK(RTC_CNTL_STATE0_REG, RTC_CNTL_SLEEP_EN);
+    for (;;)
+        ;
+}
+
+// Entry point on wake from deep sleep (replaces the esp-idf default)
+void RTC_IRAM_ATTR
+esp_wake_deep_sleep(void)
+{
+    esp_default_wake_deep_sleep();
+    if (!stub_boot_time)
+        return;
+    int ret = stub_measure(stub_get_usecs());
+    if (ret)
+        // Continue with a full boot
+        return;
+    stub_sleep();
+}
+
+// Note the time of the next required full boot (eg, for an upload)
+void
+deepsleep_set_boot_time(uint64_t boot_time)
+{
+    stub_boot_time = boot_time;
+}
+
+#else // CONFIG_WAKE_STUB
+
+void
+deepsleep_set_boot_time(uint64_t boot_time)
+{
+}
+
+#endif // CONFIG_WAKE_STUB
+
+
+/****************************************************************
+ * Sleep handling
+ ****************************************************************/
+
 static TaskHandle_t deepsleep_task_id;
 static uint64_t force_deepsleep_time;
 
@@ -62,11 +389,20 @@ deepsleep_task(void *pvParameter)
             break;
         sleep_time = (fdt - curtime) / (1000 * portTICK_PERIOD_MS);
     }
+    if (force_deepsleep_time)
+        timing_count(TC_RUN_TIMEOUT);
 
     // Enter deepsleep
     esp_wifi_stop();
     esp_deep_sleep_disable_rom_logging();
-    esp_sleep_enable_timer_wakeup(CONFIG_MEASURE_INTERVAL * 1000000ULL);
+    uint64_t curtime = get_usecs();
+    esp_sleep_enable_timer_wakeup(wakesched_next_slot(curtime) - curtime);
+#if CONFIG_DATALOG_FAST_SIZE || CONFIG_MQTT_TLS_SESSION_RESUME
+    // Part of the measurement log (or the tls session) is stored in rtc
+    // fast memory
+    esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_FAST_MEM, ESP_PD_OPTION_ON);
+#endif
+    timing_note_deferred(TP_SLEEP, 0);
     last_deepsleep_time = get_usecs();
     esp_deep_sleep_start();
 }
@@ -90,6 +426,16 @@ deepsleep_note_ota_start(void)
     force_deepsleep_time = last_wake_time + CONFIG_MAX_OTA_TIME * 1000000ULL;
 }
 
+// Check if an ota transfer should stop so that the wake can finish
+// before deep sleep is forced (a network read may block for up to
+// CONFIG_MAX_RUN_TIME)
+int
+deepsleep_ota_time_expired(void)
+{
+    uint64_t fdt = force_deepsleep_time;
+    return get_usecs() + CONFIG_MAX_RUN_TIME * 1000000ULL >= fdt;
+}
+
 void
 deepsleep_start_sleep(void)
 {
@@ -6,8 +6,12 @@
 uint64_t deepsleep_get_wake_time(void);
 uint64_t deepsleep_get_sleep_time(void);
 int deepsleep_is_wake_from_sleep(void);
+void deepsleep_sense(void);
+void deepsleep_set_boot_time(uint64_t boot_time);
+void deepsleep_note_wall_time(uint64_t wall);
 void deepsleep_init(void);
 void deepsleep_note_ota_start(void);
+int deepsleep_ota_time_expired(void);
 void deepsleep_start_sleep(void);
 void deepsleep_shutdown(void);
 
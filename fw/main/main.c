@@ -4,7 +4,6 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <stdio.h> // snprintf
 #include <esp_attr.h> // RTC_DATA_ATTR
 #include <esp_log.h> // ESP_LOGI
 #include "battery.h" // battery_sense
@@ -13,49 +12,13 @@
 #include "deepsleep.h" // deepsleep_init
 #include "mqtt.h" // mqtt_start
 #include "network.h" // network_connect
-#include "sdkconfig.h" // CONFIG_UPLOAD_INTERVAL
+#include "schedule.h" // schedule_check
+#include "spool.h" // spool_flush
+#include "timing.h" // timing_note
 
 static const char *TAG = "MQTT_TCP";
 
 
-/****************************************************************
- * Wake and sleep time reports
- ****************************************************************/
-
-struct appwake_s {
-    uint64_t waketime, sleeptime;
-};
-
-static int
-appwake_format(void *data, char *buf, int size)
-{
-    struct appwake_s *aw = data;
-    const char *latest = "";
-    if (aw->waketime == deepsleep_get_wake_time())
-        latest = ",\"latest\":1";
-    if (!aw->sleeptime)
-        return snprintf(buf, size, "\"boot_time\":%llu%s"
-                        , aw->waketime, latest);
-    return snprintf(buf, size, "\"wake_time\":%llu,\"last_sleep_time\":%llu%s"
-                    , aw->waketime, aw->sleeptime, latest);
-}
-
-static const struct datalog_type_s appwake_info = {
-    .length = sizeof(struct appwake_s),
-    .format = appwake_format,
-};
-
-static void
-waketime_sense(void)
-{
-    struct appwake_s aw = {
-        .waketime = deepsleep_get_wake_time(),
-        .sleeptime = deepsleep_get_sleep_time(),
-    };
-    datalog_append(&appwake_info, &aw);
-}
-
-
 /****************************************************************
  * Startup
  ****************************************************************/
@@ -67,8 +30,6 @@ debug_init(void)
     ESP_LOGW(TAG, "[APP] Startup..");
 }
 
-static RTC_DATA_ATTR uint64_t next_network_time;
-
 // Main esp32 code start
 void
 app_main(void)
@@ -76,22 +37,41 @@ app_main(void)
     deepsleep_init();
     debug_init();
     datalog_init();
+    timing_note(TP_APP_MAIN, 0);
 
-    waketime_sense();
+    deepsleep_sense();
+    timing_report_deferred();
     battery_sense();
+
+    // When an upload is due, start wifi before reading the bme280 so
+    // that the measurement overlaps with wifi association. (The battery
+    // check uses adc2 and must complete before wifi starts.)
+    uint64_t waketime = deepsleep_get_wake_time();
+    int do_upload = schedule_check(waketime), ret = 0;
+    if (do_upload)
+        ret = network_start();
     bme280_sense();
+    timing_note(TP_SENSE_DONE, 0);
     datalog_finalize();
+    spool_flush();
 
-    // Check if network upload should be attempted
-    if (deepsleep_get_wake_time() >= next_network_time) {
-        uint64_t upload_interval = CONFIG_UPLOAD_INTERVAL * 1000000ULL;
-        next_network_time = deepsleep_get_wake_time() + upload_interval;
-
-        int ret = network_start();
-        if (ret)
-            goto done;
-        mqtt_start();
-
+    // Check if the measurement triggers an upload
+    if (!do_upload) {
+        do_upload = schedule_check(waketime);
+        if (do_upload)
+            ret = network_start();
+    }
+    if (!do_upload)
+        goto done;
+    if (!ret) {
+        ret = mqtt_start();
+        if (!ret) {
+            schedule_note_upload();
+            timing_note_deferred(TP_UPLOAD, 0);
+        } else {
+            // Wifi failures are counted separately (see network.c)
+            timing_count(TC_UPLOAD_FAIL);
+        }
         network_disconnect();
     }
 
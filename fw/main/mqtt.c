@@ -4,32 +4,633 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <stdio.h> // snprintf
+#include <stdlib.h> // calloc
 #include <string.h> // memcmp
+#include <esp_attr.h> // RTC_DATA_ATTR
 #include <esp_log.h> // ESP_LOGI
+#include <esp_system.h> // esp_read_mac
 #include <freertos/FreeRTOS.h> // xEventGroupCreate
 #include <freertos/event_groups.h> // xEventGroupCreate
 #include <mqtt_client.h> // esp_mqtt_client_init
+#include "mqttpub.h" // mqttpub_connect
+#include "bme280.h" // bme280_format_calibration
 #include "datalog.h" // datalog_format
 #include "deepsleep.h" // deepsleep_note_ota_start
 #include "network.h" // network_note_ota_start
 #include "ota.h" // ota_start
+#include "otamqtt.h" // otamqtt_start
+#include "spool.h" // spool_format
+#include "timing.h" // timing_note_deferred
 #include "sdkconfig.h" // CONFIG_TOPIC
 
 #define DATA_TOPIC CONFIG_MQTT_TOPIC_PREFIX "/data"
+#define BATCH_TOPIC CONFIG_MQTT_TOPIC_PREFIX "/batch"
 #define OTA_TOPIC CONFIG_MQTT_TOPIC_PREFIX "/ota_url"
+#define OTA_DATA_TOPIC CONFIG_MQTT_TOPIC_PREFIX "/ota_data"
+#define OTA_ACK_TOPIC CONFIG_MQTT_TOPIC_PREFIX "/ota_ack"
+#define CALIBRATION_TOPIC CONFIG_MQTT_TOPIC_PREFIX "/bme280_calibration"
 
 static const char *TAG = "MQTT";
 
 
+/****************************************************************
+ * Data upload
+ ****************************************************************/
+
+#define MAX_PUBLISH 256
+
+// Records are formatted directly into the publish payload. With the
+// pipelined publisher that is the transmit buffer of the connection;
+// the esp-idf client copies the payload into its outbox, so a heap
+// buffer is used there.
+struct upload_s {
+    struct datalog_stream_s ds; // must be first (see upload_reserve())
+#if CONFIG_MQTT_LITE
+    struct mqttpub_s *mp;
+    uint16_t first_id, acked_count;
+    uint8_t acked[MAX_PUBLISH];
+#else
+    esp_mqtt_client_handle_t client;
+    const char *topic;
+    int retain;
+#endif
+    int publish_count, payload_start;
+    uint16_t record_counts[MAX_PUBLISH];
+#if CONFIG_MQTT_BATCH_SIZE
+    int batch_count;
+#endif
+};
+
+typedef int (*format_fn)(int *ppos, struct datalog_stream_s *ds);
+
+// Make space for more payload (see struct datalog_stream_s)
+static int
+upload_reserve(struct datalog_stream_s *ds, int len)
+{
+#if CONFIG_MQTT_LITE
+    struct upload_s *u = (struct upload_s *)ds;
+    u->mp->out_len = ds->len;
+    int ret = mqttpub_reserve(u->mp, len);
+    ds->buf = (char *)u->mp->out;
+    ds->size = u->mp->out_size;
+    return ret;
+#else
+    int size = ds->size ? ds->size : 256;
+    while (size < ds->len + len)
+        size *= 2;
+    char *buf = realloc(ds->buf, size);
+    if (!buf)
+        return -1;
+    ds->buf = buf;
+    ds->size = size;
+    return 0;
+#endif
+}
+
+#if CONFIG_MQTT_BATCH_SIZE || CONFIG_BME280_PUBLISH_RAW
+// Make sure there is space for len more bytes of payload
+static int
+upload_space(struct upload_s *u, int len)
+{
+    struct datalog_stream_s *ds = &u->ds;
+    if (ds->len + len <= ds->size)
+        return 0;
+    return upload_reserve(ds, len);
+}
+#endif
+
+// Start a publish (its payload is then added to u->ds)
+static int
+upload_begin(struct upload_s *u, const char *topic, int retain)
+{
+    if (u->publish_count >= MAX_PUBLISH)
+        return -1;
+#if CONFIG_MQTT_LITE
+    struct mqttpub_s *mp = u->mp;
+    if (mqttpub_publish_start(mp, topic, 1, retain) < 0)
+        return -1;
+    u->ds.buf = (char *)mp->out;
+    u->ds.len = mp->out_len;
+    u->ds.size = mp->out_size;
+#else
+    u->topic = topic;
+    u->retain = retain;
+    u->ds.len = 0;
+#endif
+    u->payload_start = u->ds.len;
+    return 0;
+}
+
+// Discard a publish started with upload_begin()
+static void
+upload_cancel(struct upload_s *u)
+{
+#if CONFIG_MQTT_LITE
+    mqttpub_publish_cancel(u->mp);
+#endif
+}
+
+// Send a publish started with upload_begin() that contains 'count'
+// records
+static int
+upload_end(struct upload_s *u, int count)
+{
+    struct datalog_stream_s *ds = &u->ds;
+    ESP_LOGW(TAG, "publish %d (%d records, %d bytes)"
+             , u->publish_count, count, ds->len - u->payload_start);
+#if CONFIG_MQTT_LITE
+    u->mp->out_len = ds->len;
+    if (mqttpub_publish_end(u->mp)) {
+        mqttpub_publish_cancel(u->mp);
+        return -1;
+    }
+#else
+    esp_mqtt_client_publish(u->client, u->topic, ds->buf, ds->len
+                            , 1, u->retain);
+#endif
+    u->record_counts[u->publish_count++] += count;
+    return 0;
+}
+
+// The functions below return 0 if a record was queued, 1 at the end of
+// the records, or -1 if no more publishes can be queued. A record that
+// can not be formatted is expired along with the next publish.
+
+static int
+publish_record(struct upload_s *u, format_fn format, int *ppos)
+{
+    if (upload_begin(u, DATA_TOPIC, 1))
+        return -1;
+    int ret = format(ppos, &u->ds);
+    if (ret <= 0) {
+        upload_cancel(u);
+        if (ret < 0)
+            return 1;
+        u->record_counts[u->publish_count] += 1;
+        return 0;
+    }
+    return upload_end(u, 1);
+}
+
+#if CONFIG_MQTT_BATCH_SIZE
+
+static int
+upload_putc(struct upload_s *u, char c)
+{
+    if (upload_space(u, 1))
+        return -1;
+    u->ds.buf[u->ds.len++] = c;
+    return 0;
+}
+
+// Send the pending batch of records as a single JSON array
+static int
+flush_batch(struct upload_s *u)
+{
+    int count = u->batch_count;
+    if (!count)
+        return 0;
+    u->batch_count = 0;
+    if (upload_putc(u, ']')) {
+        upload_cancel(u);
+        return -1;
+    }
+    return upload_end(u, count);
+}
+
+// Add a record to the pending batch (the batch is sent once it reaches
+// CONFIG_MQTT_BATCH_SIZE, so it may exceed it by up to one record)
+static int
+batch_record(struct upload_s *u, format_fn format, int *ppos)
+{
+    // Leave a publish for the most recent record
+    if (!u->batch_count && (u->publish_count >= MAX_PUBLISH - 1
+                            || upload_begin(u, BATCH_TOPIC, 0)))
+        return -1;
+    int mark = u->ds.len;
+    if (upload_putc(u, u->batch_count ? ',' : '[')) {
+        if (!u->batch_count)
+            upload_cancel(u);
+        return -1;
+    }
+    int ret = format(ppos, &u->ds);
+    if (ret <= 0) {
+        u->ds.len = mark;
+        if (!u->batch_count)
+            upload_cancel(u);
+        if (ret < 0)
+            return 1;
+        u->record_counts[u->publish_count] += 1;
+        return 0;
+    }
+    u->batch_count++;
+    if (u->ds.len - u->payload_start + 1 >= CONFIG_MQTT_BATCH_SIZE)
+        return flush_batch(u);
+    return 0;
+}
+
+#endif
+
+// Queue the next record for upload
+static int
+upload_record(struct upload_s *u, format_fn format, int *ppos, int is_latest)
+{
+#if CONFIG_MQTT_BATCH_SIZE
+    // Only the most recent record is sent on the data topic
+    if (!is_latest)
+        return batch_record(u, format, ppos);
+    if (flush_batch(u))
+        return -1;
+#endif
+    return publish_record(u, format, ppos);
+}
+
+#if CONFIG_BME280_PUBLISH_RAW
+// Raw measurements can not be decoded without the calibration
+static void
+upload_calibration(struct upload_s *u)
+{
+    if (upload_begin(u, CALIBRATION_TOPIC, 1))
+        return;
+    struct datalog_stream_s *ds = &u->ds;
+    int size = 256, len = -1;
+    if (!upload_space(u, size))
+        len = bme280_format_calibration(&ds->buf[ds->len], size);
+    if (len <= 0 || len >= size) {
+        upload_cancel(u);
+        return;
+    }
+    ds->len += len;
+    upload_end(u, 0);
+}
+#endif
+
+static void
+upload_records(struct upload_s *u)
+{
+    u->ds.reserve = upload_reserve;
+#if CONFIG_BME280_PUBLISH_RAW
+    upload_calibration(u);
+#endif
+    // Records stored in flash are the oldest - upload them first
+    int pos = -1, ret;
+    do {
+        ret = upload_record(u, spool_format_stream, &pos, 0);
+    } while (!ret);
+    if (ret > 0) {
+        pos = -1;
+        do {
+            ret = upload_record(u, datalog_format_stream, &pos
+                                , datalog_is_last(pos));
+        } while (!ret);
+    }
+#if CONFIG_MQTT_BATCH_SIZE
+    flush_batch(u);
+#endif
+}
+
+// Remove the oldest uploaded record
+static void
+upload_expire(void)
+{
+    if (spool_expire())
+        datalog_expire();
+}
+
+
+
+
+
+/****************************************************************
+ * Persistent session
+ ****************************************************************/
+
+// With a persistent session the broker keeps the ota topic
+// subscription between connections and queues any ota request that is
+// published while the device sleeps. The full ota check (subscribe to
+// the ota topic and wait for the retained value) is then only needed
+// when the broker reports no stored session (or every
+// CONFIG_MQTT_OTA_CHECK_INTERVAL uploads).
+
+#if CONFIG_MQTT_PERSISTENT_SESSION
+#define PERSISTENT_SESSION 1
+static RTC_DATA_ATTR uint32_t ota_check_count;
+#else
+#define PERSISTENT_SESSION 0
+#endif
+
+// Check if the full ota check should be performed on this upload
+static int
+ota_check_due(void)
+{
+    // An interrupted mqtt ota transfer resumes when the offer is seen
+    if (otamqtt_is_pending())
+        return 1;
+#if CONFIG_MQTT_PERSISTENT_SESSION
+    if (!CONFIG_MQTT_OTA_CHECK_INTERVAL)
+        return 0;
+    // The count only restarts once a check completes, so a check that
+    // is interrupted is retried on the next upload
+    if (ota_check_count < CONFIG_MQTT_OTA_CHECK_INTERVAL)
+        ota_check_count++;
+    return ota_check_count >= CONFIG_MQTT_OTA_CHECK_INTERVAL;
+#else
+    return 1;
+#endif
+}
+
+// Note that the broker responded to the ota check
+static void
+ota_note_checked(void)
+{
+#if CONFIG_MQTT_PERSISTENT_SESSION
+    ota_check_count = 0;
+#endif
+}
+
+// Return the mqtt client id (a persistent session needs a stable id)
+static const char *
+get_client_id(void)
+{
+#if CONFIG_MQTT_PERSISTENT_SESSION
+    static char client_id[32];
+    uint8_t mac[6];
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    snprintf(client_id, sizeof(client_id)
+             , "humidwifi-%02x%02x%02x%02x%02x%02x"
+             , mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return client_id;
+#else
+    return "";
+#endif
+}
+
+static int
+is_topic(const char *topic, int topic_len, const char *name)
+{
+    return (topic_len == strlen(name)
+            && memcmp(topic, name, topic_len) == 0);
+}
+
+
+
+#if CONFIG_MQTT_LITE
+
+/****************************************************************
+ * Pipelined publisher
+ ****************************************************************/
+
+// Note a data ack and expire all records acknowledged so far
+static int
+note_ack(struct upload_s *u, int id)
+{
+    int idx = (uint16_t)(id - u->first_id);
+    if (idx >= u->publish_count || u->acked[idx])
+        return 0;
+    u->acked[idx] = 1;
+    while (u->acked_count < u->publish_count && u->acked[u->acked_count]) {
+        for (int j=0; j<u->record_counts[u->acked_count]; j++)
+            upload_expire();
+        u->acked_count++;
+    }
+    return 1;
+}
+
+static int ota_in_progress, mqtt_ota;
+
+// Request the next chunks of an mqtt ota transfer
+static void
+send_ota_ack(struct mqttpub_s *mp)
+{
+    char buf[32];
+    int len = otamqtt_format_ack(buf, sizeof(buf));
+    mqttpub_publish(mp, OTA_ACK_TOPIC, buf, len, 0, 0);
+}
+
+// Start an ota update offered over mqtt
+static void
+start_mqtt_ota(struct mqttpub_s *mp, struct mqttpub_msg_s *msg)
+{
+    int ret = otamqtt_start(msg->data, msg->data_len);
+    if (ret) {
+        // Discard an invalid (or already installed) offer
+        const char *status = ret > 0 ? "done" : "fail";
+        mqttpub_publish(mp, OTA_ACK_TOPIC, status, strlen(status), 0, 0);
+        mqttpub_publish(mp, OTA_TOPIC, "", 0, 0, 1);
+        return;
+    }
+    ota_in_progress = mqtt_ota = 1;
+    deepsleep_note_ota_start();
+    network_note_ota_start();
+    // Make sure the next wake can resume the transfer
+    deepsleep_set_boot_time(0);
+    mqttpub_subscribe(mp, OTA_DATA_TOPIC, 0);
+    send_ota_ack(mp);
+}
+
+// Handle a message on the ota topic (returns non-zero when check complete)
+static int
+handle_ota(struct mqttpub_s *mp, struct mqttpub_msg_s *msg)
+{
+    if (!is_topic(msg->topic, msg->topic_len, OTA_TOPIC))
+        return 0;
+    ESP_LOGI(TAG, "Got ota_update response len=%d", msg->data_len);
+    if (ota_in_progress)
+        return 1;
+    if (!msg->data_len) {
+        // No ota request - discard any interrupted transfer
+        otamqtt_cancel();
+        return 1;
+    }
+    if (otamqtt_is_offer(msg->data, msg->data_len)) {
+        start_mqtt_ota(mp, msg);
+        return 1;
+    }
+    // OTA request
+    ota_in_progress = 1;
+    deepsleep_note_ota_start();
+    network_note_ota_start();
+    mqttpub_publish(mp, OTA_TOPIC, "", 0, 0, 1);
+    ota_start(msg->data, msg->data_len);
+    return 1;
+}
+
+// Handle a chunk of an mqtt ota transfer
+static int
+handle_ota_data(struct mqttpub_s *mp, struct mqttpub_msg_s *msg)
+{
+    if (!mqtt_ota || !is_topic(msg->topic, msg->topic_len, OTA_DATA_TOPIC))
+        return 0;
+    int ret = otamqtt_handle_chunk((uint8_t *)msg->data, msg->data_len);
+    if (ret <= 0)
+        return ret;
+    if (!otamqtt_is_complete()) {
+        send_ota_ack(mp);
+        return 0;
+    }
+    ret = otamqtt_finish();
+    ESP_LOGW(TAG, "mqtt ota complete (result %d)", ret);
+    const char *status = ret ? "fail" : "done";
+    mqttpub_publish(mp, OTA_ACK_TOPIC, status, strlen(status), 0, 0);
+    mqttpub_publish(mp, OTA_TOPIC, "", 0, 0, 1);
+    mqttpub_flush(mp);
+    mqttpub_close(mp);
+    esp_restart();
+    return 0;
+}
+
+// Queue a subscription to the ota topic followed by a publish to it
+// (the broker sends any retained ota request before the publish is
+// echoed back). Returns the id of the publish.
+static int
+queue_ota_check(struct mqttpub_s *mp)
+{
+    mqttpub_subscribe(mp, OTA_TOPIC, 1);
+    return mqttpub_publish(mp, OTA_TOPIC, "", 0, 1, 0);
+}
+
+int
+mqtt_start(void)
+{
+    static struct mqttpub_s mp;
+    struct upload_s *u = NULL;
+
+    // Wait for network connection
+    network_wait_ip();
+
+    // Queue connect, ota check, and all pending datalog entries
+    const char *client_id = get_client_id();
+    int clean_session = !PERSISTENT_SESSION;
+    int ret = mqttpub_connect(&mp, CONFIG_BROKER_URL, client_id
+                              , clean_session, CONFIG_MAX_RUN_TIME * 1000
+                              , network_resolve_broker);
+    if (ret && network_note_broker_failed()) {
+        // Cached broker address failed - retry with a normal lookup
+        ESP_LOGW(TAG, "Retrying broker connection without cache");
+        timing_count(TC_BROKER_RETRY);
+        mqttpub_close(&mp);
+        ret = mqttpub_connect(&mp, CONFIG_BROKER_URL, client_id
+                              , clean_session, CONFIG_MAX_RUN_TIME * 1000
+                              , network_resolve_broker);
+    }
+    if (ret)
+        goto fail;
+    network_note_broker_connected();
+    int ota_id = 0, ota_acked = 1, ota_checked = 1;
+    if (ota_check_due()) {
+        ota_id = queue_ota_check(&mp);
+        ota_acked = ota_checked = 0;
+    }
+    u = calloc(1, sizeof(*u));
+    if (!u)
+        goto fail;
+    u->mp = &mp;
+    u->first_id = mp.next_id + 1;
+    upload_records(u);
+
+    // Send everything in a single write
+    ret = mqttpub_flush(&mp);
+    if (ret)
+        goto fail;
+
+    // Process responses (and any mqtt ota transfer)
+    int uploaded = 0;
+    for (;;) {
+        if (!uploaded && ota_acked && ota_checked
+            && u->acked_count >= u->publish_count) {
+            uploaded = 1;
+            timing_note_deferred(TP_PUBACK, 0);
+        }
+        // An mqtt ota transfer resumes on a later wake - stop it early
+        // enough that the upload is still noted
+        if (uploaded && (!mqtt_ota || deepsleep_ota_time_expired()))
+            break;
+        struct mqttpub_msg_s msg;
+        ret = mqttpub_read(&mp, &msg);
+        if (ret) {
+            if (uploaded)
+                break;
+            goto fail;
+        }
+        switch (msg.type) {
+        case MQTTPUB_CONNACK:
+            if (msg.id) {
+                ESP_LOGW(TAG, "Connection refused %d", msg.id);
+                goto fail;
+            }
+            timing_note_deferred(TP_MQTT_CONNECT, 0);
+            if (!msg.session_present && ota_checked) {
+                // Broker did not keep the ota subscription
+                ota_id = queue_ota_check(&mp);
+                ota_acked = ota_checked = 0;
+                ret = mqttpub_flush(&mp);
+                if (ret)
+                    goto fail;
+            }
+            break;
+        case MQTTPUB_PUBACK:
+            if (msg.id == ota_id)
+                ota_acked = 1;
+            else
+                note_ack(u, msg.id);
+            break;
+        case MQTTPUB_PUBLISH:
+            if (msg.qos)
+                mqttpub_puback(&mp, msg.id);
+            if (handle_ota(&mp, &msg)) {
+                ota_checked = 1;
+                ota_note_checked();
+            }
+            ret = handle_ota_data(&mp, &msg);
+            if (!ret)
+                ret = mqttpub_flush(&mp);
+            if (ret)
+                goto fail;
+            break;
+        }
+    }
+    ESP_LOGW(TAG, "upload complete (%d publishes)", u->publish_count);
+    free(u);
+    mqttpub_close(&mp);
+    if (ota_in_progress && !mqtt_ota)
+        vTaskDelay(portMAX_DELAY);
+    return 0;
+
+fail:
+    ESP_LOGW(TAG, "Error in mqtt_start");
+    free(u);
+    mqttpub_close(&mp);
+    // An mqtt ota transfer resumes on a later wake
+    if (ota_in_progress && !mqtt_ota)
+        vTaskDelay(portMAX_DELAY);
+    return -1;
+}
+
+#else // !CONFIG_MQTT_LITE
+
 /****************************************************************
  * Command download
  ****************************************************************/
 
+#define OTA_CHECK_EVENT 1
+static int mqtt_connected, ota_in_progress, ota_check, ota_msg_id = -1;
+static int mqtt_ota;
+
 static void
 mqtt_hdl_connected(void *handler_args, esp_event_base_t base
                  , int32_t event_id, void *event_data)
 {
     esp_mqtt_event_handle_t event = event_data;
+    mqtt_connected = 1;
+    timing_note_deferred(TP_MQTT_CONNECT, 0);
+    network_note_broker_connected();
+    if (!ota_check && event->session_present) {
+        // Broker kept the ota subscription - no need to check
+        EventGroupHandle_t ota_event_group = handler_args;
+        xEventGroupSetBits(ota_event_group, OTA_CHECK_EVENT);
+        return;
+    }
     int msg_id = esp_mqtt_client_subscribe(event->client, OTA_TOPIC, 1);
     ESP_LOGI(TAG, "sent subscribe, msg_id=%d", msg_id);
 }
@@ -39,23 +640,93 @@ mqtt_hdl_subscribed(void *handler_args, esp_event_base_t base
                     , int32_t event_id, void *event_data)
 {
     esp_mqtt_event_handle_t event = event_data;
-    int msg_id = esp_mqtt_client_publish(event->client, OTA_TOPIC, "", 0, 1, 0);
-    ESP_LOGI(TAG, "sent publish, msg_id=%d", msg_id);
+    if (mqtt_ota)
+        // Subscription to the ota data topic
+        return;
+    ota_msg_id = esp_mqtt_client_publish(event->client, OTA_TOPIC, ""
+                                         , 0, 1, 0);
+    ESP_LOGI(TAG, "sent publish, msg_id=%d", ota_msg_id);
 }
 
-#define OTA_CHECK_EVENT 1
-static int ota_in_progress;
+// Request the next chunks of an mqtt ota transfer
+static void
+send_ota_ack(esp_mqtt_client_handle_t client)
+{
+    char buf[32];
+    int len = otamqtt_format_ack(buf, sizeof(buf));
+    esp_mqtt_client_publish(client, OTA_ACK_TOPIC, buf, len, 0, 0);
+}
+
+// Start an ota update offered over mqtt
+static void
+start_mqtt_ota(esp_mqtt_event_handle_t event)
+{
+    int ret = otamqtt_start(event->data, event->data_len);
+    if (ret) {
+        // Discard an invalid (or already installed) offer
+        const char *status = ret > 0 ? "done" : "fail";
+        esp_mqtt_client_publish(event->client, OTA_ACK_TOPIC, status
+                                , 0, 0, 0);
+        esp_mqtt_client_publish(event->client, OTA_TOPIC, "", 0, 0, 1);
+        return;
+    }
+    ota_in_progress = mqtt_ota = 1;
+    deepsleep_note_ota_start();
+    network_note_ota_start();
+    // Make sure the next wake can resume the transfer
+    deepsleep_set_boot_time(0);
+    esp_mqtt_client_subscribe(event->client, OTA_DATA_TOPIC, 0);
+    send_ota_ack(event->client);
+}
+
+// Handle a chunk of an mqtt ota transfer
+static void
+handle_ota_data(esp_mqtt_event_handle_t event)
+{
+    // Chunks larger than the mqtt buffer are delivered in pieces
+    // (which are not supported)
+    if (!mqtt_ota || event->current_data_offset
+        || event->data_len != event->total_data_len)
+        return;
+    int ret = otamqtt_handle_chunk((uint8_t *)event->data, event->data_len);
+    if (ret < 0) {
+        // The transfer resumes on a later wake
+        deepsleep_start_sleep();
+        return;
+    }
+    if (!ret)
+        return;
+    if (!otamqtt_is_complete()) {
+        send_ota_ack(event->client);
+        return;
+    }
+    ret = otamqtt_finish();
+    ESP_LOGW(TAG, "mqtt ota complete (result %d)", ret);
+    const char *status = ret ? "fail" : "done";
+    esp_mqtt_client_publish(event->client, OTA_ACK_TOPIC, status, 0, 0, 0);
+    esp_mqtt_client_publish(event->client, OTA_TOPIC, "", 0, 0, 1);
+    esp_restart();
+}
 
 static void
 mqtt_hdl_data(void *handler_args, esp_event_base_t base
               , int32_t event_id, void *event_data)
 {
     esp_mqtt_event_handle_t event = event_data;
-    if (ota_in_progress || event->topic_len != strlen(OTA_TOPIC)
-        || memcmp(event->topic, OTA_TOPIC, strlen(OTA_TOPIC)) != 0)
+    if (is_topic(event->topic, event->topic_len, OTA_DATA_TOPIC)) {
+        handle_ota_data(event);
+        return;
+    }
+    if (ota_in_progress
+        || !is_topic(event->topic, event->topic_len, OTA_TOPIC))
         return;
     ESP_LOGI(TAG, "Got ota_update response len=%d", event->data_len);
-    if (event->data_len) {
+    if (!event->data_len) {
+        // No ota request - discard any interrupted transfer
+        otamqtt_cancel();
+    } else if (otamqtt_is_offer(event->data, event->data_len)) {
+        start_mqtt_ota(event);
+    } else {
         // OTA request
         ota_in_progress = 1;
         deepsleep_note_ota_start();
@@ -65,6 +736,7 @@ mqtt_hdl_data(void *handler_args, esp_event_base_t base
         ESP_LOGI(TAG, "sent publish clear, msg_id=%d", msg_id);
         ota_start(event->data, event->data_len);
     }
+    ota_note_checked();
     EventGroupHandle_t ota_event_group = handler_args;
     xEventGroupSetBits(ota_event_group, OTA_CHECK_EVENT);
 }
@@ -74,19 +746,13 @@ mqtt_hdl_data(void *handler_args, esp_event_base_t base
  * Startup
  ****************************************************************/
 
-// Start connection signal
-static void
-on_got_ip(void *arg, esp_event_base_t event_base
-          , int32_t event_id, void *event_data)
-{
-    esp_mqtt_client_handle_t client = arg;
-    esp_mqtt_client_start(client);
-}
-
 static void
 mqtt_hdl_published(void *handler_args, esp_event_base_t base
                    , int32_t event_id, void *event_data)
 {
+    esp_mqtt_event_handle_t event = event_data;
+    if (event->msg_id == ota_msg_id)
+        return;
     TaskHandle_t publish_task = handler_args;
     xTaskNotifyGive(publish_task);
 }
@@ -96,12 +762,26 @@ mqtt_hdl_error(void *handler_args, esp_event_base_t base
                , int32_t event_id, void *event_data)
 {
     ESP_LOGW(TAG, "Got MQTT error. Entering deep sleep now.");
+    if (!mqtt_connected)
+        network_note_broker_failed();
     deepsleep_start_sleep();
 }
 
-void
+// The receive buffer must hold an ota chunk message
+#if CONFIG_MQTT_BATCH_SIZE > OTAMQTT_CHUNK_SIZE
+#define MQTT_BUFFER_SIZE (CONFIG_MQTT_BATCH_SIZE + 256)
+#else
+#define MQTT_BUFFER_SIZE (OTAMQTT_CHUNK_SIZE + 256)
+#endif
+
+int
 mqtt_start(void)
 {
+    struct upload_s *u = calloc(1, sizeof(*u));
+    if (!u) {
+        ESP_LOGW(TAG, "Error in mqtt_start");
+        return -1;
+    }
     EventGroupHandle_t ota_event_group = xEventGroupCreate();
     TaskHandle_t publish_task = xTaskGetCurrentTaskHandle();
 
@@ -109,49 +789,55 @@ mqtt_start(void)
     esp_mqtt_client_config_t mqtt_cfg = {
         .uri = CONFIG_BROKER_URL,
         .disable_auto_reconnect = true,
+        .disable_clean_session = PERSISTENT_SESSION,
+        .buffer_size = MQTT_BUFFER_SIZE,
     };
+    if (PERSISTENT_SESSION)
+        mqtt_cfg.client_id = get_client_id();
+    ota_check = ota_check_due();
     esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
     esp_mqtt_client_register_event(client, MQTT_EVENT_DISCONNECTED
                                    , mqtt_hdl_error, NULL);
     esp_mqtt_client_register_event(client, MQTT_EVENT_ERROR
                                    , mqtt_hdl_error, NULL);
     esp_mqtt_client_register_event(client, MQTT_EVENT_CONNECTED
-                                   , mqtt_hdl_connected, NULL);
+                                   , mqtt_hdl_connected, ota_event_group);
     esp_mqtt_client_register_event(client, MQTT_EVENT_SUBSCRIBED
                                    , mqtt_hdl_subscribed, NULL);
     esp_mqtt_client_register_event(client, MQTT_EVENT_DATA
                                    , mqtt_hdl_data, ota_event_group);
     esp_mqtt_client_register_event(client, MQTT_EVENT_PUBLISHED
                                    , mqtt_hdl_published, publish_task);
-    esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP
-                               , &on_got_ip, client);
 
     // Upload pending datalog entries
-    int pos = -1, count = 0;
-    for (;;) {
-        char buf[256];
-        int ret = datalog_format(&pos, buf, sizeof(buf));
-        if (ret < 0)
-            break;
-        ESP_LOGW(TAG, "data publish %d '%.*s'", count, ret, buf);
-        esp_mqtt_client_publish(client, DATA_TOPIC, buf, ret, 1, 1);
-        count++;
-    }
+    u->client = client;
+    upload_records(u);
+    free(u->ds.buf);
 
-    // Wait for ota publish ack
-    ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+    // Start connection once network is available
+    network_wait_ip();
+    esp_mqtt_client_start(client);
 
     // Wait for acks from sent data
-    while (count--) {
+    for (int i=0; i<u->publish_count; i++) {
         ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
-        datalog_expire();
+        for (int j=0; j<u->record_counts[i]; j++)
+            upload_expire();
     }
+    timing_note_deferred(TP_PUBACK, 0);
+    free(u);
 
     // Wait for ota check to complete
     xEventGroupWaitBits(ota_event_group, OTA_CHECK_EVENT
                         , true, true, portMAX_DELAY);
+    if (mqtt_ota)
+        // The transfer continues in the event handlers
+        vTaskDelay(portMAX_DELAY);
     esp_mqtt_client_stop(client);
     esp_mqtt_client_disconnect(client);
     if (ota_in_progress)
         vTaskDelay(portMAX_DELAY);
+    return 0;
 }
+
+#endif // !CONFIG_MQTT_LITE
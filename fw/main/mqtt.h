@@ -1,6 +1,6 @@
 #ifndef MQTT_H
 #define MQTT_H
 
-void mqtt_start(void);
+int mqtt_start(void);
 
 #endif // mqtt.h
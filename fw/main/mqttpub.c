@@ -0,0 +1,504 @@
+// Minimal pipelined MQTT 3.1.1 publisher
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This code only uses the standard socket interface so that it may
+// also be compiled and tested on a Linux host (TLS connections use
+// mqtttls.c, which needs mbedtls - see scripts/host/tls_check.c).
+
+#include <netdb.h> // getaddrinfo
+#include <netinet/in.h> // struct sockaddr_in
+#include <stdio.h> // snprintf
+#include <stdlib.h> // realloc
+#include <string.h> // memcpy
+#include <sys/socket.h> // socket
+#include <sys/time.h> // struct timeval
+#include <unistd.h> // close
+#include "mqttpub.h" // mqttpub_connect
+#include "mqtttls.h" // mqtttls_open
+#include "sdkconfig.h" // CONFIG_MQTT_TLS
+
+#define MQTT_PORT 1883
+#define MQTTS_PORT 8883
+#define MQTT_KEEPALIVE 60
+
+enum {
+    MT_CONNECT = 1, MT_SUBSCRIBE = 8, MT_DISCONNECT = 14,
+};
+
+
+/****************************************************************
+ * Packet building
+ ****************************************************************/
+
+// Make space for len more bytes in the outgoing buffer (without
+// adding them to out_len)
+int
+mqttpub_reserve(struct mqttpub_s *m, int len)
+{
+    int need = m->out_len + len;
+    if (need > m->out_size) {
+        int new_size = m->out_size ? m->out_size : 256;
+        while (new_size < need)
+            new_size *= 2;
+        uint8_t *out = realloc(m->out, new_size);
+        if (!out)
+            return -1;
+        m->out = out;
+        m->out_size = new_size;
+    }
+    return 0;
+}
+
+// Reserve space in the outgoing buffer
+static uint8_t *
+out_alloc(struct mqttpub_s *m, int len)
+{
+    if (mqttpub_reserve(m, len))
+        return NULL;
+    uint8_t *p = &m->out[m->out_len];
+    m->out_len += len;
+    return p;
+}
+
+static uint8_t *
+put_u16(uint8_t *p, int v)
+{
+    *p++ = v >> 8;
+    *p++ = v;
+    return p;
+}
+
+static uint8_t *
+put_str(uint8_t *p, const char *s, int len)
+{
+    p = put_u16(p, len);
+    memcpy(p, s, len);
+    return p + len;
+}
+
+// Encode the fixed header "remaining length" - returns encoded size
+static int
+put_rem_len(uint8_t *p, int v)
+{
+    int len = 0;
+    do {
+        p[len++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+    return len;
+}
+
+// Allocate a packet and fill in its fixed header
+static uint8_t *
+packet_start(struct mqttpub_s *m, int type_flags, int rem_len)
+{
+    uint8_t *p = out_alloc(m, 1 + 4 + rem_len);
+    if (!p)
+        return NULL;
+    *p++ = type_flags;
+    int hlen = put_rem_len(p, rem_len);
+    // Return unused header space
+    m->out_len -= 4 - hlen;
+    return p + hlen;
+}
+
+static uint16_t
+alloc_id(struct mqttpub_s *m)
+{
+    if (!++m->next_id)
+        m->next_id = 1;
+    return m->next_id;
+}
+
+
+/****************************************************************
+ * Broker connection
+ ****************************************************************/
+
+struct broker_url_s {
+    char host[128], user[64], pass[64];
+    int port, tls;
+};
+
+// Parse a "mqtt://[user[:pass]@]host[:port]" url (or a "mqtts://" url)
+static int
+parse_url(const char *url, struct broker_url_s *bu)
+{
+    memset(bu, 0, sizeof(*bu));
+    bu->port = MQTT_PORT;
+    const char *prefix = "mqtt://";
+#if CONFIG_MQTT_TLS
+    if (strncmp(url, "mqtts://", 8) == 0) {
+        prefix = "mqtts://";
+        bu->port = MQTTS_PORT;
+        bu->tls = 1;
+    }
+#endif
+    if (strncmp(url, prefix, strlen(prefix)) != 0)
+        return -1;
+    const char *s = url + strlen(prefix), *at = strchr(s, '@');
+    if (at) {
+        const char *colon = memchr(s, ':', at - s);
+        int ulen = (colon ? colon : at) - s;
+        snprintf(bu->user, sizeof(bu->user), "%.*s", ulen, s);
+        if (colon)
+            snprintf(bu->pass, sizeof(bu->pass), "%.*s"
+                     , (int)(at - colon - 1), colon + 1);
+        s = at + 1;
+    }
+    int hlen = strcspn(s, ":/");
+    snprintf(bu->host, sizeof(bu->host), "%.*s", hlen, s);
+    if (s[hlen] == ':')
+        bu->port = atoi(&s[hlen + 1]);
+    return 0;
+}
+
+static int
+queue_connect(struct mqttpub_s *m, struct broker_url_s *bu
+              , const char *client_id, int clean_session)
+{
+    int ulen = strlen(bu->user), plen = strlen(bu->pass);
+    int cidlen = strlen(client_id);
+    int rem_len = 10 + 2 + cidlen;
+    uint8_t flags = clean_session ? 0x02 : 0x00;
+    if (ulen) {
+        flags |= 0x80;
+        rem_len += 2 + ulen;
+        if (plen) {
+            flags |= 0x40;
+            rem_len += 2 + plen;
+        }
+    }
+    uint8_t *p = packet_start(m, MT_CONNECT << 4, rem_len);
+    if (!p)
+        return -1;
+    p = put_str(p, "MQTT", 4);
+    *p++ = 4; // Protocol level 3.1.1
+    *p++ = flags;
+    p = put_u16(p, MQTT_KEEPALIVE);
+    p = put_str(p, client_id, cidlen);
+    if (flags & 0x80)
+        p = put_str(p, bu->user, ulen);
+    if (flags & 0x40)
+        p = put_str(p, bu->pass, plen);
+    return 0;
+}
+
+// Look up the ipv4 address of a host
+int
+mqttpub_resolve(const char *host, int port, struct sockaddr_in *sin)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_INET, .ai_socktype = SOCK_STREAM,
+    }, *res;
+    char portstr[8];
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    int ret = getaddrinfo(host, portstr, &hints, &res);
+    if (ret || !res)
+        return -1;
+    memcpy(sin, res->ai_addr, sizeof(*sin));
+    freeaddrinfo(res);
+    return 0;
+}
+
+// Open a connection to the broker and queue an mqtt CONNECT request
+// (the broker host is looked up with the given resolve function, or
+// with mqttpub_resolve() if it is NULL)
+int
+mqttpub_connect(struct mqttpub_s *m, const char *url, const char *client_id
+                , int clean_session, int timeout_ms
+                , mqttpub_resolve_fn resolve)
+{
+    memset(m, 0, sizeof(*m));
+    m->fd = -1;
+    struct broker_url_s bu;
+    int ret = parse_url(url, &bu);
+    if (ret)
+        return ret;
+
+    struct sockaddr_in sin;
+    ret = (resolve ? resolve : mqttpub_resolve)(bu.host, bu.port, &sin);
+    if (ret)
+        return -1;
+    m->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m->fd < 0)
+        return -1;
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    setsockopt(m->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(m->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    ret = connect(m->fd, (struct sockaddr *)&sin, sizeof(sin));
+    if (ret)
+        return -1;
+#if CONFIG_MQTT_TLS
+    if (bu.tls) {
+        m->tls = mqtttls_open(m->fd, bu.host);
+        if (!m->tls)
+            return -1;
+    }
+#endif
+
+    return queue_connect(m, &bu, client_id, clean_session);
+}
+
+
+/****************************************************************
+ * Requests
+ ****************************************************************/
+
+// Queue a SUBSCRIBE request (returns packet id)
+int
+mqttpub_subscribe(struct mqttpub_s *m, const char *topic, int qos)
+{
+    int tlen = strlen(topic);
+    uint8_t *p = packet_start(m, (MT_SUBSCRIBE << 4) | 0x02, 2 + 2 + tlen + 1);
+    if (!p)
+        return -1;
+    int id = alloc_id(m);
+    p = put_u16(p, id);
+    p = put_str(p, topic, tlen);
+    *p++ = qos;
+    return id;
+}
+
+// Queue a PUBLISH request (returns packet id, or zero for qos 0)
+int
+mqttpub_publish(struct mqttpub_s *m, const char *topic
+                , const void *data, int len, int qos, int retain)
+{
+    int tlen = strlen(topic);
+    int rem_len = 2 + tlen + (qos ? 2 : 0) + len;
+    uint8_t *p = packet_start(m, (MQTTPUB_PUBLISH << 4) | (qos << 1)
+                              | (retain ? 1 : 0), rem_len);
+    if (!p)
+        return -1;
+    p = put_str(p, topic, tlen);
+    int id = 0;
+    if (qos) {
+        id = alloc_id(m);
+        p = put_u16(p, id);
+    }
+    memcpy(p, data, len);
+    return id;
+}
+
+// Header space reserved for the remaining length of a streamed
+// PUBLISH (two bytes is enough for payloads up to 16KiB)
+#define STREAM_LEN_BYTES 2
+
+// Start a PUBLISH request whose payload is then added directly to the
+// outgoing buffer by the caller (using mqttpub_reserve() and out_len).
+// Returns packet id (or zero for qos 0).
+int
+mqttpub_publish_start(struct mqttpub_s *m, const char *topic
+                      , int qos, int retain)
+{
+    int tlen = strlen(topic);
+    int len = 1 + STREAM_LEN_BYTES + 2 + tlen + (qos ? 2 : 0);
+    m->pub_start = m->out_len;
+    uint8_t *p = out_alloc(m, len);
+    if (!p)
+        return -1;
+    *p = (MQTTPUB_PUBLISH << 4) | (qos << 1) | (retain ? 1 : 0);
+    p = put_str(p + 1 + STREAM_LEN_BYTES, topic, tlen);
+    int id = 0;
+    if (qos) {
+        id = alloc_id(m);
+        p = put_u16(p, id);
+    }
+    return id;
+}
+
+// Fill in the fixed header of a PUBLISH started with
+// mqttpub_publish_start()
+int
+mqttpub_publish_end(struct mqttpub_s *m)
+{
+    int body = m->pub_start + 1 + STREAM_LEN_BYTES;
+    int rem_len = m->out_len - body;
+    uint8_t hdr[4];
+    int hlen = put_rem_len(hdr, rem_len);
+    if (hlen != STREAM_LEN_BYTES) {
+        // Reserved header space did not match - move the body
+        if (hlen > STREAM_LEN_BYTES
+            && mqttpub_reserve(m, hlen - STREAM_LEN_BYTES))
+            return -1;
+        uint8_t *start = &m->out[m->pub_start];
+        memmove(&start[1 + hlen], &start[1 + STREAM_LEN_BYTES], rem_len);
+        m->out_len += hlen - STREAM_LEN_BYTES;
+    }
+    memcpy(&m->out[m->pub_start + 1], hdr, hlen);
+    return 0;
+}
+
+// Discard a PUBLISH started with mqttpub_publish_start()
+void
+mqttpub_publish_cancel(struct mqttpub_s *m)
+{
+    if (m->out_len > m->pub_start && m->out[m->pub_start] & 0x06)
+        // Release the packet id
+        m->next_id--;
+    m->out_len = m->pub_start;
+}
+
+// Queue a PUBACK response to a received qos 1 PUBLISH
+int
+mqttpub_puback(struct mqttpub_s *m, int id)
+{
+    uint8_t *p = packet_start(m, MQTTPUB_PUBACK << 4, 2);
+    if (!p)
+        return -1;
+    put_u16(p, id);
+    return 0;
+}
+
+static int
+conn_send(struct mqttpub_s *m, const uint8_t *buf, int len)
+{
+#if CONFIG_MQTT_TLS
+    if (m->tls)
+        return mqtttls_send(m->tls, buf, len);
+#endif
+    return send(m->fd, buf, len, 0);
+}
+
+static int
+conn_recv(struct mqttpub_s *m, uint8_t *buf, int len)
+{
+#if CONFIG_MQTT_TLS
+    if (m->tls)
+        return mqtttls_recv(m->tls, buf, len);
+#endif
+    return recv(m->fd, buf, len, 0);
+}
+
+// Transmit all queued requests
+int
+mqttpub_flush(struct mqttpub_s *m)
+{
+    int pos = 0;
+    while (pos < m->out_len) {
+        int ret = conn_send(m, &m->out[pos], m->out_len - pos);
+        if (ret <= 0)
+            return -1;
+        pos += ret;
+    }
+    m->out_len = 0;
+    return 0;
+}
+
+
+/****************************************************************
+ * Responses
+ ****************************************************************/
+
+// Decode the fixed header - returns header length (or 0 if incomplete)
+static int
+parse_header(struct mqttpub_s *m, int *prem_len)
+{
+    int rem_len = 0, shift = 0, pos = 1;
+    for (;;) {
+        if (pos >= m->in_len || pos > 4)
+            return 0;
+        uint8_t c = m->in[pos++];
+        rem_len |= (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            break;
+        shift += 7;
+    }
+    *prem_len = rem_len;
+    return pos;
+}
+
+static inline int
+load_u16(uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+// Wait for and decode the next packet from the broker
+int
+mqttpub_read(struct mqttpub_s *m, struct mqttpub_msg_s *msg)
+{
+    // Discard previously returned packet
+    int hdr_len, rem_len;
+    if (m->in_len && (hdr_len = parse_header(m, &rem_len))) {
+        int pkt_len = hdr_len + rem_len;
+        if (pkt_len <= m->in_len) {
+            m->in_len -= pkt_len;
+            memmove(m->in, &m->in[pkt_len], m->in_len);
+        }
+    }
+
+    // Read until a full packet is available
+    for (;;) {
+        hdr_len = parse_header(m, &rem_len);
+        if (hdr_len && hdr_len + rem_len <= m->in_len)
+            break;
+        if ((hdr_len && hdr_len + rem_len > sizeof(m->in))
+            || m->in_len >= sizeof(m->in))
+            return -1;
+        int ret = conn_recv(m, &m->in[m->in_len], sizeof(m->in) - m->in_len);
+        if (ret <= 0)
+            return -1;
+        m->in_len += ret;
+    }
+
+    // Decode packet
+    uint8_t *p = &m->in[hdr_len];
+    memset(msg, 0, sizeof(*msg));
+    msg->type = m->in[0] >> 4;
+    switch (msg->type) {
+    case MQTTPUB_CONNACK:
+        if (rem_len < 2)
+            return -1;
+        msg->session_present = p[0] & 0x01;
+        msg->id = p[1];
+        break;
+    case MQTTPUB_PUBACK:
+    case MQTTPUB_SUBACK:
+        if (rem_len < 2)
+            return -1;
+        msg->id = load_u16(p);
+        break;
+    case MQTTPUB_PUBLISH: {
+        msg->qos = (m->in[0] >> 1) & 0x03;
+        int tlen = rem_len >= 2 ? load_u16(p) : rem_len;
+        int vlen = 2 + tlen + (msg->qos ? 2 : 0);
+        if (vlen > rem_len)
+            return -1;
+        msg->topic = (char*)&p[2];
+        msg->topic_len = tlen;
+        if (msg->qos)
+            msg->id = load_u16(&p[2 + tlen]);
+        msg->data = (char*)&p[vlen];
+        msg->data_len = rem_len - vlen;
+        break;
+    }
+    }
+    return 0;
+}
+
+// Send a DISCONNECT request and close the connection
+void
+mqttpub_close(struct mqttpub_s *m)
+{
+    if (m->fd >= 0) {
+        m->out_len = 0;
+        if (packet_start(m, MT_DISCONNECT << 4, 0))
+            mqttpub_flush(m);
+#if CONFIG_MQTT_TLS
+        mqtttls_close(m->tls);
+        m->tls = NULL;
+#endif
+        close(m->fd);
+        m->fd = -1;
+    }
+    free(m->out);
+    m->out = NULL;
+    m->out_len = m->out_size = 0;
+}
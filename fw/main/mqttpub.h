@@ -0,0 +1,51 @@
+#ifndef MQTTPUB_H
+#define MQTTPUB_H
+
+#include <stdint.h> // uint8_t
+
+enum {
+    MQTTPUB_CONNACK = 2, MQTTPUB_PUBLISH = 3, MQTTPUB_PUBACK = 4,
+    MQTTPUB_SUBACK = 9,
+};
+
+// Receive buffer size (must hold an ota chunk message - see otamqtt.h)
+#define MQTTPUB_IN_SIZE 1280
+
+struct mqttpub_s {
+    int fd;
+    struct mqtttls_s *tls;
+    uint8_t *out;
+    int out_len, out_size, pub_start;
+    uint8_t in[MQTTPUB_IN_SIZE];
+    int in_len;
+    uint16_t next_id;
+};
+
+struct mqttpub_msg_s {
+    int type, id, qos, session_present;
+    char *topic, *data;
+    int topic_len, data_len;
+};
+
+struct sockaddr_in;
+typedef int (*mqttpub_resolve_fn)(const char *host, int port
+                                  , struct sockaddr_in *sin);
+
+int mqttpub_resolve(const char *host, int port, struct sockaddr_in *sin);
+int mqttpub_connect(struct mqttpub_s *m, const char *url, const char *client_id
+                    , int clean_session, int timeout_ms
+                    , mqttpub_resolve_fn resolve);
+int mqttpub_subscribe(struct mqttpub_s *m, const char *topic, int qos);
+int mqttpub_publish(struct mqttpub_s *m, const char *topic
+                    , const void *data, int len, int qos, int retain);
+int mqttpub_publish_start(struct mqttpub_s *m, const char *topic
+                          , int qos, int retain);
+int mqttpub_publish_end(struct mqttpub_s *m);
+void mqttpub_publish_cancel(struct mqttpub_s *m);
+int mqttpub_reserve(struct mqttpub_s *m, int len);
+int mqttpub_puback(struct mqttpub_s *m, int id);
+int mqttpub_flush(struct mqttpub_s *m);
+int mqttpub_read(struct mqttpub_s *m, struct mqttpub_msg_s *msg);
+void mqttpub_close(struct mqttpub_s *m);
+
+#endif // mqttpub.h
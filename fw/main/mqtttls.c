@@ -0,0 +1,265 @@
+// TLS connections (with session resumption) for the built-in publisher
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <stdlib.h> // calloc
+#include <string.h> // memcpy
+#include <sys/socket.h> // send
+#include <esp_attr.h> // RTC_FAST_ATTR
+#include <esp_log.h> // ESP_LOGW
+#include <esp_system.h> // esp_fill_random
+#include <esp_timer.h> // esp_timer_get_time
+#include <mbedtls/net_sockets.h> // MBEDTLS_ERR_NET_SEND_FAILED
+#include <mbedtls/ssl.h> // mbedtls_ssl_handshake
+#include "deepsleep.h" // deepsleep_get_wake_time
+#include "mqtttls.h" // mqtttls_open
+#include "timing.h" // timing_note_deferred
+#include "sdkconfig.h" // CONFIG_MQTT_TLS_SESSION_RESUME
+
+#if CONFIG_MQTT_TLS
+
+static const char *TAG = "MQTTTLS";
+
+// A full TLS handshake requires public key operations that take a
+// notable amount of time on the esp32 (and an additional network round
+// trip). The session negotiated on each upload is stored in rtc memory
+// and offered on the next upload - if the broker still has the session
+// (or accepts its session ticket) then an abbreviated handshake is
+// performed. The broker certificate is not verified.
+
+// The stored session is kept in rtc fast memory as the measurement log
+// uses nearly all of rtc slow memory. It is only written during a full
+// boot, so the wake stub checksum of rtc fast memory is not disturbed.
+
+#define TICKET_MAX 256
+
+#if CONFIG_MQTT_TLS_SESSION_RESUME
+#define SESSION_RESUME 1
+#else
+#define SESSION_RESUME 0
+#endif
+
+struct tls_session_s {
+    uint64_t save_time;
+    int32_t ciphersuite;
+    uint32_t ticket_lifetime;
+    uint16_t ticket_len;
+    uint8_t valid, id_len, mfl_code, trunc_hmac, encrypt_then_mac;
+    uint8_t id[32], master[48];
+    uint8_t ticket[TICKET_MAX];
+};
+
+static RTC_FAST_ATTR struct tls_session_s saved_session;
+
+struct mqtttls_s {
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    int fd;
+};
+
+
+/****************************************************************
+ * Session storage
+ ****************************************************************/
+
+// Store the session of the current connection
+static void
+session_save(mbedtls_ssl_context *ssl)
+{
+    struct tls_session_s *ss = &saved_session;
+    mbedtls_ssl_session s;
+    mbedtls_ssl_session_init(&s);
+    ss->valid = 0;
+    if (mbedtls_ssl_get_session(ssl, &s) || s.id_len > sizeof(ss->id))
+        goto done;
+    ss->save_time = deepsleep_get_wake_time();
+    ss->ciphersuite = s.ciphersuite;
+    ss->id_len = s.id_len;
+    memcpy(ss->id, s.id, s.id_len);
+    memcpy(ss->master, s.master, sizeof(ss->master));
+    ss->ticket_len = 0;
+    ss->ticket_lifetime = 0;
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    if (s.ticket && s.ticket_len <= sizeof(ss->ticket)) {
+        // Tickets that do not fit fall back to resuming by session id
+        memcpy(ss->ticket, s.ticket, s.ticket_len);
+        ss->ticket_len = s.ticket_len;
+        ss->ticket_lifetime = s.ticket_lifetime;
+    }
+#endif
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+    ss->mfl_code = s.mfl_code;
+#endif
+#if defined(MBEDTLS_SSL_TRUNCATED_HMAC)
+    ss->trunc_hmac = s.trunc_hmac;
+#endif
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+    ss->encrypt_then_mac = s.encrypt_then_mac;
+#endif
+    ss->valid = ss->id_len || ss->ticket_len;
+done:
+    mbedtls_ssl_session_free(&s);
+}
+
+// Offer the stored session (returns 1 if a session was offered)
+static int
+session_restore(mbedtls_ssl_context *ssl)
+{
+    struct tls_session_s *ss = &saved_session;
+    if (!ss->valid)
+        return 0;
+    uint64_t age = deepsleep_get_wake_time() - ss->save_time;
+    if (ss->ticket_lifetime && age > ss->ticket_lifetime * 1000000ULL) {
+        // The broker would not accept the ticket
+        ss->valid = 0;
+        return 0;
+    }
+    mbedtls_ssl_session s;
+    mbedtls_ssl_session_init(&s);
+    s.ciphersuite = ss->ciphersuite;
+    s.id_len = ss->id_len;
+    memcpy(s.id, ss->id, ss->id_len);
+    memcpy(s.master, ss->master, sizeof(s.master));
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    // The ticket is copied by mbedtls_ssl_set_session()
+    s.ticket = ss->ticket_len ? ss->ticket : NULL;
+    s.ticket_len = ss->ticket_len;
+    s.ticket_lifetime = ss->ticket_lifetime;
+#endif
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+    s.mfl_code = ss->mfl_code;
+#endif
+#if defined(MBEDTLS_SSL_TRUNCATED_HMAC)
+    s.trunc_hmac = ss->trunc_hmac;
+#endif
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+    s.encrypt_then_mac = ss->encrypt_then_mac;
+#endif
+    int ret = mbedtls_ssl_set_session(ssl, &s);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    s.ticket = NULL;
+#endif
+    mbedtls_ssl_session_free(&s);
+    return !ret;
+}
+
+// Check if the handshake resumed the stored session (a resumed
+// session keeps its master secret)
+static int
+session_was_resumed(mbedtls_ssl_context *ssl)
+{
+    mbedtls_ssl_session s;
+    mbedtls_ssl_session_init(&s);
+    int ret = mbedtls_ssl_get_session(ssl, &s);
+    int resumed = (!ret && memcmp(s.master, saved_session.master
+                                  , sizeof(s.master)) == 0);
+    mbedtls_ssl_session_free(&s);
+    return resumed;
+}
+
+
+/****************************************************************
+ * Connection
+ ****************************************************************/
+
+static int
+tls_random(void *ctx, unsigned char *buf, size_t len)
+{
+    esp_fill_random(buf, len);
+    return 0;
+}
+
+static int
+tls_net_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    struct mqtttls_s *t = ctx;
+    int ret = send(t->fd, buf, len, 0);
+    return ret < 0 ? MBEDTLS_ERR_NET_SEND_FAILED : ret;
+}
+
+static int
+tls_net_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    struct mqtttls_s *t = ctx;
+    int ret = recv(t->fd, buf, len, 0);
+    return ret < 0 ? MBEDTLS_ERR_NET_RECV_FAILED : ret;
+}
+
+// Perform a TLS handshake on a connected socket
+struct mqtttls_s *
+mqtttls_open(int fd, const char *host)
+{
+    int64_t start_time = esp_timer_get_time();
+    struct mqtttls_s *t = calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+    t->fd = fd;
+    mbedtls_ssl_init(&t->ssl);
+    mbedtls_ssl_config_init(&t->conf);
+    int ret = mbedtls_ssl_config_defaults(
+        &t->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM
+        , MBEDTLS_SSL_PRESET_DEFAULT);
+    if (ret)
+        goto fail;
+    mbedtls_ssl_conf_authmode(&t->conf, MBEDTLS_SSL_VERIFY_NONE);
+    mbedtls_ssl_conf_rng(&t->conf, tls_random, NULL);
+    ret = mbedtls_ssl_setup(&t->ssl, &t->conf);
+    if (ret)
+        goto fail;
+    ret = mbedtls_ssl_set_hostname(&t->ssl, host);
+    if (ret)
+        goto fail;
+    mbedtls_ssl_set_bio(&t->ssl, t, tls_net_send, tls_net_recv, NULL);
+    int offered = SESSION_RESUME && session_restore(&t->ssl);
+
+    ret = mbedtls_ssl_handshake(&t->ssl);
+    if (ret) {
+        // Don't offer the session again if it caused a failure
+        saved_session.valid = 0;
+        goto fail;
+    }
+    int resumed = offered && session_was_resumed(&t->ssl);
+    if (!resumed)
+        timing_count(TC_TLS_FULL_HANDSHAKE);
+    if (SESSION_RESUME)
+        session_save(&t->ssl);
+    timing_note_deferred(TP_TLS_HANDSHAKE, start_time);
+    ESP_LOGW(TAG, "TLS handshake complete (%s)"
+             , resumed ? "resumed" : "full");
+    return t;
+
+fail:
+    ESP_LOGW(TAG, "TLS handshake failed (%d)", ret);
+    mqtttls_close(t);
+    return NULL;
+}
+
+int
+mqtttls_send(struct mqtttls_s *t, const uint8_t *buf, int len)
+{
+    int ret = mbedtls_ssl_write(&t->ssl, buf, len);
+    return ret < 0 ? -1 : ret;
+}
+
+int
+mqtttls_recv(struct mqtttls_s *t, uint8_t *buf, int len)
+{
+    int ret = mbedtls_ssl_read(&t->ssl, buf, len);
+    return ret < 0 ? -1 : ret;
+}
+
+// Free the TLS state (the caller closes the socket)
+void
+mqtttls_close(struct mqtttls_s *t)
+{
+    if (!t)
+        return;
+    mbedtls_ssl_close_notify(&t->ssl);
+    mbedtls_ssl_free(&t->ssl);
+    mbedtls_ssl_config_free(&t->conf);
+    free(t);
+}
+
+#endif // CONFIG_MQTT_TLS
@@ -0,0 +1,13 @@
+#ifndef MQTTTLS_H
+#define MQTTTLS_H
+
+#include <stdint.h> // uint8_t
+
+struct mqtttls_s;
+
+struct mqtttls_s *mqtttls_open(int fd, const char *host);
+int mqtttls_send(struct mqtttls_s *t, const uint8_t *buf, int len);
+int mqtttls_recv(struct mqtttls_s *t, uint8_t *buf, int len);
+void mqtttls_close(struct mqtttls_s *t);
+
+#endif // mqtttls.h
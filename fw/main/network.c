@@ -4,12 +4,25 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <string.h> // memcpy
 #include <esp_log.h> // ESP_LOGI
 #include <esp_netif.h> // esp_netif_init
+#include <esp_sntp.h> // sntp_init
+#include <esp_timer.h> // esp_timer_get_time
 #include <esp_wifi.h> // esp_wifi_init
 #include <nvs_flash.h> // nvs_flash_init
+#include <esp32/rom/crc.h> // crc32_le
+#include <mbedtls/pkcs5.h> // mbedtls_pkcs5_pbkdf2_hmac
+#include <lwip/etharp.h> // etharp_input
+#include <lwip/prot/etharp.h> // struct etharp_hdr
+#include <lwip/sockets.h> // struct sockaddr_in
+#include <lwip/tcpip.h> // tcpip_callback
+#include "mqttpub.h" // mqttpub_resolve
+#include <freertos/FreeRTOS.h> // xEventGroupCreate
+#include <freertos/event_groups.h> // xEventGroupCreate
 #include "deepsleep.h" // deepsleep_start_sleep()
 #include "network.h" // network_connect
+#include "timing.h" // timing_note_deferred
 #include "sdkconfig.h" // CONFIG_WIFI_SSID
 
 static const char *TAG = "NETWORK";
@@ -117,14 +130,303 @@ fail:
     return ret;
 }
 
-static RTC_DATA_ATTR uint8_t Last_channel;
+// Access point of the last successful connection (used to skip the
+// wifi scan on the next connection)
+struct ap_cache_s {
+    uint8_t bssid[6];
+    uint8_t channel, valid;
+};
+static RTC_DATA_ATTR struct ap_cache_s ap_cache;
+static int used_ap_cache, is_connected;
+static int64_t connect_start_time, connected_time;
 
 static void
 on_wifi_connect(void *arg, esp_event_base_t event_base
                 , int32_t event_id, void *event_data)
 {
     wifi_event_sta_connected_t *e = event_data;
-    Last_channel = e->channel;
+    memcpy(ap_cache.bssid, e->bssid, sizeof(ap_cache.bssid));
+    ap_cache.channel = e->channel;
+    ap_cache.valid = 1;
+    is_connected = 1;
+    connected_time = esp_timer_get_time();
+    timing_note_deferred(TP_WIFI_CONNECT, 0);
+    timing_note_deferred(TP_ASSOC, connect_start_time);
+}
+
+// Broker address and the hardware address of the next hop towards it
+// (the broker itself if it is on the local network, otherwise the
+// gateway). This avoids a dns lookup and an arp exchange on each
+// upload.
+struct broker_cache_s {
+    uint64_t valid_time;
+    uint32_t addr, hop_addr;
+    uint8_t hop_mac[6];
+    uint8_t have_addr, have_mac;
+};
+static RTC_DATA_ATTR struct broker_cache_s broker_cache;
+static int used_broker_cache;
+
+static int
+broker_cache_valid(void)
+{
+    return deepsleep_get_wake_time() < broker_cache.valid_time;
+}
+
+// Add the cached next hop to the lwip arp table by passing a
+// synthesized arp reply to lwip (runs in the lwip thread)
+static void
+arp_seed(void *arg)
+{
+    struct netif *netif = netif_default;
+    if (!netif || ip4_addr_isany_val(*netif_ip4_addr(netif)))
+        return;
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, SIZEOF_ETHARP_HDR, PBUF_RAM);
+    if (!p)
+        return;
+    struct etharp_hdr *hdr = p->payload;
+    hdr->hwtype = PP_HTONS(LWIP_IANA_HWTYPE_ETHERNET);
+    hdr->proto = PP_HTONS(ETHTYPE_IP);
+    hdr->hwlen = ETH_HWADDR_LEN;
+    hdr->protolen = sizeof(ip4_addr_t);
+    hdr->opcode = PP_HTONS(ARP_REPLY);
+    memcpy(&hdr->shwaddr, broker_cache.hop_mac, ETH_HWADDR_LEN);
+    memcpy(&hdr->sipaddr, &broker_cache.hop_addr, sizeof(hdr->sipaddr));
+    memcpy(&hdr->dhwaddr, netif->hwaddr, ETH_HWADDR_LEN);
+    memcpy(&hdr->dipaddr, netif_ip4_addr(netif), sizeof(hdr->dipaddr));
+    etharp_input(p, netif);
+}
+
+// Store the hardware address of the next hop (runs in the lwip thread)
+static void
+arp_capture(void *arg)
+{
+    struct netif *netif = netif_default;
+    if (!netif)
+        return;
+    ip4_addr_t hop = *netif_ip4_gw(netif);
+    if (broker_cache.have_addr) {
+        ip4_addr_t broker = { .addr = broker_cache.addr };
+        if (ip4_addr_netcmp(&broker, netif_ip4_addr(netif)
+                            , netif_ip4_netmask(netif)))
+            hop = broker;
+    }
+    struct eth_addr *eth_ret;
+    const ip4_addr_t *ip_ret;
+    if (etharp_find_addr(netif, &hop, &eth_ret, &ip_ret) < 0)
+        return;
+    broker_cache.hop_addr = hop.addr;
+    memcpy(broker_cache.hop_mac, eth_ret->addr, ETH_HWADDR_LEN);
+    broker_cache.have_mac = 1;
+}
+
+// Flush the lwip arp table (runs in the lwip thread)
+static void
+arp_flush(void *arg)
+{
+    if (netif_default)
+        etharp_cleanup_netif(netif_default);
+}
+
+// Resolve the broker host name (using the cached address if valid)
+int
+network_resolve_broker(const char *host, int port, struct sockaddr_in *sin)
+{
+    if (broker_cache_valid() && broker_cache.have_addr) {
+        memset(sin, 0, sizeof(*sin));
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        sin->sin_addr.s_addr = broker_cache.addr;
+        used_broker_cache = 1;
+        return 0;
+    }
+    int ret = mqttpub_resolve(host, port, sin);
+    if (ret)
+        return ret;
+    broker_cache.addr = sin->sin_addr.s_addr;
+    broker_cache.have_addr = 1;
+    return 0;
+}
+
+// Note that a connection to the broker was established
+void
+network_note_broker_connected(void)
+{
+    if (!CONFIG_BROKER_CACHE_HOURS || broker_cache_valid())
+        return;
+    uint64_t vtime = CONFIG_BROKER_CACHE_HOURS * 60ULL * 60 * 1000000;
+    broker_cache.valid_time = deepsleep_get_wake_time() + vtime;
+    tcpip_callback(arp_capture, NULL);
+}
+
+// Discard the cached broker information after a connection failure
+// (returns non-zero if cached information was used on this wake)
+int
+network_note_broker_failed(void)
+{
+    int used_cache = used_broker_cache;
+    if (broker_cache_valid() && broker_cache.have_mac)
+        used_cache = 1;
+    memset(&broker_cache, 0, sizeof(broker_cache));
+    used_broker_cache = 0;
+    if (used_cache)
+        tcpip_callback(arp_flush, NULL);
+    return used_cache;
+}
+
+#if CONFIG_SNTP_SYNC
+
+// The esp-idf sntp code calls this to set the system time. The wall
+// time is instead passed to the wake scheduler - the system time is
+// the rtc clock that all log timestamps are based on.
+void
+sntp_sync_time(struct timeval *tv)
+{
+    deepsleep_note_wall_time((uint64_t)tv->tv_sec * 1000000 + tv->tv_usec);
+    sntp_set_sync_status(SNTP_SYNC_STATUS_COMPLETED);
+}
+
+// Request the wall time (the response arrives in the background)
+static void
+sntp_start(void)
+{
+    sntp_setoperatingmode(SNTP_OPMODE_POLL);
+    sntp_setservername(0, CONFIG_SNTP_SERVER);
+    sntp_init();
+}
+
+#endif
+
+#define GOT_IP_EVENT 1
+static EventGroupHandle_t network_events;
+
+static void
+on_ip_ready(void *arg, esp_event_base_t event_base
+            , int32_t event_id, void *event_data)
+{
+    timing_note_deferred(TP_GOT_IP, 0);
+    timing_note_deferred(TP_DHCP, connected_time);
+    if (broker_cache_valid() && broker_cache.have_mac)
+        tcpip_callback(arp_seed, NULL);
+#if CONFIG_SNTP_SYNC
+    sntp_start();
+#endif
+    xEventGroupSetBits(network_events, GOT_IP_EVENT);
+}
+
+// Wait for the network to obtain an ip address
+void
+network_wait_ip(void)
+{
+    xEventGroupWaitBits(network_events, GOT_IP_EVENT, false, true
+                        , portMAX_DELAY);
+}
+
+// Cached wpa2 pairwise master key (the pbkdf2 derivation of the
+// password is slow, so it is only done once)
+struct pmk_cache_s {
+    uint32_t key;
+    uint8_t pmk[32];
+    uint8_t valid;
+};
+static RTC_DATA_ATTR struct pmk_cache_s pmk_cache;
+static int used_pmk_cache;
+
+#if CONFIG_WIFI_CACHE_PMK
+
+// Identify the ssid and password that the cached key was derived from
+static uint32_t
+pmk_cache_key(void)
+{
+    const char *ssid = CONFIG_WIFI_SSID, *pass = CONFIG_WIFI_PASSWORD;
+    uint32_t crc = crc32_le(0, (uint8_t*)ssid, strlen(ssid));
+    return crc32_le(crc, (uint8_t*)pass, strlen(pass));
+}
+
+static int
+pmk_derive(void)
+{
+    const char *ssid = CONFIG_WIFI_SSID, *pass = CONFIG_WIFI_PASSWORD;
+    int64_t start_time = esp_timer_get_time();
+    mbedtls_md_context_t ctx;
+    mbedtls_md_init(&ctx);
+    int ret = mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA1)
+                               , 1);
+    if (!ret)
+        ret = mbedtls_pkcs5_pbkdf2_hmac(
+            &ctx, (uint8_t*)pass, strlen(pass), (uint8_t*)ssid, strlen(ssid)
+            , 4096, sizeof(pmk_cache.pmk), pmk_cache.pmk);
+    mbedtls_md_free(&ctx);
+    if (ret) {
+        ESP_LOGW(TAG, "Error deriving pmk %d", ret);
+        return ret;
+    }
+    pmk_cache.key = pmk_cache_key();
+    pmk_cache.valid = 1;
+    timing_note_deferred(TP_PMK_DERIVE, start_time);
+    return 0;
+}
+
+#endif
+
+// Replace the wifi password with the (hex encoded) cached key - the
+// wifi driver uses a 64 character hex password as the key directly
+static void
+pmk_set_password(wifi_config_t *wifi_config)
+{
+    used_pmk_cache = 0;
+#if CONFIG_WIFI_CACHE_PMK
+    if (strlen(CONFIG_WIFI_PASSWORD) < 8)
+        return;
+    if (!pmk_cache.valid || pmk_cache.key != pmk_cache_key())
+        if (pmk_derive())
+            return;
+    static const char hex[] = "0123456789abcdef";
+    uint8_t *pass = wifi_config->sta.password;
+    for (int i=0; i<sizeof(pmk_cache.pmk); i++) {
+        pass[i*2] = hex[pmk_cache.pmk[i] >> 4];
+        pass[i*2 + 1] = hex[pmk_cache.pmk[i] & 0x0f];
+    }
+    used_pmk_cache = 1;
+#endif
+}
+
+// Check if a disconnect reason indicates the key was not accepted
+static int
+is_auth_failure(int reason)
+{
+    return (reason == WIFI_REASON_AUTH_FAIL
+            || reason == WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT
+            || reason == WIFI_REASON_HANDSHAKE_TIMEOUT
+            || reason == WIFI_REASON_MIC_FAILURE);
+}
+
+// Set the access point configuration and start a connection attempt
+static int
+wifi_connect_ap(int is_retry)
+{
+    wifi_config_t wifi_config = {
+        .sta = {
+            .ssid = CONFIG_WIFI_SSID,
+            .password = CONFIG_WIFI_PASSWORD,
+        },
+    };
+    used_ap_cache = ap_cache.valid;
+    if (used_ap_cache) {
+        memcpy(wifi_config.sta.bssid, ap_cache.bssid
+               , sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.bssid_set = 1;
+        wifi_config.sta.channel = ap_cache.channel;
+    }
+    if (!is_retry)
+        pmk_set_password(&wifi_config);
+    ESP_LOGI(TAG, "Connecting to %s (cached ap %d, cached pmk %d)..."
+             , wifi_config.sta.ssid, used_ap_cache, used_pmk_cache);
+    int ret = esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+    if (ret)
+        return ret;
+    connect_start_time = esp_timer_get_time();
+    return esp_wifi_connect();
 }
 
 static int no_sleep_on_disconnect;
@@ -137,23 +439,48 @@ on_wifi_disconnect(void *arg, esp_event_base_t event_base
         return;
     wifi_event_sta_disconnected_t *e = event_data;
     ESP_LOGW(TAG, "Wifi disconnect %d", e->reason);
+    if (used_pmk_cache && !is_connected && is_auth_failure(e->reason))
+        pmk_cache.valid = 0;
+    if ((used_ap_cache || used_pmk_cache) && !is_connected) {
+        // Cached connection info failed - retry with a full scan and
+        // the plain password
+        timing_count(TC_WIFI_RETRY);
+        ap_cache.valid = 0;
+        used_pmk_cache = 0;
+        if (!wifi_connect_ap(1))
+            return;
+    }
+    if (!is_connected)
+        timing_count(TC_WIFI_FAIL);
     deepsleep_start_sleep();
 }
 
+// Start connecting to the wifi network (the connection completes in
+// the background - see network_wait_ip())
 int
 network_start(void)
 {
+    timing_note_deferred(TP_WIFI_START, 0);
+    int64_t start_time = esp_timer_get_time();
+    network_events = xEventGroupCreate();
     int ret = esp32_init();
     if (ret)
         goto fail;
     ret = ip_init();
     if (ret)
         goto fail;
+    ret = esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP
+                                     , &on_ip_ready, NULL);
+    if (ret)
+        goto fail;
+    timing_note_deferred(TP_NET_INIT, start_time);
 
+    start_time = esp_timer_get_time();
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ret = esp_wifi_init(&cfg);
     if (ret)
         goto fail;
+    timing_note_deferred(TP_WIFI_INIT, start_time);
     ret = esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED
                                      , &on_wifi_connect, NULL);
     if (ret)
@@ -165,27 +492,21 @@ network_start(void)
     ret = esp_wifi_set_storage(WIFI_STORAGE_RAM);
     if (ret)
         goto fail;
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = CONFIG_WIFI_SSID,
-            .password = CONFIG_WIFI_PASSWORD,
-            .channel = Last_channel,
-        },
-    };
-    ESP_LOGI(TAG, "Connecting to %s...", wifi_config.sta.ssid);
     ret = esp_wifi_set_ps(WIFI_PS_NONE);
     if (ret)
         goto fail;
     ret = esp_wifi_set_mode(WIFI_MODE_STA);
     if (ret)
         goto fail;
-    ret = esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
-    if (ret)
-        goto fail;
+    // Starting wifi initializes the radio. After a deep sleep wake the
+    // esp-idf phy code skips rf calibration and reloads the calibration
+    // data stored in flash during the first boot.
+    start_time = esp_timer_get_time();
     ret = esp_wifi_start();
     if (ret)
         goto fail;
-    ret = esp_wifi_connect();
+    timing_note_deferred(TP_PHY_INIT, start_time);
+    ret = wifi_connect_ap(0);
     if (ret)
         goto fail;
     return 0;
@@ -2,6 +2,12 @@
 #define NETWORK_H
 
 int network_start(void);
+void network_wait_ip(void);
+struct sockaddr_in;
+int network_resolve_broker(const char *host, int port
+                           , struct sockaddr_in *sin);
+void network_note_broker_connected(void);
+int network_note_broker_failed(void);
 void network_disconnect(void);
 void network_note_ota_start(void);
 
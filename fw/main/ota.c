@@ -6,22 +6,135 @@
 
 #include <string.h> // memcpy
 #include <esp_http_client.h> // esp_http_client_config_t
-#include <esp_https_ota.h> // esp_https_ota
 #include <esp_log.h> // ESP_LOGD
+#include <esp_ota_ops.h> // esp_ota_begin
+#include <esp_partition.h> // esp_partition_read
 #include <freertos/task.h> // xTaskCreate
 #include "ota.h" // ota_start
+#include "otaimage.h" // otaimage_feed
 
 static const char *TAG = "OTA";
 
+// The download may be a plain firmware image (as built by "idf.py
+// build") or a compressed or delta image generated by
+// scripts/ota_image.py (which reduces the time the radio is on).
+
+#define DOWNLOAD_SIZE 1024
+
+struct ota_s {
+    struct otaimage_io_s io; // must be first (see ota_begin())
+    const esp_partition_t *running, *target;
+    esp_ota_handle_t handle;
+    int started;
+};
+
+static int
+ota_begin(struct otaimage_io_s *io, uint32_t image_size)
+{
+    struct ota_s *o = (struct ota_s *)io;
+    int ret = esp_ota_begin(o->target, image_size, &o->handle);
+    if (ret)
+        return ret;
+    o->started = 1;
+    return 0;
+}
+
+static int
+ota_write(struct otaimage_io_s *io, const uint8_t *buf, int len)
+{
+    struct ota_s *o = (struct ota_s *)io;
+    return esp_ota_write(o->handle, buf, len);
+}
+
+static int
+ota_read_base(struct otaimage_io_s *io, uint32_t offset
+              , uint8_t *buf, int len)
+{
+    struct ota_s *o = (struct ota_s *)io;
+    return esp_partition_read(o->running, offset, buf, len);
+}
+
+// Download the image and write it to the target partition
+static int
+ota_download(struct ota_s *o, esp_http_client_handle_t client)
+{
+    static uint8_t buf[DOWNLOAD_SIZE];
+    int ret = esp_http_client_open(client, 0);
+    if (ret)
+        return ret;
+    int content_length = esp_http_client_fetch_headers(client);
+    if (esp_http_client_get_status_code(client) != 200)
+        return -1;
+    struct otaimage_s *oi = NULL;
+    int total = 0;
+    for (;;) {
+        int len = esp_http_client_read(client, (char *)buf, sizeof(buf));
+        if (len < 0) {
+            ret = len;
+            break;
+        }
+        if (!len) {
+            ret = oi ? otaimage_finish(oi) : 0;
+            if (!ret && !total)
+                ret = -1;
+            break;
+        }
+        if (!total) {
+            // Check the image format
+            if (otaimage_check_magic(buf, len)) {
+                oi = otaimage_alloc(&o->io);
+                if (!oi) {
+                    ret = -1;
+                    break;
+                }
+            } else {
+                ret = ota_begin(&o->io, content_length > 0 ? content_length
+                                : OTA_SIZE_UNKNOWN);
+                if (ret)
+                    break;
+            }
+        }
+        total += len;
+        if (oi)
+            ret = otaimage_feed(oi, buf, len);
+        else
+            ret = ota_write(&o->io, buf, len);
+        if (ret)
+            break;
+    }
+    otaimage_free(oi);
+    ESP_LOGW(TAG, "Downloaded %d bytes (result %d)", total, ret);
+    return ret;
+}
+
 static void
-simple_ota_example_task(void *pvParameter)
+ota_task(void *pvParameter)
 {
-    ESP_LOGI(TAG, "Starting OTA updat");
+    ESP_LOGI(TAG, "Starting OTA update");
 
+    struct ota_s o = {
+        .io = { .begin = ota_begin, .write = ota_write
+                , .read_base = ota_read_base },
+        .running = esp_ota_get_running_partition(),
+        .target = esp_ota_get_next_update_partition(NULL),
+    };
     esp_http_client_config_t config = {
         .url = pvParameter,
     };
-    esp_err_t ret = esp_https_ota(&config);
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    int ret = -1;
+    if (client && o.target) {
+        ret = ota_download(&o, client);
+        esp_http_client_close(client);
+        esp_http_client_cleanup(client);
+    }
+    if (o.started) {
+        int end_ret = esp_ota_end(o.handle);
+        if (!ret)
+            ret = end_ret;
+    }
+    if (!ret)
+        ret = esp_ota_set_boot_partition(o.target);
     if (ret)
         ESP_LOGE(TAG, "Firmware upgrade failed");
 
@@ -35,6 +148,5 @@ ota_start(char *url, int url_len)
     memcpy(new_url, url, url_len);
     new_url[url_len] = 0;
 
-    xTaskCreate(&simple_ota_example_task, "ota_example_task", 8192
-                , new_url, 5, NULL);
+    xTaskCreate(&ota_task, "ota_task", 8192, new_url, 5, NULL);
 }
@@ -0,0 +1,401 @@
+// Decoding of compressed and delta ota images
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <stdlib.h> // calloc
+#include <string.h> // memcmp
+#include <esp_log.h> // ESP_LOGW
+#include <esp32/rom/miniz.h> // tinfl_decompress
+#include <mbedtls/sha256.h> // mbedtls_sha256_update_ret
+#include "datalog.h" // datalog_unzigzag
+#include "otaimage.h" // otaimage_feed
+
+static const char *TAG = "OTAIMAGE";
+
+// An image (as generated by scripts/ota_image.py) consists of a header
+// followed by a zlib stream. The decompressed stream is a sequence of
+// operations that each start with an op byte and varint arguments:
+//   OP_DATA <len> <data> - append the given data
+//   OP_COPY <offset> <len> - append data from the base
+//   OP_DIFF <offset> <len> <data> - append data from the base with
+//                                   each byte added to the given data
+// Base offsets are zigzag encoded and relative to the end of the
+// previous OP_COPY or OP_DIFF. The base (only used by delta images) is
+// the firmware image in the running partition.
+
+#define OTAIMAGE_MAGIC "HWOI"
+#define OTAIMAGE_VERSION 1
+#define OIF_DELTA 0x01
+
+struct otaimage_header_s {
+    uint8_t magic[4];
+    uint8_t version, flags;
+    uint16_t header_size;
+    uint32_t image_size, base_size;
+    uint8_t image_sha256[32], base_sha256[32];
+} __attribute__((packed));
+
+enum { OP_DATA, OP_COPY, OP_DIFF };
+enum { ST_HEADER, ST_OP, ST_ARG, ST_DATA, ST_DIFF, ST_DONE };
+
+#define WRITE_SIZE 4096
+#define BASE_CHUNK 1024
+
+struct otaimage_s {
+    struct otaimage_io_s *io;
+    struct otaimage_header_s hdr;
+    mbedtls_sha256_context sha;
+    int state, hdr_len;
+    // Current operation
+    uint8_t op, argc, arg_shift;
+    uint64_t args[2];
+    uint32_t remaining, base_pos, image_pos;
+    // Decompression state (the dictionary is also the output buffer)
+    tinfl_decompressor inflator;
+    uint32_t dict_pos;
+    uint8_t dict[TINFL_LZ_DICT_SIZE];
+    // Pending writes and base reads
+    int write_len;
+    uint8_t write_buf[WRITE_SIZE];
+    uint8_t base_buf[BASE_CHUNK];
+};
+
+// Check if a download starts with a compressed image header
+int
+otaimage_check_magic(const uint8_t *buf, int len)
+{
+    return (len >= strlen(OTAIMAGE_MAGIC)
+            && memcmp(buf, OTAIMAGE_MAGIC, strlen(OTAIMAGE_MAGIC)) == 0);
+}
+
+struct otaimage_s *
+otaimage_alloc(struct otaimage_io_s *io)
+{
+    struct otaimage_s *oi = calloc(1, sizeof(*oi));
+    if (!oi)
+        return NULL;
+    oi->io = io;
+    mbedtls_sha256_init(&oi->sha);
+    mbedtls_sha256_starts_ret(&oi->sha, 0);
+    tinfl_init(&oi->inflator);
+    return oi;
+}
+
+void
+otaimage_free(struct otaimage_s *oi)
+{
+    if (!oi)
+        return;
+    mbedtls_sha256_free(&oi->sha);
+    free(oi);
+}
+
+
+/****************************************************************
+ * Image output
+ ****************************************************************/
+
+static int
+flush_output(struct otaimage_s *oi)
+{
+    if (!oi->write_len)
+        return 0;
+    int ret = oi->io->write(oi->io, oi->write_buf, oi->write_len);
+    oi->write_len = 0;
+    return ret;
+}
+
+static int
+put_output(struct otaimage_s *oi, const uint8_t *buf, uint32_t len)
+{
+    if (len > oi->hdr.image_size - oi->image_pos) {
+        ESP_LOGW(TAG, "Image data exceeds image size");
+        return -1;
+    }
+    mbedtls_sha256_update_ret(&oi->sha, buf, len);
+    oi->image_pos += len;
+    while (len) {
+        uint32_t n = WRITE_SIZE - oi->write_len;
+        if (n > len)
+            n = len;
+        memcpy(&oi->write_buf[oi->write_len], buf, n);
+        oi->write_len += n;
+        buf += n;
+        len -= n;
+        if (oi->write_len >= WRITE_SIZE) {
+            int ret = flush_output(oi);
+            if (ret)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+// Read the next 'len' bytes of the base (len must not exceed BASE_CHUNK)
+static int
+read_base(struct otaimage_s *oi, uint32_t len)
+{
+    int ret = oi->io->read_base(oi->io, oi->base_pos, oi->base_buf, len);
+    oi->base_pos += len;
+    return ret;
+}
+
+
+/****************************************************************
+ * Operation decoding
+ ****************************************************************/
+
+// Start an operation once all its arguments are known
+static int
+start_op(struct otaimage_s *oi)
+{
+    if (oi->op == OP_DATA) {
+        oi->remaining = oi->args[0];
+        oi->state = ST_DATA;
+        return 0;
+    }
+    int64_t base_pos = oi->base_pos + datalog_unzigzag(oi->args[0]);
+    uint64_t len = oi->args[1];
+    if (base_pos < 0 || base_pos + len > oi->hdr.base_size) {
+        ESP_LOGW(TAG, "Invalid base range %d+%d", (int)base_pos, (int)len);
+        return -1;
+    }
+    oi->base_pos = base_pos;
+    oi->remaining = len;
+    if (oi->op == OP_DIFF) {
+        oi->state = ST_DIFF;
+        return 0;
+    }
+    // OP_COPY
+    while (oi->remaining) {
+        uint32_t n = oi->remaining > BASE_CHUNK ? BASE_CHUNK : oi->remaining;
+        int ret = read_base(oi, n);
+        if (ret)
+            return ret;
+        ret = put_output(oi, oi->base_buf, n);
+        if (ret)
+            return ret;
+        oi->remaining -= n;
+    }
+    oi->state = ST_OP;
+    return 0;
+}
+
+// Process decompressed data
+static int
+process_ops(struct otaimage_s *oi, const uint8_t *buf, uint32_t len)
+{
+    while (len) {
+        uint32_t n;
+        int ret;
+        switch (oi->state) {
+        case ST_OP:
+            oi->op = *buf++;
+            len--;
+            if (oi->op > OP_DIFF) {
+                ESP_LOGW(TAG, "Invalid op %d", oi->op);
+                return -1;
+            }
+            oi->argc = oi->arg_shift = 0;
+            oi->args[0] = oi->args[1] = 0;
+            oi->state = ST_ARG;
+            break;
+        case ST_ARG: {
+            uint8_t c = *buf++;
+            len--;
+            if (oi->arg_shift > 63)
+                return -1;
+            oi->args[oi->argc] |= (uint64_t)(c & 0x7f) << oi->arg_shift;
+            oi->arg_shift += 7;
+            if (c & 0x80)
+                break;
+            oi->arg_shift = 0;
+            oi->argc++;
+            if (oi->argc < (oi->op == OP_DATA ? 1 : 2))
+                break;
+            ret = start_op(oi);
+            if (ret)
+                return ret;
+            break;
+        }
+        case ST_DATA:
+            n = oi->remaining > len ? len : oi->remaining;
+            ret = put_output(oi, buf, n);
+            if (ret)
+                return ret;
+            buf += n;
+            len -= n;
+            oi->remaining -= n;
+            break;
+        case ST_DIFF:
+            n = oi->remaining > len ? len : oi->remaining;
+            if (n > BASE_CHUNK)
+                n = BASE_CHUNK;
+            ret = read_base(oi, n);
+            if (ret)
+                return ret;
+            for (int i=0; i<n; i++)
+                oi->base_buf[i] += buf[i];
+            ret = put_output(oi, oi->base_buf, n);
+            if (ret)
+                return ret;
+            buf += n;
+            len -= n;
+            oi->remaining -= n;
+            break;
+        default:
+            ESP_LOGW(TAG, "Data after end of image");
+            return -1;
+        }
+        if ((oi->state == ST_DATA || oi->state == ST_DIFF) && !oi->remaining)
+            oi->state = ST_OP;
+    }
+    return 0;
+}
+
+
+/****************************************************************
+ * Header and decompression
+ ****************************************************************/
+
+// Check that the running partition contains the base of a delta image
+static int
+check_base(struct otaimage_s *oi)
+{
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+    int ret = 0;
+    while (oi->base_pos < oi->hdr.base_size) {
+        uint32_t n = oi->hdr.base_size - oi->base_pos;
+        if (n > BASE_CHUNK)
+            n = BASE_CHUNK;
+        ret = read_base(oi, n);
+        if (ret)
+            break;
+        mbedtls_sha256_update_ret(&sha, oi->base_buf, n);
+    }
+    uint8_t digest[32];
+    mbedtls_sha256_finish_ret(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    oi->base_pos = 0;
+    if (ret)
+        return ret;
+    if (memcmp(digest, oi->hdr.base_sha256, sizeof(digest)) != 0) {
+        ESP_LOGW(TAG, "Delta image does not match the running firmware");
+        return -1;
+    }
+    return 0;
+}
+
+// Collect the image header (returns the number of bytes used)
+static int
+parse_header(struct otaimage_s *oi, const uint8_t *buf, int len)
+{
+    struct otaimage_header_s *hdr = &oi->hdr;
+    int n = sizeof(*hdr) - oi->hdr_len;
+    if (n > len)
+        n = len;
+    memcpy((uint8_t *)hdr + oi->hdr_len, buf, n);
+    oi->hdr_len += n;
+    if (oi->hdr_len < sizeof(*hdr))
+        return n;
+    if (!otaimage_check_magic(hdr->magic, sizeof(hdr->magic))
+        || hdr->version != OTAIMAGE_VERSION
+        || hdr->header_size != sizeof(*hdr)) {
+        ESP_LOGW(TAG, "Unsupported ota image");
+        return -1;
+    }
+    // A full image has no base (and a delta image must have one)
+    static const uint8_t no_base_sha256[32];
+    int is_delta = hdr->flags & OIF_DELTA;
+    if ((hdr->flags & ~OIF_DELTA)
+        || (is_delta && !hdr->base_size)
+        || (!is_delta && (hdr->base_size
+                          || memcmp(hdr->base_sha256, no_base_sha256
+                                    , sizeof(no_base_sha256)) != 0))) {
+        ESP_LOGW(TAG, "Invalid ota image header");
+        return -1;
+    }
+    ESP_LOGW(TAG, "Decoding %s image (%u bytes)"
+             , hdr->base_size ? "delta" : "compressed", hdr->image_size);
+    if (hdr->base_size) {
+        int ret = check_base(oi);
+        if (ret)
+            return ret;
+    }
+    int ret = oi->io->begin(oi->io, hdr->image_size);
+    if (ret)
+        return ret;
+    oi->state = ST_OP;
+    return n;
+}
+
+// Process the next part of a downloaded image
+int
+otaimage_feed(struct otaimage_s *oi, const uint8_t *buf, int len)
+{
+    if (oi->state == ST_HEADER) {
+        int ret = parse_header(oi, buf, len);
+        if (ret < 0)
+            return ret;
+        buf += ret;
+        len -= ret;
+    }
+    while (len && oi->state != ST_DONE) {
+        // The dictionary may fill before all input is consumed
+        int status = TINFL_STATUS_HAS_MORE_OUTPUT;
+        while (status == TINFL_STATUS_HAS_MORE_OUTPUT) {
+            size_t in_bytes = len;
+            size_t out_bytes = TINFL_LZ_DICT_SIZE - oi->dict_pos;
+            uint8_t *out = &oi->dict[oi->dict_pos];
+            status = tinfl_decompress(
+                &oi->inflator, buf, &in_bytes, oi->dict, out, &out_bytes
+                , TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT
+                  | TINFL_FLAG_COMPUTE_ADLER32);
+            buf += in_bytes;
+            len -= in_bytes;
+            oi->dict_pos = ((oi->dict_pos + out_bytes)
+                            & (TINFL_LZ_DICT_SIZE - 1));
+            if (status < TINFL_STATUS_DONE) {
+                ESP_LOGW(TAG, "Decompression error %d", status);
+                return -1;
+            }
+            int ret = process_ops(oi, out, out_bytes);
+            if (ret)
+                return ret;
+        }
+        if (status == TINFL_STATUS_DONE) {
+            if (oi->state != ST_OP)
+                return -1;
+            oi->state = ST_DONE;
+        }
+    }
+    if (len) {
+        ESP_LOGW(TAG, "Data after end of image");
+        return -1;
+    }
+    return 0;
+}
+
+// Verify the decoded image (call after all data has been fed)
+int
+otaimage_finish(struct otaimage_s *oi)
+{
+    if (oi->state != ST_DONE || oi->image_pos != oi->hdr.image_size) {
+        ESP_LOGW(TAG, "Image truncated");
+        return -1;
+    }
+    int ret = flush_output(oi);
+    if (ret)
+        return ret;
+    uint8_t digest[32];
+    mbedtls_sha256_finish_ret(&oi->sha, digest);
+    if (memcmp(digest, oi->hdr.image_sha256, sizeof(digest)) != 0) {
+        ESP_LOGW(TAG, "Image checksum mismatch");
+        return -1;
+    }
+    return 0;
+}
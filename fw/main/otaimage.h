@@ -0,0 +1,25 @@
+#ifndef OTAIMAGE_H
+#define OTAIMAGE_H
+
+#include <stdint.h> // uint8_t
+
+// Access to the flash partitions (see ota.c)
+struct otaimage_io_s {
+    // Prepare the target partition for an image of the given size
+    int (*begin)(struct otaimage_io_s *io, uint32_t image_size);
+    // Append decoded image data to the target partition
+    int (*write)(struct otaimage_io_s *io, const uint8_t *buf, int len);
+    // Read from the running partition (the base of a delta image)
+    int (*read_base)(struct otaimage_io_s *io, uint32_t offset
+                     , uint8_t *buf, int len);
+};
+
+struct otaimage_s;
+
+int otaimage_check_magic(const uint8_t *buf, int len);
+struct otaimage_s *otaimage_alloc(struct otaimage_io_s *io);
+int otaimage_feed(struct otaimage_s *oi, const uint8_t *buf, int len);
+int otaimage_finish(struct otaimage_s *oi);
+void otaimage_free(struct otaimage_s *oi);
+
+#endif // otaimage.h
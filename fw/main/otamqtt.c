@@ -0,0 +1,211 @@
+// Firmware updates delivered over the mqtt connection
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <stdio.h> // snprintf
+#include <stdlib.h> // strtoul
+#include <string.h> // memcmp
+#include <esp_attr.h> // RTC_DATA_ATTR
+#include <esp_log.h> // ESP_LOGW
+#include <esp_ota_ops.h> // esp_ota_get_next_update_partition
+#include <esp_partition.h> // esp_partition_write
+#include <mbedtls/sha256.h> // mbedtls_sha256_update_ret
+#include "otamqtt.h" // otamqtt_start
+
+static const char *TAG = "OTAMQTT";
+
+// An update is offered by publishing "mqtt:<size>:<sha256>" (instead
+// of an http url) to the ota topic, where <sha256> is the digest that
+// the build appends to the app image (the last 32 bytes of the .bin
+// file, which cover the rest of the file). The device then publishes
+// requests of the form "<offset>,<chunk_size>,<window>,<session>" to
+// the ota_ack topic (the session changes each time the transfer is
+// resumed) and the publisher (scripts/ota_publish.py) responds with
+// chunks on the ota_data topic (each a 4 byte little endian offset
+// followed by the data). A request is sent after each chunk is written
+// to flash, so it also acknowledges the chunk. The offset of the stored
+// data is kept in rtc memory - if the device returns to deep sleep
+// before the transfer completes, it resumes from that offset on the
+// next upload. The result ("done" or "fail") is also reported on the
+// ota_ack topic. An offer of the running image (for example, if the
+// offer was not cleared before the device restarted into the new
+// image) is reported as "done" without a transfer.
+
+#define OFFER_PREFIX "mqtt:"
+#define SECTOR_SIZE 4096
+
+struct otamqtt_state_s {
+    uint8_t sha256[32];
+    uint32_t size, offset, erased, session;
+};
+
+static RTC_DATA_ATTR struct otamqtt_state_s ota_state;
+static const esp_partition_t *target;
+
+// Check if an ota request is an offer of an mqtt transfer
+int
+otamqtt_is_offer(const char *data, int len)
+{
+    return (len >= strlen(OFFER_PREFIX)
+            && memcmp(data, OFFER_PREFIX, strlen(OFFER_PREFIX)) == 0);
+}
+
+static int
+parse_hex(const char *s, uint8_t *buf, int len)
+{
+    for (int i=0; i<len*2; i++) {
+        char c = s[i];
+        int v;
+        if (c >= '0' && c <= '9')
+            v = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            v = c - 'A' + 10;
+        else
+            return -1;
+        if (i & 1)
+            buf[i/2] |= v;
+        else
+            buf[i/2] = v << 4;
+    }
+    return 0;
+}
+
+// Start (or resume) the transfer of an offered image - returns 0 if
+// the transfer should proceed, 1 if the image was already installed,
+// or -1 if the offer is invalid
+int
+otamqtt_start(const char *data, int len)
+{
+    char offer[128];
+    if (len >= sizeof(offer))
+        goto fail;
+    memcpy(offer, data, len);
+    offer[len] = '\0';
+    char *p = &offer[strlen(OFFER_PREFIX)], *end;
+    uint32_t size = strtoul(p, &end, 10);
+    uint8_t sha256[32];
+    if (end == p || *end != ':' || strlen(end + 1) != sizeof(sha256) * 2
+        || parse_hex(end + 1, sha256, sizeof(sha256)))
+        goto fail;
+    target = esp_ota_get_next_update_partition(NULL);
+    if (!target || size <= sizeof(sha256) || size > target->size)
+        goto fail;
+
+    // The rtc state does not survive the restart into a new image, so
+    // check the digest of the running image
+    uint8_t running[32];
+    int ret = esp_partition_get_sha256(esp_ota_get_running_partition()
+                                       , running);
+    if (!ret && memcmp(running, sha256, sizeof(sha256)) == 0) {
+        ESP_LOGW(TAG, "Offered image already installed");
+        return 1;
+    }
+    struct otamqtt_state_s *s = &ota_state;
+    if (memcmp(s->sha256, sha256, sizeof(sha256)) != 0 || s->size != size) {
+        memcpy(s->sha256, sha256, sizeof(sha256));
+        s->size = size;
+        s->offset = s->erased = 0;
+    }
+    s->session++;
+    ESP_LOGW(TAG, "Transfer at %u of %u bytes", s->offset, s->size);
+    return 0;
+
+fail:
+    ESP_LOGW(TAG, "Invalid ota offer");
+    return -1;
+}
+
+// Check if an incomplete transfer should be resumed
+int
+otamqtt_is_pending(void)
+{
+    return ota_state.size != 0;
+}
+
+// Discard any incomplete transfer
+void
+otamqtt_cancel(void)
+{
+    ota_state.size = 0;
+}
+
+// Format a request for the chunks following the stored data
+int
+otamqtt_format_ack(char *buf, int size)
+{
+    return snprintf(buf, size, "%u,%d,%d,%u", ota_state.offset
+                    , OTAMQTT_CHUNK_SIZE, OTAMQTT_WINDOW, ota_state.session);
+}
+
+// Store a received chunk - returns 1 if the chunk was stored (and
+// should be acknowledged), 0 if it was ignored, or -1 on error
+int
+otamqtt_handle_chunk(const uint8_t *data, int len)
+{
+    struct otamqtt_state_s *s = &ota_state;
+    if (!target || !s->size || len < 4)
+        return 0;
+    uint32_t offset = (data[0] | (data[1] << 8) | (data[2] << 16)
+                       | ((uint32_t)data[3] << 24));
+    data += 4;
+    len -= 4;
+    // Chunks sent before a resume may still arrive
+    if (offset != s->offset || !len || len > s->size - offset)
+        return 0;
+    while (s->erased < offset + len) {
+        int ret = esp_partition_erase_range(target, s->erased, SECTOR_SIZE);
+        if (ret)
+            return -1;
+        s->erased += SECTOR_SIZE;
+    }
+    // Rewriting a chunk (if the offset was not updated before a reset)
+    // is harmless as the same data is written
+    int ret = esp_partition_write(target, offset, data, len);
+    if (ret)
+        return -1;
+    s->offset += len;
+    return 1;
+}
+
+int
+otamqtt_is_complete(void)
+{
+    return ota_state.size && ota_state.offset >= ota_state.size;
+}
+
+// Verify the received image and boot it on the next restart
+int
+otamqtt_finish(void)
+{
+    struct otamqtt_state_s *s = &ota_state;
+    uint8_t buf[256], digest[32];
+    uint32_t end = s->size - sizeof(digest);
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+    int ret = 0;
+    for (uint32_t pos=0; pos<end && !ret; pos+=sizeof(buf)) {
+        uint32_t n = end - pos > sizeof(buf) ? sizeof(buf) : end - pos;
+        ret = esp_partition_read(target, pos, buf, n);
+        if (!ret)
+            mbedtls_sha256_update_ret(&sha, buf, n);
+    }
+    mbedtls_sha256_finish_ret(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    // The image must end with the offered digest of its contents
+    if (!ret)
+        ret = esp_partition_read(target, end, buf, sizeof(digest));
+    s->size = 0;
+    if (!ret && (memcmp(digest, s->sha256, sizeof(digest)) != 0
+                 || memcmp(buf, s->sha256, sizeof(digest)) != 0)) {
+        ESP_LOGW(TAG, "Image checksum mismatch");
+        ret = -1;
+    }
+    if (!ret)
+        ret = esp_ota_set_boot_partition(target);
+    return ret;
+}
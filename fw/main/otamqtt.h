@@ -0,0 +1,21 @@
+#ifndef OTAMQTT_H
+#define OTAMQTT_H
+
+#include <stdint.h> // uint8_t
+
+// Maximum chunk data requested from the publisher (the chunk messages
+// must fit in the mqtt receive buffer)
+#define OTAMQTT_CHUNK_SIZE 1024
+// Number of chunks requested ahead of the last stored chunk
+#define OTAMQTT_WINDOW 4
+
+int otamqtt_is_offer(const char *data, int len);
+int otamqtt_start(const char *data, int len);
+int otamqtt_is_pending(void);
+void otamqtt_cancel(void);
+int otamqtt_format_ack(char *buf, int size);
+int otamqtt_handle_chunk(const uint8_t *data, int len);
+int otamqtt_is_complete(void);
+int otamqtt_finish(void);
+
+#endif // otamqtt.h
@@ -0,0 +1,118 @@
+// Decide when measurements should be uploaded
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <math.h> // fabsf
+#include <stdlib.h> // atof
+#include <esp_attr.h> // RTC_DATA_ATTR
+#include <esp_log.h> // ESP_LOGW
+#include "bme280.h" // bme280_get_reading
+#include "datalog.h" // datalog_fill
+#include "deepsleep.h" // deepsleep_set_boot_time
+#include "otamqtt.h" // otamqtt_is_pending
+#include "schedule.h" // schedule_check
+#include "sdkconfig.h" // CONFIG_UPLOAD_INTERVAL
+
+static const char *TAG = "SCHEDULE";
+
+// Uploads normally occur every CONFIG_UPLOAD_INTERVAL seconds. If
+// CONFIG_UPLOAD_MAX_INTERVAL is larger, then the interval is doubled
+// after each upload (up to that maximum) while readings are stable. An
+// upload is forced early if the datalog is filling up or if the
+// temperature or humidity has changed notably since the last upload.
+// An interrupted mqtt firmware transfer is resumed on the next wake.
+
+struct schedule_s {
+    uint64_t next_upload_time;
+    uint32_t interval;
+    float last_temperature, last_humidity;
+    uint8_t have_last, upload_pending;
+};
+
+static RTC_DATA_ATTR struct schedule_s sched;
+
+// Obtain the current reading (it is only calibrated if change
+// triggers are enabled)
+static int
+get_reading(float *temperature, float *humidity)
+{
+    if (atof(CONFIG_UPLOAD_TEMPERATURE_DELTA) <= 0.f
+        && atof(CONFIG_UPLOAD_HUMIDITY_DELTA) <= 0.f)
+        return -1;
+    return bme280_get_reading(temperature, humidity);
+}
+
+// Check if the current reading differs notably from the last upload
+static int
+reading_changed(void)
+{
+    float temperature, humidity;
+    if (!sched.have_last || get_reading(&temperature, &humidity))
+        return 0;
+    float tdelta = atof(CONFIG_UPLOAD_TEMPERATURE_DELTA);
+    float hdelta = atof(CONFIG_UPLOAD_HUMIDITY_DELTA);
+    if (tdelta > 0.f && fabsf(temperature - sched.last_temperature) >= tdelta)
+        return 1;
+    if (hdelta > 0.f && fabsf(humidity - sched.last_humidity) >= hdelta)
+        return 1;
+    return 0;
+}
+
+// Check if an upload should be attempted on this wake (this may be
+// called before and after the bme280 is read)
+int
+schedule_check(uint64_t curtime)
+{
+    int reason = SR_NONE;
+    if (curtime >= sched.next_upload_time)
+        reason = SR_TIMER;
+    else if (otamqtt_is_pending())
+        // Resume an interrupted firmware transfer
+        reason = SR_OTA;
+    else if (sched.upload_pending)
+        // Last upload failed - wait for the timer before retrying
+        return SR_NONE;
+    else if (CONFIG_UPLOAD_LOG_FILL
+             && datalog_fill() >= CONFIG_UPLOAD_LOG_FILL)
+        reason = SR_LOG_FILL;
+    else if (reading_changed())
+        reason = SR_CHANGE;
+    if (reason == SR_NONE)
+        return SR_NONE;
+
+    // Calculate next upload time
+    uint32_t interval = sched.interval;
+    if (reason == SR_CHANGE || !interval)
+        interval = CONFIG_UPLOAD_INTERVAL;
+    else if (reason == SR_TIMER)
+        interval *= 2;
+    if (interval > CONFIG_UPLOAD_MAX_INTERVAL)
+        interval = CONFIG_UPLOAD_MAX_INTERVAL;
+    if (interval < CONFIG_UPLOAD_INTERVAL)
+        interval = CONFIG_UPLOAD_INTERVAL;
+    sched.interval = interval;
+    sched.next_upload_time = curtime + interval * 1000000ULL;
+    sched.upload_pending = 1;
+    if (otamqtt_is_pending())
+        // Every wake must perform a full boot to resume the transfer
+        deepsleep_set_boot_time(0);
+    else
+        deepsleep_set_boot_time(sched.next_upload_time);
+    ESP_LOGW(TAG, "Upload reason %d (next in %u seconds)", reason, interval);
+    return reason;
+}
+
+// Note that the current wake's readings were successfully uploaded
+void
+schedule_note_upload(void)
+{
+    sched.upload_pending = 0;
+    float temperature, humidity;
+    if (get_reading(&temperature, &humidity))
+        return;
+    sched.last_temperature = temperature;
+    sched.last_humidity = humidity;
+    sched.have_last = 1;
+}
@@ -0,0 +1,13 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdint.h> // uint64_t
+
+enum {
+    SR_NONE, SR_TIMER, SR_LOG_FILL, SR_CHANGE, SR_OTA,
+};
+
+int schedule_check(uint64_t curtime);
+void schedule_note_upload(void);
+
+#endif // schedule.h
@@ -0,0 +1,314 @@
+// Store datalog records in flash during long network outages
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include <esp_attr.h> // RTC_DATA_ATTR
+#include <esp_log.h> // ESP_LOGW
+#include <esp_partition.h> // esp_partition_find_first
+#include "datalog.h" // datalog_export
+#include "spool.h" // spool_flush
+#include "sdkconfig.h" // CONFIG_SPOOL_ENABLE
+
+static const char *TAG = "SPOOL";
+
+// The spool is a log structured sequence of flash sectors. Each sector
+// starts with a header and is followed by "chunks" of datalog records.
+// Sectors are used in a circular fashion so that erases are spread
+// evenly across the partition.
+
+#define SECTOR_SIZE 4096
+#define SPOOL_MAGIC 0x4c4f5053 // "SPOL"
+struct sector_hdr_s {
+    uint32_t magic, seq;
+};
+
+struct chunk_hdr_s {
+    uint32_t len, flags;
+    uint64_t first_time;
+};
+
+struct spool_state_s {
+    uint32_t valid, head_seq, head_pos;
+    // Position of next record to upload and end of its chunk
+    uint32_t tail_pos, tail_end;
+    // Running timestamp prior to tail_pos
+    uint64_t tail_time;
+};
+
+static RTC_DATA_ATTR struct spool_state_s ss;
+static const esp_partition_t *part;
+
+
+/****************************************************************
+ * Sector helpers
+ ****************************************************************/
+
+// Return the start of the sector containing the data prior to pos
+static inline uint32_t
+pos_sector(uint32_t pos)
+{
+    return (pos - 1) / SECTOR_SIZE * SECTOR_SIZE;
+}
+
+static inline uint32_t
+next_sector(uint32_t pos)
+{
+    uint32_t sec = pos_sector(pos) + SECTOR_SIZE;
+    return sec >= part->size ? 0 : sec;
+}
+
+static int
+sector_start(uint32_t sec, uint32_t seq)
+{
+    int ret = esp_partition_erase_range(part, sec, SECTOR_SIZE);
+    if (ret)
+        return ret;
+    struct sector_hdr_s sh = { .magic = SPOOL_MAGIC, .seq = seq };
+    return esp_partition_write(part, sec, &sh, sizeof(sh));
+}
+
+// Read the chunk header at pos (returns -1 if there is no chunk there)
+static int
+read_chunk(uint32_t pos, struct chunk_hdr_s *ch)
+{
+    uint32_t space = SECTOR_SIZE - pos % SECTOR_SIZE;
+    if (!(pos % SECTOR_SIZE) || space < sizeof(*ch))
+        return -1;
+    int ret = esp_partition_read(part, pos, ch, sizeof(*ch));
+    if (ret || ch->len == 0xffffffff || ch->len > space - sizeof(*ch))
+        return -1;
+    return 0;
+}
+
+// Advance a position to the next chunk if the current one is consumed
+static int
+load_chunk(uint32_t *ppos, uint32_t *pend, uint64_t *ptime, int do_release)
+{
+    if (*ppos < *pend)
+        return 0;
+    uint32_t pos = *pend;
+    for (int i=0; i<=part->size / SECTOR_SIZE; i++) {
+        if (pos == ss.head_pos)
+            return -1;
+        struct chunk_hdr_s ch;
+        int ret = read_chunk(pos, &ch);
+        if (!ret) {
+            *ppos = pos + sizeof(ch);
+            *pend = *ppos + ch.len;
+            *ptime = ch.first_time;
+            return 0;
+        }
+        // No more chunks in this sector - move to next sector
+        uint32_t sec = pos_sector(pos), nsec = next_sector(pos);
+        if (do_release) {
+            // Sector fully consumed - clear its magic (which does not
+            // require an erase) so it is not recovered after a power
+            // loss. The sector is erased by sector_start() when reused.
+            uint32_t magic = 0;
+            esp_partition_write(part, sec, &magic, sizeof(magic));
+            *ppos = *pend = nsec + sizeof(struct sector_hdr_s);
+        }
+        pos = nsec + sizeof(struct sector_hdr_s);
+    }
+    return -1;
+}
+
+
+/****************************************************************
+ * Partition setup
+ ****************************************************************/
+
+// Rebuild the spool state from flash (after power loss)
+static void
+spool_recover(void)
+{
+    uint32_t min_seq = 0, max_seq = 0, min_sec = 0, max_sec = 0;
+    int have_sector = 0;
+    for (uint32_t sec = 0; sec < part->size; sec += SECTOR_SIZE) {
+        struct sector_hdr_s sh;
+        int ret = esp_partition_read(part, sec, &sh, sizeof(sh));
+        if (ret || sh.magic != SPOOL_MAGIC)
+            continue;
+        if (!have_sector || sh.seq < min_seq) {
+            min_seq = sh.seq;
+            min_sec = sec;
+        }
+        if (!have_sector || sh.seq > max_seq) {
+            max_seq = sh.seq;
+            max_sec = sec;
+        }
+        have_sector = 1;
+    }
+
+    memset(&ss, 0, sizeof(ss));
+    if (!have_sector) {
+        // Empty partition
+        int ret = sector_start(0, 1);
+        if (ret) {
+            ESP_LOGW(TAG, "Unable to initialize spool %d", ret);
+            part = NULL;
+            return;
+        }
+        max_seq = 1;
+    }
+
+    // Find the end of the last written sector
+    uint32_t pos = max_sec + sizeof(struct sector_hdr_s);
+    for (;;) {
+        struct chunk_hdr_s ch;
+        int ret = read_chunk(pos, &ch);
+        if (ret)
+            break;
+        pos += sizeof(ch) + ch.len;
+    }
+    ss.head_seq = max_seq;
+    ss.head_pos = pos;
+    ss.tail_pos = ss.tail_end = min_sec + sizeof(struct sector_hdr_s);
+    ss.valid = SPOOL_MAGIC;
+}
+
+static int
+spool_open(void)
+{
+    if (part)
+        return 0;
+#if CONFIG_SPOOL_ENABLE
+    part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA
+                                    , ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+    if (!part || part->size % SECTOR_SIZE) {
+        part = NULL;
+        return -1;
+    }
+    if (ss.valid != SPOOL_MAGIC)
+        spool_recover();
+#endif
+    return part ? 0 : -1;
+}
+
+static int
+spool_is_empty(void)
+{
+    return ss.valid == SPOOL_MAGIC && ss.tail_pos == ss.head_pos;
+}
+
+
+/****************************************************************
+ * Interface
+ ****************************************************************/
+
+// Move the head to a freshly erased sector
+static int
+head_next_sector(void)
+{
+    uint32_t nsec = next_sector(ss.head_pos);
+    if (pos_sector(ss.tail_end) == nsec) {
+        // Spool full - discard the oldest sector
+        ESP_LOGW(TAG, "Spool full - discarding oldest records");
+        uint32_t pos = next_sector(nsec + 1) + sizeof(struct sector_hdr_s);
+        ss.tail_pos = ss.tail_end = pos;
+    }
+    int ret = sector_start(nsec, ss.head_seq + 1);
+    if (ret)
+        return ret;
+    ss.head_seq++;
+    ss.head_pos = nsec + sizeof(struct sector_hdr_s);
+    return 0;
+}
+
+// Move the oldest datalog records to flash if rtc memory is filling up
+void
+spool_flush(void)
+{
+    if (datalog_free() >= SPOOL_FLUSH_THRESHOLD || spool_open())
+        return;
+    int max_len = (SECTOR_SIZE - sizeof(struct sector_hdr_s)
+                   - sizeof(struct chunk_hdr_s));
+    uint8_t *buf = malloc(sizeof(struct chunk_hdr_s) + max_len);
+    if (!buf)
+        return;
+    struct chunk_hdr_s *ch = (void*)buf;
+    int count;
+    int len = datalog_export(&buf[sizeof(*ch)], max_len, &ch->first_time
+                             , &count);
+    ch->len = len;
+    ch->flags = 0;
+    if (!count)
+        goto done;
+
+    // Append chunk (moving to the next sector if needed)
+    int total = sizeof(*ch) + len;
+    int ret = 0;
+    uint32_t off = ss.head_pos % SECTOR_SIZE;
+    if (!off || SECTOR_SIZE - off < total)
+        ret = head_next_sector();
+    if (!ret)
+        ret = esp_partition_write(part, ss.head_pos, buf, total);
+    if (ret) {
+        ESP_LOGW(TAG, "Error writing spool %d", ret);
+        goto done;
+    }
+    ss.head_pos += total;
+    ESP_LOGW(TAG, "Stored %d records (%d bytes) to flash", count, len);
+    while (count--)
+        datalog_expire();
+done:
+    free(buf);
+}
+
+static uint32_t format_pos, format_end;
+static uint64_t format_time;
+
+// Format the next spooled record (see datalog_format_stream())
+int
+spool_format_stream(int *ppos, struct datalog_stream_s *ds)
+{
+    if (spool_is_empty() || spool_open())
+        return -1;
+    if (*ppos < 0) {
+        format_pos = ss.tail_pos;
+        format_end = ss.tail_end;
+        format_time = ss.tail_time;
+        *ppos = 0;
+    }
+    if (load_chunk(&format_pos, &format_end, &format_time, 0))
+        return -1;
+    uint8_t rec[256];
+    int ret = esp_partition_read(part, format_pos, rec, 1);
+    int len = rec[0];
+    if (ret || !len || format_pos + len > format_end) {
+        // Corrupt chunk - skip it
+        format_pos = format_end;
+        return 0;
+    }
+    ret = esp_partition_read(part, format_pos, rec, len);
+    format_pos += len;
+    if (ret)
+        return 0;
+    return datalog_decode_stream(rec, len, &format_time, ds);
+}
+
+// Remove the oldest spooled record (returns -1 if the spool is empty)
+int
+spool_expire(void)
+{
+    if (spool_is_empty() || spool_open())
+        return -1;
+    if (load_chunk(&ss.tail_pos, &ss.tail_end, &ss.tail_time, 1))
+        return -1;
+    uint8_t rec[256];
+    int ret = esp_partition_read(part, ss.tail_pos, rec, 1);
+    int len = rec[0];
+    if (ret || !len || ss.tail_pos + len > ss.tail_end) {
+        ss.tail_pos = ss.tail_end;
+        return 0;
+    }
+    ret = esp_partition_read(part, ss.tail_pos, rec, len);
+    if (!ret)
+        datalog_decode(rec, len, &ss.tail_time, NULL, 0);
+    ss.tail_pos += len;
+    return 0;
+}
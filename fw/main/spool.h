@@ -0,0 +1,13 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+// Move records to flash when rtc memory has less than this many bytes free
+#define SPOOL_FLUSH_THRESHOLD 1024
+
+struct datalog_stream_s;
+
+void spool_flush(void);
+int spool_format_stream(int *ppos, struct datalog_stream_s *ds);
+int spool_expire(void);
+
+#endif // spool.h
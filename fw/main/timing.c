@@ -0,0 +1,188 @@
+// Report the time spent in each phase of a wake (and wake retry counts)
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <stdio.h> // snprintf
+#include <esp_attr.h> // RTC_DATA_ATTR
+#include <esp_log.h> // ESP_LOGI
+#include <esp_timer.h> // esp_timer_get_time
+#include "datalog.h" // datalog_append
+#include "timing.h" // timing_note
+
+static const char *TAG = "TIMING";
+
+// Phases are reported either as a duration or (with a start_time of
+// zero) as the time since the application started. Phases that
+// complete after the wake's datalog record is stored are reported in
+// the next wake's record (and are named with a "last_" prefix).
+static const char * const phase_names[TP_MAX] = {
+    [TP_BME280] = "bme280",
+    [TP_WIFI_START] = "last_wifi_start",
+    [TP_SENSE_DONE] = "sense_done",
+    [TP_WIFI_CONNECT] = "last_wifi_connect",
+    [TP_GOT_IP] = "last_got_ip",
+    [TP_UPLOAD] = "last_upload",
+    [TP_NET_INIT] = "last_net_init",
+    [TP_WIFI_INIT] = "last_wifi_init",
+    [TP_PHY_INIT] = "last_phy_init",
+    [TP_ASSOC] = "last_assoc",
+    [TP_DHCP] = "last_dhcp",
+    [TP_PMK_DERIVE] = "last_pmk_derive",
+    [TP_APP_MAIN] = "app_main",
+    [TP_MQTT_CONNECT] = "last_mqtt_connect",
+    [TP_PUBACK] = "last_puback",
+    [TP_SLEEP] = "last_sleep",
+    [TP_TLS_HANDSHAKE] = "last_tls_handshake",
+};
+
+static RTC_DATA_ATTR uint32_t deferred_usecs[TP_MAX];
+
+struct timing_s {
+    uint8_t phase;
+    uint32_t usecs;
+};
+
+static int
+timing_format(void *data, char *buf, int size)
+{
+    struct timing_s *t = data;
+    const char *name = t->phase < TP_MAX ? phase_names[t->phase] : NULL;
+    if (!name)
+        return snprintf(buf, size, "\"phase%d_us\":%u", t->phase, t->usecs);
+    return snprintf(buf, size, "\"%s_us\":%u", name, t->usecs);
+}
+
+static int
+timing_pack(void *data, uint8_t *buf, uint64_t *ptime)
+{
+    struct timing_s *t = data;
+    buf[0] = t->phase;
+    return 1 + datalog_put_varint(&buf[1], t->usecs);
+}
+
+static int
+timing_unpack(uint8_t *buf, void *data, uint64_t *ptime)
+{
+    struct timing_s *t = data;
+    uint64_t usecs;
+    t->phase = buf[0];
+    int len = datalog_get_varint(&buf[1], &usecs);
+    t->usecs = usecs;
+    return 1 + len;
+}
+
+const struct datalog_type_s timing_info = {
+    .id = DLT_TIMING,
+    .length = sizeof(struct timing_s),
+    .pack = timing_pack,
+    .unpack = timing_unpack,
+    .format = timing_format,
+};
+
+// Counters report the number of retries and failures since the last
+// record that reported them.
+static const char * const counter_names[TC_MAX] = {
+    [TC_WIFI_RETRY] = "wifi_retries",
+    [TC_WIFI_FAIL] = "wifi_failures",
+    [TC_BROKER_RETRY] = "broker_retries",
+    [TC_UPLOAD_FAIL] = "upload_failures",
+    [TC_RUN_TIMEOUT] = "run_timeouts",
+    [TC_TLS_FULL_HANDSHAKE] = "tls_full_handshakes",
+};
+
+static RTC_DATA_ATTR uint16_t counts[TC_MAX];
+
+struct counter_s {
+    uint8_t counter;
+    uint16_t count;
+};
+
+static int
+counter_format(void *data, char *buf, int size)
+{
+    struct counter_s *c = data;
+    const char *name = c->counter < TC_MAX ? counter_names[c->counter] : NULL;
+    if (!name)
+        return snprintf(buf, size, "\"counter%d\":%u", c->counter, c->count);
+    return snprintf(buf, size, "\"%s\":%u", name, c->count);
+}
+
+static int
+counter_pack(void *data, uint8_t *buf, uint64_t *ptime)
+{
+    struct counter_s *c = data;
+    buf[0] = c->counter;
+    return 1 + datalog_put_varint(&buf[1], c->count);
+}
+
+static int
+counter_unpack(uint8_t *buf, void *data, uint64_t *ptime)
+{
+    struct counter_s *c = data;
+    uint64_t count;
+    c->counter = buf[0];
+    int len = datalog_get_varint(&buf[1], &count);
+    c->count = count;
+    return 1 + len;
+}
+
+const struct datalog_type_s counter_info = {
+    .id = DLT_COUNTER,
+    .length = sizeof(struct counter_s),
+    .pack = counter_pack,
+    .unpack = counter_unpack,
+    .format = counter_format,
+};
+
+// Add the time since start_time (from esp_timer_get_time()) to the
+// wake's pending datalog record
+void
+timing_note(int phase, int64_t start_time)
+{
+    struct timing_s t = {
+        .phase = phase,
+        .usecs = esp_timer_get_time() - start_time,
+    };
+    ESP_LOGI(TAG, "phase %d: %u us", phase, t.usecs);
+    datalog_append(&timing_info, &t);
+}
+
+// Note a phase timing that is added to the log on the next wake
+void
+timing_note_deferred(int phase, int64_t start_time)
+{
+    uint32_t usecs = esp_timer_get_time() - start_time;
+    ESP_LOGI(TAG, "phase %d: %u us", phase, usecs);
+    deferred_usecs[phase] = usecs ? usecs : 1;
+}
+
+// Note a retry or failure (reported on the next wake)
+void
+timing_count(int counter)
+{
+    ESP_LOGI(TAG, "counter %d", counter);
+    if (counts[counter] < UINT16_MAX)
+        counts[counter]++;
+}
+
+// Add timings and counts noted during the last wake to the log
+void
+timing_report_deferred(void)
+{
+    for (int i=0; i<TP_MAX; i++) {
+        if (!deferred_usecs[i])
+            continue;
+        struct timing_s t = { .phase = i, .usecs = deferred_usecs[i] };
+        datalog_append(&timing_info, &t);
+        deferred_usecs[i] = 0;
+    }
+    for (int i=0; i<TC_MAX; i++) {
+        if (!counts[i])
+            continue;
+        struct counter_s c = { .counter = i, .count = counts[i] };
+        datalog_append(&counter_info, &c);
+        counts[i] = 0;
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h> // int64_t
+
+// Wake phase ids (stored in the log - do not renumber)
+enum {
+    TP_BME280 = 1, TP_WIFI_START, TP_SENSE_DONE, TP_WIFI_CONNECT, TP_GOT_IP,
+    TP_UPLOAD, TP_NET_INIT, TP_WIFI_INIT, TP_PHY_INIT, TP_ASSOC, TP_DHCP,
+    TP_PMK_DERIVE, TP_APP_MAIN, TP_MQTT_CONNECT, TP_PUBACK, TP_SLEEP,
+    TP_TLS_HANDSHAKE, TP_MAX
+};
+
+// Wake event counter ids (stored in the log - do not renumber)
+enum {
+    TC_WIFI_RETRY = 1, TC_WIFI_FAIL, TC_BROKER_RETRY, TC_UPLOAD_FAIL,
+    TC_RUN_TIMEOUT, TC_TLS_FULL_HANDSHAKE, TC_MAX
+};
+
+void timing_note(int phase, int64_t start_time);
+void timing_note_deferred(int phase, int64_t start_time);
+void timing_count(int counter);
+void timing_report_deferred(void);
+
+#endif // timing.h
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+# Report the rtc memory usage of a firmware image
+#
+# Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, optparse, struct
+
+# This script is run automatically after the firmware is linked (see
+# CMakeLists.txt). It may also be run directly with something like:
+#  fw/rtc_budget.py fw/build/humidwifi.elf
+# The rtc memory holds the data kept during deep sleep (including the
+# measurement log) and the deep sleep wake stub.
+
+# Address ranges of the esp32 rtc memory (rtc fast memory is accessible
+# at two addresses - code and data)
+RTC_SLOW = [0x50000000]
+RTC_FAST = [0x400c0000, 0x3ff80000]
+# Sizes available to the linker (in esp-idf v4.1)
+RTC_SLOW_SIZE = 0x1000
+RTC_FAST_SIZE = 0x2000
+
+# Measurement log storage (see fw/main/datalog.c)
+LOG_SYMBOLS = ['log_storage', 'log_fast']
+
+
+######################################################################
+# ELF parsing
+######################################################################
+
+SHT_SYMTAB = 2
+SHF_ALLOC = 0x2
+
+def read_sections(data):
+    if data[:4] != b'\x7fELF' or data[4:5] != b'\x01':
+        raise ValueError("Not a 32-bit ELF file")
+    shoff, = struct.unpack_from('<I', data, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from('<HHH', data, 0x2e)
+    sections = []
+    for i in range(shnum):
+        sections.append(struct.unpack_from('<IIIIIIIIII', data,
+                                           shoff + i * shentsize))
+    strtab = sections[shstrndx]
+    def get_name(offset, table):
+        start = table[4] + offset
+        return data[start:data.index(b'\0', start)].decode()
+    out = []
+    for s in sections:
+        name, stype, flags, addr, offset, size, link = s[:7]
+        out.append({'name': get_name(name, strtab), 'type': stype,
+                    'flags': flags, 'addr': addr, 'offset': offset,
+                    'size': size, 'link': link, 'entsize': s[9]})
+    return out
+
+def read_symbols(data, sections, names):
+    syms = {}
+    for s in sections:
+        if s['type'] != SHT_SYMTAB:
+            continue
+        strtab = sections[s['link']]
+        for pos in range(s['offset'], s['offset'] + s['size'],
+                         s['entsize']):
+            name, value, size = struct.unpack_from('<III', data, pos)
+            start = strtab['offset'] + name
+            sym = data[start:data.index(b'\0', start)].decode()
+            if sym in names:
+                syms[sym] = (value, size)
+    return syms
+
+
+######################################################################
+# Budget report
+######################################################################
+
+def in_region(addr, bases, size):
+    for base in bases:
+        if addr >= base and addr < base + size:
+            return addr - base
+    return None
+
+def region_usage(sections, syms, bases, size):
+    used = log = 0
+    details = []
+    for s in sections:
+        if not s['flags'] & SHF_ALLOC or not s['size']:
+            continue
+        offset = in_region(s['addr'], bases, size)
+        if offset is None:
+            continue
+        used = max(used, offset + s['size'])
+        details.append((s['name'], s['size']))
+    for value, sym_size in syms.values():
+        if in_region(value, bases, size) is not None:
+            log += sym_size
+    return used, log, details
+
+def main():
+    usage = "%prog [options] <firmware.elf>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-v", "--verbose", action="store_true", dest="verbose",
+                    help="report the size of each rtc section")
+    opts.add_option("--slow-size", type="int", dest="slow_size",
+                    default=RTC_SLOW_SIZE,
+                    help="size of rtc slow memory (default %default)")
+    opts.add_option("--fast-size", type="int", dest="fast_size",
+                    default=RTC_FAST_SIZE,
+                    help="size of rtc fast memory (default %default)")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    f = open(args[0], 'rb')
+    data = f.read()
+    f.close()
+    sections = read_sections(data)
+    syms = read_symbols(data, sections, LOG_SYMBOLS)
+    print("RTC memory budget (%s):" % (args[0],))
+    for name, bases, size in [("slow", RTC_SLOW, options.slow_size),
+                              ("fast", RTC_FAST, options.fast_size)]:
+        used, log, details = region_usage(sections, syms, bases, size)
+        print("  rtc %s memory: %d of %d bytes used (measurement log %d),"
+              " %d free" % (name, used, size, log, size - used))
+        if options.verbose:
+            for sname, ssize in details:
+                print("    %-24s %6d" % (sname, ssize))
+
+if __name__ == '__main__':
+    main()
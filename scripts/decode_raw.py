@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+# Convert raw bme280 readings in an MQTT log to calibrated values
+#
+# Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, optparse, json
+
+# This script is used with the "Upload raw sensor readings" firmware
+# option. Create an MQTT log that includes the calibration topic with
+# something like:
+#  mosquitto_sub -F '%I;%t;%p' -t 'topic/data' -t 'topic/batch' \
+#    -t 'topic/bme280_calibration' > mylog &
+# and then run:
+#  decode_raw.py mylog > decoded_log
+# The output may be passed to graph_data.py.
+
+
+######################################################################
+# BME280 compensation (formulas from bme280 spec)
+######################################################################
+
+def tdiv(a, b):
+    # Integer division that truncates towards zero (as in C)
+    q = abs(a) // abs(b)
+    return q if (a < 0) == (b < 0) else -q
+
+def s32(v):
+    return ((v + (1 << 31)) & 0xffffffff) - (1 << 31)
+
+def calc_t_fine(calib, adc_T):
+    T1, T2, T3 = calib['T']
+    var1 = (((adc_T >> 3) - (T1 << 1)) * T2) >> 11
+    var2 = (((((adc_T >> 4) - T1) * ((adc_T >> 4) - T1)) >> 12) * T3) >> 14
+    return s32(var1 + var2)
+
+def calc_pressure(calib, t_fine, adc_P):
+    P1, P2, P3, P4, P5, P6, P7, P8, P9 = calib['P']
+    if adc_P == 0x80000:
+        return None
+    var1 = t_fine - 128000
+    var2 = var1 * var1 * P6
+    var2 = var2 + ((var1 * P5) << 17)
+    var2 = var2 + (P4 << 35)
+    var1 = ((var1 * var1 * P3) >> 8) + ((var1 * P2) << 12)
+    var1 = (((1 << 47) + var1) * P1) >> 33
+    if not var1:
+        return None
+    p = 1048576 - adc_P
+    p = tdiv(((p << 31) - var2) * 3125, var1)
+    var1 = (P9 * (p >> 13) * (p >> 13)) >> 25
+    var2 = (P8 * p) >> 19
+    p = ((p + var1 + var2) >> 8) + (P7 << 4)
+    return (p & 0xffffffff) / 25600.
+
+def calc_humidity(calib, t_fine, adc_H):
+    H1, H2, H3, H4, H5, H6 = calib['H']
+    v = t_fine - 76800
+    v = s32(s32((((adc_H << 14) - (H4 << 20) - (H5 * v)) + 16384) >> 15)
+            * s32((((((((v * H6) >> 10) * (((v * H3) >> 11) + 32768))
+                      >> 10) + 2097152) * H2 + 8192) >> 14)))
+    v = v - (((((v >> 15) * (v >> 15)) >> 7) * H1) >> 4)
+    v = min(max(v, 0), 419430400)
+    return (v >> 12) / 1024.
+
+def decode_raw(calib, rawhex):
+    d = bytes.fromhex(rawhex)
+    adc_P = (d[0] << 12) | (d[1] << 4) | (d[2] >> 4)
+    adc_T = (d[3] << 12) | (d[4] << 4) | (d[5] >> 4)
+    adc_H = (d[6] << 8) | d[7]
+    t_fine = calc_t_fine(calib, adc_T)
+    out = {'temperature': round(t_fine / 5120., 2),
+           'humidity': round(calc_humidity(calib, t_fine, adc_H), 1)}
+    pressure = calc_pressure(calib, t_fine, adc_P)
+    if pressure is not None:
+        out['pressure'] = round(pressure, 1)
+    return out
+
+
+######################################################################
+# Log processing
+######################################################################
+
+def decode_record(calib, data):
+    if not isinstance(data, dict) or 'bme280_raw' not in data:
+        return data, False
+    if calib is None:
+        return data, True
+    data = dict(data)
+    data.update(decode_raw(calib, data.pop('bme280_raw')))
+    return data, False
+
+def process_log(infile, outfile, calibs):
+    missing = 0
+    for line in infile:
+        parts = line.rstrip('\n').split(';', 2)
+        if len(parts) != 3:
+            outfile.write(line)
+            continue
+        datestr, topic, value = parts
+        topicparts = topic.split('/')
+        pcb = '/'.join(topicparts[:-1])
+        try:
+            records = json.loads(value)
+        except ValueError:
+            outfile.write(line)
+            continue
+        if topicparts[-1] == 'bme280_calibration':
+            calibs[pcb] = records
+            continue
+        calib = calibs.get(pcb)
+        if isinstance(records, list):
+            decoded = [decode_record(calib, r) for r in records]
+            records = [r for r, m in decoded]
+            missing += sum([m for r, m in decoded])
+        else:
+            records, m = decode_record(calib, records)
+            missing += m
+        outfile.write("%s;%s;%s\n" % (datestr, topic,
+                                      json.dumps(records,
+                                                 separators=(',', ':'))))
+    if missing:
+        sys.stderr.write("%d records lacked calibration data\n" % (missing,))
+
+def main():
+    usage = "%prog [options] <logfile> ..."
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-o", "--output", type="string", dest="output",
+                    default=None, help="filename of output log")
+    options, args = opts.parse_args()
+    if len(args) < 1:
+        opts.error("Incorrect number of arguments")
+    outfile = sys.stdout
+    if options.output is not None:
+        outfile = open(options.output, 'w')
+    calibs = {}
+    for logname in args:
+        f = open(logname, 'r')
+        process_log(f, outfile, calibs)
+        f.close()
+    outfile.close()
+
+if __name__ == '__main__':
+    main()
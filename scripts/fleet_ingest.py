@@ -0,0 +1,278 @@
+#!/usr/bin/env python3
+# Store MQTT data uploads of a fleet of sensors as they arrive
+#
+# Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, time, signal, threading, http.server, socket
+import graph_data, mqttclient
+
+# This script subscribes to the data uploads of all devices and stores
+# the samples in a column store directory (the same format as the
+# graph_data.py cache). Run it with something like:
+#  fleet_ingest.py --broker mqtt://mqtt.local --store ~/fleet
+# and graph the stored data with:
+#  graph_data.py ~/fleet
+# Samples are written in batches (every few seconds). Uploads are only
+# acknowledged (qos 1 PUBACK) once their samples are written, so with a
+# persistent session (-P) the broker resends any upload that was not
+# stored (the duplicate records are discarded). The broker limits the
+# number of unacknowledged messages it sends (mosquitto's
+# max_inflight_messages defaults to 20), so a write is also made when
+# --max-unacked messages are waiting. Counters and lag measurements
+# are available (in Prometheus text format) from
+# http://localhost:<metrics-port>/metrics .
+
+RECONNECT_MAX_DELAY = 60.
+
+
+######################################################################
+# Metrics
+######################################################################
+
+class Metrics:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.values = {}
+        self.help = {}
+    def define(self, name, mtype, help):
+        self.help[name] = (mtype, help)
+        self.values[name] = 0
+    def update(self, **kw):
+        with self.lock:
+            self.values.update(kw)
+    def add(self, name, value):
+        with self.lock:
+            self.values[name] += value
+    def snapshot(self):
+        with self.lock:
+            return dict(self.values)
+    def export(self):
+        values = self.snapshot()
+        out = []
+        for name, (mtype, help) in self.help.items():
+            out.append("# HELP humidwifi_ingest_%s %s" % (name, help))
+            out.append("# TYPE humidwifi_ingest_%s %s" % (name, mtype))
+            out.append("humidwifi_ingest_%s %s" % (name, values[name]))
+        return "\n".join(out) + "\n"
+
+METRICS = [
+    ('messages_total', 'counter', "MQTT messages received"),
+    ('bytes_total', 'counter', "Payload bytes received"),
+    ('records_total', 'counter', "Measurement records received"),
+    ('duplicates_total', 'counter', "Duplicate records discarded"),
+    ('samples_total', 'counter', "Samples written to the store"),
+    ('flushes_total', 'counter', "Batched writes to the store"),
+    ('flush_seconds_total', 'counter', "Time spent writing the store"),
+    ('connects_total', 'counter', "Connections to the broker"),
+    ('pending_samples', 'gauge', "Samples not yet written to the store"),
+    ('lag_seconds', 'gauge',
+     "Time the oldest unwritten message has been waiting"),
+    ('flush_lag_seconds', 'gauge',
+     "Receive to write delay of the oldest message in the last flush"),
+    ('flush_lag_seconds_max', 'gauge',
+     "Maximum receive to write delay of any message"),
+    ('devices', 'gauge', "Number of devices seen"),
+    ('connected', 'gauge', "Connected to the broker"),
+]
+
+class MetricsHandler(http.server.BaseHTTPRequestHandler):
+    def do_GET(self):
+        if self.path != '/metrics':
+            self.send_error(404)
+            return
+        data = self.server.metrics.export().encode()
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/plain; version=0.0.4')
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+    def log_message(self, format, *args):
+        pass
+
+def start_metrics_server(metrics, address, port):
+    server = http.server.ThreadingHTTPServer((address, port),
+                                             MetricsHandler)
+    server.daemon_threads = True
+    server.metrics = metrics
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+    return server
+
+
+######################################################################
+# Ingest
+######################################################################
+
+class Ingest:
+    def __init__(self, store, metrics, flush_interval, flush_size,
+                 max_unacked):
+        self.store = store
+        self.metrics = metrics
+        self.flush_interval = flush_interval
+        self.flush_size = flush_size
+        self.max_unacked = max_unacked
+        # Packet ids of received qos 1 messages not yet written
+        self.unacked = []
+        store.open()
+        self.parser = graph_data.LogParser(store.state['devices'])
+        self.written_samples = 0
+        self.first_pending = None
+        self.flush_lag_max = 0.
+        self.shutdown = False
+    def process(self, messages):
+        if not messages:
+            return
+        now = time.time()
+        for msg in messages:
+            payload = msg.payload.decode('utf-8', 'replace')
+            self.parser.parse_message(now, msg.topic, payload)
+            if msg.qos:
+                self.unacked.append(msg.pid)
+        if self.first_pending is None:
+            self.first_pending = now
+        m = self.metrics
+        m.add('messages_total', len(messages))
+        m.add('bytes_total', sum([len(msg.payload) for msg in messages]))
+        m.update(pending_samples=self.parser.sample_count
+                 - self.written_samples)
+    def check_flush(self, force=False):
+        # Write pending samples - returns the packet ids of the messages
+        # that may now be acknowledged
+        if self.first_pending is None:
+            return []
+        now = time.time()
+        pending = self.parser.sample_count - self.written_samples
+        if (not force and pending < self.flush_size
+            and len(self.unacked) < self.max_unacked
+            and now - self.first_pending < self.flush_interval):
+            self.metrics.update(lag_seconds=now - self.first_pending)
+            return []
+        # Write pending samples and device state to the store
+        p = self.parser
+        self.store.append(p)
+        self.written_samples = p.sample_count
+        acks = self.unacked
+        self.unacked = []
+        done = time.time()
+        lag = done - self.first_pending
+        self.flush_lag_max = max(self.flush_lag_max, lag)
+        self.first_pending = None
+        m = self.metrics
+        m.add('flushes_total', 1)
+        m.add('flush_seconds_total', done - now)
+        m.update(records_total=p.record_count,
+                 duplicates_total=p.duplicate_count,
+                 samples_total=p.sample_count, pending_samples=0,
+                 lag_seconds=0., flush_lag_seconds=lag,
+                 flush_lag_seconds_max=self.flush_lag_max,
+                 devices=len(p.devices))
+        return acks
+
+def run(options, ingest, metrics):
+    topics = [t.strip() for t in options.topics.split(',')]
+    status_time = time.time() + options.status_interval
+    delay = 1.
+    while not ingest.shutdown:
+        client = mqttclient.MQTTClient(
+            options.broker, options.client_id, not options.persistent,
+            manual_ack=True)
+        try:
+            session = client.connect()
+            if not session:
+                pid = client.subscribe(topics, qos=1)
+                if not client.wait_acks([pid], 10.):
+                    raise mqttclient.error("No response to subscribe")
+            metrics.add('connects_total', 1)
+            metrics.update(connected=1)
+            delay = 1.
+            while not ingest.shutdown:
+                ingest.process(client.get_messages(.250))
+                for pid in ingest.check_flush():
+                    client.puback(pid)
+                client.flush()
+                if (options.status_interval
+                    and time.time() >= status_time):
+                    status_time = time.time() + options.status_interval
+                    v = metrics.snapshot()
+                    sys.stdout.write(
+                        "messages=%d samples=%d duplicates=%d"
+                        " devices=%d flush_lag_max=%.3f\n" % (
+                            v['messages_total'], v['samples_total'],
+                            v['duplicates_total'], v['devices'],
+                            v['flush_lag_seconds_max']))
+                    sys.stdout.flush()
+        except (socket.error, mqttclient.error) as e:
+            sys.stderr.write("Broker connection error: %s\n" % (e,))
+        client.close()
+        metrics.update(connected=0)
+        # Messages of the closed connection can no longer be acked (the
+        # broker resends them to a persistent session)
+        ingest.check_flush(force=True)
+        if not ingest.shutdown:
+            time.sleep(delay)
+            delay = min(delay * 2., RECONNECT_MAX_DELAY)
+    ingest.check_flush(force=True)
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-b", "--broker", type="string", dest="broker",
+                    default="mqtt://localhost", help="broker url"
+                    " (default %default)")
+    opts.add_option("-t", "--topics", type="string", dest="topics",
+                    default="+/data,+/batch",
+                    help="topics to subscribe to (default %default)")
+    opts.add_option("-s", "--store", type="string", dest="store",
+                    default="fleet_store", help="directory to store"
+                    " samples in (default %default)")
+    opts.add_option("-i", "--flush-interval", type="float",
+                    dest="flush_interval", default=5.,
+                    help="maximum seconds before writing received"
+                    " samples (default %default)")
+    opts.add_option("-z", "--flush-size", type="int", dest="flush_size",
+                    default=50000, help="number of pending samples that"
+                    " triggers a write (default %default)")
+    opts.add_option("-a", "--max-unacked", type="int", dest="max_unacked",
+                    default=20, help="number of unacknowledged messages"
+                    " that triggers a write (default %default)")
+    opts.add_option("-p", "--metrics-port", type="int", dest="metrics_port",
+                    default=9710, help="port of the metrics http server"
+                    " (0 to disable, default %default)")
+    opts.add_option("--metrics-address", type="string",
+                    dest="metrics_address", default="localhost",
+                    help="address of the metrics http server")
+    opts.add_option("-c", "--client-id", type="string", dest="client_id",
+                    default="humidwifi-ingest",
+                    help="MQTT client id (default %default)")
+    opts.add_option("-P", "--persistent", action="store_true",
+                    dest="persistent", help="use a persistent session (the"
+                    " broker queues uploads while not running)")
+    opts.add_option("--status-interval", type="float",
+                    dest="status_interval", default=60.,
+                    help="seconds between status reports (0 to disable)")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    try:
+        mqttclient.parse_url(options.broker)
+    except mqttclient.error as e:
+        opts.error(str(e))
+
+    metrics = Metrics()
+    for name, mtype, help in METRICS:
+        metrics.define(name, mtype, help)
+    store = graph_data.ColumnStore(os.path.expanduser(options.store))
+    ingest = Ingest(store, metrics, options.flush_interval,
+                    options.flush_size, options.max_unacked)
+    def handle_signal(signum, frame):
+        ingest.shutdown = True
+    signal.signal(signal.SIGTERM, handle_signal)
+    signal.signal(signal.SIGINT, handle_signal)
+    if options.metrics_port:
+        start_metrics_server(metrics, options.metrics_address,
+                             options.metrics_port)
+    run(options, ingest, metrics)
+
+if __name__ == '__main__':
+    main()
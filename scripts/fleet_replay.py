@@ -0,0 +1,285 @@
+#!/usr/bin/env python3
+# Benchmark fleet_ingest.py by replaying captured MQTT traffic
+#
+# Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, datetime, random, time, tempfile, shutil
+import subprocess, urllib.request
+import graph_data, graph_bench, mqttclient
+
+# This script publishes the messages of an MQTT log (in the format used
+# by graph_data.py) to a local broker (such as mosquitto) at a multiple
+# of their original rate, while fleet_ingest.py stores them. It reports
+# the ingest throughput and lag, and checks the stored samples against
+# an offline parse of the log. For example:
+#  fleet_replay.py --speed 100 mylog
+# A log for a simulated fleet is generated if no log is given:
+#  fleet_replay.py --devices 2000 --hours 6
+
+
+######################################################################
+# Replay input
+######################################################################
+
+def read_logs(lognames, limit):
+    messages = []
+    for logname in lognames:
+        f = open(logname, 'r')
+        for line in f:
+            parts = line.rstrip('\n').split(';')
+            if len(parts) != 3:
+                continue
+            datestr, topic, payload = parts
+            try:
+                d = datetime.datetime.fromisoformat(datestr.split('+')[0])
+            except ValueError:
+                continue
+            secs = (d - graph_data.EPOCH).total_seconds()
+            messages.append((secs, topic, payload))
+        f.close()
+    messages.sort(key=lambda m: m[0])
+    if limit:
+        messages = messages[:limit]
+    return messages
+
+def generate_messages(options):
+    start = (datetime.datetime(2020, 1, 1)
+             - graph_data.EPOCH).total_seconds()
+    devices = [graph_bench.DeviceSim("dev%04d" % (i,), options, start)
+               for i in range(options.devices)]
+    end = start + options.hours * 3600.
+    messages = []
+    for dev in devices:
+        # Spread the uploads of the devices over the upload interval
+        dev.last_upload -= random.uniform(0., options.upload_interval)
+        while dev.host_time < end:
+            for line in dev.step():
+                datestr, topic, payload = line.rstrip('\n').split(';')
+                secs = (datetime.datetime.fromisoformat(datestr[:-5])
+                        - graph_data.EPOCH).total_seconds()
+                messages.append((secs, topic, payload))
+                # Simulate an upload retried after a lost acknowledgment
+                if random.random() < options.resend:
+                    messages.append((secs + random.uniform(1., 10.),
+                                     topic, payload))
+    messages.sort(key=lambda m: m[0])
+    return messages
+
+# Parse the messages directly (the expected contents of the store)
+def expected_rows(messages):
+    parser = graph_data.LogParser()
+    for secs, topic, payload in messages:
+        parser.parse_message(secs, topic, payload)
+    rows = {}
+    for (pcb, field), cols in parser.take_columns().items():
+        rows.setdefault(pcb, {})[field] = len(cols[0])
+    return rows, parser
+
+
+######################################################################
+# Ingest process
+######################################################################
+
+def read_metrics(url):
+    try:
+        f = urllib.request.urlopen(url, timeout=1.)
+        data = f.read().decode()
+        f.close()
+    except (OSError, ValueError):
+        return None
+    out = {}
+    for line in data.splitlines():
+        if line.startswith('#') or ' ' not in line:
+            continue
+        name, value = line.split(' ', 1)
+        out[name.replace('humidwifi_ingest_', '')] = float(value)
+    return out
+
+def wait_metrics(url, cond, timeout):
+    end = time.time() + timeout
+    while time.time() < end:
+        m = read_metrics(url)
+        if m is not None and cond(m):
+            return m
+        time.sleep(.1)
+    return None
+
+def start_ingest(options, store):
+    script = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                          "fleet_ingest.py")
+    cmd = [sys.executable, script, "--broker", options.broker,
+           "--topics", options.topics, "--store", store,
+           "--flush-interval", str(options.flush_interval),
+           "--metrics-port", str(options.metrics_port),
+           "--client-id", "humidwifi-replay-ingest",
+           "--status-interval", "0"]
+    return subprocess.Popen(cmd)
+
+
+######################################################################
+# Replay
+######################################################################
+
+class Publisher:
+    def __init__(self, broker):
+        self.client = mqttclient.MQTTClient(broker, "humidwifi-replay")
+        self.client.connect()
+        self.outstanding = {}
+        self.ack_times = []
+    def check_acks(self, timeout=0.):
+        c = self.client
+        c.poll(timeout)
+        now = time.time()
+        for pid in c.acked:
+            send_time = self.outstanding.pop(pid, None)
+            if send_time is not None:
+                self.ack_times.append(now - send_time)
+        c.acked.clear()
+    def publish(self, topic, payload):
+        pid = self.client.publish(topic, payload, qos=1)
+        self.outstanding[pid] = time.time()
+    def finish(self, timeout=30.):
+        end = time.time() + timeout
+        while self.outstanding and time.time() < end:
+            self.check_acks(.1)
+        self.client.close()
+
+def replay(messages, options, metrics_url):
+    pub = Publisher(options.broker)
+    samples = []
+    base = messages[0][0]
+    start = next_scrape = time.time()
+    behind_max = 0.
+    for secs, topic, payload in messages:
+        due = start + (secs - base) / options.speed
+        now = time.time()
+        while now < due:
+            pub.client.flush()
+            pub.check_acks(due - now)
+            now = time.time()
+        behind_max = max(behind_max, now - due)
+        pub.publish(topic, payload)
+        if now >= next_scrape:
+            pub.client.flush()
+            pub.check_acks()
+            next_scrape = now + 1.
+            m = read_metrics(metrics_url)
+            if m is not None:
+                samples.append(m)
+    pub.client.flush()
+    end = time.time()
+    pub.finish()
+    return start, end, behind_max, samples, pub
+
+def percentile(values, p):
+    if not values:
+        return 0.
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+def main():
+    usage = "%prog [options] [<logfile> ...]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-b", "--broker", type="string", dest="broker",
+                    default="mqtt://localhost",
+                    help="broker url (default %default)")
+    opts.add_option("-t", "--topics", type="string", dest="topics",
+                    default="+/data,+/batch",
+                    help="topics the ingest subscribes to (default"
+                    " %default)")
+    opts.add_option("-x", "--speed", type="float", dest="speed",
+                    default=100., help="replay speed relative to the"
+                    " original traffic (default %default)")
+    opts.add_option("-n", "--limit", type="int", dest="limit", default=0,
+                    help="replay at most this many messages of the logs")
+    opts.add_option("-d", "--devices", type="int", dest="devices",
+                    default=1000, help="number of simulated devices when"
+                    " no log is given (default %default)")
+    opts.add_option("-H", "--hours", type="float", dest="hours",
+                    default=2., help="hours of simulated traffic when no"
+                    " log is given (default %default)")
+    opts.add_option("-i", "--interval", type="float", dest="interval",
+                    default=300., help="simulated measurement interval")
+    opts.add_option("-u", "--upload-interval", type="float",
+                    dest="upload_interval", default=1800.,
+                    help="simulated upload interval")
+    opts.add_option("-r", "--resend", type="float", dest="resend",
+                    default=.01, help="fraction of simulated uploads that"
+                    " are sent twice (default %default)")
+    opts.add_option("-f", "--flush-interval", type="float",
+                    dest="flush_interval", default=5.,
+                    help="ingest flush interval (default %default)")
+    opts.add_option("-p", "--metrics-port", type="int", dest="metrics_port",
+                    default=9711, help="ingest metrics port (default"
+                    " %default)")
+    options, args = opts.parse_args()
+    random.seed(0)
+    if args:
+        messages = read_logs(args, options.limit)
+    else:
+        messages = generate_messages(options)
+    if not messages:
+        opts.error("No messages to replay")
+    duration = messages[-1][0] - messages[0][0]
+    print("Replaying %d messages (%.1f hours of traffic) at %.0fx"
+          " (about %.0f seconds)" % (len(messages), duration / 3600.,
+                                     options.speed,
+                                     duration / options.speed))
+    sys.stdout.flush()
+    expected, exp_parser = expected_rows(messages)
+
+    tmpdir = tempfile.mkdtemp(prefix="fleet_replay")
+    store = os.path.join(tmpdir, "store")
+    metrics_url = "http://localhost:%d/metrics" % (options.metrics_port,)
+    ingest = start_ingest(options, store)
+    try:
+        if wait_metrics(metrics_url, lambda m: m['connected'], 10.) is None:
+            sys.stderr.write("Ingest did not connect to the broker\n")
+            sys.exit(1)
+        start, end, behind_max, samples, pub = replay(messages, options,
+                                                     metrics_url)
+        # Wait for the ingest to receive and store all messages
+        final = wait_metrics(
+            metrics_url, lambda m: (m['messages_total'] >= len(messages)
+                                    and not m['pending_samples']),
+            options.flush_interval + 60.)
+        caught_up = time.time()
+    finally:
+        ingest.terminate()
+        ingest.wait()
+    if final is None:
+        final = read_metrics(metrics_url) or samples[-1]
+        sys.stderr.write("Ingest did not store all messages\n")
+    rows = graph_data.ColumnStore(store).state['rows']
+    shutil.rmtree(tmpdir)
+
+    # Report
+    elapsed = caught_up - start
+    lag_max = max([m['lag_seconds'] for m in samples] + [0.])
+    print("Results:")
+    print("  publish: %d messages in %.1fs (%.0f/s), max %.3fs behind"
+          " schedule" % (len(messages), end - start,
+                         len(messages) / (end - start), behind_max))
+    print("  broker puback latency: p50 %.1fms p99 %.1fms" % (
+        percentile(pub.ack_times, .5) * 1000.,
+        percentile(pub.ack_times, .99) * 1000.))
+    print("  ingest: %d messages, %d records (%d duplicates), %d samples"
+          % (final['messages_total'], final['records_total'],
+             final['duplicates_total'], final['samples_total']))
+    print("  ingest throughput: %.0f messages/s, %.0f samples/s" % (
+        final['messages_total'] / elapsed, final['samples_total'] / elapsed))
+    print("  store writes: %d flushes, %.3fs total" % (
+        final['flushes_total'], final['flush_seconds_total']))
+    print("  lag: max %.3fs unwritten, max %.3fs receive to write" % (
+        lag_max, final['flush_lag_seconds_max']))
+    print("  catch up after the last publish: %.3fs" % (caught_up - end,))
+    ok = (rows == expected
+          and final['duplicates_total'] == exp_parser.duplicate_count)
+    print("  stored samples %s the offline parse (%d expected)" % (
+        "match" if ok else "DO NOT MATCH", exp_parser.sample_count))
+    if not ok:
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
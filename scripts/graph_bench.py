@@ -0,0 +1,246 @@
+#!/usr/bin/env python3
+# Benchmark graph_data.py log parsing with and without its cache
+#
+# Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, json, datetime, random, time, tempfile, shutil
+import numpy
+import graph_data
+
+# This script generates an MQTT log (in the format used by graph_data.py)
+# for a fleet of devices and reports the time to load it without the
+# cache, to build the cache, to load it from the cache, and to update
+# the cache after new lines are added to the log. Each cached result is
+# checked against the result of parsing the log without the cache, and
+# the log is also loaded as two rotated logs to check that the result
+# is unchanged. For example:
+#  graph_bench.py --size 2000 --devices 12
+
+
+######################################################################
+# Log generation
+######################################################################
+
+class DeviceSim:
+    def __init__(self, name, options, start):
+        self.name = name
+        self.options = options
+        self.topic = "%s/batch" % (name,)
+        self.data_topic = "%s/data" % (name,)
+        self.host_time = start + random.uniform(0., options.interval)
+        self.wake_time = random.randrange(1000000, 100000000)
+        self.last_upload = self.host_time
+        self.pending = []
+        self.temp = random.uniform(15., 25.)
+        self.humidity = random.uniform(30., 60.)
+    def gen_record(self):
+        self.temp += random.gauss(0., .1)
+        self.humidity += random.gauss(0., .3)
+        return {
+            'wake_time': self.wake_time, 'battery': 3.1,
+            'temperature': round(self.temp, 2),
+            'humidity': round(self.humidity, 2), 'pressure': 101325.,
+            'app_main_us': random.randrange(40000, 60000),
+            'sense_done_us': random.randrange(60000, 90000),
+            'last_assoc_us': random.randrange(100000, 900000),
+        }
+    # Generate the log lines of the next wake (if it uploads)
+    def step(self):
+        interval = self.options.interval
+        self.host_time += interval
+        self.wake_time += int(interval * 1000000)
+        self.pending.append(self.gen_record())
+        if self.host_time - self.last_upload < self.options.upload_interval:
+            return []
+        self.last_upload = self.host_time
+        latest = self.pending.pop()
+        latest['latest'] = 1
+        latest['last_sleep_time'] = self.wake_time - 4000000
+        datestr = datetime.datetime.utcfromtimestamp(
+            self.host_time).isoformat()
+        lines = []
+        if self.pending:
+            lines.append("%s+0000;%s;%s\n" % (
+                datestr, self.topic,
+                json.dumps(self.pending, separators=(',', ':'))))
+        lines.append("%s+0000;%s;%s\n" % (
+            datestr, self.data_topic,
+            json.dumps(latest, separators=(',', ':'))))
+        self.pending = []
+        return lines
+
+def generate_log(f, devices, size):
+    written = 0
+    while written < size:
+        for dev in devices:
+            for line in dev.step():
+                f.write(line)
+                written += len(line)
+    return written
+
+
+######################################################################
+# Benchmark
+######################################################################
+
+def timed(desc, func):
+    start = time.time()
+    res = func()
+    elapsed = time.time() - start
+    print("  %-40s %8.2fs" % (desc, elapsed))
+    sys.stdout.flush()
+    return res, elapsed
+
+def count_samples(data):
+    return sum(len(cols[0]) for fields in data.values()
+               for cols in fields.values())
+
+# Report the differences between two load_data() results
+def compare_data(desc, data, ref):
+    errors = []
+    for pcb in sorted(set(data) | set(ref)):
+        fields, ref_fields = data.get(pcb, {}), ref.get(pcb, {})
+        for field in sorted(set(fields) | set(ref_fields)):
+            if field not in fields or field not in ref_fields:
+                errors.append("%s %s missing" % (pcb, field))
+                continue
+            for name, col, ref_col in zip(['date', 'ts', 'value'],
+                                          fields[field], ref_fields[field]):
+                if not numpy.array_equal(col, ref_col):
+                    errors.append("%s %s %s (%d vs %d samples)" % (
+                        pcb, field, name, len(col), len(ref_col)))
+    if errors:
+        print("    %s: MISMATCH: %s" % (desc, "; ".join(errors[:5])))
+    return not errors
+
+def select(data, fields, min_secs=None):
+    out = {}
+    for pcb, pfields in data.items():
+        for field in fields:
+            if field not in pfields:
+                continue
+            cols = pfields[field]
+            if min_secs is not None:
+                mask = cols[0] >= min_secs
+                cols = tuple(c[mask] for c in cols)
+            out.setdefault(pcb, {})[field] = cols
+    return out
+
+# Split a log into two rotated logs. The split is made after a batch
+# message (so its records wait for a timestamp from the next log) and
+# the second log starts with a retained data message that was already
+# logged (as when the subscriber reconnects).
+def split_log(logname, first, second):
+    f = open(logname, 'rb')
+    lines = f.readlines()
+    f.close()
+    pos = len(lines) // 2
+    while b'/batch;' not in lines[pos]:
+        pos += 1
+    retained = [l for l in lines[:pos] if b'/data;' in l][-1:]
+    for fname, part in [(first, lines[:pos + 1]),
+                        (second, retained + lines[pos + 1:])]:
+        f = open(fname, 'wb')
+        f.write(b''.join(part))
+        f.close()
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-s", "--size", type="float", dest="size", default=200.,
+                    help="size of the generated log in MB (default 200)")
+    opts.add_option("-d", "--devices", type="int", dest="devices",
+                    default=12, help="number of devices (default 12)")
+    opts.add_option("-i", "--interval", type="float", dest="interval",
+                    default=300., help="measurement interval in seconds")
+    opts.add_option("-u", "--upload-interval", type="float",
+                    dest="upload_interval", default=1800.,
+                    help="upload interval in seconds")
+    opts.add_option("-l", "--log", type="string", dest="log", default=None,
+                    help="keep the generated log in this file")
+    opts.add_option("-p", "--plot", action="store_true", dest="plot",
+                    help="also time rendering the graph to a file")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    random.seed(0)
+    tmpdir = tempfile.mkdtemp(prefix="graph_bench")
+    logname = options.log or os.path.join(tmpdir, "bench.log")
+    start = (datetime.datetime(2020, 1, 1)
+             - datetime.datetime(1970, 1, 1)).total_seconds()
+    devices = [DeviceSim("dev%02d" % (i,), options, start)
+               for i in range(options.devices)]
+    size = int(options.size * 1024 * 1024)
+    try:
+        print("Generating %.0fMB log for %d devices" % (
+            options.size, options.devices))
+        f = open(logname, 'w')
+        generate_log(f, devices, size)
+        f.close()
+        cache_dir = os.path.join(tmpdir, "cache")
+        os.mkdir(cache_dir)
+        all_fields = set(graph_data.FIELDS)
+        fields = {'temperature', 'humidity'}
+        min_date = datetime.datetime(2000, 1, 1)
+        max_date = datetime.datetime(9998, 12, 31)
+        def load(use_cache, fields=all_fields, min_date=min_date,
+                 lognames=[logname]):
+            return graph_data.load_data(lognames, fields, min_date,
+                                        max_date, use_cache, cache_dir)
+        print("Results:")
+        ref, t_parse = timed("parse without cache (all fields)",
+                             lambda: load(False))
+        print("    %d samples" % (count_samples(ref),))
+        ok = True
+        data, t_build = timed("build cache", lambda: load(True))
+        ok &= compare_data("build cache", data, ref)
+        data, t_reload = timed("load from cache (all fields)",
+                               lambda: load(True))
+        ok &= compare_data("load from cache", data, ref)
+        data, t_sel = timed("load from cache (2 fields)",
+                            lambda: load(True, fields))
+        ok &= compare_data("load 2 fields", data, select(ref, fields))
+        # Last 30 days only
+        last = max(dev.host_time for dev in devices)
+        recent = datetime.datetime.utcfromtimestamp(last - 30 * 86400)
+        data, t_recent = timed("load from cache (2 fields, 30 days)",
+                               lambda: load(True, fields, recent))
+        recent_secs = (recent - graph_data.EPOCH).total_seconds()
+        ok &= compare_data("load 30 days", data,
+                           select(ref, fields, recent_secs))
+        if options.plot:
+            graph_data.setup_matplotlib(True)
+            def plot():
+                fig = graph_data.plot_data(data, ['temperature',
+                                                  'humidity'])
+                fig.savefig(os.path.join(tmpdir, "bench.png"))
+            timed("plot (2 fields, 30 days)", plot)
+        # Append about 1% more data and update
+        f = open(logname, 'a')
+        generate_log(f, devices, size // 100)
+        f.close()
+        data, t_update = timed("update cache (1% new lines)",
+                               lambda: load(True, fields))
+        ref = load(False)
+        ok &= compare_data("update cache", data, select(ref, fields))
+        # Load the same lines as two rotated logs
+        rotated = [os.path.join(tmpdir, "rotated.log.1"),
+                   os.path.join(tmpdir, "rotated.log")]
+        split_log(logname, *rotated)
+        ok &= compare_data("rotated logs", load(False, lognames=rotated),
+                           ref)
+        ok &= compare_data("rotated logs (cached)",
+                           load(True, lognames=rotated), ref)
+        print("Speedup of a cached re-plot load: %.0fx (all fields),"
+              " %.0fx (2 fields, 30 days)" % (
+                  t_parse / t_reload, t_parse / t_recent))
+        if not ok:
+            print("Cached results do NOT match the uncached results")
+            sys.exit(1)
+        print("Cached results match the uncached results")
+    finally:
+        shutil.rmtree(tmpdir)
+
+if __name__ == '__main__':
+    main()
@@ -4,84 +4,401 @@
 # Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import optparse, json, datetime
-import matplotlib
+import os, optparse, json, datetime, collections, hashlib, shutil
+import urllib.parse
+import numpy, matplotlib
 
 # To use this script, create an MQTT log with something like:
-#  mosquitto_sub -F '%I;%t;%p' -t 'topic/data' > mylog &
+#  mosquitto_sub -F '%I;%t;%p' -t 'topic/data' -t 'topic/batch' > mylog &
+# The parsed samples of each log are cached (in mylog.cache/ by default)
+# and only lines added to the log since the last run are parsed.
+# The store directory of scripts/fleet_ingest.py may also be given
+# instead of a log. Several logs (for example, rotated logs) may be
+# given oldest first - the device state (duplicate detection and
+# records waiting for a timestamp) is carried from each log to the next.
 
 MEASUREMENTS = [
     'battery', 'temperature', 'pressure', 'humidity', 'last_sleep_time',
 ]
 
-def parse_log(logname, timestamp_info, min_date, max_date):
-    f = open(logname, 'r')
-    ts_base = 1. / 1000000.
-    out = []
-    for line in f:
-        # Parse line
+# Wake phase timings (in microseconds since the application started)
+# in the order they occur during a wake. Phases with a "last_" prefix
+# are reported in the record following the wake they occurred in.
+PHASES = [
+    'app_main_us', 'sense_done_us', 'last_wifi_start_us',
+    'last_wifi_connect_us', 'last_got_ip_us', 'last_mqtt_connect_us',
+    'last_puback_us', 'last_upload_us', 'last_sleep_us',
+]
+
+# Phase durations (in microseconds)
+DURATIONS = [
+    'bme280_us', 'last_net_init_us', 'last_wifi_init_us', 'last_phy_init_us',
+    'last_pmk_derive_us', 'last_assoc_us', 'last_dhcp_us',
+    'last_tls_handshake_us',
+]
+
+# Retry and failure counts
+COUNTERS = [
+    'wifi_retries', 'wifi_failures', 'broker_retries', 'upload_failures',
+    'run_timeouts', 'tls_full_handshakes',
+]
+
+FIELDS = MEASUREMENTS + PHASES + DURATIONS + COUNTERS
+
+# Graphs that combine several fields
+GROUPS = {'phases': PHASES, 'durations': DURATIONS, 'counters': COUNTERS}
+
+
+######################################################################
+# Log parsing
+######################################################################
+
+EPOCH = datetime.datetime(1970, 1, 1)
+TS_BASE = 1. / 1000000.
+# Number of recent timestamps checked for duplicate records
+RECENT_COUNT = 100
+
+# Timestamp reconstruction state of a device
+class DeviceState:
+    def __init__(self, state=None):
+        if state is None:
+            state = {'date': None, 'ts': 1<<63, 'recent': [], 'pending': []}
+        self.date = state['date']
+        self.ts = state['ts']
+        # Device clock rate relative to the host (see clock_drift below)
+        self.rate = state.get('rate', 1.)
+        self.recent = collections.deque(state['recent'])
+        self.recent_set = set(self.recent)
+        self.pending = state['pending']
+    def get_state(self):
+        return {'date': self.date, 'ts': self.ts, 'rate': self.rate,
+                'recent': list(self.recent), 'pending': self.pending}
+    def is_duplicate(self, ts):
+        if ts in self.recent_set:
+            return True
+        if len(self.recent) >= RECENT_COUNT:
+            self.recent_set.discard(self.recent.popleft())
+        self.recent.append(ts)
+        self.recent_set.add(ts)
+        return False
+
+# Convert log lines to columns of samples (per device and field). The
+# sample dates are in seconds since 1970 (host time, with the device
+# timestamps used to reconstruct the time of each measurement).
+class LogParser:
+    def __init__(self, state=None):
+        self.devices = {}
+        if state is not None:
+            for pcb, ds in state.items():
+                self.devices[pcb] = DeviceState(ds)
+        self.columns = {}
+        self.record_count = self.duplicate_count = self.sample_count = 0
+    def get_state(self):
+        return {pcb: ds.get_state() for pcb, ds in self.devices.items()}
+    def take_columns(self):
+        columns = self.columns
+        self.columns = {}
+        return columns
+    def add_sample(self, pcb, date, ts, data):
+        for m in FIELDS:
+            if m not in data:
+                continue
+            try:
+                value = float(data[m])
+            except (TypeError, ValueError):
+                continue
+            col = self.columns.get((pcb, m))
+            if col is None:
+                col = self.columns[pcb, m] = ([], [], [])
+            col[0].append(date)
+            col[1].append(ts)
+            col[2].append(value)
+            self.sample_count += 1
+    def parse_line(self, line):
         parts = line.split(';')
         if len(parts) != 3:
-            continue
+            return
         datestr, topic, value = parts
-        topicparts = topic.split('/')
         try:
             d = datetime.datetime.fromisoformat(datestr.split('+')[0])
-            if d < min_date or d > max_date:
-                continue
-            pcb = topicparts[-2]
-            data = json.loads(value.strip())
         except:
-            continue
-        # Remove duplicates
-        ts = data.get('wake_time', data.get('boot_time'))
-        if ts is None:
-            continue
-        pcb_info = timestamp_info.setdefault(pcb, [None, 1<<63, [], []])
-        prev_date, prev_ts, recent_ts, pending = pcb_info
-        if ts in recent_ts:
-            continue
-        del recent_ts[100:]
-        recent_ts.insert(0, ts)
-        # Calculate host based timestamp
-        if data.get('latest'):
-            pcb_info[0] = adj_date = d
-            pcb_info[1] = ts
-            # Add any sensor data that lacked a valid timestamp
-            for old_data in pending:
-                old_ts = old_data.get('wake_time', old_data.get('boot_time'))
-                secs = datetime.timedelta(seconds=(old_ts - ts) * ts_base)
-                old_adj_date = d + secs
-                for m in MEASUREMENTS:
-                    if m in old_data:
-                        out.append((old_adj_date, pcb, m, old_ts, old_data[m]))
-            del pending[:]
-        elif prev_ts - ts > 36000000000.:
-            # Timestamp not valid - add to pending list
-            pending.append(data)
-            continue
-        else:
-            secs = datetime.timedelta(seconds=(ts - prev_ts) * ts_base)
-            adj_date = prev_date + secs
-        # Store sensor data
-        for m in MEASUREMENTS:
-            if m in data:
-                out.append((adj_date, pcb, m, ts, data[m]))
+            return
+        self.parse_message((d - EPOCH).total_seconds(), topic, value)
+    def parse_message(self, date, topic, value):
+        # Parse an mqtt message received at the given date
+        try:
+            pcb = topic.split('/')[-2]
+            records = json.loads(value)
+        except:
+            return
+        # Batched uploads contain a list of records
+        if not isinstance(records, list):
+            records = [records]
+        for data in records:
+            if not isinstance(data, dict):
+                continue
+            ts = data.get('wake_time', data.get('boot_time'))
+            if not isinstance(ts, int):
+                continue
+            self.record_count += 1
+            ds = self.devices.get(pcb)
+            if ds is None:
+                ds = self.devices[pcb] = DeviceState()
+            # Remove duplicates
+            if ds.is_duplicate(ts):
+                self.duplicate_count += 1
+                continue
+            # Calculate host based timestamp
+            if data.get('latest'):
+                # Devices that know the wall time (see the SNTP_SYNC
+                # firmware option) report it along with the measured
+                # drift of their clock
+                wall_time = data.get('wall_time')
+                if isinstance(wall_time, int):
+                    date = wall_time * TS_BASE
+                    ds.rate = 1. + data.get('clock_drift', 0) * 1e-9
+                ds.date = adj_date = date
+                ds.ts = ts
+                # Add any sensor data that lacked a valid timestamp
+                for old_data in ds.pending:
+                    old_ts = old_data.get('wake_time',
+                                          old_data.get('boot_time'))
+                    old_date = date + (old_ts - ts) * TS_BASE * ds.rate
+                    self.add_sample(pcb, old_date, old_ts, old_data)
+                del ds.pending[:]
+            elif ds.ts - ts > 36000000000.:
+                # Timestamp not valid - add to pending list
+                ds.pending.append(data)
+                continue
+            else:
+                adj_date = ds.date + (ts - ds.ts) * TS_BASE * ds.rate
+            # Store sensor data
+            self.add_sample(pcb, adj_date, ts, data)
+
+# Parse new lines of a log file starting at the given byte offset. The
+# columns are passed to the flush callback after each chunk of the
+# file. Returns the offset after the last complete line.
+def parse_log(logname, parser, offset=0, flush=None,
+              chunk_size=64*1024*1024):
+    f = open(logname, 'rb')
+    f.seek(offset)
+    while 1:
+        chunk = f.read(chunk_size)
+        end = chunk.rfind(b'\n') + 1
+        if not end:
+            break
+        for line in chunk[:end].decode('utf-8', 'replace').splitlines():
+            parser.parse_line(line)
+        offset += end
+        f.seek(offset)
+        if flush is not None:
+            flush(parser, offset)
+    f.close()
+    return offset
+
+
+######################################################################
+# Sample cache
+######################################################################
+
+# A column store holds the parsed samples of each device and field as
+# three binary columns (date, device timestamp, and value) along with
+# the timestamp reconstruction state of each device. New samples are
+# appended to the columns.
+COLUMNS = [('date', 'float64'), ('ts', 'int64'), ('value', 'float64')]
+STORE_VERSION = 1
+
+class ColumnStore:
+    def __init__(self, path):
+        self.path = path
+        self.state_file = os.path.join(self.path, "state.json")
+        self.state = self.load_state()
+    def load_state(self):
+        try:
+            f = open(self.state_file, 'r')
+            state = json.load(f)
+            f.close()
+        except (IOError, ValueError):
+            return None
+        if state.get('version') != STORE_VERSION:
+            return None
+        return state
+    def save_state(self):
+        tmpname = self.state_file + ".tmp"
+        f = open(tmpname, 'w')
+        json.dump(self.state, f)
+        f.close()
+        os.rename(tmpname, self.state_file)
+    def column_file(self, pcb, field, col):
+        pcbdir = urllib.parse.quote(pcb, safe='')
+        return os.path.join(self.path, pcbdir, "%s.%s" % (field, col))
+    def reset(self, **extra):
+        if os.path.isdir(self.path):
+            shutil.rmtree(self.path)
+        os.makedirs(self.path)
+        self.state = {'version': STORE_VERSION, 'devices': {}, 'rows': {}}
+        self.state.update(extra)
+    def open(self):
+        # Open the store for appending (creating it if needed)
+        if self.state is None:
+            self.reset()
+            self.save_state()
+        self.truncate_columns()
+    def truncate_columns(self):
+        # Discard any rows appended after the last saved state
+        for pcb, fields in self.state['rows'].items():
+            for field, rows in fields.items():
+                for col, dtype in COLUMNS:
+                    fname = self.column_file(pcb, field, col)
+                    size = rows * numpy.dtype(dtype).itemsize
+                    if os.path.getsize(fname) > size:
+                        os.truncate(fname, size)
+    def append(self, parser, **extra):
+        # Write the parser columns and state (returns number of samples)
+        rows = self.state['rows']
+        count = 0
+        for (pcb, field), values in parser.take_columns().items():
+            for (col, dtype), data in zip(COLUMNS, values):
+                fname = self.column_file(pcb, field, col)
+                if not os.path.isdir(os.path.dirname(fname)):
+                    os.makedirs(os.path.dirname(fname))
+                f = open(fname, 'ab')
+                f.write(numpy.array(data, dtype=dtype).tobytes())
+                f.close()
+            prows = rows.setdefault(pcb, {})
+            prows[field] = prows.get(field, 0) + len(values[0])
+            count += len(values[0])
+        self.state['devices'] = parser.get_state()
+        self.state.update(extra)
+        self.save_state()
+        return count
+    def load(self, fields):
+        out = {}
+        if self.state is None:
+            return out
+        for pcb, prows in self.state['rows'].items():
+            for field in fields:
+                rows = prows.get(field, 0)
+                if not rows:
+                    continue
+                out[pcb, field] = [
+                    numpy.fromfile(self.column_file(pcb, field, col),
+                                   dtype=dtype, count=rows)
+                    for col, dtype in COLUMNS]
+        return out
+
+# The cache of a log is a column store of its parsed samples. New log
+# lines are parsed from the offset where the last update stopped.
+FINGERPRINT_SIZE = 4096
+
+# Hash the start of the log (to detect a replaced log file)
+def log_fingerprint(logname, size=FINGERPRINT_SIZE):
+    f = open(logname, 'rb')
+    data = f.read(size)
     f.close()
+    return len(data), hashlib.sha1(data).hexdigest()
+
+class LogCache(ColumnStore):
+    def __init__(self, logname, cache_dir=None):
+        self.logname = logname
+        if cache_dir is None:
+            path = logname + ".cache"
+        else:
+            path = os.path.join(cache_dir,
+                                os.path.basename(logname) + ".cache")
+        ColumnStore.__init__(self, path)
+    def is_valid(self):
+        if self.state is None or 'offset' not in self.state:
+            return False
+        if os.path.getsize(self.logname) < self.state['offset']:
+            # Log was truncated
+            return False
+        if self.state['fingerprint'] is None:
+            return True
+        fp_len, fp = self.state['fingerprint']
+        return log_fingerprint(self.logname, fp_len) == (fp_len, fp)
+    def flush(self, parser, offset):
+        fingerprint = self.state['fingerprint']
+        if fingerprint is None or fingerprint[0] < FINGERPRINT_SIZE:
+            fingerprint = log_fingerprint(self.logname)
+        self.append(parser, offset=offset, fingerprint=fingerprint)
+    def update(self, initial=None):
+        # The parser starts from the given device state (the state at
+        # the end of the previous log). Returns the state at the end of
+        # this log.
+        initial = json.dumps(initial or {}, sort_keys=True)
+        if not self.is_valid() or self.state.get('initial', '{}') != initial:
+            self.reset(offset=0, fingerprint=None, initial=initial,
+                       devices=json.loads(initial))
+        else:
+            self.truncate_columns()
+        parser = LogParser(self.state['devices'])
+        parse_log(self.logname, parser, self.state['offset'], self.flush)
+        return self.state['devices']
+
+# Convert parser columns to the same format as ColumnStore.load()
+def parser_columns(parser, fields):
+    return {key: [numpy.array(data, dtype=dtype)
+                  for (col, dtype), data in zip(COLUMNS, values)]
+            for key, values in parser.take_columns().items()
+            if key[1] in fields}
+
+# Load the samples of the given fields from the logs (using the caches
+# unless use_cache is false). Returns {pcb: {field: (dates, ts, values)}}
+# with the samples in the date range sorted by date.
+def load_data(lognames, fields, min_date, max_date, use_cache=True,
+              cache_dir=None):
+    columns = []
+    state = {}
+    for logname in lognames:
+        if os.path.isdir(logname):
+            # Column store (for example, from fleet_ingest.py)
+            store = ColumnStore(logname)
+            columns.append(store.load(fields))
+            if store.state is not None:
+                state = store.state['devices']
+        elif use_cache:
+            cache = LogCache(logname, cache_dir)
+            state = cache.update(state)
+            columns.append(cache.load(fields))
+        else:
+            parser = LogParser(state)
+            parse_log(logname, parser)
+            columns.append(parser_columns(parser, fields))
+            state = parser.get_state()
+    min_secs = (min_date - EPOCH).total_seconds()
+    max_secs = (max_date - EPOCH).total_seconds()
+    keys = {key for logcols in columns for key in logcols}
+    out = {}
+    for pcb, field in keys:
+        parts = [logcols[pcb, field] for logcols in columns
+                 if (pcb, field) in logcols]
+        dates, ts, values = [numpy.concatenate(p) for p in zip(*parts)]
+        mask = (dates >= min_secs) & (dates <= max_secs)
+        dates, ts, values = dates[mask], ts[mask], values[mask]
+        order = numpy.argsort(dates, kind='stable')
+        out.setdefault(pcb, {})[field] = (dates[order], ts[order],
+                                          values[order])
     return out
 
-def calc_wake_time(pdata):
+
+######################################################################
+# Graphing
+######################################################################
+
+def calc_wake_time(dates, ts, values):
     smooth_samples = 32
     times = []
     data = []
     cumulative_ticks = []
     total = 0
+    ts = ts.tolist()
+    values = values.tolist()
     # Calculate time awake for each network upload
-    for i in range(len(pdata)-1):
-        diff = pdata[i+1][4] - pdata[i][3]
+    for i in range(len(ts)-1):
+        diff = values[i+1] - ts[i]
         awake_time = diff / 1000000.
         if awake_time < 0. or awake_time > 10.:
-            #print("skip", pdata[i][1], pdata[i][0], pdata[i][3], diff/1000000.)
             continue
         if awake_time < .5:
             continue
@@ -91,37 +408,49 @@ def calc_wake_time(pdata):
         if ccount > smooth_samples:
             elaps_ticks = total - cumulative_ticks[ccount - smooth_samples - 1]
             data.append(elaps_ticks / (smooth_samples * 1000000.))
-            times.append(pdata[i][0])
-    return times, data
+            times.append(dates[i])
+    return numpy.array(times), data
+
+def graph_fields(gtype):
+    return GROUPS.get(gtype, [gtype])
 
-def plot_data(data, graphs):
+def plot_data(bypcb, graphs):
     labels = {'battery': 'Volts', 'temperature': 'Temperature (F)',
               'pressure': 'Pressure', 'humidity': 'Humidity (%)',
-              'last_sleep_time': 'Upload time'}
-    # Extract data
-    bypcb = {}
-    for d in data:
-        if d[2] not in graphs:
-            continue
-        bypcb.setdefault(d[1], {}).setdefault(d[2], []).append(d)
+              'last_sleep_time': 'Upload time', 'phases': 'Wake phase (ms)',
+              'durations': 'Phase duration (ms)', 'counters': 'Count'}
+    # Sample dates are in seconds since 1970
+    date_base = matplotlib.dates.date2num(EPOCH)
     # Build plot
-    fig, axes = matplotlib.pyplot.subplots(nrows=len(graphs), sharex=True)
+    fig, axes = matplotlib.pyplot.subplots(nrows=len(graphs), sharex=True,
+                                           squeeze=False)
+    axes = axes[:, 0]
     for pcbname in sorted(bypcb.keys()):
         for gtype, ax in zip(graphs, axes):
-            pdata = bypcb[pcbname].get(gtype, [])
-            if gtype == 'last_sleep_time':
-                times, data = calc_wake_time(pdata)
-            else:
-                times = [p[0] for p in pdata]
-                data = [p[4] for p in pdata]
-                if gtype == 'temperature':
-                    data = [d * 1.8 + 32.0 for d in data]
-            ax.set_ylabel(labels[gtype])
-            ax.plot_date(times, data, '-', label=pcbname, alpha=0.6)
+            ax.set_ylabel(labels.get(gtype, gtype))
             ax.grid(True)
+            for field in graph_fields(gtype):
+                pdata = bypcb[pcbname].get(field)
+                if pdata is None or not len(pdata[0]):
+                    continue
+                label = pcbname
+                if gtype in GROUPS:
+                    label = "%s %s" % (pcbname, field)
+                if field == 'last_sleep_time':
+                    times, data = calc_wake_time(*pdata)
+                else:
+                    times, data = pdata[0], pdata[2]
+                    if field == 'temperature':
+                        data = data * 1.8 + 32.0
+                    elif field.endswith('_us'):
+                        data = data / 1000.
+                times = date_base + times / 86400.
+                ax.plot_date(times, data, '-', label=label, alpha=0.6)
     fontP = matplotlib.font_manager.FontProperties()
     fontP.set_size('x-small')
-    axes[0].legend(loc='best', prop=fontP)
+    for gtype, ax in zip(graphs, axes):
+        if gtype in GROUPS or ax is axes[0]:
+            ax.legend(loc='best', prop=fontP)
     axes[0].set_title("Sensor data")
     #axes[-1].set_xlabel('Date')
     return fig
@@ -142,11 +471,18 @@ def main():
                     default=None, help="filename of output graph")
     opts.add_option("-f", "--fields", type="string", dest="fields",
                     default="battery,temperature,humidity",
-                    help="sensor fields to graph")
+                    help="sensor fields to graph (or 'phases',"
+                    " 'durations', or 'counters' to graph wake timing)")
     opts.add_option("-m", "--min_date", type="string", dest="min_date",
                     default="2000-01-01", help="minimum date (YYYY-MM-DD)")
     opts.add_option("-M", "--max_date", type="string", dest="max_date",
                     default="9998-12-31", help="maximum date (YYYY-MM-DD)")
+    opts.add_option("-c", "--cache-dir", type="string", dest="cache_dir",
+                    default=None, help="directory to store parsed log"
+                    " caches (default is next to each log)")
+    opts.add_option("-n", "--no-cache", action="store_false",
+                    dest="use_cache", default=True,
+                    help="parse the logs without using a cache")
     options, args = opts.parse_args()
     if len(args) < 1:
         opts.error("Incorrect number of arguments")
@@ -157,19 +493,17 @@ def main():
 
     graphs = [gn.strip() for gn in options.fields.split(',')]
     for g in graphs:
-        if g not in MEASUREMENTS:
+        if g not in FIELDS and g not in GROUPS:
             opts.error("Invalid field '%s' (available: %s)"
-                       % (g, ", ".join(MEASUREMENTS)))
+                       % (g, ", ".join(MEASUREMENTS + sorted(GROUPS)
+                                       + PHASES + DURATIONS + COUNTERS)))
 
     # Parse data
-    timestamp_info = {}
-    data = []
-    for logname in args:
-        logdata = parse_log(logname, timestamp_info, min_date, max_date)
-        data.extend(logdata)
+    fields = {f for g in graphs for f in graph_fields(g)}
+    data = load_data(args, fields, min_date, max_date, options.use_cache,
+                     options.cache_dir)
     if not data:
         return
-    data.sort()
 
     # Draw graph
     fig = plot_data(data, graphs)
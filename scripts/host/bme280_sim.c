@@ -0,0 +1,531 @@
+// Emulation of a BME280 sensor attached to the esp-idf i2c driver
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Host tools link this file in place of the esp-idf i2c driver so that
+// fw/main/bme280.c takes its measurements from an emulated sensor. The
+// sensor reports the environment set with bme280_sim_set(). Its raw
+// data registers hold the values that the datasheet's floating point
+// compensation formulas (section 8.1) convert to that environment, so
+// the firmware's integer formulas are checked against an independent
+// implementation. Measurements take the time given in the datasheet
+// (as reported by esp_timer_get_time()). The IIR filter is not
+// emulated. The sensor may also be accessed by toggling the i2c lines
+// (see bme280_sim_bus()) as the deep sleep wake stub does.
+
+#include <stdlib.h> // calloc
+#include "bme280_sim.h" // bme280_sim_set
+#include "driver/i2c.h" // i2c_master_cmd_begin
+#include "esp_timer.h" // esp_timer_get_time
+#include "sdkconfig.h" // CONFIG_BME280_I2C_ADDR
+
+
+/****************************************************************
+ * Sensor registers
+ ****************************************************************/
+
+// Calibration values (typical of a production sensor)
+static const struct {
+    uint16_t T1;
+    int16_t T2, T3;
+    uint16_t P1;
+    int16_t P2, P3, P4, P5, P6, P7, P8, P9;
+    uint8_t H1, H3;
+    int16_t H2, H4, H5;
+    int8_t H6;
+} cal = {
+    .T1 = 27504, .T2 = 26435, .T3 = -1000,
+    .P1 = 36477, .P2 = -10685, .P3 = 3024, .P4 = 2855, .P5 = 140, .P6 = -7,
+    .P7 = 15500, .P8 = -14600, .P9 = 6000,
+    .H1 = 75, .H2 = 362, .H3 = 0, .H4 = 313, .H5 = 50, .H6 = 30,
+};
+
+#define REG_CHIP_ID 0xd0
+#define REG_CTRL_HUM 0xf2
+#define REG_STATUS 0xf3
+#define REG_CTRL_MEAS 0xf4
+#define REG_DATA 0xf7
+
+static uint8_t regs[256];
+static int regs_ready, measurements, absent;
+static double env_temperature = 20., env_pressure = 1013.25;
+static double env_humidity = 50.;
+// Time the current measurement completes (zero if none pending)
+static int64_t meas_end;
+static uint8_t meas_ctrl_hum, meas_ctrl_meas;
+
+static void
+put_short(uint8_t *p, int v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void
+regs_init(void)
+{
+    if (regs_ready)
+        return;
+    regs_ready = 1;
+    uint8_t *c = &regs[0x88];
+    put_short(&c[0], cal.T1);
+    put_short(&c[2], cal.T2);
+    put_short(&c[4], cal.T3);
+    put_short(&c[6], cal.P1);
+    put_short(&c[8], cal.P2);
+    put_short(&c[10], cal.P3);
+    put_short(&c[12], cal.P4);
+    put_short(&c[14], cal.P5);
+    put_short(&c[16], cal.P6);
+    put_short(&c[18], cal.P7);
+    put_short(&c[20], cal.P8);
+    put_short(&c[22], cal.P9);
+    regs[0xa1] = cal.H1;
+    put_short(&regs[0xe1], cal.H2);
+    regs[0xe3] = cal.H3;
+    regs[0xe4] = cal.H4 >> 4;
+    regs[0xe5] = (cal.H4 & 0x0f) | (cal.H5 << 4);
+    regs[0xe6] = cal.H5 >> 4;
+    regs[0xe7] = cal.H6;
+    regs[REG_CHIP_ID] = 0x60;
+    // Data registers hold the "skipped" values after a reset
+    regs[REG_DATA] = regs[REG_DATA + 3] = 0x80;
+    regs[REG_DATA + 6] = 0x80;
+}
+
+
+/****************************************************************
+ * Measurements
+ ****************************************************************/
+
+static double
+comp_t_fine(double unused, int32_t adc_T)
+{
+    double v1 = (adc_T / 16384. - cal.T1 / 1024.) * cal.T2;
+    double v2 = adc_T / 131072. - cal.T1 / 8192.;
+    return v1 + v2 * v2 * cal.T3;
+}
+
+static double
+comp_temperature(double unused, int32_t adc_T)
+{
+    return comp_t_fine(0., adc_T) / 5120.;
+}
+
+// Pressure in hPa
+static double
+comp_pressure(double t_fine, int32_t adc_P)
+{
+    double var1 = t_fine / 2. - 64000.;
+    double var2 = var1 * var1 * cal.P6 / 32768.;
+    var2 = var2 + var1 * cal.P5 * 2.;
+    var2 = var2 / 4. + cal.P4 * 65536.;
+    var1 = (cal.P3 * var1 * var1 / 524288. + cal.P2 * var1) / 524288.;
+    var1 = (1. + var1 / 32768.) * cal.P1;
+    if (!var1)
+        return 0.;
+    double p = 1048576. - adc_P;
+    p = (p - var2 / 4096.) * 6250. / var1;
+    var1 = cal.P9 * p * p / 2147483648.;
+    var2 = p * cal.P8 / 32768.;
+    return (p + (var1 + var2 + cal.P7) / 16.) / 100.;
+}
+
+static double
+comp_humidity(double t_fine, int32_t adc_H)
+{
+    double h = t_fine - 76800.;
+    h = ((adc_H - (cal.H4 * 64. + cal.H5 / 16384. * h))
+         * (cal.H2 / 65536. * (1. + cal.H6 / 67108864. * h
+                                * (1. + cal.H3 / 67108864. * h))));
+    h = h * (1. - cal.H1 * h / 524288.);
+    return h < 0. ? 0. : (h > 100. ? 100. : h);
+}
+
+// Find the raw value (from 0 to max) that converts closest to target
+static int32_t
+find_raw(double (*conv)(double t_fine, int32_t raw), double t_fine
+         , int32_t max, double target)
+{
+    int up = conv(t_fine, max) > conv(t_fine, 0);
+    int32_t lo = 0, hi = max;
+    while (lo < hi) {
+        int32_t mid = lo + (hi - lo) / 2;
+        if ((conv(t_fine, mid) < target) == up)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo && (conv(t_fine, lo) - target) * (conv(t_fine, lo) - target)
+        > (conv(t_fine, lo - 1) - target) * (conv(t_fine, lo - 1) - target))
+        lo--;
+    return lo;
+}
+
+static void
+put_20bit(uint8_t *p, int32_t v)
+{
+    p[0] = v >> 12;
+    p[1] = v >> 4;
+    p[2] = v << 4;
+}
+
+// Store the results of a completed measurement
+static void
+meas_complete(void)
+{
+    int32_t adc_T = find_raw(comp_temperature, 0., 0xfffff, env_temperature);
+    double t_fine = comp_t_fine(0., adc_T);
+    int32_t adc_P = find_raw(comp_pressure, t_fine, 0xfffff, env_pressure);
+    int32_t adc_H = find_raw(comp_humidity, t_fine, 0xffff, env_humidity);
+    if (adc_P == 0x80000)
+        adc_P++;
+    uint8_t *d = &regs[REG_DATA];
+    if (meas_ctrl_meas >> 5)
+        put_20bit(&d[3], adc_T);
+    if ((meas_ctrl_meas >> 2) & 0x07)
+        put_20bit(&d[0], adc_P);
+    if (meas_ctrl_hum & 0x07) {
+        d[6] = adc_H >> 8;
+        d[7] = adc_H;
+    }
+    regs[REG_CTRL_MEAS] &= ~0x03;
+    meas_end = 0;
+    measurements++;
+}
+
+static void
+meas_update(void)
+{
+    if (meas_end && esp_timer_get_time() >= meas_end)
+        meas_complete();
+    regs[REG_STATUS] = meas_end ? 0x08 : 0x00;
+}
+
+// Measurement duration (in us) for an oversampling setting
+static int
+osrs_time(int osrs, int per, int extra)
+{
+    return osrs ? per * (1 << ((osrs > 5 ? 5 : osrs) - 1)) + extra : 0;
+}
+
+static void
+reg_write(uint8_t reg, uint8_t val)
+{
+    regs[reg] = val;
+    if (reg != REG_CTRL_MEAS || (val & 0x03) == 0x00 || meas_end)
+        return;
+    // Start a forced measurement (taking the mean of the typical and
+    // maximum times from the datasheet, section 9.1)
+    meas_ctrl_hum = regs[REG_CTRL_HUM];
+    meas_ctrl_meas = val;
+    int t = val >> 5, p = (val >> 2) & 0x07, h = meas_ctrl_hum & 0x07;
+    int typ = (1000 + osrs_time(t, 2000, 0) + osrs_time(p, 2000, 500)
+               + osrs_time(h, 2000, 500));
+    int max = (1250 + osrs_time(t, 2300, 0) + osrs_time(p, 2300, 575)
+               + osrs_time(h, 2300, 575));
+    meas_end = esp_timer_get_time() + (typ + max) / 2;
+}
+
+// Set the environment reported by the sensor
+void
+bme280_sim_set(double temperature, double pressure, double humidity)
+{
+    env_temperature = temperature;
+    env_pressure = pressure;
+    env_humidity = humidity;
+}
+
+// Report the number of measurements taken
+int
+bme280_sim_measurements(void)
+{
+    return measurements;
+}
+
+// Disconnect (or reconnect) the sensor from the i2c bus
+void
+bme280_sim_set_absent(int is_absent)
+{
+    absent = is_absent;
+}
+
+
+/****************************************************************
+ * I2C slave
+ ****************************************************************/
+
+enum { SS_IDLE, SS_ADDR, SS_REG, SS_VALUE, SS_READ };
+static int slave_state;
+static uint8_t slave_reg;
+
+static void
+slave_start(void)
+{
+    regs_init();
+    slave_state = SS_ADDR;
+}
+
+static void
+slave_stop(void)
+{
+    slave_state = SS_IDLE;
+}
+
+// Receive a byte - returns non-zero if the byte is not acknowledged.
+// Writes are pairs of a register and its value.
+static int
+slave_write(uint8_t data)
+{
+    switch (slave_state) {
+    case SS_ADDR:
+        if (absent || data >> 1 != CONFIG_BME280_I2C_ADDR) {
+            slave_state = SS_IDLE;
+            return 1;
+        }
+        slave_state = data & 0x01 ? SS_READ : SS_REG;
+        return 0;
+    case SS_REG:
+        slave_reg = data;
+        slave_state = SS_VALUE;
+        return 0;
+    case SS_VALUE:
+        reg_write(slave_reg, data);
+        slave_state = SS_REG;
+        return 0;
+    }
+    return 1;
+}
+
+// Transmit a byte (reads continue at the following register)
+static uint8_t
+slave_read(void)
+{
+    if (slave_state != SS_READ)
+        return 0xff;
+    meas_update();
+    return regs[slave_reg++];
+}
+
+
+/****************************************************************
+ * Bit-banged i2c bus
+ ****************************************************************/
+
+enum { BS_IDLE, BS_RECV, BS_ACK, BS_SEND, BS_SEND_ACK };
+static int bus_state, bus_bits, bus_nack, bus_scl = 1, bus_sda = 1;
+// Sda level driven by the sensor (zero when pulling the line low)
+static int bus_drive = 1;
+static uint8_t bus_byte;
+
+// Start transmitting the next register to the master
+static void
+bus_send_byte(void)
+{
+    bus_byte = slave_read();
+    bus_bits = 0;
+    bus_drive = bus_byte >> 7;
+    bus_state = BS_SEND;
+}
+
+// Update the state of the i2c lines - scl and sda are the levels set
+// by the master (and the pullups). Returns the level of sda on the
+// bus (which the sensor may be pulling low). The sensor changes sda
+// while scl is low and samples it on the rising edge of scl.
+int
+bme280_sim_bus(int scl, int sda)
+{
+    int level = sda && bus_drive;
+    if (scl && bus_scl && level != bus_sda) {
+        // Start or stop condition
+        if (!level) {
+            slave_start();
+            bus_state = BS_RECV;
+            bus_bits = 0;
+        } else {
+            slave_stop();
+            bus_state = BS_IDLE;
+        }
+    } else if (scl && !bus_scl) {
+        // Rising clock edge
+        if (bus_state == BS_RECV && bus_bits < 8) {
+            bus_byte = (bus_byte << 1) | level;
+            bus_bits++;
+        } else if (bus_state == BS_SEND_ACK) {
+            bus_nack = level;
+        }
+    } else if (!scl && bus_scl) {
+        // Falling clock edge
+        switch (bus_state) {
+        case BS_RECV:
+            if (bus_bits == 8) {
+                bus_nack = slave_write(bus_byte);
+                bus_drive = bus_nack;
+                bus_state = BS_ACK;
+            }
+            break;
+        case BS_ACK:
+            bus_drive = 1;
+            bus_bits = 0;
+            if (bus_nack)
+                bus_state = BS_IDLE;
+            else if (slave_state == SS_READ)
+                bus_send_byte();
+            else
+                bus_state = BS_RECV;
+            break;
+        case BS_SEND:
+            if (++bus_bits == 8) {
+                bus_drive = 1;
+                bus_state = BS_SEND_ACK;
+            } else {
+                bus_drive = (bus_byte >> (7 - bus_bits)) & 1;
+            }
+            break;
+        case BS_SEND_ACK:
+            if (bus_nack)
+                bus_state = BS_IDLE;
+            else
+                bus_send_byte();
+            break;
+        }
+    }
+    bus_scl = scl;
+    bus_sda = sda && bus_drive;
+    return bus_sda;
+}
+
+
+/****************************************************************
+ * esp-idf i2c driver
+ ****************************************************************/
+
+enum { OP_START, OP_STOP, OP_WRITE, OP_READ };
+
+struct i2c_op_s {
+    int type, ack;
+    uint8_t *data, byte;
+    size_t len;
+};
+
+struct i2c_cmd_s {
+    struct i2c_op_s ops[16];
+    int count;
+};
+
+esp_err_t
+i2c_driver_install(int port, int mode, size_t rx_len, size_t tx_len
+                   , int flags)
+{
+    return 0;
+}
+
+esp_err_t
+i2c_param_config(int port, const i2c_config_t *conf)
+{
+    return 0;
+}
+
+i2c_cmd_handle_t
+i2c_cmd_link_create(void)
+{
+    return calloc(1, sizeof(struct i2c_cmd_s));
+}
+
+void
+i2c_cmd_link_delete(i2c_cmd_handle_t cmd)
+{
+    free(cmd);
+}
+
+static esp_err_t
+add_op(i2c_cmd_handle_t cmd, int type, uint8_t *data, size_t len, int ack)
+{
+    struct i2c_cmd_s *c = cmd;
+    if (!c || c->count >= sizeof(c->ops) / sizeof(c->ops[0]))
+        return -1;
+    struct i2c_op_s *op = &c->ops[c->count++];
+    op->type = type;
+    op->data = data;
+    op->len = len;
+    op->ack = ack;
+    return 0;
+}
+
+esp_err_t
+i2c_master_start(i2c_cmd_handle_t cmd)
+{
+    return add_op(cmd, OP_START, NULL, 0, 0);
+}
+
+esp_err_t
+i2c_master_stop(i2c_cmd_handle_t cmd)
+{
+    return add_op(cmd, OP_STOP, NULL, 0, 0);
+}
+
+esp_err_t
+i2c_master_write_byte(i2c_cmd_handle_t cmd, uint8_t data, int ack)
+{
+    struct i2c_cmd_s *c = cmd;
+    int ret = add_op(cmd, OP_WRITE, NULL, 1, ack);
+    if (!ret) {
+        // Like the esp-idf driver, a single byte is copied
+        struct i2c_op_s *op = &c->ops[c->count - 1];
+        op->byte = data;
+        op->data = &op->byte;
+    }
+    return ret;
+}
+
+esp_err_t
+i2c_master_write(i2c_cmd_handle_t cmd, uint8_t *data, size_t len, int ack)
+{
+    return add_op(cmd, OP_WRITE, data, len, ack);
+}
+
+esp_err_t
+i2c_master_read(i2c_cmd_handle_t cmd, uint8_t *data, size_t len, int ack)
+{
+    return add_op(cmd, OP_READ, data, len, ack);
+}
+
+esp_err_t
+i2c_master_read_byte(i2c_cmd_handle_t cmd, uint8_t *data, int ack)
+{
+    return add_op(cmd, OP_READ, data, 1, ack);
+}
+
+// Run the queued transaction (a byte that is not acknowledged aborts
+// it with an error)
+esp_err_t
+i2c_master_cmd_begin(int port, i2c_cmd_handle_t cmd, TickType_t ticks)
+{
+    struct i2c_cmd_s *c = cmd;
+    for (int i=0; i<c->count; i++) {
+        struct i2c_op_s *op = &c->ops[i];
+        switch (op->type) {
+        case OP_START:
+            slave_start();
+            break;
+        case OP_STOP:
+            slave_stop();
+            break;
+        case OP_WRITE:
+            for (size_t j=0; j<op->len; j++) {
+                if (slave_write(op->data[j]) && op->ack) {
+                    slave_stop();
+                    return -1;
+                }
+            }
+            break;
+        case OP_READ:
+            for (size_t j=0; j<op->len; j++)
+                op->data[j] = slave_read();
+            break;
+        }
+    }
+    return 0;
+}
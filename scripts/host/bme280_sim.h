@@ -0,0 +1,9 @@
+#ifndef BME280_SIM_H
+#define BME280_SIM_H
+
+void bme280_sim_set(double temperature, double pressure, double humidity);
+int bme280_sim_measurements(void);
+void bme280_sim_set_absent(int is_absent);
+int bme280_sim_bus(int scl, int sda);
+
+#endif // bme280_sim.h
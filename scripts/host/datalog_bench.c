@@ -0,0 +1,717 @@
+// Benchmark and randomized self-check of the datalog ring buffer
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This tool compiles fw/main/datalog.c (and fw/main/mqttpub.c) on a
+// Linux host along with the firmware's record types. Build and run it
+// with something like:
+//   gcc -O2 -Wall -ffunction-sections -Wl,--gc-sections -I scripts/host
+//     -I fw/main -o /tmp/datalog_bench scripts/host/datalog_bench.c
+//     fw/main/deepsleep.c fw/main/bme280.c fw/main/battery.c
+//     fw/main/timing.c && /tmp/datalog_bench
+// (the linker discards the firmware code that accesses hardware).
+// Add -DDATALOG_SIZE=<bytes> to the gcc command to evaluate other log
+// sizes (and -DDATALOG_FAST_SIZE=<bytes> to add a segment in rtc fast
+// memory). The self-check drives random sequences of append, finalize,
+// expire, format, and export operations and compares the results to
+// a simple reference model of the log, and checks that timestamps
+// survive the zigzag varint encoding. It then streams a full log into
+// mqtt PUBLISH requests (as the pipelined publisher does) and checks
+// the requests received on the other end of a socket. The benchmark
+// compares the size of each wake record (and the number of wakes the
+// log holds) with the original layout, which stored a type pointer
+// and the unpacked data of each entry.
+
+#include <inttypes.h> // PRIu64
+#include <stdio.h> // printf
+#include <stdlib.h> // rand
+#include <string.h> // memcpy
+#include <sys/socket.h> // socketpair
+#include <time.h> // clock_gettime
+#include <unistd.h> // getopt
+#include "datalog.c" // log_storage
+#include "mqttpub.c" // mqttpub_publish_start
+
+int esp_log_verbose;
+
+
+/****************************************************************
+ * Record types
+ ****************************************************************/
+
+// The firmware record types (appwake_info, battery_info, bme280_info,
+// bme280_raw_info, timing_info, and counter_info) are linked in from
+// fw/main/. Their data layouts are:
+
+struct appwake_s {
+    uint64_t waketime, sleeptime;
+};
+
+struct bme280_s {
+    float temperature, pressure, humidity;
+};
+
+struct timing_s {
+    uint8_t phase;
+    uint32_t usecs;
+};
+
+struct counter_s {
+    uint8_t counter;
+    uint16_t count;
+};
+
+// The firmware reads the esp timer when noting wake phase timings
+int64_t
+esp_timer_get_time(void)
+{
+    return 0;
+}
+
+static const struct datalog_type_s * const test_types[] = {
+    &appwake_info, &battery_info, &bme280_info, &bme280_raw_info,
+    &timing_info, &counter_info,
+};
+
+static uint64_t clock_time;
+
+// Generate random data for a record type. Values are generated at the
+// resolution that the firmware packs them with, so that the formatted
+// records match the reference model (which formats the data directly).
+static void
+random_entry(const struct datalog_type_s *dt, void *data)
+{
+    memset(data, 0, MAX_DATA);
+    if (dt == &appwake_info) {
+        // Mostly increasing times (with an occasional clock reset)
+        if (rand() % 64)
+            clock_time += 1000000ULL * (rand() % 1000);
+        else
+            clock_time = (uint64_t)rand() * rand();
+        struct appwake_s *aw = data;
+        aw->waketime = clock_time;
+        if (rand() % 8)
+            aw->sleeptime = clock_time - 1000000ULL * (rand() % 1000);
+    } else if (dt == &battery_info) {
+        *(float*)data = (rand() % 4000) / 1000.f;
+    } else if (dt == &bme280_info) {
+        struct bme280_s *b = data;
+        b->temperature = (rand() % 8000 - 4000) / 100.0f;
+        b->pressure = (rand() % 2000 + 9000) / 10.0f;
+        b->humidity = (rand() % 10000) / 100.0f;
+    } else if (dt == &timing_info) {
+        struct timing_s *t = data;
+        t->phase = rand() % 16;
+        t->usecs = rand() >> (rand() % 31);
+    } else if (dt == &counter_info) {
+        struct counter_s *c = data;
+        c->counter = rand() % 16;
+        c->count = rand() >> (rand() % 31);
+    } else {
+        uint8_t *d = data;
+        for (int i=0; i<dt->length; i++)
+            d[i] = rand();
+    }
+}
+
+static void
+reset_log(void)
+{
+    memset(log_storage, 0, sizeof(log_storage));
+#if DATALOG_FAST_SIZE
+    memset(log_fast, 0, sizeof(log_fast));
+#endif
+    log_first = log_end = 0;
+    log_first_time = log_end_time = pending_time = format_time = 0;
+    pending_open = 0;
+    clock_time = 0;
+}
+
+
+/****************************************************************
+ * Reference model
+ ****************************************************************/
+
+#define MODEL_MAX (LOG_SIZE + 1)
+#define FORMAT_SIZE 4096
+
+struct model_rec_s {
+    int len;
+    char *json;
+};
+
+static struct model_rec_s model[MODEL_MAX];
+static int model_first, model_count, model_used;
+// State of the pending record
+static char pending_json[FORMAT_SIZE];
+static int pending_len, pending_json_len;
+static uint64_t model_ptime;
+
+static void
+model_reset(void)
+{
+    for (int i=0; i<model_count; i++)
+        free(model[(model_first + i) % MODEL_MAX].json);
+    model_first = model_count = model_used = 0;
+    model_ptime = 0;
+}
+
+static void
+model_expire(void)
+{
+    if (!model_count)
+        return;
+    struct model_rec_s *r = &model[model_first];
+    model_used -= r->len;
+    free(r->json);
+    model_first = (model_first + 1) % MODEL_MAX;
+    model_count--;
+}
+
+static int
+model_avail(void)
+{
+    return LOG_SIZE - model_used - 1;
+}
+
+static void
+model_init(void)
+{
+    while (model_avail() < 1)
+        model_expire();
+    pending_len = 1;
+    pending_json_len = 0;
+}
+
+// Returns the expected datalog_append() result
+static int
+model_append(const struct datalog_type_s *dt, void *data)
+{
+    uint8_t buf[MAX_RECORD + 1];
+    uint64_t ptime = model_ptime;
+    int len = dt->pack ? dt->pack(data, buf, &ptime) : dt->length;
+    int new_len = pending_len + 1 + len;
+    if (new_len > MAX_RECORD)
+        return -1;
+    while (model_avail() < new_len)
+        model_expire();
+    pending_len = new_len;
+    model_ptime = ptime;
+    pending_json[pending_json_len] = pending_json_len ? ',' : '{';
+    pending_json_len++;
+    pending_json_len += dt->format(data, &pending_json[pending_json_len]
+                                   , sizeof(pending_json) - pending_json_len);
+    return 0;
+}
+
+static void
+model_finalize(void)
+{
+    if (!pending_json_len)
+        pending_json[pending_json_len++] = '{';
+    pending_json[pending_json_len++] = '}';
+    pending_json[pending_json_len] = '\0';
+    struct model_rec_s *r = &model[(model_first + model_count) % MODEL_MAX];
+    r->len = pending_len;
+    r->json = strdup(pending_json);
+    model_count++;
+    model_used += pending_len;
+}
+
+
+/****************************************************************
+ * Self-check
+ ****************************************************************/
+
+static int check_errors;
+
+#define CHECK(cond, fmt, ...) do {                                      \
+        if (!(cond)) {                                                  \
+            check_errors++;                                             \
+            fprintf(stderr, "check failed (%s): " fmt "\n", #cond       \
+                    , ##__VA_ARGS__);                                   \
+            return -1;                                                  \
+        }                                                               \
+    } while (0)
+
+// Verify the log contents using datalog_format()
+static int
+check_format(void)
+{
+    CHECK(datalog_free() == model_avail(), "free %d vs %d"
+          , datalog_free(), model_avail());
+    char buf[FORMAT_SIZE];
+    int pos = -1;
+    for (int i=0; i<model_count; i++) {
+        struct model_rec_s *r = &model[(model_first + i) % MODEL_MAX];
+        CHECK(!datalog_is_end(pos), "record %d of %d", i, model_count);
+        int ret = datalog_format(&pos, buf, sizeof(buf));
+        CHECK(ret == strlen(r->json) && memcmp(buf, r->json, ret) == 0
+              , "record %d '%.*s' vs '%s'", i, ret > 0 ? ret : 0, buf
+              , r->json);
+    }
+    CHECK(datalog_is_end(pos), "extra records");
+    CHECK(datalog_format(&pos, buf, sizeof(buf)) < 0, "extra records");
+    return 0;
+}
+
+// Verify that records are not formatted into a too small buffer (the
+// delta encoded timestamps require formatting all records in order, so
+// this is done in two passes)
+static int
+check_format_size(void)
+{
+    char buf[FORMAT_SIZE];
+    for (int pass=0; pass<2; pass++) {
+        int pos = -1;
+        for (int i=0; i<model_count; i++) {
+            struct model_rec_s *r = &model[(model_first + i) % MODEL_MAX];
+            int len = strlen(r->json);
+            int ret = datalog_format(&pos, buf, pass ? len : len - 1);
+            if (pass)
+                CHECK(ret == len && memcmp(buf, r->json, len) == 0
+                      , "record %d exact buffer", i);
+            else
+                CHECK(ret == 0, "record %d formatted to %d bytes", i, len - 1);
+        }
+    }
+    return 0;
+}
+
+// Verify the records copied by datalog_export()
+static int
+check_export(void)
+{
+    uint8_t buf[LOG_SIZE];
+    int size = rand() % sizeof(buf), count;
+    uint64_t ptime;
+    int len = datalog_export(buf, size, &ptime, &count);
+    // The most recent record is never exported
+    int avail = model_count ? model_count - 1 : 0;
+    CHECK(count <= avail && len <= size, "export %d", count);
+    int pos = 0;
+    for (int i=0; i<count; i++) {
+        struct model_rec_s *r = &model[(model_first + i) % MODEL_MAX];
+        char out[FORMAT_SIZE];
+        CHECK(buf[pos] == r->len, "export record %d length", i);
+        int ret = datalog_decode(&buf[pos], buf[pos], &ptime, out
+                                 , sizeof(out));
+        CHECK(ret == strlen(r->json) && memcmp(out, r->json, ret) == 0
+              , "export record %d", i);
+        pos += buf[pos];
+    }
+    CHECK(pos == len, "export length %d vs %d", pos, len);
+    if (count < avail) {
+        struct model_rec_s *r = &model[(model_first + count) % MODEL_MAX];
+        CHECK(len + r->len > size, "export stopped early");
+    }
+    return 0;
+}
+
+static int
+run_check(int iterations)
+{
+    reset_log();
+    model_reset();
+    uint8_t __aligned(sizeof(uint64_t)) data[MAX_DATA];
+    for (int iter=0; iter<iterations; iter++) {
+        datalog_init();
+        model_init();
+        // Add entries (occasionally enough to exceed MAX_RECORD)
+        int count = rand() % 8 ? rand() % 8 : rand() % 40;
+        for (int i=0; i<count; i++) {
+            const struct datalog_type_s *dt = test_types[
+                rand() % ARRAY_SIZE(test_types)];
+            random_entry(dt, data);
+            int expect = model_append(dt, data);
+            int ret = datalog_append(dt, data);
+            CHECK(ret == expect, "append %d vs %d (iteration %d)"
+                  , ret, expect, iter);
+        }
+        datalog_finalize();
+        model_finalize();
+        random_entry(&battery_info, data);
+        CHECK(datalog_append(&battery_info, data) < 0
+              , "append after finalize");
+
+        // Expire records (as an upload would)
+        if (!(rand() % 16)) {
+            int expire_count = rand() % 8;
+            for (int i=0; i<expire_count; i++) {
+                datalog_expire();
+                model_expire();
+            }
+        }
+
+        if (check_format())
+            return -1;
+        if (!(rand() % 32) && check_format_size())
+            return -1;
+        if (!(rand() % 8) && check_export())
+            return -1;
+    }
+    return 0;
+}
+
+
+// Verify that timestamps survive the zigzag varint encoding
+static int
+check_timestamp_encoding(int iterations)
+{
+    static const int64_t edges[] = {
+        0, 1, -1, 63, -64, 64, -65, INT32_MAX, INT32_MIN, INT64_MAX,
+        INT64_MIN, INT64_MAX - 1, INT64_MIN + 1,
+    };
+    uint8_t buf[16];
+    for (int i=0; i<ARRAY_SIZE(edges) + iterations; i++) {
+        int64_t v = i < ARRAY_SIZE(edges) ? edges[i] : 0;
+        if (i >= ARRAY_SIZE(edges)) {
+            // Random values of all magnitudes
+            for (int j=0; j<4; j++)
+                v = (v << 16) ^ (rand() & 0xffff);
+            v >>= rand() % 64;
+        }
+        uint64_t zz = datalog_zigzag(v), out;
+        int len = datalog_put_varint(buf, zz);
+        CHECK(len <= 10 && datalog_get_varint(buf, &out) == len && out == zz
+              , "varint %" PRIu64 " (%d bytes)", zz, len);
+        CHECK(datalog_unzigzag(out) == v, "zigzag %" PRId64, v);
+    }
+
+    // Wake records with forward, backward, and missing timestamps
+    // (rtc times stay below 2^62 us)
+    uint64_t pack_time = 0, unpack_time = 0;
+    for (int i=0; i<iterations; i++) {
+        struct appwake_s aw, out;
+        random_entry(&appwake_info, &aw);
+        if (!(rand() % 16))
+            aw.waketime = (((uint64_t)rand() << 31) ^ rand()) << (rand() % 32);
+        aw.waketime &= (1ULL << 62) - 1;
+        aw.sleeptime &= (1ULL << 62) - 1;
+        uint8_t rec[MAX_DATA];
+        int len = appwake_info.pack(&aw, rec, &pack_time);
+        CHECK(appwake_info.unpack(rec, &out, &unpack_time) == len
+              && out.waketime == aw.waketime && out.sleeptime == aw.sleeptime
+              && unpack_time == pack_time
+              , "appwake %" PRIu64 "/%" PRIu64 " (%d bytes)"
+              , aw.waketime, aw.sleeptime, len);
+    }
+    return 0;
+}
+
+
+/****************************************************************
+ * Upload check
+ ****************************************************************/
+
+#define UPLOAD_TOPIC "test/data"
+
+struct upload_stream_s {
+    struct datalog_stream_s ds;
+    struct mqttpub_s *mp;
+};
+
+// Grow the mqttpub transmit buffer (as done in fw/main/mqtt.c)
+static int
+upload_reserve(struct datalog_stream_s *ds, int len)
+{
+    struct upload_stream_s *us = (struct upload_stream_s *)ds;
+    us->mp->out_len = ds->len;
+    int ret = mqttpub_reserve(us->mp, len);
+    ds->buf = (char *)us->mp->out;
+    ds->size = us->mp->out_size;
+    return ret;
+}
+
+// Fill the log with large records (that format to more than 256 bytes)
+static void
+fill_upload_log(void)
+{
+    uint8_t __aligned(sizeof(uint64_t)) data[MAX_DATA];
+    reset_log();
+    model_reset();
+    while (datalog_free() >= MAX_RECORD / 2) {
+        datalog_init();
+        model_init();
+        random_entry(&appwake_info, data);
+        model_append(&appwake_info, data);
+        datalog_append(&appwake_info, data);
+        int count = 20 + rand() % 20;
+        for (int i=0; i<count; i++) {
+            random_entry(&timing_info, data);
+            if (model_append(&timing_info, data))
+                break;
+            datalog_append(&timing_info, data);
+        }
+        datalog_finalize();
+        model_finalize();
+    }
+}
+
+// Read exactly len bytes from a socket
+static int
+read_full(int fd, uint8_t *buf, int len)
+{
+    int pos = 0;
+    while (pos < len) {
+        int ret = read(fd, &buf[pos], len - pos);
+        if (ret <= 0)
+            return -1;
+        pos += ret;
+    }
+    return 0;
+}
+
+// Verify the PUBLISH requests received from the upload
+static int
+check_upload_packets(int fd, int first_id)
+{
+    int topic_len = strlen(UPLOAD_TOPIC), max_len = 0;
+    for (int i=0; i<model_count; i++) {
+        struct model_rec_s *r = &model[(model_first + i) % MODEL_MAX];
+        uint8_t hdr[5];
+        int rem_len = 0, hlen = 1;
+        CHECK(!read_full(fd, hdr, 1), "publish %d header", i);
+        CHECK(hdr[0] == ((MQTTPUB_PUBLISH << 4) | 0x03), "publish %d type", i);
+        do {
+            CHECK(hlen < 5 && !read_full(fd, &hdr[hlen], 1)
+                  , "publish %d length", i);
+            rem_len |= (hdr[hlen] & 0x7f) << (7 * (hlen - 1));
+        } while (hdr[hlen++] & 0x80);
+        CHECK(hlen - 1 == (rem_len < 128 ? 1 : 2), "publish %d length"
+              " encoding %d", i, hlen - 1);
+        uint8_t *pkt = malloc(rem_len);
+        CHECK(pkt && !read_full(fd, pkt, rem_len), "publish %d body", i);
+        int data_len = rem_len - 2 - topic_len - 2;
+        char *data = (char *)&pkt[2 + topic_len + 2];
+        int ok = (load_u16(pkt) == topic_len
+                  && memcmp(&pkt[2], UPLOAD_TOPIC, topic_len) == 0
+                  && load_u16(&pkt[2 + topic_len]) == (uint16_t)(first_id + i)
+                  && data_len == strlen(r->json)
+                  && memcmp(data, r->json, data_len) == 0);
+        free(pkt);
+        CHECK(ok, "publish %d contents", i);
+        if (data_len > max_len)
+            max_len = data_len;
+    }
+    CHECK(max_len > 256, "largest record only %d bytes", max_len);
+    return 0;
+}
+
+// Stream a full log into mqtt PUBLISH requests and check the result
+static int
+check_upload(void)
+{
+    fill_upload_log();
+    int fds[2];
+    CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds), "socketpair");
+    struct mqttpub_s mp = { .fd = fds[0] };
+    struct upload_stream_s us = {
+        .ds = { .reserve = upload_reserve }, .mp = &mp,
+    };
+    // Include an empty qos 1 publish that is cancelled
+    mqttpub_publish_start(&mp, UPLOAD_TOPIC, 1, 1);
+    mqttpub_publish_cancel(&mp);
+    int first_id = mp.next_id + 1, pos = -1, count = 0, ret;
+    for (;;) {
+        ret = mqttpub_publish_start(&mp, UPLOAD_TOPIC, 1, 1);
+        if (ret < 0)
+            break;
+        us.ds.buf = (char *)mp.out;
+        us.ds.len = mp.out_len;
+        us.ds.size = mp.out_size;
+        ret = datalog_format_stream(&pos, &us.ds);
+        if (ret <= 0) {
+            mqttpub_publish_cancel(&mp);
+            break;
+        }
+        mp.out_len = us.ds.len;
+        ret = mqttpub_publish_end(&mp);
+        if (ret)
+            break;
+        count++;
+    }
+    int out_len = mp.out_len;
+    // The socket buffer is larger than the log, so this doesn't block
+    ret = ret < 0 && count == model_count ? mqttpub_flush(&mp) : -1;
+    if (!ret)
+        ret = check_upload_packets(fds[1], first_id);
+    free(mp.out);
+    close(fds[0]);
+    close(fds[1]);
+    CHECK(!ret, "upload of %d records (%d bytes)", count, out_len);
+    printf("Upload check: %d records in %d bytes (log %d of %d bytes)\n"
+           , count, out_len, LOG_SIZE - 1 - datalog_free(), LOG_SIZE);
+    return 0;
+}
+
+
+/****************************************************************
+ * Benchmark
+ ****************************************************************/
+
+struct mix_s {
+    const char *name;
+    int battery, bme280, bme280_raw, timings, counters;
+};
+
+static const struct mix_s mixes[] = {
+    { "sensor", 1, 1, 0, 0, 0 },
+    { "raw", 0, 0, 1, 0, 0 },
+    { "timing", 1, 1, 0, 6, 0 },
+    { "upload", 1, 1, 0, 14, 2 },
+};
+
+static double
+get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * .000000001;
+}
+
+static void
+append_mix(const struct mix_s *m)
+{
+    uint8_t __aligned(sizeof(uint64_t)) data[MAX_DATA];
+    datalog_init();
+    random_entry(&appwake_info, data);
+    datalog_append(&appwake_info, data);
+    for (int i=0; i<m->battery; i++) {
+        random_entry(&battery_info, data);
+        datalog_append(&battery_info, data);
+    }
+    for (int i=0; i<m->bme280; i++) {
+        random_entry(&bme280_info, data);
+        datalog_append(&bme280_info, data);
+    }
+    for (int i=0; i<m->bme280_raw; i++) {
+        random_entry(&bme280_raw_info, data);
+        datalog_append(&bme280_raw_info, data);
+    }
+    for (int i=0; i<m->timings; i++) {
+        random_entry(&timing_info, data);
+        datalog_append(&timing_info, data);
+    }
+    for (int i=0; i<m->counters; i++) {
+        random_entry(&counter_info, data);
+        datalog_append(&counter_info, data);
+    }
+    datalog_finalize();
+}
+
+// Size of a wake record in the original log layout (a record length
+// byte, and a type struct pointer followed by the unpacked data for
+// each entry)
+#define OLD_TYPE_PTR 4 // sizeof(void*) on the esp32
+
+static int
+old_record_bytes(const struct mix_s *m)
+{
+    return (1 + OLD_TYPE_PTR + appwake_info.length
+            + m->battery * (OLD_TYPE_PTR + battery_info.length)
+            + m->bme280 * (OLD_TYPE_PTR + bme280_info.length)
+            + m->bme280_raw * (OLD_TYPE_PTR + bme280_raw_info.length)
+            + m->timings * (OLD_TYPE_PTR + timing_info.length)
+            + m->counters * (OLD_TYPE_PTR + counter_info.length));
+}
+
+static int
+count_records(void)
+{
+    int pos = log_first, count = 0;
+    while (pos != log_end) {
+        pos = pos_wrap(pos + record_len(pos));
+        count++;
+    }
+    return count;
+}
+
+static void
+run_bench(int records)
+{
+    printf("Log size %d bytes (%d in rtc fast memory)\n"
+           , LOG_SIZE, DATALOG_FAST_SIZE);
+    printf("%-8s %10s %10s %8s %8s %12s %12s\n", "mix", "old b/wake"
+           , "bytes/wake", "old held", "held", "appends/s", "formats/s");
+    for (int i=0; i<ARRAY_SIZE(mixes); i++) {
+        const struct mix_s *m = &mixes[i];
+        reset_log();
+
+        // Append (with the log wrapping and expiring old records)
+        double start = get_time();
+        for (int j=0; j<records; j++)
+            append_mix(m);
+        double append_time = get_time() - start;
+        int held = count_records();
+        double rec_bytes = (double)(LOG_SIZE - 1 - datalog_free()) / held;
+
+        // Format the full log repeatedly
+        char buf[FORMAT_SIZE];
+        int formatted = 0;
+        start = get_time();
+        while (formatted < records) {
+            int pos = -1;
+            while (datalog_format(&pos, buf, sizeof(buf)) >= 0)
+                formatted++;
+        }
+        double format_time = get_time() - start;
+
+        // The original layout has no varying sizes to measure
+        int old_bytes = old_record_bytes(m);
+        int old_held = (LOG_SIZE - 1) / old_bytes;
+
+        printf("%-8s %10d %10.1f %8d %8d %12.0f %12.0f\n", m->name
+               , old_bytes, rec_bytes, old_held, held
+               , records / append_time, formatted / format_time);
+    }
+}
+
+
+/****************************************************************
+ * Startup
+ ****************************************************************/
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-c iterations] [-b records] [-s seed] [-v]\n"
+            , prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    int iterations = 20000, records = 200000;
+    unsigned int seed = time(NULL);
+    int opt;
+    while ((opt = getopt(argc, argv, "c:b:s:v")) != -1) {
+        switch (opt) {
+        case 'c': iterations = atoi(optarg); break;
+        case 'b': records = atoi(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        case 'v': esp_log_verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (iterations) {
+        printf("Self-check: %d iterations (seed %u)\n", iterations, seed);
+        srand(seed);
+        if (run_check(iterations) || check_timestamp_encoding(iterations)) {
+            printf("Self-check FAILED\n");
+            return 1;
+        }
+        if (check_upload()) {
+            printf("Self-check FAILED\n");
+            return 1;
+        }
+        printf("Self-check passed\n");
+    }
+    if (records)
+        run_bench(records);
+    return 0;
+}
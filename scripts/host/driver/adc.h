@@ -0,0 +1,18 @@
+// Minimal esp-idf driver/adc.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef ADC_H
+#define ADC_H
+
+#include "driver/gpio.h" // gpio_num_t
+
+enum { ADC_ATTEN_DB_6 = 2 };
+enum { ADC_WIDTH_12Bit = 3 };
+
+int adc2_config_channel_atten(int channel, int atten);
+int adc2_pad_get_io_num(int channel, gpio_num_t *gpio);
+int adc2_get_raw(int channel, int width, int *raw);
+
+#endif // adc.h
@@ -0,0 +1,18 @@
+// Minimal esp-idf driver/gpio.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef GPIO_H
+#define GPIO_H
+
+typedef int gpio_num_t;
+
+enum { GPIO_PULLUP_DISABLE, GPIO_PULLUP_ENABLE };
+
+int gpio_pullup_en(gpio_num_t gpio);
+int gpio_pullup_dis(gpio_num_t gpio);
+int gpio_pulldown_en(gpio_num_t gpio);
+int gpio_pulldown_dis(gpio_num_t gpio);
+
+#endif // gpio.h
@@ -0,0 +1,44 @@
+// Minimal esp-idf driver/i2c.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef I2C_H
+#define I2C_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+#include "driver/gpio.h" // GPIO_PULLUP_ENABLE
+#include "freertos/FreeRTOS.h" // portTICK_RATE_MS
+
+typedef int esp_err_t;
+typedef void *i2c_cmd_handle_t;
+
+enum { I2C_NUM_0 };
+enum { I2C_MODE_MASTER };
+enum { I2C_MASTER_WRITE, I2C_MASTER_READ };
+
+typedef struct {
+    int mode, sda_io_num, sda_pullup_en, scl_io_num, scl_pullup_en;
+    struct {
+        uint32_t clk_speed;
+    } master;
+} i2c_config_t;
+
+esp_err_t i2c_driver_install(int port, int mode, size_t rx_len
+                             , size_t tx_len, int flags);
+esp_err_t i2c_param_config(int port, const i2c_config_t *conf);
+i2c_cmd_handle_t i2c_cmd_link_create(void);
+void i2c_cmd_link_delete(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_start(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_stop(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_write_byte(i2c_cmd_handle_t cmd, uint8_t data, int ack);
+esp_err_t i2c_master_write(i2c_cmd_handle_t cmd, uint8_t *data, size_t len
+                           , int ack);
+esp_err_t i2c_master_read(i2c_cmd_handle_t cmd, uint8_t *data, size_t len
+                          , int ack);
+esp_err_t i2c_master_read_byte(i2c_cmd_handle_t cmd, uint8_t *data, int ack);
+esp_err_t i2c_master_cmd_begin(int port, i2c_cmd_handle_t cmd
+                               , TickType_t ticks);
+
+#endif // i2c.h
@@ -0,0 +1,11 @@
+// Minimal esp-idf driver/rtc_io.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef RTC_IO_H
+#define RTC_IO_H
+
+// Only used by the deep sleep wake stub (which is not built on the host)
+
+#endif // rtc_io.h
@@ -0,0 +1,13 @@
+// Minimal esp-idf esp32/rom/ets_sys.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef ETS_SYS_H
+#define ETS_SYS_H
+
+#include <stdint.h> // uint32_t
+
+void ets_delay_us(uint32_t us);
+
+#endif // ets_sys.h
@@ -0,0 +1,70 @@
+// Minimal esp-idf esp32/rom/miniz.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef MINIZ_H
+#define MINIZ_H
+
+// The esp32 rom provides the miniz "tinfl" decompressor. This wraps
+// the host zlib library with the same interface (link with -lz).
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+#include <string.h> // memset
+#include <zlib.h> // inflate
+
+#define TINFL_LZ_DICT_SIZE 32768
+
+enum {
+    TINFL_FLAG_PARSE_ZLIB_HEADER = 1, TINFL_FLAG_HAS_MORE_INPUT = 2,
+    TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
+    TINFL_FLAG_COMPUTE_ADLER32 = 8,
+};
+
+typedef enum {
+    TINFL_STATUS_BAD_PARAM = -3, TINFL_STATUS_ADLER32_MISMATCH = -2,
+    TINFL_STATUS_FAILED = -1, TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1, TINFL_STATUS_HAS_MORE_OUTPUT = 2
+} tinfl_status;
+
+typedef struct {
+    z_stream zs;
+    int started;
+} tinfl_decompressor;
+
+#define tinfl_init(r) do { (r)->started = 0; } while (0)
+
+static inline tinfl_status
+tinfl_decompress(tinfl_decompressor *r, const uint8_t *in, size_t *in_size
+                 , uint8_t *out_start, uint8_t *out_next, size_t *out_size
+                 , uint32_t flags)
+{
+    if (!r->started) {
+        memset(&r->zs, 0, sizeof(r->zs));
+        int wbits = flags & TINFL_FLAG_PARSE_ZLIB_HEADER ? 15 : -15;
+        if (inflateInit2(&r->zs, wbits) != Z_OK)
+            return TINFL_STATUS_FAILED;
+        r->started = 1;
+    }
+    r->zs.next_in = (uint8_t *)in;
+    r->zs.avail_in = *in_size;
+    r->zs.next_out = out_next;
+    r->zs.avail_out = *out_size;
+    int ret = inflate(&r->zs, Z_NO_FLUSH);
+    *in_size -= r->zs.avail_in;
+    *out_size -= r->zs.avail_out;
+    if (ret == Z_STREAM_END) {
+        inflateEnd(&r->zs);
+        return TINFL_STATUS_DONE;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        inflateEnd(&r->zs);
+        return TINFL_STATUS_FAILED;
+    }
+    if (!r->zs.avail_out)
+        return TINFL_STATUS_HAS_MORE_OUTPUT;
+    return TINFL_STATUS_NEEDS_MORE_INPUT;
+}
+
+#endif // miniz.h
@@ -0,0 +1,16 @@
+// Minimal esp-idf esp32/rom/rtc.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef ROM_RTC_H
+#define ROM_RTC_H
+
+#include "soc/rtc_cntl_reg.h" // RTC_CNTL_STORE1_REG
+
+#define RTC_SLOW_CLK_CAL_REG RTC_CNTL_STORE1_REG
+#define RTC_BOOT_TIME_LOW_REG RTC_CNTL_STORE2_REG
+#define RTC_BOOT_TIME_HIGH_REG RTC_CNTL_STORE3_REG
+#define RTC_ENTRY_ADDR_REG RTC_CNTL_STORE6_REG
+
+#endif // rtc.h
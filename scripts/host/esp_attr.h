@@ -0,0 +1,17 @@
+// Minimal esp-idf esp_attr.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef ESP_ATTR_H
+#define ESP_ATTR_H
+
+#define RTC_DATA_ATTR
+#define RTC_IRAM_ATTR
+#define RTC_FAST_ATTR
+#define FORCE_INLINE_ATTR static inline __attribute__((always_inline))
+#ifndef __aligned
+#define __aligned(x) __attribute__((aligned(x)))
+#endif
+
+#endif // esp_attr.h
@@ -0,0 +1,19 @@
+// Minimal esp-idf esp_log.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef ESP_LOG_H
+#define ESP_LOG_H
+
+#include <stdio.h> // fprintf
+
+extern int esp_log_verbose;
+
+#define ESP_LOGW(tag, fmt, ...) do {                                    \
+        if (esp_log_verbose)                                            \
+            fprintf(stderr, "W %s: " fmt "\n", tag, ##__VA_ARGS__);     \
+    } while (0)
+#define ESP_LOGI(tag, fmt, ...) do { (void)(tag); } while (0)
+
+#endif // esp_log.h
@@ -0,0 +1,16 @@
+// Minimal esp-idf esp_ota_ops.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef ESP_OTA_OPS_H
+#define ESP_OTA_OPS_H
+
+#include "esp_partition.h" // esp_partition_t
+
+const esp_partition_t *esp_ota_get_next_update_partition(
+    const esp_partition_t *start_from);
+int esp_ota_set_boot_partition(const esp_partition_t *partition);
+const esp_partition_t *esp_ota_get_running_partition(void);
+
+#endif // esp_ota_ops.h
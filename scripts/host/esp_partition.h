@@ -0,0 +1,32 @@
+// Minimal esp-idf esp_partition.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef ESP_PARTITION_H
+#define ESP_PARTITION_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t
+
+typedef struct {
+    uint32_t address, size;
+    const char *label;
+} esp_partition_t;
+
+enum { ESP_PARTITION_TYPE_APP, ESP_PARTITION_TYPE_DATA };
+enum { ESP_PARTITION_SUBTYPE_DATA_SPIFFS = 0x82 };
+
+// The host tool provides the partitions and their contents
+const esp_partition_t *esp_partition_find_first(int type, int subtype
+                                                , const char *label);
+int esp_partition_read(const esp_partition_t *partition, size_t src_offset
+                       , void *dst, size_t size);
+int esp_partition_write(const esp_partition_t *partition, size_t dst_offset
+                        , const void *src, size_t size);
+int esp_partition_erase_range(const esp_partition_t *partition
+                              , size_t offset, size_t size);
+int esp_partition_get_sha256(const esp_partition_t *partition
+                             , uint8_t *sha_256);
+
+#endif // esp_partition.h
@@ -0,0 +1,29 @@
+// Minimal esp-idf esp_sleep.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef ESP_SLEEP_H
+#define ESP_SLEEP_H
+
+#include <stdint.h> // uint64_t
+
+typedef enum {
+    ESP_PD_DOMAIN_RTC_PERIPH, ESP_PD_DOMAIN_RTC_SLOW_MEM,
+    ESP_PD_DOMAIN_RTC_FAST_MEM, ESP_PD_DOMAIN_XTAL, ESP_PD_DOMAIN_MAX
+} esp_sleep_pd_domain_t;
+typedef enum {
+    ESP_PD_OPTION_OFF, ESP_PD_OPTION_ON, ESP_PD_OPTION_AUTO
+} esp_sleep_pd_option_t;
+enum { ESP_SLEEP_WAKEUP_UNDEFINED, ESP_SLEEP_WAKEUP_TIMER = 4 };
+
+int esp_sleep_get_wakeup_cause(void);
+int esp_sleep_enable_timer_wakeup(uint64_t time_in_us);
+int esp_sleep_pd_config(esp_sleep_pd_domain_t domain
+                        , esp_sleep_pd_option_t option);
+void esp_deep_sleep_disable_rom_logging(void);
+void esp_deep_sleep_start(void);
+void esp_default_wake_deep_sleep(void);
+void esp_wake_deep_sleep(void);
+
+#endif // esp_sleep.h
@@ -0,0 +1,18 @@
+// Minimal esp-idf esp_system.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef ESP_SYSTEM_H
+#define ESP_SYSTEM_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+
+typedef enum { ESP_MAC_WIFI_STA } esp_mac_type_t;
+
+int esp_read_mac(uint8_t *mac, esp_mac_type_t type);
+void esp_restart(void);
+void esp_fill_random(void *buf, size_t len);
+
+#endif // esp_system.h
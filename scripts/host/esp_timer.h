@@ -0,0 +1,13 @@
+// Minimal esp-idf esp_timer.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef ESP_TIMER_H
+#define ESP_TIMER_H
+
+#include <stdint.h> // int64_t
+
+int64_t esp_timer_get_time(void);
+
+#endif // esp_timer.h
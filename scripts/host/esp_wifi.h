@@ -0,0 +1,11 @@
+// Minimal esp-idf esp_wifi.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef ESP_WIFI_H
+#define ESP_WIFI_H
+
+int esp_wifi_stop(void);
+
+#endif // esp_wifi.h
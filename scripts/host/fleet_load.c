@@ -0,0 +1,826 @@
+// Load test an MQTT broker with a simulated fleet of devices
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This tool compiles the firmware's measurement record code and the
+// pipelined publisher on a Linux host and uses them to simulate a
+// fleet of devices uploading to a broker. Build it with something like:
+//   gcc -O2 -Wall -pthread -ffunction-sections -Wl,--gc-sections
+//     -I scripts/host -I fw/main -o /tmp/fleet_load
+//     scripts/host/fleet_load.c fw/main/datalog.c fw/main/mqttpub.c
+//     fw/main/deepsleep.c fw/main/bme280.c fw/main/battery.c
+//     fw/main/timing.c
+// (the linker discards the firmware code that accesses hardware) and
+// run it against a local broker with something like:
+//   /tmp/fleet_load -d 5000 -i 60 -t 120 mqtt://localhost
+// Each upload follows the mqtt_start() sequence of the built-in
+// publisher: connect, subscribe to the ota topic, publish an empty qos
+// 1 message to it, publish the pending records (retained, qos 1) to
+// the data topic, wait for all responses, and disconnect. The -b option
+// instead times single uploads of 1, 10, and 100 records, both with the
+// pipelined requests and with the requests sent one at a time in the
+// order of the esp-idf mqtt client:
+//   /tmp/fleet_load -b 50 -c mqtt://localhost
+
+#include <errno.h> // errno
+#include <netinet/in.h> // struct sockaddr_in
+#include <pthread.h> // pthread_create
+#include <stdio.h> // printf
+#include <stdlib.h> // qsort
+#include <string.h> // memcmp
+#include <time.h> // clock_gettime
+#include <unistd.h> // getopt
+#include "datalog.h" // datalog_append
+#include "deepsleep.h" // deepsleep_init
+#include "mqttpub.h" // mqttpub_connect
+#include "timing.h" // timing_note
+
+int esp_log_verbose;
+
+#define MAX_RECORDS 128
+#define FILL_RECORDS 16
+#define AWAKE_US 250000
+
+static const char *broker_url;
+static int records = 3, timeout_ms = 5000;
+static double upload_interval = 900., jitter = .1;
+
+
+/****************************************************************
+ * Host environment
+ ****************************************************************/
+
+// The firmware reads the esp timer when noting wake phase timings
+static int64_t sim_timer;
+
+int64_t
+esp_timer_get_time(void)
+{
+    return sim_timer;
+}
+
+// deepsleep_init() is used to note the wake time of each upload (the
+// deep sleep task it creates is never run)
+int
+xTaskCreate(void (*fn)(void *), const char *name, uint32_t stack
+            , void *param, int prio, void **handle)
+{
+    return 1;
+}
+
+int
+esp_sleep_get_wakeup_cause(void)
+{
+    return 0;
+}
+
+uint32_t
+ulTaskNotifyTake(int clear, uint32_t ticks)
+{
+    abort();
+}
+
+int
+esp_sleep_enable_timer_wakeup(uint64_t time_in_us)
+{
+    abort();
+}
+
+int
+esp_wifi_stop(void)
+{
+    abort();
+}
+
+void
+esp_deep_sleep_disable_rom_logging(void)
+{
+    abort();
+}
+
+void
+esp_deep_sleep_start(void)
+{
+    abort();
+}
+
+static double
+get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * .000000001;
+}
+
+// Look up the broker once (as the firmware does with a cached address)
+static int
+cached_resolve(const char *host, int port, struct sockaddr_in *sin)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static struct sockaddr_in cache;
+    static int have_cache;
+    pthread_mutex_lock(&lock);
+    int ret = 0;
+    if (!have_cache) {
+        ret = mqttpub_resolve(host, port, &cache);
+        have_cache = !ret;
+    }
+    *sin = cache;
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+
+/****************************************************************
+ * Simulated devices
+ ****************************************************************/
+
+// Record layouts of fw/main/deepsleep.c and fw/main/bme280.c
+struct appwake_s {
+    uint64_t waketime, sleeptime;
+};
+
+struct bme280_s {
+    float temperature, pressure, humidity;
+};
+
+struct device_s {
+    char client_id[32], data_topic[48], ota_topic[48];
+    double next_upload;
+    unsigned int seed;
+    float temperature, humidity;
+    int uploaded;
+};
+
+static float
+random_float(struct device_s *d, float min, float max)
+{
+    return min + (max - min) * rand_r(&d->seed) / (float)RAND_MAX;
+}
+
+static void
+device_init(struct device_s *d, int id, const char *prefix)
+{
+    snprintf(d->client_id, sizeof(d->client_id), "%s-%05d", prefix, id);
+    snprintf(d->data_topic, sizeof(d->data_topic), "%s/data", d->client_id);
+    snprintf(d->ota_topic, sizeof(d->ota_topic), "%s/ota_url"
+             , d->client_id);
+    d->seed = id;
+    d->next_upload = random_float(d, 0., upload_interval);
+    d->temperature = random_float(d, 15., 25.);
+    d->humidity = random_float(d, 30., 60.);
+}
+
+// The firmware's measurement log is global, so uploads are formatted
+// one at a time
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Add records (numbered first to first+count-1 of the records taken
+// since the device's last upload) to the log
+static void
+fill_log(struct device_s *d, uint64_t waketime, int first, int count)
+{
+    uint64_t spacing = upload_interval * 1000000. / records;
+    for (int i=first; i<first+count; i++) {
+        datalog_init();
+        struct appwake_s aw;
+        aw.waketime = waketime - (records - 1 - i) * spacing;
+        aw.sleeptime = aw.waketime - AWAKE_US;
+        datalog_append(&appwake_info, &aw);
+        float battery = random_float(d, 3.0, 3.3);
+        datalog_append(&battery_info, &battery);
+        d->temperature += random_float(d, -.2, .2);
+        d->humidity += random_float(d, -.5, .5);
+        struct bme280_s b = {
+            .temperature = d->temperature, .humidity = d->humidity,
+            .pressure = random_float(d, 1000., 1020.),
+        };
+        datalog_append(&bme280_info, &b);
+        sim_timer = random_float(d, 40000., 60000.);
+        timing_note(TP_APP_MAIN, 0);
+        sim_timer += random_float(d, 10000., 30000.);
+        timing_note(TP_SENSE_DONE, 0);
+        datalog_finalize();
+    }
+}
+
+struct upload_stream_s {
+    struct datalog_stream_s ds;
+    struct mqttpub_s *mp;
+};
+
+// Grow the mqttpub transmit buffer (as done in fw/main/mqtt.c)
+static int
+upload_reserve(struct datalog_stream_s *ds, int len)
+{
+    struct upload_stream_s *us = (struct upload_stream_s *)ds;
+    us->mp->out_len = ds->len;
+    int ret = mqttpub_reserve(us->mp, len);
+    ds->buf = (char *)us->mp->out;
+    ds->size = us->mp->out_size;
+    return ret;
+}
+
+// Format the device's records into PUBLISH requests (returns count).
+// The records are added to the log in groups so that large uploads do
+// not overflow it. With flush_each, every PUBLISH is sent in its own
+// network write.
+static int
+queue_records(struct device_s *d, struct mqttpub_s *mp, int flush_each)
+{
+    struct upload_stream_s us = {
+        .ds = { .reserve = upload_reserve }, .mp = mp,
+    };
+    int count = 0;
+    pthread_mutex_lock(&log_lock);
+    // Note the wake time (the record with this time is the "latest")
+    deepsleep_init();
+    uint64_t waketime = deepsleep_get_wake_time();
+    for (int first=0; first<records; first+=FILL_RECORDS) {
+        int pos = -1, fill = records - first;
+        if (fill > FILL_RECORDS)
+            fill = FILL_RECORDS;
+        fill_log(d, waketime, first, fill);
+        while (count < MAX_RECORDS) {
+            if (mqttpub_publish_start(mp, d->data_topic, 1, 1) < 0)
+                break;
+            us.ds.buf = (char *)mp->out;
+            us.ds.len = mp->out_len;
+            us.ds.size = mp->out_size;
+            int ret = datalog_format_stream(&pos, &us.ds);
+            if (ret <= 0) {
+                mqttpub_publish_cancel(mp);
+                if (ret < 0)
+                    break;
+                continue;
+            }
+            mp->out_len = us.ds.len;
+            if (mqttpub_publish_end(mp)) {
+                mqttpub_publish_cancel(mp);
+                break;
+            }
+            count++;
+            if (flush_each && mqttpub_flush(mp))
+                break;
+        }
+        while (!datalog_is_end(-1))
+            datalog_expire();
+    }
+    pthread_mutex_unlock(&log_lock);
+    return count;
+}
+
+enum {
+    UR_OK, UR_CONNECT_FAIL, UR_REFUSED, UR_TIMEOUT, UR_ERROR, UR_MAX
+};
+
+static const char * const result_names[UR_MAX] = {
+    "completed", "connect errors", "refused", "timeouts", "errors",
+};
+
+// Perform an upload (as mqtt_start() does with the built-in publisher).
+// In stepwise mode the requests are instead sent in the order the
+// esp-idf mqtt client sends them: each in its own network write, the
+// records and the ota subscription once the CONNACK arrives, and the
+// ota check once the SUBACK arrives.
+static int
+run_upload(struct device_s *d, int stepwise, double *platency, int *pcount)
+{
+    struct mqttpub_s mp;
+    double start = get_time(), end = start + timeout_ms * .001;
+    int ret = mqttpub_connect(&mp, broker_url, "", 1, timeout_ms
+                              , cached_resolve);
+    if (ret) {
+        mqttpub_close(&mp);
+        return UR_CONNECT_FAIL;
+    }
+    int ota_id = -1, first_id = 0, count = 0, acked_count = 0;
+    if (!stepwise) {
+        mqttpub_subscribe(&mp, d->ota_topic, 1);
+        ota_id = mqttpub_publish(&mp, d->ota_topic, "", 0, 1, 0);
+        first_id = mp.next_id + 1;
+        count = queue_records(d, &mp, 0);
+    }
+    uint8_t acked[MAX_RECORDS] = { 0 };
+    ret = mqttpub_flush(&mp);
+    int res = UR_ERROR, connected = 0, ota_acked = 0, ota_checked = 0;
+    while (!ret && (!connected || !ota_acked || !ota_checked
+                    || acked_count < count)) {
+        if (get_time() > end) {
+            ret = -1;
+            break;
+        }
+        struct mqttpub_msg_s msg;
+        errno = 0;
+        ret = mqttpub_read(&mp, &msg);
+        if (ret)
+            break;
+        switch (msg.type) {
+        case MQTTPUB_CONNACK:
+            if (msg.id) {
+                res = UR_REFUSED;
+                ret = -1;
+            }
+            connected = 1;
+            if (stepwise && !ret) {
+                mqttpub_subscribe(&mp, d->ota_topic, 1);
+                ret = mqttpub_flush(&mp);
+                first_id = mp.next_id + 1;
+                count = queue_records(d, &mp, 1);
+            }
+            break;
+        case MQTTPUB_SUBACK:
+            if (stepwise) {
+                ota_id = mqttpub_publish(&mp, d->ota_topic, "", 0, 1, 0);
+                ret = mqttpub_flush(&mp);
+            }
+            break;
+        case MQTTPUB_PUBACK: {
+            int idx = (uint16_t)(msg.id - first_id);
+            if (msg.id == ota_id)
+                ota_acked = 1;
+            else if (idx < count && !acked[idx]) {
+                acked[idx] = 1;
+                acked_count++;
+            }
+            break;
+        }
+        case MQTTPUB_PUBLISH:
+            if (msg.qos)
+                mqttpub_puback(&mp, msg.id);
+            if (msg.topic_len == strlen(d->ota_topic)
+                && !memcmp(msg.topic, d->ota_topic, msg.topic_len))
+                ota_checked = 1;
+            ret = mqttpub_flush(&mp);
+            break;
+        }
+    }
+    if (!ret) {
+        *platency = get_time() - start;
+        *pcount = count;
+        res = UR_OK;
+    } else if (res != UR_REFUSED && (errno == EAGAIN || errno == EWOULDBLOCK
+                                     || get_time() > end)) {
+        res = UR_TIMEOUT;
+    }
+    mqttpub_close(&mp);
+    return res;
+}
+
+
+/****************************************************************
+ * Upload scheduling
+ ****************************************************************/
+
+// Devices are kept in a heap ordered by their next upload time
+static struct device_s **heap;
+static int heap_count;
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+static double start_time, end_time;
+
+static void
+heap_push(struct device_s *d)
+{
+    int pos = heap_count++;
+    while (pos) {
+        int parent = (pos - 1) / 2;
+        if (heap[parent]->next_upload <= d->next_upload)
+            break;
+        heap[pos] = heap[parent];
+        pos = parent;
+    }
+    heap[pos] = d;
+}
+
+static struct device_s *
+heap_pop(void)
+{
+    struct device_s *top = heap[0], *last = heap[--heap_count];
+    int pos = 0;
+    for (;;) {
+        int child = pos * 2 + 1;
+        if (child >= heap_count)
+            break;
+        if (child + 1 < heap_count
+            && heap[child + 1]->next_upload < heap[child]->next_upload)
+            child++;
+        if (last->next_upload <= heap[child]->next_upload)
+            break;
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = last;
+    return top;
+}
+
+// Wait for the next due upload (returns NULL at the end of the test)
+static struct device_s *
+next_device(double *pdelay)
+{
+    pthread_mutex_lock(&sched_lock);
+    struct device_s *d = NULL;
+    for (;;) {
+        if (!heap_count)
+            break;
+        double due = start_time + heap[0]->next_upload, now = get_time();
+        if (due >= end_time)
+            break;
+        if (due <= now) {
+            d = heap_pop();
+            *pdelay = now - due;
+            break;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        double wait = due - now < .1 ? due - now : .1;
+        long nsec = ts.tv_nsec + (long)(wait * 1000000000.);
+        ts.tv_sec += nsec / 1000000000;
+        ts.tv_nsec = nsec % 1000000000;
+        pthread_cond_timedwait(&sched_cond, &sched_lock, &ts);
+    }
+    pthread_mutex_unlock(&sched_lock);
+    return d;
+}
+
+static void
+reschedule(struct device_s *d)
+{
+    double j = upload_interval * jitter;
+    d->next_upload += upload_interval + random_float(d, -j, j);
+    pthread_mutex_lock(&sched_lock);
+    heap_push(d);
+    pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+
+/****************************************************************
+ * Statistics
+ ****************************************************************/
+
+struct samples_s {
+    double *values;
+    int count, size;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int results[UR_MAX], publishes;
+    struct samples_s latency, delay;
+} stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void
+add_sample(struct samples_s *s, double v)
+{
+    if (s->count >= s->size) {
+        s->size = s->size ? s->size * 2 : 1024;
+        s->values = realloc(s->values, s->size * sizeof(s->values[0]));
+        if (!s->values) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    s->values[s->count++] = v;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double da = *(double*)a, db = *(double*)b;
+    return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+static double
+percentile(struct samples_s *s, double p)
+{
+    if (!s->count)
+        return 0.;
+    int idx = s->count * p;
+    return s->values[idx < s->count ? idx : s->count - 1];
+}
+
+static void *
+worker(void *arg)
+{
+    for (;;) {
+        double delay, latency = 0.;
+        struct device_s *d = next_device(&delay);
+        if (!d)
+            break;
+        int count = 0, res = run_upload(d, 0, &latency, &count);
+        pthread_mutex_lock(&stats.lock);
+        stats.results[res]++;
+        add_sample(&stats.delay, delay);
+        if (res == UR_OK) {
+            add_sample(&stats.latency, latency);
+            stats.publishes += count;
+            d->uploaded = 1;
+        }
+        pthread_mutex_unlock(&stats.lock);
+        reschedule(d);
+    }
+    return NULL;
+}
+
+
+/****************************************************************
+ * Broker monitor
+ ****************************************************************/
+
+// Mosquitto periodically publishes its statistics to $SYS topics
+#define SYS_RETAINED "$SYS/broker/retained messages/count"
+#define SYS_HEAP "$SYS/broker/heap/current"
+
+static struct {
+    pthread_mutex_t lock;
+    int stop, updates;
+    long retained_first, retained_last, heap_first, heap_last;
+} monitor = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .retained_first = -1, .retained_last = -1,
+    .heap_first = -1, .heap_last = -1,
+};
+
+static void
+note_sys(struct mqttpub_msg_s *msg, long *pfirst, long *plast)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.*s", msg->data_len, msg->data);
+    pthread_mutex_lock(&monitor.lock);
+    *plast = atol(buf);
+    if (*pfirst < 0)
+        *pfirst = *plast;
+    monitor.updates++;
+    pthread_mutex_unlock(&monitor.lock);
+}
+
+static int
+topic_is(struct mqttpub_msg_s *msg, const char *topic)
+{
+    return (msg->topic_len == strlen(topic)
+            && !memcmp(msg->topic, topic, msg->topic_len));
+}
+
+static void *
+monitor_task(void *arg)
+{
+    struct mqttpub_s mp;
+    if (mqttpub_connect(&mp, broker_url, "fleet_load-monitor", 1, 500
+                        , cached_resolve)) {
+        mqttpub_close(&mp);
+        return NULL;
+    }
+    mqttpub_subscribe(&mp, SYS_RETAINED, 0);
+    mqttpub_subscribe(&mp, SYS_HEAP, 0);
+    if (mqttpub_flush(&mp)) {
+        mqttpub_close(&mp);
+        return NULL;
+    }
+    while (!monitor.stop) {
+        struct mqttpub_msg_s msg;
+        errno = 0;
+        if (mqttpub_read(&mp, &msg)) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            break;
+        }
+        if (msg.type != MQTTPUB_PUBLISH)
+            continue;
+        if (topic_is(&msg, SYS_RETAINED))
+            note_sys(&msg, &monitor.retained_first, &monitor.retained_last);
+        else if (topic_is(&msg, SYS_HEAP))
+            note_sys(&msg, &monitor.heap_first, &monitor.heap_last);
+    }
+    mqttpub_close(&mp);
+    return NULL;
+}
+
+// Wait for the next $SYS update from the broker (so the final values
+// include the last uploads)
+static void
+wait_monitor(double timeout)
+{
+    pthread_mutex_lock(&monitor.lock);
+    int updates = monitor.updates;
+    pthread_mutex_unlock(&monitor.lock);
+    if (updates <= 0)
+        return;
+    double end = get_time() + timeout;
+    while (get_time() < end) {
+        pthread_mutex_lock(&monitor.lock);
+        int cur = monitor.updates;
+        pthread_mutex_unlock(&monitor.lock);
+        if (cur != updates)
+            return;
+        usleep(100000);
+    }
+}
+
+// Remove the retained data messages of the simulated devices
+static int
+clear_retained(struct device_s *devices, int count)
+{
+    struct mqttpub_s mp;
+    int ret = mqttpub_connect(&mp, broker_url, "", 1, timeout_ms
+                              , cached_resolve);
+    int id = 0;
+    for (int i=0; !ret && i<count; i++)
+        if (devices[i].uploaded)
+            ret = mqttpub_publish(&mp, devices[i].data_topic, "", 0, 0, 1);
+    if (!ret)
+        id = mqttpub_publish(&mp, devices[0].ota_topic, "", 0, 1, 0);
+    if (!ret)
+        ret = mqttpub_flush(&mp);
+    // The broker handles requests in order - wait for the last ack
+    while (!ret) {
+        struct mqttpub_msg_s msg;
+        ret = mqttpub_read(&mp, &msg);
+        if (!ret && msg.type == MQTTPUB_PUBACK && msg.id == id)
+            break;
+    }
+    mqttpub_close(&mp);
+    return ret;
+}
+
+
+/****************************************************************
+ * Upload latency comparison
+ ****************************************************************/
+
+// Time individual uploads of a single device for several upload sizes
+// with both the pipelined and the stepwise request order
+static int
+compare_uploads(const char *prefix, int uploads, int clear)
+{
+    static const int sizes[] = { 1, 10, 100 };
+    static const char * const modes[] = { "pipelined", "stepwise" };
+    struct device_s d;
+    device_init(&d, 0, prefix);
+    printf("Connect to last puback of %d uploads (one at a time):\n"
+           , uploads);
+    printf("records  %-28s%s\n", modes[0], modes[1]);
+    int failures = 0;
+    for (int i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+        records = sizes[i];
+        printf("%7d", records);
+        for (int stepwise=0; stepwise<2; stepwise++) {
+            struct samples_s s = { 0 };
+            for (int j=0; j<uploads; j++) {
+                double latency;
+                int count;
+                int res = run_upload(&d, stepwise, &latency, &count);
+                if (res != UR_OK || count != records)
+                    failures++;
+                else
+                    add_sample(&s, latency);
+            }
+            qsort(s.values, s.count, sizeof(double), cmp_double);
+            printf("  p50 %6.1fms p90 %6.1fms  ", percentile(&s, .5) * 1000.
+                   , percentile(&s, .9) * 1000.);
+            free(s.values);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    if (failures)
+        printf("%d uploads failed\n", failures);
+    d.uploaded = 1;
+    if (clear && clear_retained(&d, 1)) {
+        fprintf(stderr, "Unable to clear retained messages\n");
+        return 1;
+    }
+    return failures != 0;
+}
+
+
+/****************************************************************
+ * Startup
+ ****************************************************************/
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] <broker url>\n"
+            "  -d <devices>   number of simulated devices (1000)\n"
+            "  -n <records>   records per upload (3)\n"
+            "  -i <seconds>   time between uploads of a device (900)\n"
+            "  -j <fraction>  random jitter of the upload interval (0.1)\n"
+            "  -t <seconds>   test duration (60)\n"
+            "  -w <workers>   maximum concurrent uploads (64)\n"
+            "  -T <ms>        upload timeout (5000)\n"
+            "  -p <prefix>    client id and topic prefix (fleet_load)\n"
+            "  -c             clear the retained messages after the test\n"
+            "  -b <uploads>   compare the upload latency of 1, 10, and 100\n"
+            "                 records with both request orders\n"
+            , prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    int device_count = 1000, workers = 64, clear = 0, compare = 0;
+    double duration = 60.;
+    const char *prefix = "fleet_load";
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:i:j:t:w:T:p:cb:")) != -1) {
+        switch (opt) {
+        case 'd': device_count = atoi(optarg); break;
+        case 'n': records = atoi(optarg); break;
+        case 'i': upload_interval = atof(optarg); break;
+        case 'j': jitter = atof(optarg); break;
+        case 't': duration = atof(optarg); break;
+        case 'w': workers = atoi(optarg); break;
+        case 'T': timeout_ms = atoi(optarg); break;
+        case 'p': prefix = optarg; break;
+        case 'c': clear = 1; break;
+        case 'b': compare = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || device_count < 1 || workers < 1
+        || records < 1 || records > MAX_RECORDS || upload_interval <= 0.)
+        usage(argv[0]);
+    broker_url = argv[optind];
+    if (compare > 0)
+        return compare_uploads(prefix, compare, clear);
+
+    struct device_s *devices = calloc(device_count, sizeof(*devices));
+    heap = calloc(device_count, sizeof(*heap));
+    pthread_t *threads = calloc(workers, sizeof(*threads));
+    if (!devices || !heap || !threads) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i=0; i<device_count; i++) {
+        device_init(&devices[i], i, prefix);
+        heap_push(&devices[i]);
+    }
+    printf("Simulating %d devices (%d records per upload every %.0fs"
+           " +/- %.0f%%) for %.0fs with %d workers\n", device_count
+           , records, upload_interval, jitter * 100., duration, workers);
+    fflush(stdout);
+
+    pthread_t monitor_thread;
+    pthread_create(&monitor_thread, NULL, monitor_task, NULL);
+    usleep(500000);
+    start_time = get_time();
+    end_time = start_time + duration;
+    for (int i=0; i<workers; i++)
+        pthread_create(&threads[i], NULL, worker, NULL);
+    for (int i=0; i<workers; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = get_time() - start_time;
+    int topics = 0;
+    for (int i=0; i<device_count; i++)
+        topics += devices[i].uploaded;
+    wait_monitor(15.);
+
+    // Report
+    int total = 0;
+    for (int i=0; i<UR_MAX; i++)
+        total += stats.results[i];
+    printf("Uploads: %d started", total);
+    for (int i=0; i<UR_MAX; i++)
+        if (i == UR_OK || stats.results[i])
+            printf(", %d %s", stats.results[i], result_names[i]);
+    printf("\n");
+    int ok = stats.results[UR_OK];
+    printf("Accept rate: %.1f%% (%.1f uploads/s, %.1f data publishes/s)\n"
+           , total ? 100. * ok / total : 0., ok / elapsed
+           , stats.publishes / elapsed);
+    qsort(stats.latency.values, stats.latency.count, sizeof(double)
+          , cmp_double);
+    qsort(stats.delay.values, stats.delay.count, sizeof(double)
+          , cmp_double);
+    printf("Connect to last puback: p50 %.1fms p99 %.1fms max %.1fms\n"
+           , percentile(&stats.latency, .5) * 1000.
+           , percentile(&stats.latency, .99) * 1000.
+           , percentile(&stats.latency, 1.) * 1000.);
+    printf("Upload start delay: p50 %.1fms p99 %.1fms (high values mean"
+           " too few workers)\n", percentile(&stats.delay, .5) * 1000.
+           , percentile(&stats.delay, .99) * 1000.);
+    pthread_mutex_lock(&monitor.lock);
+    if (monitor.retained_first >= 0)
+        printf("Broker retained messages: %ld -> %ld (%+ld, %d device data"
+               " topics)\n", monitor.retained_first, monitor.retained_last
+               , monitor.retained_last - monitor.retained_first, topics);
+    else
+        printf("Broker retained messages: not reported (%d device data"
+               " topics)\n", topics);
+    if (monitor.heap_first >= 0)
+        printf("Broker heap: %ld -> %ld bytes (%+ld)\n", monitor.heap_first
+               , monitor.heap_last, monitor.heap_last - monitor.heap_first);
+    monitor.stop = 1;
+    pthread_mutex_unlock(&monitor.lock);
+    pthread_join(monitor_thread, NULL);
+
+    if (clear && clear_retained(devices, device_count)) {
+        fprintf(stderr, "Unable to clear retained messages\n");
+        return 1;
+    }
+    return 0;
+}
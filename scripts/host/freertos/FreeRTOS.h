@@ -0,0 +1,19 @@
+// Minimal esp-idf freertos/FreeRTOS.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+#include <stdint.h> // uint32_t
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+#define portTICK_PERIOD_MS 10
+#define portTICK_RATE_MS portTICK_PERIOD_MS
+#define portMAX_DELAY 0xffffffff
+#define pdFALSE 0
+#define pdTRUE 1
+
+#endif // FreeRTOS.h
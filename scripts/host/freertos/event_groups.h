@@ -0,0 +1,14 @@
+// Minimal esp-idf freertos/event_groups.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef EVENT_GROUPS_H
+#define EVENT_GROUPS_H
+
+#include "FreeRTOS.h" // BaseType_t
+#include "task.h" // vTaskDelay
+
+typedef void *EventGroupHandle_t;
+
+#endif // event_groups.h
@@ -0,0 +1,20 @@
+// Minimal esp-idf freertos/task.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef TASK_H
+#define TASK_H
+
+#include <stdint.h> // uint32_t
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack
+                       , void *param, int prio, TaskHandle_t *handle);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+BaseType_t xTaskNotifyGive(TaskHandle_t handle);
+void vTaskDelay(TickType_t ticks);
+
+#endif // task.h
@@ -0,0 +1,47 @@
+// Minimal mbedtls/sha256.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef SHA256_H
+#define SHA256_H
+
+// Wraps the host openssl library (link with -lcrypto)
+
+#include <stddef.h> // size_t
+#define OPENSSL_API_COMPAT 0x10100000L
+#include <openssl/sha.h> // SHA256_Init
+
+typedef SHA256_CTX mbedtls_sha256_context;
+
+static inline void
+mbedtls_sha256_init(mbedtls_sha256_context *ctx)
+{
+}
+
+static inline void
+mbedtls_sha256_free(mbedtls_sha256_context *ctx)
+{
+}
+
+static inline int
+mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx, int is224)
+{
+    return !SHA256_Init(ctx);
+}
+
+static inline int
+mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx
+                          , const unsigned char *input, size_t ilen)
+{
+    return !SHA256_Update(ctx, input, ilen);
+}
+
+static inline int
+mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx
+                          , unsigned char output[32])
+{
+    return !SHA256_Final(output, ctx);
+}
+
+#endif // sha256.h
@@ -0,0 +1,12 @@
+// Minimal esp-idf mqtt_client.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef MQTT_CLIENT_H
+#define MQTT_CLIENT_H
+
+// Host tools only build the pipelined publisher (CONFIG_MQTT_LITE)
+typedef void *esp_mqtt_client_handle_t;
+
+#endif // mqtt_client.h
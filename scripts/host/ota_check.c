@@ -0,0 +1,270 @@
+// Decode check of compressed and delta ota images
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This tool compiles fw/main/otaimage.c on a Linux host and decodes an
+// image generated by scripts/ota_image.py into a file-backed
+// partition. Build and run it with something like:
+//   gcc -O2 -Wall -I scripts/host -I fw/main -o /tmp/ota_check
+//     scripts/host/ota_check.c fw/main/otaimage.c -lz -lcrypto
+//   /tmp/ota_check -b old.bin delta.img fw/build/humidwifi.bin
+// The image is fed to the decoder in randomly sized pieces (as they
+// arrive from the http client) and the SHA-256 of the resulting
+// partition is compared to the SHA-256 of the firmware file. The
+// decoder must then reject the image with each bit of its header
+// flipped and with its body corrupted at random positions (from a
+// fixed seed unless -s is given, so that a run is repeatable).
+
+#include <fcntl.h> // open
+#include <stdio.h> // printf
+#include <stdlib.h> // rand
+#include <string.h> // memcmp
+#include <time.h> // clock_gettime
+#include <unistd.h> // pwrite
+#include <mbedtls/sha256.h> // mbedtls_sha256_update_ret
+#include "otaimage.h" // otaimage_feed
+
+int esp_log_verbose;
+
+// Size of the app partitions (see fw/partitions.csv)
+#define PARTITION_SIZE 0x190000
+// Size of the image header (see struct otaimage_header_s)
+#define HEADER_SIZE 80
+
+
+/****************************************************************
+ * File-backed partitions
+ ****************************************************************/
+
+struct file_io_s {
+    struct otaimage_io_s io; // must be first
+    int base_fd, target_fd;
+    uint32_t write_pos, image_size;
+};
+
+static int
+file_begin(struct otaimage_io_s *io, uint32_t image_size)
+{
+    struct file_io_s *f = (struct file_io_s *)io;
+    if (image_size > PARTITION_SIZE)
+        return -1;
+    // Erase the partition
+    static uint8_t erased[PARTITION_SIZE];
+    memset(erased, 0xff, sizeof(erased));
+    if (pwrite(f->target_fd, erased, sizeof(erased), 0) != sizeof(erased))
+        return -1;
+    f->write_pos = 0;
+    f->image_size = image_size;
+    return 0;
+}
+
+static int
+file_write(struct otaimage_io_s *io, const uint8_t *buf, int len)
+{
+    struct file_io_s *f = (struct file_io_s *)io;
+    if (f->write_pos + len > PARTITION_SIZE)
+        return -1;
+    if (pwrite(f->target_fd, buf, len, f->write_pos) != len)
+        return -1;
+    f->write_pos += len;
+    return 0;
+}
+
+static int
+file_read_base(struct otaimage_io_s *io, uint32_t offset
+               , uint8_t *buf, int len)
+{
+    struct file_io_s *f = (struct file_io_s *)io;
+    if (offset + len > PARTITION_SIZE)
+        return -1;
+    if (pread(f->base_fd, buf, len, offset) != len)
+        return -1;
+    return 0;
+}
+
+// Create a partition file (containing the contents of 'filename')
+static int
+create_partition(const char *filename)
+{
+    char tmpname[] = "/tmp/ota_checkXXXXXX";
+    int fd = mkstemp(tmpname);
+    if (fd < 0)
+        return -1;
+    unlink(tmpname);
+    static uint8_t data[PARTITION_SIZE];
+    memset(data, 0xff, sizeof(data));
+    if (filename) {
+        FILE *f = fopen(filename, "rb");
+        if (!f)
+            return -1;
+        fread(data, 1, sizeof(data), f);
+        fclose(f);
+    }
+    if (pwrite(fd, data, sizeof(data), 0) != sizeof(data))
+        return -1;
+    return fd;
+}
+
+
+/****************************************************************
+ * Decode check
+ ****************************************************************/
+
+static uint8_t *
+read_file(const char *filename, int *plen)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    int len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = malloc(len);
+    if (data && fread(data, 1, len, f) != len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *plen = len;
+    return data;
+}
+
+static void
+sha256(int fd, const uint8_t *data, uint32_t len, uint8_t *digest)
+{
+    static uint8_t buf[PARTITION_SIZE];
+    if (!data) {
+        pread(fd, buf, len, 0);
+        data = buf;
+    }
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+    mbedtls_sha256_update_ret(&sha, data, len);
+    mbedtls_sha256_finish_ret(&sha, digest);
+    mbedtls_sha256_free(&sha);
+}
+
+// Decode an image - returns 0 if the decoder reports success
+static int
+decode(struct file_io_s *f, const uint8_t *image, int len)
+{
+    struct otaimage_s *oi = otaimage_alloc(&f->io);
+    if (!oi)
+        return -1;
+    int pos = 0, ret = 0;
+    while (pos < len && !ret) {
+        int n = 1 + rand() % 4096;
+        if (n > len - pos)
+            n = len - pos;
+        ret = otaimage_feed(oi, &image[pos], n);
+        pos += n;
+    }
+    if (!ret)
+        ret = otaimage_finish(oi);
+    otaimage_free(oi);
+    return ret;
+}
+
+static double
+get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * .000000001;
+}
+
+static void
+usage(const char *prog)
+{
+    printf("Usage: %s [-b base.bin] [-c corrupt_count] [-s seed]"
+           " <image> <firmware.bin>\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *base_file = NULL;
+    int corrupt_count = 100, seed = 1, c;
+    while ((c = getopt(argc, argv, "b:c:s:")) != -1) {
+        switch (c) {
+        case 'b': base_file = optarg; break;
+        case 'c': corrupt_count = atoi(optarg); break;
+        case 's': seed = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
+        usage(argv[0]);
+    srand(seed);
+    int image_len, fw_len;
+    uint8_t *image = read_file(argv[optind], &image_len);
+    uint8_t *fw = read_file(argv[optind + 1], &fw_len);
+    if (!image || !fw) {
+        printf("Unable to read input files\n");
+        return 1;
+    }
+    struct file_io_s f = {
+        .io = { .begin = file_begin, .write = file_write
+                , .read_base = file_read_base },
+        .base_fd = create_partition(base_file),
+        .target_fd = create_partition(NULL),
+    };
+    if (f.base_fd < 0 || f.target_fd < 0) {
+        printf("Unable to create partition files\n");
+        return 1;
+    }
+
+    // Decode image and compare the partition to the firmware
+    printf("Decoding %d byte image (seed %d)\n", image_len, seed);
+    double start = get_time();
+    int ret = decode(&f, image, image_len);
+    double elapsed = get_time() - start;
+    if (ret) {
+        printf("Decode failed\n");
+        return 1;
+    }
+    uint8_t fw_digest[32], part_digest[32];
+    sha256(-1, fw, fw_len, fw_digest);
+    sha256(f.target_fd, NULL, fw_len, part_digest);
+    if (f.image_size != fw_len
+        || memcmp(fw_digest, part_digest, sizeof(fw_digest)) != 0) {
+        printf("Partition does not match the firmware\n");
+        return 1;
+    }
+    printf("Decoded %d bytes in %.3fs (%.1f%% of firmware size)\n"
+           , fw_len, elapsed, 100. * image_len / fw_len);
+
+    // Check that every single bit flip in the header is rejected
+    int accepted = 0, hdr_len = HEADER_SIZE * 8;
+    for (int i=0; i<hdr_len; i++) {
+        image[i / 8] ^= 1 << (i % 8);
+        if (!decode(&f, image, image_len)) {
+            printf("Header bit flip at byte %d bit %d accepted\n"
+                   , i / 8, i % 8);
+            accepted++;
+        }
+        image[i / 8] ^= 1 << (i % 8);
+    }
+    // Check that images corrupted at random positions are rejected
+    for (int i=0; i<corrupt_count; i++) {
+        int pos = HEADER_SIZE + rand() % (image_len - HEADER_SIZE);
+        uint8_t orig = image[pos];
+        image[pos] ^= 1 << (rand() % 8);
+        if (!decode(&f, image, image_len))
+            accepted++;
+        image[pos] = orig;
+    }
+    if (accepted) {
+        printf("%d of %d corrupted images accepted\n"
+               , accepted, hdr_len + corrupt_count);
+        return 1;
+    }
+    printf("Rejected %d corrupted images (%d header bit flips)\n"
+           , hdr_len + corrupt_count, hdr_len);
+    printf("Decode check passed\n");
+    return 0;
+}
@@ -0,0 +1,484 @@
+// Check of firmware transfers over an mqtt connection
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This tool compiles the pipelined mqtt upload (fw/main/mqtt.c with
+// CONFIG_MQTT_LITE), the transfer code (fw/main/otamqtt.c), and the
+// built-in publisher (fw/main/mqttpub.c) on a Linux host and acts as a
+// device receiving an update offered by scripts/ota_publish.py. Build
+// and run it against a local broker with something like:
+//   gcc -O2 -Wall -I scripts/host -I fw/main -o /tmp/ota_mqtt_check
+//     scripts/host/ota_mqtt_check.c fw/main/mqttpub.c -lcrypto
+//   scripts/ota_publish.py --broker mqtt://localhost fw/build/humidwifi.bin &
+//   /tmp/ota_mqtt_check -n 300 mqtt://localhost fw/build/humidwifi.bin
+// Each simulated wake logs a few records and calls mqtt_start(), which
+// uploads them, checks the ota topic, and handles the chunk transfer.
+// The ota time limit of each wake is reached after a number of chunks
+// so that the next wake must resume the transfer. Chunks may also be
+// dropped to check that the publisher resends them. Every wake must
+// return success with its records acknowledged. The partition is
+// compared to the firmware file after the transfer completes, and the
+// firmware is then offered again (as if the device restarted into it
+// before the offer was cleared) to check that it is reported as
+// installed without another transfer. The topic prefix is "topic"
+// (the ota_publish.py default).
+
+#include <setjmp.h> // setjmp
+#include <stdio.h> // printf
+#include <stdlib.h> // rand
+#include <string.h> // memcmp
+#include <time.h> // clock_gettime
+#include <unistd.h> // getopt
+#include <mbedtls/sha256.h> // mbedtls_sha256_update_ret
+#include "esp_ota_ops.h" // esp_ota_set_boot_partition
+#include "mqttpub.h" // mqttpub_connect
+
+int esp_log_verbose;
+
+static const char *broker_url;
+#define CONFIG_MQTT_LITE 1
+#define CONFIG_BROKER_URL broker_url
+
+// The messages read and published by mqtt.c pass through the functions
+// below (see "Simulated device")
+static int check_read(struct mqttpub_s *m, struct mqttpub_msg_s *msg);
+static int check_publish(struct mqttpub_s *m, const char *topic
+                         , const void *data, int len, int qos, int retain);
+#define mqttpub_read check_read
+#define mqttpub_publish check_publish
+#include "mqtt.c" // mqtt_start
+#undef mqttpub_read
+#undef mqttpub_publish
+#define TAG OTAMQTT_TAG
+#include "otamqtt.c" // ota_state
+#undef TAG
+
+// Size of the app partitions (see fw/partitions.csv)
+#define PARTITION_SIZE 0x190000
+
+static int drop_percent, records_per_wake = 3;
+
+
+/****************************************************************
+ * Simulated flash partition
+ ****************************************************************/
+
+static uint8_t flash[PARTITION_SIZE];
+static const esp_partition_t running_partition = {
+    .address = 0x80000, .size = PARTITION_SIZE, .label = "ota_0",
+};
+static const esp_partition_t target_partition = {
+    .address = 0x210000, .size = PARTITION_SIZE, .label = "ota_1",
+};
+static int boot_set, erase_count;
+// Digest appended to the image in the running partition
+static uint8_t running_digest[32];
+
+int
+esp_partition_read(const esp_partition_t *partition, size_t src_offset
+                   , void *dst, size_t size)
+{
+    if (src_offset + size > partition->size)
+        return -1;
+    memcpy(dst, &flash[src_offset], size);
+    return 0;
+}
+
+// Like flash, a write can only clear bits (the sector must be erased)
+int
+esp_partition_write(const esp_partition_t *partition, size_t dst_offset
+                    , const void *src, size_t size)
+{
+    if (dst_offset + size > partition->size)
+        return -1;
+    const uint8_t *s = src;
+    for (int i=0; i<size; i++)
+        flash[dst_offset + i] &= s[i];
+    return 0;
+}
+
+int
+esp_partition_erase_range(const esp_partition_t *partition
+                          , size_t offset, size_t size)
+{
+    if (offset % SECTOR_SIZE || size % SECTOR_SIZE
+        || offset + size > partition->size)
+        return -1;
+    memset(&flash[offset], 0xff, size);
+    erase_count++;
+    return 0;
+}
+
+const esp_partition_t *
+esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+    return &target_partition;
+}
+
+int
+esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    boot_set = 1;
+    return 0;
+}
+
+const esp_partition_t *
+esp_ota_get_running_partition(void)
+{
+    return &running_partition;
+}
+
+int
+esp_partition_get_sha256(const esp_partition_t *partition, uint8_t *sha_256)
+{
+    if (partition != &running_partition)
+        return -1;
+    memcpy(sha_256, running_digest, sizeof(running_digest));
+    return 0;
+}
+
+
+/****************************************************************
+ * Simulated measurement log
+ ****************************************************************/
+
+// Records are numbered - those from log_first to log_end are pending
+static int log_first, log_end;
+
+int
+datalog_format_stream(int *ppos, struct datalog_stream_s *ds)
+{
+    int pos = *ppos < 0 ? log_first : *ppos;
+    if (pos == log_end)
+        return -1;
+    *ppos = pos + 1;
+    int size = 32;
+    if (ds->len + size > ds->size && ds->reserve(ds, size))
+        return 0;
+    ds->len += snprintf(&ds->buf[ds->len], size, "{\"record\":%d}", pos);
+    return 1;
+}
+
+int
+datalog_is_last(int pos)
+{
+    if (pos < 0)
+        pos = log_first;
+    return pos != log_end && pos + 1 == log_end;
+}
+
+void
+datalog_expire(void)
+{
+    if (log_first != log_end)
+        log_first++;
+}
+
+int
+spool_format_stream(int *ppos, struct datalog_stream_s *ds)
+{
+    return -1;
+}
+
+// The spool is empty - expire records from the measurement log
+int
+spool_expire(void)
+{
+    return 1;
+}
+
+
+/****************************************************************
+ * Simulated device
+ ****************************************************************/
+
+enum { W_NO_OFFER, W_PENDING, W_DONE, W_FAIL, W_ERROR };
+
+static jmp_buf restart_jmp;
+static int max_chunks, wake_offer;
+static uint32_t wake_offset;
+static const char *wake_status;
+
+void network_wait_ip(void) { }
+void network_note_broker_connected(void) { }
+int network_note_broker_failed(void) { return 0; }
+void network_note_ota_start(void) { }
+void deepsleep_note_ota_start(void) { }
+void deepsleep_set_boot_time(uint64_t boot_time) { }
+void timing_note_deferred(int phase, int64_t start_time) { }
+void timing_count(int counter) { }
+
+int
+network_resolve_broker(const char *host, int port, struct sockaddr_in *sin)
+{
+    return mqttpub_resolve(host, port, sin);
+}
+
+// The ota time of the wake runs out after max_chunks chunks
+int
+deepsleep_ota_time_expired(void)
+{
+    return ota_state.offset - wake_offset >= max_chunks * OTAMQTT_CHUNK_SIZE;
+}
+
+void
+ota_start(char *url, int url_len)
+{
+    printf("Unexpected http ota request\n");
+    exit(1);
+}
+
+void
+vTaskDelay(TickType_t ticks)
+{
+    printf("Unexpected wait for an http ota update\n");
+    exit(1);
+}
+
+void
+esp_restart(void)
+{
+    longjmp(restart_jmp, 1);
+}
+
+static int
+check_read(struct mqttpub_s *m, struct mqttpub_msg_s *msg)
+{
+    for (;;) {
+        int ret = mqttpub_read(m, msg);
+        if (ret || msg->type != MQTTPUB_PUBLISH)
+            return ret;
+        if (is_topic(msg->topic, msg->topic_len, OTA_TOPIC)
+            && otamqtt_is_offer(msg->data, msg->data_len))
+            wake_offer = 1;
+        if (!is_topic(msg->topic, msg->topic_len, OTA_DATA_TOPIC)
+            || rand() % 100 >= drop_percent)
+            return 0;
+    }
+}
+
+// Note the "done" or "fail" status of the transfer
+static int
+check_publish(struct mqttpub_s *m, const char *topic
+              , const void *data, int len, int qos, int retain)
+{
+    if (strcmp(topic, OTA_ACK_TOPIC) == 0 && len == 4
+        && (memcmp(data, "done", 4) == 0 || memcmp(data, "fail", 4) == 0))
+        wake_status = memcmp(data, "done", 4) == 0 ? "done" : "fail";
+    return mqttpub_publish(m, topic, data, len, qos, retain);
+}
+
+static double
+get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * .000000001;
+}
+
+// Run one wake (a new boot, so the non-rtc state of mqtt.c is reset) -
+// returns one of the W_ states
+static int
+device_wake(int chunks_per_wake, int *pchunks)
+{
+    ota_in_progress = mqtt_ota = 0;
+    max_chunks = chunks_per_wake;
+    wake_offset = ota_state.offset;
+    wake_offer = 0;
+    wake_status = NULL;
+    log_end += records_per_wake;
+    int ret = 0, restarted = setjmp(restart_jmp);
+    if (!restarted)
+        ret = mqtt_start();
+    *pchunks = (ota_state.offset - wake_offset) / OTAMQTT_CHUNK_SIZE;
+    if (*pchunks > chunks_per_wake) {
+        printf("Transfer did not stop at the ota time limit\n");
+        return W_ERROR;
+    }
+    if (restarted)
+        return (boot_set && wake_status && !strcmp(wake_status, "done")
+                ? W_DONE : W_FAIL);
+    if (ret) {
+        printf("mqtt_start() failed\n");
+        return W_ERROR;
+    }
+    if (log_first != log_end) {
+        printf("Records were not acknowledged\n");
+        return W_ERROR;
+    }
+    if (wake_status)
+        return strcmp(wake_status, "done") ? W_FAIL : W_DONE;
+    return wake_offer ? W_PENDING : W_NO_OFFER;
+}
+
+// Offset of the stored data (as sent in the chunk requests)
+static uint32_t
+get_offset(void)
+{
+    char buf[32];
+    otamqtt_format_ack(buf, sizeof(buf));
+    return strtoul(buf, NULL, 10);
+}
+
+// Publish a retained offer of an image (and wait for the broker to
+// acknowledge it)
+static int
+publish_offer(const uint8_t *fw, int fw_len)
+{
+    char offer[128];
+    int pos = snprintf(offer, sizeof(offer), "mqtt:%d:", fw_len);
+    for (int i=0; i<32; i++)
+        pos += snprintf(&offer[pos], sizeof(offer) - pos, "%02x"
+                        , fw[fw_len - 32 + i]);
+    struct mqttpub_s mp;
+    int ret = mqttpub_connect(&mp, broker_url, "ota_mqtt_check", 1
+                              , CONFIG_MAX_RUN_TIME * 1000, mqttpub_resolve);
+    int id = ret ? -1 : mqttpub_publish(&mp, OTA_TOPIC, offer, pos, 1, 1);
+    ret = id < 0 ? -1 : mqttpub_flush(&mp);
+    while (!ret) {
+        struct mqttpub_msg_s msg;
+        ret = mqttpub_read(&mp, &msg);
+        if (!ret && msg.type == MQTTPUB_PUBACK && msg.id == id)
+            break;
+    }
+    mqttpub_close(&mp);
+    return ret;
+}
+
+
+/****************************************************************
+ * Startup
+ ****************************************************************/
+
+static uint8_t *
+read_file(const char *filename, int *plen)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    int len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = malloc(len);
+    if (data && fread(data, 1, len, f) != len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *plen = len;
+    return data;
+}
+
+static void
+sha256(const uint8_t *data, uint32_t len, uint8_t *digest)
+{
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+    mbedtls_sha256_update_ret(&sha, data, len);
+    mbedtls_sha256_finish_ret(&sha, digest);
+    mbedtls_sha256_free(&sha);
+}
+
+static void
+usage(const char *prog)
+{
+    printf("Usage: %s [-n chunks_per_wake] [-w max_wakes] [-d drop_percent]"
+           " [-r records_per_wake] [-v] <broker_url> <firmware.bin>\n"
+           , prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    int chunks_per_wake = 300, max_wakes = 100, c;
+    while ((c = getopt(argc, argv, "n:w:d:r:v")) != -1) {
+        switch (c) {
+        case 'n': chunks_per_wake = atoi(optarg); break;
+        case 'w': max_wakes = atoi(optarg); break;
+        case 'd': drop_percent = atoi(optarg); break;
+        case 'r': records_per_wake = atoi(optarg); break;
+        case 'v': esp_log_verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
+        usage(argv[0]);
+    broker_url = argv[optind];
+    int fw_len;
+    uint8_t *fw = read_file(argv[optind + 1], &fw_len);
+    if (!fw || fw_len <= 32 || fw_len > PARTITION_SIZE) {
+        printf("Unable to read firmware file\n");
+        return 1;
+    }
+    // Start with a partition that is not erased
+    for (int i=0; i<PARTITION_SIZE; i++)
+        flash[i] = rand();
+
+    int state = W_NO_OFFER, wakes = 0, resumes = 0;
+    double transfer_time = 0.;
+    while (wakes < max_wakes) {
+        uint32_t offset = get_offset();
+        int chunks = 0;
+        double start = get_time();
+        state = device_wake(chunks_per_wake, &chunks);
+        double elapsed = get_time() - start;
+        if (state == W_ERROR)
+            return 1;
+        if (state == W_NO_OFFER) {
+            // Wait for the publisher to offer the update
+            sleep(1);
+            continue;
+        }
+        wakes++;
+        transfer_time += elapsed;
+        if (chunks && offset)
+            resumes++;
+        printf("Wake %d: %d chunks from offset %u in %.3fs\n"
+               , wakes, chunks, offset, elapsed);
+        if (state != W_PENDING)
+            break;
+    }
+    if (state != W_DONE || !boot_set) {
+        printf("Transfer did not complete\n");
+        return 1;
+    }
+    uint8_t fw_digest[32], part_digest[32];
+    sha256(fw, fw_len, fw_digest);
+    sha256(flash, fw_len, part_digest);
+    if (memcmp(fw_digest, part_digest, sizeof(fw_digest)) != 0) {
+        printf("Partition does not match the firmware\n");
+        return 1;
+    }
+    printf("Transferred %d bytes in %d wakes (%d resumed, %d sector"
+           " erases) %.3fs (%.1f KiB/s)\n", fw_len, wakes, resumes
+           , erase_count, transfer_time, fw_len / transfer_time / 1024.);
+    if (wakes > 1 && !resumes) {
+        printf("Transfer was not resumed\n");
+        return 1;
+    }
+
+    // Restart into the new image (which clears the rtc memory) and
+    // check that an offer of it (as if the offer was not cleared) does
+    // not start another transfer
+    memset(&ota_state, 0, sizeof(ota_state));
+    memcpy(running_digest, &fw[fw_len - 32], sizeof(running_digest));
+    // Give the publisher time to clear its offer
+    sleep(1);
+    if (publish_offer(fw, fw_len)) {
+        printf("Unable to publish offer\n");
+        return 1;
+    }
+    int chunks = 0, erases = erase_count;
+    state = device_wake(chunks_per_wake, &chunks);
+    if (state != W_DONE || chunks || erase_count != erases) {
+        printf("Offer of the running image was not reported as"
+               " installed\n");
+        return 1;
+    }
+    printf("MQTT ota check passed\n");
+    return 0;
+}
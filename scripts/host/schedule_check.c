@@ -0,0 +1,429 @@
+// Check of the upload scheduler and replay of recorded sensor traces
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This tool compiles fw/main/schedule.c on a Linux host. The scheduler
+// settings are the CONFIG_UPLOAD_* options of scripts/host/sdkconfig.h
+// and may be changed with -D. Build it with something like:
+//   gcc -O2 -Wall -I scripts/host -I fw/main -o /tmp/schedule_check
+//     -DCONFIG_UPLOAD_MAX_INTERVAL=7200
+//     -DCONFIG_UPLOAD_TEMPERATURE_DELTA='"0.5"'
+//     -DCONFIG_UPLOAD_HUMIDITY_DELTA='"5"' -DCONFIG_UPLOAD_LOG_FILL=50
+//     scripts/host/schedule_check.c -lm
+// Without a trace, it runs a set of checks of the scheduling rules
+// (checks of options that are disabled in the build are skipped):
+//   /tmp/schedule_check
+// With a trace (lines of "seconds,temperature,humidity", as used by
+// wake_sim.c) it runs a measurement on every wake using the trace
+// readings and lists the wakes that upload:
+//   /tmp/schedule_check -d 7 -t sensor_trace.csv
+
+#include <math.h> // fabs
+#include <stdio.h> // printf
+#include <stdlib.h> // rand
+#include <string.h> // memset
+#include <unistd.h> // getopt
+#include "schedule.c" // sched
+
+int esp_log_verbose;
+
+// Approximate number of log bytes used by each measurement
+#define RECORD_BYTES 35
+
+#define MEASURE_US (CONFIG_MEASURE_INTERVAL * 1000000ULL)
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+static const char *reason_names[] = {
+    "none", "timer", "log fill", "change", "ota",
+};
+
+
+/****************************************************************
+ * Host environment
+ ****************************************************************/
+
+static uint64_t cur_time, boot_time;
+static float cur_temperature = 20.f, cur_humidity = 50.f;
+static int have_reading, pending_records, ota_pending, network_down;
+static int log_growth = 1;
+
+int
+bme280_get_reading(float *temperature, float *humidity)
+{
+    if (!have_reading)
+        return -1;
+    *temperature = cur_temperature;
+    *humidity = cur_humidity;
+    return 0;
+}
+
+int
+datalog_fill(void)
+{
+    int fill = pending_records * RECORD_BYTES * 100 / CONFIG_DATALOG_SIZE;
+    return fill > 100 ? 100 : fill;
+}
+
+void
+deepsleep_set_boot_time(uint64_t boottime)
+{
+    boot_time = boottime;
+}
+
+int
+otamqtt_is_pending(void)
+{
+    return ota_pending;
+}
+
+static void
+reset(void)
+{
+    memset(&sched, 0, sizeof(sched));
+    cur_time = boot_time = 0;
+    cur_temperature = 20.f;
+    cur_humidity = 50.f;
+    pending_records = ota_pending = network_down = 0;
+    log_growth = 1;
+}
+
+// Run one wake in the order of app_main() and return the upload reason
+static int
+wake(void)
+{
+    have_reading = 0;
+    int reason = schedule_check(cur_time);
+    // Measurement
+    have_reading = 1;
+    pending_records += log_growth;
+    if (!reason)
+        reason = schedule_check(cur_time);
+    if (reason && !network_down) {
+        schedule_note_upload();
+        pending_records = 0;
+    }
+    cur_time += MEASURE_US;
+    return reason;
+}
+
+// Run wakes until one uploads (returns the reason)
+static int
+wake_until_upload(int max_wakes)
+{
+    for (int i=0; i<max_wakes; i++) {
+        int reason = wake();
+        if (reason)
+            return reason;
+    }
+    return SR_NONE;
+}
+
+static uint64_t
+round_to_wake(uint64_t time)
+{
+    return (time + MEASURE_US - 1) / MEASURE_US * MEASURE_US;
+}
+
+
+/****************************************************************
+ * Checks
+ ****************************************************************/
+
+static int check_errors;
+
+#define CHECK(cond, fmt, ...) do {                                      \
+        if (!(cond)) {                                                  \
+            check_errors++;                                             \
+            fprintf(stderr, "check failed (%s): " fmt "\n", #cond       \
+                    , ##__VA_ARGS__);                                   \
+            return -1;                                                  \
+        }                                                               \
+    } while (0)
+
+#define WAKES_PER_DAY (86400 / CONFIG_MEASURE_INTERVAL)
+
+// Stable readings - the interval doubles up to the maximum
+static int
+check_backoff(void)
+{
+    reset();
+    log_growth = 0;
+    uint32_t interval = CONFIG_UPLOAD_INTERVAL;
+    CHECK(wake() == SR_TIMER, "first wake uploads");
+    uint64_t last = 0;
+    for (int i=0; i<16; i++) {
+        CHECK(boot_time == last + interval * 1000000ULL
+              , "boot time for upload %d", i);
+        int reason = wake_until_upload(2 * WAKES_PER_DAY);
+        uint64_t upload_time = cur_time - MEASURE_US;
+        CHECK(reason == SR_TIMER, "upload %d reason %d", i, reason);
+        CHECK(upload_time == round_to_wake(last + interval * 1000000ULL)
+              , "upload %d after %llu seconds (interval %u)", i
+              , (unsigned long long)(upload_time - last) / 1000000
+              , interval);
+        last = upload_time;
+        interval *= 2;
+        if (interval > CONFIG_UPLOAD_MAX_INTERVAL)
+            interval = CONFIG_UPLOAD_MAX_INTERVAL;
+        if (interval < CONFIG_UPLOAD_INTERVAL)
+            interval = CONFIG_UPLOAD_INTERVAL;
+    }
+    return 0;
+}
+
+// A change is uploaded on the wake it is measured (and resets the
+// interval), while a smaller change is not
+static int
+check_change(const char *name, float delta, float *value)
+{
+    reset();
+    // Back off to the maximum interval
+    for (int i=0; i<WAKES_PER_DAY; i++)
+        wake();
+    wake_until_upload(2 * WAKES_PER_DAY);
+    *value += delta * .9f;
+    CHECK(wake() == SR_NONE, "%s change below the delta", name);
+    *value += delta * .2f;
+    int reason = wake();
+    CHECK(reason == SR_CHANGE, "%s change reason %d", name, reason);
+    uint64_t upload_time = cur_time - MEASURE_US;
+    CHECK(boot_time == upload_time + CONFIG_UPLOAD_INTERVAL * 1000000ULL
+          , "%s change resets the interval", name);
+    // The reference is now the uploaded reading
+    *value -= delta * 1.1f;
+    if (CONFIG_UPLOAD_INTERVAL > CONFIG_MEASURE_INTERVAL)
+        CHECK(wake() == SR_CHANGE, "%s change back", name);
+    return 0;
+}
+
+// After a failed upload only the timer starts a new attempt
+static int
+check_failure(void)
+{
+    reset();
+    wake();
+    network_down = 1;
+    CHECK(wake_until_upload(2 * WAKES_PER_DAY) == SR_TIMER
+          , "failed timer upload");
+    float hdelta = atof(CONFIG_UPLOAD_HUMIDITY_DELTA);
+    float tdelta = atof(CONFIG_UPLOAD_TEMPERATURE_DELTA);
+    int attempts = 0;
+    for (int i=0; i<WAKES_PER_DAY; i++) {
+        // Readings (and the log) that would trigger an upload
+        cur_humidity = i & 1 ? 50.f + 2.f * hdelta : 50.f;
+        cur_temperature = i & 1 ? 20.f + 2.f * tdelta : 20.f;
+        int reason = wake();
+        CHECK(reason == SR_NONE || reason == SR_TIMER
+              , "wake %d with failed uploads reason %d", i, reason);
+        attempts += reason != SR_NONE;
+    }
+    CHECK(attempts <= 86400 / CONFIG_UPLOAD_INTERVAL + 1
+          , "%d upload attempts", attempts);
+    // An interrupted firmware transfer is resumed immediately, and
+    // every wake performs a full boot until it completes
+    ota_pending = 1;
+    CHECK(wake() == SR_OTA, "ota resume");
+    for (int i=0; i<2 * WAKES_PER_DAY; i++) {
+        CHECK(!boot_time, "boot time set during ota (wake %d)", i);
+        if (wake() == SR_TIMER)
+            break;
+    }
+    CHECK(!boot_time, "boot time set by timer upload during ota");
+    ota_pending = 0;
+    // Change triggers resume after a successful upload
+    network_down = 0;
+    CHECK(wake_until_upload(2 * WAKES_PER_DAY) == SR_TIMER
+          , "timer after failures");
+    if (hdelta > 0.f || tdelta > 0.f) {
+        cur_humidity += 2.f * hdelta;
+        cur_temperature += 2.f * tdelta;
+        CHECK(wake() == SR_CHANGE, "change after recovery");
+    }
+    return 0;
+}
+
+// An upload is forced when the log reaches the fill threshold
+static int
+check_log_fill(void)
+{
+    reset();
+    // Back off to the maximum interval (without filling the log)
+    log_growth = 0;
+    for (int i=0; i<4*WAKES_PER_DAY; i++)
+        wake();
+    wake_until_upload(4 * WAKES_PER_DAY);
+    log_growth = 1;
+    while (datalog_fill() < CONFIG_UPLOAD_LOG_FILL)
+        pending_records++;
+    int fill_wakes = pending_records;
+    uint64_t next_upload = sched.next_upload_time;
+    if (cur_time + fill_wakes * MEASURE_US >= next_upload) {
+        printf("  (log fill check skipped - the timer is due first)\n");
+        return 0;
+    }
+    pending_records = 0;
+    int reason = wake_until_upload(fill_wakes);
+    CHECK(reason == SR_LOG_FILL, "log fill reason %d", reason);
+    CHECK(cur_time - MEASURE_US < next_upload, "log fill before timer");
+    return 0;
+}
+
+static int
+run_checks(void)
+{
+    float tdelta = atof(CONFIG_UPLOAD_TEMPERATURE_DELTA);
+    float hdelta = atof(CONFIG_UPLOAD_HUMIDITY_DELTA);
+    printf("Upload interval %d, max interval %d, temperature delta %.2f"
+           ", humidity delta %.2f, log fill %d%%\n"
+           , CONFIG_UPLOAD_INTERVAL, CONFIG_UPLOAD_MAX_INTERVAL
+           , tdelta, hdelta, CONFIG_UPLOAD_LOG_FILL);
+    int ret = check_backoff();
+    if (!ret && tdelta > 0.f)
+        ret = check_change("temperature", tdelta, &cur_temperature);
+    if (!ret && hdelta > 0.f)
+        ret = check_change("humidity", hdelta, &cur_humidity);
+    if (!ret)
+        ret = check_failure();
+    if (!ret && CONFIG_UPLOAD_LOG_FILL)
+        ret = check_log_fill();
+    if (ret) {
+        printf("Check failed\n");
+        return -1;
+    }
+    printf("Scheduler checks passed\n");
+    return 0;
+}
+
+
+/****************************************************************
+ * Trace replay
+ ****************************************************************/
+
+struct sample_s {
+    double time, temperature, humidity;
+};
+
+static struct sample_s *trace;
+static int trace_count;
+
+static int
+load_trace(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f)
+        return -1;
+    char line[256];
+    int size = 0;
+    while (fgets(line, sizeof(line), f)) {
+        struct sample_s s;
+        if (sscanf(line, "%lf,%lf,%lf", &s.time, &s.temperature
+                   , &s.humidity) != 3)
+            continue;
+        if (trace_count >= size) {
+            size = size ? size * 2 : 1024;
+            trace = realloc(trace, size * sizeof(*trace));
+            if (!trace) {
+                fclose(f);
+                return -1;
+            }
+        }
+        if (trace_count && s.time < trace[trace_count - 1].time)
+            continue;
+        trace[trace_count++] = s;
+    }
+    fclose(f);
+    return trace_count ? 0 : -1;
+}
+
+// Set the readings to the trace sample at the current time
+static void
+update_reading(void)
+{
+    double start = trace[0].time;
+    double duration = trace[trace_count - 1].time - start + 1.;
+    double t = start + fmod(cur_time * .000001, duration);
+    int lo = 0, hi = trace_count;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (trace[mid].time <= t)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    cur_temperature = trace[lo].temperature;
+    cur_humidity = trace[lo].humidity;
+}
+
+static void
+replay(double days, double fail)
+{
+    int wakes = days * 86400. / CONFIG_MEASURE_INTERVAL, uploads = 0;
+    int reasons[ARRAY_SIZE(reason_names)] = { 0 };
+    printf("    hours  reason    temperature  humidity  next (s)\n");
+    for (int i=0; i<wakes; i++) {
+        update_reading();
+        network_down = rand() < fail * RAND_MAX;
+        uint64_t t = cur_time;
+        int reason = wake();
+        if (!reason)
+            continue;
+        reasons[reason]++;
+        uploads += !network_down;
+        printf("%9.2f  %-8s  %11.2f  %8.2f  %8u%s\n", t / 3600000000.
+               , reason_names[reason], cur_temperature, cur_humidity
+               , sched.interval, network_down ? "  (failed)" : "");
+    }
+    printf("%d wakes, %d uploads (%.1f per day)\n", wakes, uploads
+           , uploads / days);
+    for (int i=SR_TIMER; i<ARRAY_SIZE(reason_names); i++)
+        printf("  %-8s %d\n", reason_names[i], reasons[i]);
+}
+
+
+/****************************************************************
+ * Startup
+ ****************************************************************/
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "  -t <file>         sensor trace to replay\n"
+            "  -d <days>         number of days to replay (1)\n"
+            "  -f <fraction>     chance an upload fails (0)\n"
+            "  -s <seed>         random seed (0)\n"
+            "  -v                show firmware log messages\n"
+            , prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *trace_file = NULL;
+    double days = 1., fail = 0.;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:f:s:v")) != -1) {
+        switch (opt) {
+        case 't': trace_file = optarg; break;
+        case 'd': days = atof(optarg); break;
+        case 'f': fail = atof(optarg); break;
+        case 's': srand(atoi(optarg)); break;
+        case 'v': esp_log_verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || days <= 0.)
+        usage(argv[0]);
+    if (!trace_file)
+        return run_checks() ? 1 : 0;
+    if (load_trace(trace_file)) {
+        fprintf(stderr, "Unable to read trace %s\n", trace_file);
+        return 1;
+    }
+    reset();
+    replay(days, fail);
+    return 0;
+}
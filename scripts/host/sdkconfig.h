@@ -0,0 +1,63 @@
+// Default configuration for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+#define CONFIG_MAX_OTA_TIME 300
+#define CONFIG_DATALOG_FAST_SIZE 0
+#define CONFIG_BATTERY_CHANNEL 3
+#define CONFIG_BATTERY_SCALE "2.0"
+#define CONFIG_BATTERY_OFFSET "0.089"
+#define CONFIG_BATTERY_CUTOFF "2.9"
+#define CONFIG_BME280_I2C_ADDR 0x77
+#define CONFIG_BME280_SDA_GPIO 22
+#define CONFIG_BME280_SCL_GPIO 23
+#define CONFIG_BME280_OSRS_T 1
+#define CONFIG_BME280_OSRS_P 1
+#define CONFIG_BME280_OSRS_H 1
+#define CONFIG_BME280_IIR_FILTER 0
+#define CONFIG_MQTT_TOPIC_PREFIX "topic"
+
+// Options below may be changed with -D when compiling a host tool
+#ifndef CONFIG_MEASURE_INTERVAL
+#define CONFIG_MEASURE_INTERVAL 300
+#endif
+#ifndef CONFIG_MAX_RUN_TIME
+#define CONFIG_MAX_RUN_TIME 5
+#endif
+#ifndef CONFIG_DATALOG_SIZE
+#define CONFIG_DATALOG_SIZE 3600
+#endif
+#ifndef CONFIG_UPLOAD_INTERVAL
+#define CONFIG_UPLOAD_INTERVAL 900
+#endif
+#ifndef CONFIG_UPLOAD_MAX_INTERVAL
+#define CONFIG_UPLOAD_MAX_INTERVAL 900
+#endif
+#ifndef CONFIG_UPLOAD_TEMPERATURE_DELTA
+#define CONFIG_UPLOAD_TEMPERATURE_DELTA "0"
+#endif
+#ifndef CONFIG_UPLOAD_HUMIDITY_DELTA
+#define CONFIG_UPLOAD_HUMIDITY_DELTA "0"
+#endif
+#ifndef CONFIG_UPLOAD_LOG_FILL
+#define CONFIG_UPLOAD_LOG_FILL 0
+#endif
+#ifndef CONFIG_SPOOL_ENABLE
+#define CONFIG_SPOOL_ENABLE 1
+#endif
+#ifndef CONFIG_MQTT_BATCH_SIZE
+#define CONFIG_MQTT_BATCH_SIZE 0
+#endif
+#ifndef CONFIG_MQTT_TLS
+#define CONFIG_MQTT_TLS 0
+#endif
+#ifndef CONFIG_MQTT_TLS_SESSION_RESUME
+// Only available with CONFIG_MQTT_TLS (as in Kconfig)
+#define CONFIG_MQTT_TLS_SESSION_RESUME CONFIG_MQTT_TLS
+#endif
+
+#endif // sdkconfig.h
@@ -0,0 +1,18 @@
+// Minimal esp-idf soc/gpio_reg.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef GPIO_REG_H
+#define GPIO_REG_H
+
+#include "soc/soc.h" // DR_REG_GPIO_BASE
+
+#define GPIO_OUT_W1TS_REG (DR_REG_GPIO_BASE + 0x0008)
+#define GPIO_OUT_W1TC_REG (DR_REG_GPIO_BASE + 0x000c)
+#define GPIO_ENABLE_W1TS_REG (DR_REG_GPIO_BASE + 0x0024)
+#define GPIO_ENABLE_W1TC_REG (DR_REG_GPIO_BASE + 0x0028)
+#define GPIO_IN_REG (DR_REG_GPIO_BASE + 0x003c)
+#define GPIO_FUNC0_OUT_SEL_CFG_REG (DR_REG_GPIO_BASE + 0x0530)
+
+#endif // gpio_reg.h
@@ -0,0 +1,11 @@
+// Minimal esp-idf soc/gpio_sig_map.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef GPIO_SIG_MAP_H
+#define GPIO_SIG_MAP_H
+
+#define SIG_GPIO_OUT_IDX 256
+
+#endif // gpio_sig_map.h
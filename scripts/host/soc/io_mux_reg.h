@@ -0,0 +1,52 @@
+// Minimal esp-idf soc/io_mux_reg.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef IO_MUX_REG_H
+#define IO_MUX_REG_H
+
+#include "soc/soc.h" // DR_REG_IO_MUX_BASE
+
+#define MCU_SEL 0x7
+#define MCU_SEL_S 12
+#define FUN_IE BIT(9)
+#define FUN_PU BIT(8)
+#define PIN_FUNC_GPIO 2
+
+#define PIN_FUNC_SELECT(reg, func)                                      \
+    REG_WRITE((reg), (REG_READ(reg) & ~(MCU_SEL << MCU_SEL_S))          \
+              | ((func) << MCU_SEL_S))
+#define PIN_INPUT_ENABLE(reg) SET_PERI_REG_MASK((reg), FUN_IE)
+#define PIN_PULLUP_EN(reg) SET_PERI_REG_MASK((reg), FUN_PU)
+
+// The io mux registers of gpio 0-31 (gpio 20, 24, and 28-31 do not
+// exist on the esp32)
+#define IO_MUX_GPIO0_REG (DR_REG_IO_MUX_BASE + 0x44)
+#define IO_MUX_GPIO1_REG (DR_REG_IO_MUX_BASE + 0x88)
+#define IO_MUX_GPIO2_REG (DR_REG_IO_MUX_BASE + 0x40)
+#define IO_MUX_GPIO3_REG (DR_REG_IO_MUX_BASE + 0x84)
+#define IO_MUX_GPIO4_REG (DR_REG_IO_MUX_BASE + 0x48)
+#define IO_MUX_GPIO5_REG (DR_REG_IO_MUX_BASE + 0x6c)
+#define IO_MUX_GPIO6_REG (DR_REG_IO_MUX_BASE + 0x60)
+#define IO_MUX_GPIO7_REG (DR_REG_IO_MUX_BASE + 0x64)
+#define IO_MUX_GPIO8_REG (DR_REG_IO_MUX_BASE + 0x68)
+#define IO_MUX_GPIO9_REG (DR_REG_IO_MUX_BASE + 0x54)
+#define IO_MUX_GPIO10_REG (DR_REG_IO_MUX_BASE + 0x58)
+#define IO_MUX_GPIO11_REG (DR_REG_IO_MUX_BASE + 0x5c)
+#define IO_MUX_GPIO12_REG (DR_REG_IO_MUX_BASE + 0x34)
+#define IO_MUX_GPIO13_REG (DR_REG_IO_MUX_BASE + 0x38)
+#define IO_MUX_GPIO14_REG (DR_REG_IO_MUX_BASE + 0x30)
+#define IO_MUX_GPIO15_REG (DR_REG_IO_MUX_BASE + 0x3c)
+#define IO_MUX_GPIO16_REG (DR_REG_IO_MUX_BASE + 0x4c)
+#define IO_MUX_GPIO17_REG (DR_REG_IO_MUX_BASE + 0x50)
+#define IO_MUX_GPIO18_REG (DR_REG_IO_MUX_BASE + 0x70)
+#define IO_MUX_GPIO19_REG (DR_REG_IO_MUX_BASE + 0x74)
+#define IO_MUX_GPIO21_REG (DR_REG_IO_MUX_BASE + 0x7c)
+#define IO_MUX_GPIO22_REG (DR_REG_IO_MUX_BASE + 0x80)
+#define IO_MUX_GPIO23_REG (DR_REG_IO_MUX_BASE + 0x8c)
+#define IO_MUX_GPIO25_REG (DR_REG_IO_MUX_BASE + 0x24)
+#define IO_MUX_GPIO26_REG (DR_REG_IO_MUX_BASE + 0x28)
+#define IO_MUX_GPIO27_REG (DR_REG_IO_MUX_BASE + 0x2c)
+
+#endif // io_mux_reg.h
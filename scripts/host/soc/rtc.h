@@ -0,0 +1,12 @@
+// Minimal esp-idf soc/rtc.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef SOC_RTC_H
+#define SOC_RTC_H
+
+// Fractional bits of the slow clock calibration (us per tick)
+#define RTC_CLK_CAL_FRACT 19
+
+#endif // rtc.h
@@ -0,0 +1,27 @@
+// Minimal esp-idf soc/rtc_cntl_reg.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef RTC_CNTL_REG_H
+#define RTC_CNTL_REG_H
+
+#include "soc/soc.h" // DR_REG_RTCCNTL_BASE
+
+#define RTC_CNTL_SLP_TIMER0_REG (DR_REG_RTCCNTL_BASE + 0x4)
+#define RTC_CNTL_SLP_TIMER1_REG (DR_REG_RTCCNTL_BASE + 0x8)
+#define RTC_CNTL_TIME_UPDATE_REG (DR_REG_RTCCNTL_BASE + 0xc)
+#define RTC_CNTL_TIME_UPDATE BIT(31)
+#define RTC_CNTL_TIME_VALID BIT(30)
+#define RTC_CNTL_TIME0_REG (DR_REG_RTCCNTL_BASE + 0x10)
+#define RTC_CNTL_TIME1_REG (DR_REG_RTCCNTL_BASE + 0x14)
+#define RTC_CNTL_STATE0_REG (DR_REG_RTCCNTL_BASE + 0x18)
+#define RTC_CNTL_SLEEP_EN BIT(31)
+#define RTC_CNTL_INT_CLR_REG (DR_REG_RTCCNTL_BASE + 0x48)
+#define RTC_CNTL_TIME_VALID_INT_CLR BIT(10)
+#define RTC_CNTL_STORE1_REG (DR_REG_RTCCNTL_BASE + 0x50)
+#define RTC_CNTL_STORE2_REG (DR_REG_RTCCNTL_BASE + 0x54)
+#define RTC_CNTL_STORE3_REG (DR_REG_RTCCNTL_BASE + 0x58)
+#define RTC_CNTL_STORE6_REG (DR_REG_RTCCNTL_BASE + 0xb8)
+
+#endif // rtc_cntl_reg.h
@@ -0,0 +1,31 @@
+// Minimal esp-idf soc/soc.h definitions for host compiles
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef SOC_H
+#define SOC_H
+
+#include <stdint.h> // uint32_t
+
+// Register accesses (only made by the deep sleep wake stub) are passed
+// to functions that a host tool building the wake stub must provide
+uint32_t host_reg_read(uint32_t reg);
+void host_reg_write(uint32_t reg, uint32_t val);
+
+#define BIT(nr) (1UL << (nr))
+
+#define REG_READ(reg) host_reg_read(reg)
+#define REG_WRITE(reg, val) host_reg_write((reg), (val))
+#define READ_PERI_REG(reg) REG_READ(reg)
+#define WRITE_PERI_REG(reg, val) REG_WRITE((reg), (val))
+#define SET_PERI_REG_MASK(reg, mask) REG_WRITE((reg), REG_READ(reg) | (mask))
+#define CLEAR_PERI_REG_MASK(reg, mask)          \
+    REG_WRITE((reg), REG_READ(reg) & ~(mask))
+#define GET_PERI_REG_MASK(reg, mask) (REG_READ(reg) & (mask))
+
+#define DR_REG_GPIO_BASE 0x3ff44000
+#define DR_REG_RTCCNTL_BASE 0x3ff48000
+#define DR_REG_IO_MUX_BASE 0x3ff49000
+
+#endif // soc.h
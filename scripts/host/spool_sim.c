@@ -0,0 +1,468 @@
+// Simulate the flash spool to check its recovery and estimate its wear
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This tool compiles fw/main/spool.c (along with the firmware's
+// measurement log and record code) on a Linux host and runs it on a
+// partition stored in a file. Build it with something like:
+//   gcc -O2 -Wall -ffunction-sections -Wl,--gc-sections
+//     -I scripts/host -I fw/main -o /tmp/spool_sim
+//     scripts/host/spool_sim.c fw/main/datalog.c fw/main/deepsleep.c
+//     fw/main/bme280.c fw/main/battery.c fw/main/timing.c
+// and run it with something like:
+//   /tmp/spool_sim -d 365 -o 24:72 -o 200:500 -l 0.001
+// Each simulated wake stores a measurement (as app_main() does) and
+// calls spool_flush(). On each upload, the spooled records and then the
+// records in the log are formatted and expired (as fw/main/mqtt.c
+// does), and the wake times found are checked for lost, duplicate, and
+// out of order records. The -l option simulates power loss (the rtc
+// memory state of the log and spool is discarded) before a wake. The
+// partition file (-f) starts erased unless -k is given (records left
+// from an earlier run are then recovered and uploaded first).
+
+#include <fcntl.h> // open
+#include <inttypes.h> // PRIu64
+#include <stdio.h> // printf
+#include <stdlib.h> // rand
+#include <string.h> // memset
+#include <time.h> // clock_gettime
+#include <unistd.h> // getopt
+#include "timing.h" // timing_note
+#include "spool.c" // ss
+
+int esp_log_verbose;
+
+// Flash costs (in seconds) - the same as scripts/host/wake_sim.c
+#define FLASH_WRITE_TIME .015
+#define FLASH_ERASE_TIME .045
+#define ERASE_CYCLES 100000
+
+#define MAX_OUTAGES 16
+#define MAX_SECTORS 256
+
+static double measure_interval = CONFIG_MEASURE_INTERVAL;
+static double upload_interval = CONFIG_UPLOAD_INTERVAL;
+static double power_loss;
+static struct {
+    double start, end;
+} outages[MAX_OUTAGES];
+static int outage_count;
+
+static struct {
+    int wakes, uploads, power_losses, stored, uploaded;
+    int lost, duplicates, misordered, missing_latest;
+    int flush_chunks, flush_bytes;
+    int flash_writes, flash_bytes, flash_erases;
+    double flash_time, format_time;
+} stats;
+
+
+/****************************************************************
+ * Host environment
+ ****************************************************************/
+
+// The firmware reads the esp timer when noting wake phase timings
+static int64_t sim_timer;
+
+int64_t
+esp_timer_get_time(void)
+{
+    return sim_timer;
+}
+
+int
+xTaskCreate(void (*fn)(void *), const char *name, uint32_t stack
+            , void *param, int prio, void **handle)
+{
+    abort();
+}
+
+int
+esp_sleep_get_wakeup_cause(void)
+{
+    return 0;
+}
+
+uint32_t
+ulTaskNotifyTake(int clear, uint32_t ticks)
+{
+    abort();
+}
+
+int
+esp_sleep_enable_timer_wakeup(uint64_t time_in_us)
+{
+    abort();
+}
+
+int
+esp_wifi_stop(void)
+{
+    abort();
+}
+
+void
+esp_deep_sleep_disable_rom_logging(void)
+{
+    abort();
+}
+
+void
+esp_deep_sleep_start(void)
+{
+    abort();
+}
+
+static double
+get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * .000000001;
+}
+
+
+/****************************************************************
+ * File backed partition
+ ****************************************************************/
+
+static int flash_fd = -1;
+static int sector_erases[MAX_SECTORS];
+static esp_partition_t spool_partition = {
+    .address = 0x391000, .size = 0xf000, .label = "spiffs",
+};
+
+static int
+flash_open(const char *filename, int keep)
+{
+    flash_fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (flash_fd < 0)
+        return -1;
+    off_t size = lseek(flash_fd, 0, SEEK_END);
+    if (keep && size == spool_partition.size)
+        return 0;
+    // Start with an erased partition
+    uint8_t buf[SECTOR_SIZE];
+    memset(buf, 0xff, sizeof(buf));
+    if (ftruncate(flash_fd, 0))
+        return -1;
+    for (uint32_t pos = 0; pos < spool_partition.size; pos += sizeof(buf))
+        if (pwrite(flash_fd, buf, sizeof(buf), pos) != sizeof(buf))
+            return -1;
+    return 0;
+}
+
+const esp_partition_t *
+esp_partition_find_first(int type, int subtype, const char *label)
+{
+    if (type != ESP_PARTITION_TYPE_DATA
+        || subtype != ESP_PARTITION_SUBTYPE_DATA_SPIFFS)
+        return NULL;
+    return &spool_partition;
+}
+
+int
+esp_partition_read(const esp_partition_t *partition, size_t src_offset
+                   , void *dst, size_t size)
+{
+    if (src_offset + size > partition->size)
+        return -1;
+    return pread(flash_fd, dst, size, src_offset) == size ? 0 : -1;
+}
+
+// Like flash, a write can only clear bits (the sector must be erased)
+int
+esp_partition_write(const esp_partition_t *partition, size_t dst_offset
+                    , const void *src, size_t size)
+{
+    uint8_t buf[SECTOR_SIZE];
+    if (dst_offset + size > partition->size || size > sizeof(buf)
+        || esp_partition_read(partition, dst_offset, buf, size))
+        return -1;
+    const uint8_t *s = src;
+    for (int i=0; i<size; i++)
+        buf[i] &= s[i];
+    if (pwrite(flash_fd, buf, size, dst_offset) != size)
+        return -1;
+    stats.flash_writes++;
+    stats.flash_bytes += size;
+    stats.flash_time += FLASH_WRITE_TIME;
+    return 0;
+}
+
+int
+esp_partition_erase_range(const esp_partition_t *partition
+                          , size_t offset, size_t size)
+{
+    uint8_t buf[SECTOR_SIZE];
+    if (offset % SECTOR_SIZE || size % SECTOR_SIZE
+        || offset + size > partition->size)
+        return -1;
+    memset(buf, 0xff, sizeof(buf));
+    for (int i=0; i<size / SECTOR_SIZE; i++) {
+        if (pwrite(flash_fd, buf, sizeof(buf), offset + i * SECTOR_SIZE)
+            != sizeof(buf))
+            return -1;
+        sector_erases[offset / SECTOR_SIZE + i]++;
+        stats.flash_erases++;
+        stats.flash_time += FLASH_ERASE_TIME;
+    }
+    return 0;
+}
+
+
+/****************************************************************
+ * Wakes and uploads
+ ****************************************************************/
+
+// Record layouts of fw/main/deepsleep.c and fw/main/bme280.c
+struct appwake_s {
+    uint64_t waketime, sleeptime;
+};
+
+struct bme280_s {
+    float temperature, pressure, humidity;
+};
+
+static uint64_t
+wake_time(int wake)
+{
+    return (uint64_t)(wake * measure_interval * 1000000.) + 250000;
+}
+
+static float
+random_float(float min, float max)
+{
+    return min + (max - min) * rand() / (float)RAND_MAX;
+}
+
+// Store a measurement and spool the log if needed (as app_main() does)
+static void
+take_measurement(int wake)
+{
+    static float temperature = 20., humidity = 50.;
+    datalog_init();
+    struct appwake_s aw = { .waketime = wake_time(wake) };
+    aw.sleeptime = aw.waketime - 250000;
+    datalog_append(&appwake_info, &aw);
+    float battery = random_float(3.0, 3.3);
+    datalog_append(&battery_info, &battery);
+    temperature += random_float(-.2, .2);
+    humidity += random_float(-.5, .5);
+    struct bme280_s b = {
+        .temperature = temperature, .humidity = humidity,
+        .pressure = random_float(1000., 1020.),
+    };
+    datalog_append(&bme280_info, &b);
+    sim_timer = random_float(40000., 60000.);
+    timing_note(TP_APP_MAIN, 0);
+    sim_timer += random_float(10000., 30000.);
+    timing_note(TP_SENSE_DONE, 0);
+    datalog_finalize();
+
+    int free_before = datalog_free();
+    spool_flush();
+    if (datalog_free() != free_before) {
+        stats.flush_chunks++;
+        stats.flush_bytes += datalog_free() - free_before;
+    }
+    stats.stored++;
+}
+
+// Discard the contents of rtc memory (the flash partition is kept)
+static void
+lose_power(void)
+{
+    while (!datalog_is_end(-1))
+        datalog_expire();
+    memset(&ss, 0, sizeof(ss));
+    part = NULL;
+    stats.power_losses++;
+}
+
+static int next_wake;
+
+// Check the wake time of an uploaded record
+static void
+note_record(const char *json, int *plast)
+{
+    // The first wake has no prior sleep and reports a boot_time
+    const char *p = strstr(json, "\"wake_time\":");
+    if (!p)
+        p = strstr(json, "\"boot_time\":");
+    if (!p)
+        return;
+    uint64_t waketime = strtoull(p + strlen("\"wake_time\":"), NULL, 10);
+    int wake = (waketime / 1000000.) / measure_interval;
+    if (wake < *plast) {
+        stats.misordered++;
+    } else if (wake < next_wake) {
+        stats.duplicates++;
+    } else {
+        stats.lost += wake - next_wake;
+        next_wake = wake + 1;
+    }
+    *plast = wake;
+    stats.uploaded++;
+}
+
+// Format and expire all pending records (as fw/main/mqtt.c does)
+static void
+upload(int wake)
+{
+    double start = get_time();
+    char buf[1024];
+    struct datalog_stream_s ds = { .buf = buf, .size = sizeof(buf) };
+    int count = 0, pos = -1, last = -1, ret;
+    for (;;) {
+        ds.len = 0;
+        ret = spool_format_stream(&pos, &ds);
+        if (ret < 0)
+            break;
+        buf[ds.len] = '\0';
+        note_record(buf, &last);
+        count++;
+    }
+    pos = -1;
+    for (;;) {
+        ds.len = 0;
+        ret = datalog_format_stream(&pos, &ds);
+        if (ret < 0)
+            break;
+        buf[ds.len] = '\0';
+        note_record(buf, &last);
+        count++;
+    }
+    if (last != wake)
+        stats.missing_latest++;
+    while (count--)
+        if (spool_expire())
+            datalog_expire();
+    stats.format_time += get_time() - start;
+    stats.uploads++;
+}
+
+static int
+in_outage(double t)
+{
+    for (int i=0; i<outage_count; i++)
+        if (t >= outages[i].start && t < outages[i].end)
+            return 1;
+    return 0;
+}
+
+static void
+simulate(double days)
+{
+    int wakes = days * 86400. / measure_interval;
+    double next_upload = 0.;
+    for (int wake=0; wake<wakes; wake++) {
+        if (power_loss && rand() < power_loss * RAND_MAX)
+            lose_power();
+        double t = wake * measure_interval;
+        take_measurement(wake);
+        stats.wakes++;
+        if (t >= next_upload && !in_outage(t)) {
+            upload(wake);
+            next_upload = t + upload_interval;
+        }
+    }
+    // Remaining records are pending rather than lost
+    if (!datalog_is_end(-1) || !spool_is_empty())
+        upload(wakes - 1);
+}
+
+static void
+report(double days)
+{
+    int sectors = spool_partition.size / SECTOR_SIZE, max_erases = 0;
+    for (int i=0; i<sectors; i++)
+        if (sector_erases[i] > max_erases)
+            max_erases = sector_erases[i];
+    printf("Simulated %.1f days (%d wakes, %d uploads, %d power losses)\n"
+           , days, stats.wakes, stats.uploads, stats.power_losses);
+    printf("Records: %d stored, %d uploaded, %d lost, %d duplicates"
+           ", %d out of order\n"
+           , stats.stored, stats.uploaded, stats.lost, stats.duplicates
+           , stats.misordered);
+    printf("Uploads missing the newest record: %d\n", stats.missing_latest);
+    printf("Spool: %d chunks (%d bytes) moved to flash\n"
+           , stats.flush_chunks, stats.flush_bytes);
+    printf("Flash: %d writes (%d bytes), %d sector erases, %.1fs of"
+           " flash time\n"
+           , stats.flash_writes, stats.flash_bytes, stats.flash_erases
+           , stats.flash_time);
+    if (stats.flush_chunks)
+        printf("  %.2f flash bytes written and %.0f log bytes spooled"
+               " per sector erase\n"
+               , (double)stats.flash_bytes / stats.flush_bytes
+               , (double)stats.flush_bytes / stats.flash_erases);
+    printf("  max sector erases: %d", max_erases);
+    if (max_erases)
+        printf(" (%.0f years to %d erase cycles)"
+               , ERASE_CYCLES * days / max_erases / 365., ERASE_CYCLES);
+    printf("\nUpload formatting: %.0f records per second (host)\n"
+           , stats.format_time ? stats.uploaded / stats.format_time : 0.);
+}
+
+
+/****************************************************************
+ * Startup
+ ****************************************************************/
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "  -d <days>         number of days to simulate (30)\n"
+            "  -s <seed>         random seed (0)\n"
+            "  -o <start:hours>  network outage (start and duration in"
+            " hours)\n"
+            "  -l <fraction>     chance of a power loss before a wake (0)\n"
+            "  -f <file>         partition file (/tmp/spool_sim.bin)\n"
+            "  -k                keep the existing partition contents\n"
+            "  -v                show firmware log messages\n"
+            , prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *filename = "/tmp/spool_sim.bin";
+    double days = 30.;
+    int keep = 0, opt;
+    while ((opt = getopt(argc, argv, "d:s:o:l:f:kv")) != -1) {
+        switch (opt) {
+        case 'd': days = atof(optarg); break;
+        case 's': srand(atoi(optarg)); break;
+        case 'o': {
+            double start, duration;
+            if (outage_count >= MAX_OUTAGES
+                || sscanf(optarg, "%lf:%lf", &start, &duration) != 2)
+                usage(argv[0]);
+            outages[outage_count].start = start * 3600.;
+            outages[outage_count].end = (start + duration) * 3600.;
+            outage_count++;
+            break;
+        }
+        case 'l': power_loss = atof(optarg); break;
+        case 'f': filename = optarg; break;
+        case 'k': keep = 1; break;
+        case 'v': esp_log_verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || days <= 0.)
+        usage(argv[0]);
+    if (flash_open(filename, keep)) {
+        fprintf(stderr, "Unable to open %s\n", filename);
+        return 1;
+    }
+    simulate(days);
+    report(days);
+    close(flash_fd);
+    return stats.misordered || stats.missing_latest;
+}
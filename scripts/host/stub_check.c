@@ -0,0 +1,566 @@
+// Check of the deep sleep wake stub measurement path
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This tool compiles the firmware's wake stub (fw/main/deepsleep.c and
+// the bit-banged i2c code in fw/main/bme280.c) along with the log and
+// record code on a Linux host. Build and run it with something like:
+//   gcc -O2 -Wall -Wno-pointer-to-int-cast -ffunction-sections
+//     -Wl,--gc-sections -DCONFIG_WAKE_STUB=1 -I scripts/host -I fw/main
+//     -o /tmp/stub_check scripts/host/stub_check.c
+//     scripts/host/bme280_sim.c fw/main/deepsleep.c fw/main/bme280.c
+//     fw/main/datalog.c fw/main/battery.c fw/main/timing.c
+//     && /tmp/stub_check
+// (add -DCONFIG_BME280_STORE_RAW=1 -DCONFIG_BME280_PUBLISH_RAW=1 to
+// check the raw upload format). The gpio, io mux, and rtc timer
+// registers that the stub accesses are emulated, and the i2c lines are
+// connected to the emulated bme280 (see bme280_sim.c). Each cycle is a
+// full boot, a wake handled by the stub, and a wake where the stub
+// must defer to a full boot, all at the same sensor environment. The
+// record the stub added is then checked against the record of the
+// full boot (which reads the sensor through the i2c driver).
+
+#include <inttypes.h> // PRIu64
+#include <math.h> // fabs
+#include <setjmp.h> // setjmp
+#include <stdio.h> // printf
+#include <stdlib.h> // rand
+#include <string.h> // strstr
+#include <sys/time.h> // struct timeval
+#include <time.h> // time
+#include <unistd.h> // getopt
+#include <esp32/rom/rtc.h> // RTC_ENTRY_ADDR_REG
+#include <soc/gpio_reg.h> // GPIO_IN_REG
+#include <soc/gpio_sig_map.h> // SIG_GPIO_OUT_IDX
+#include <soc/io_mux_reg.h> // FUN_PU
+#include <soc/rtc.h> // RTC_CLK_CAL_FRACT
+#include "bme280.h" // bme280_sense
+#include "bme280_sim.h" // bme280_sim_bus
+#include "datalog.h" // datalog_format
+#include "deepsleep.h" // deepsleep_set_boot_time
+#include "esp_sleep.h" // esp_wake_deep_sleep
+#include "freertos/FreeRTOS.h" // portTICK_PERIOD_MS
+#include "freertos/task.h" // xTaskCreate
+#include "sdkconfig.h" // CONFIG_MEASURE_INTERVAL
+
+int esp_log_verbose;
+
+// Rtc slow clock period (in us, with RTC_CLK_CAL_FRACT fraction bits)
+#define RTC_CAL ((uint32_t)(1000000. / 150000. * (1 << RTC_CLK_CAL_FRACT)))
+// Rtc time at rtc tick zero (stored in rtc registers by esp-idf)
+#define RTC_BOOT_TIME 0x123456789ULL
+
+#define SDA_BIT (1 << CONFIG_BME280_SDA_GPIO)
+#define SCL_BIT (1 << CONFIG_BME280_SCL_GPIO)
+#define _MUX_REG(pin) IO_MUX_GPIO ## pin ## _REG
+#define MUX_REG(pin) _MUX_REG(pin)
+#define OUT_SEL_REG(pin) (GPIO_FUNC0_OUT_SEL_CFG_REG + (pin) * 4)
+
+static struct {
+    int cycles, stub_wakes, full_boots, bus_errors, bad_regs;
+    uint64_t stub_time, stub_time_max, boot_sense_time;
+    double slot_error_max;
+} stats;
+
+
+/****************************************************************
+ * Virtual clock
+ ****************************************************************/
+
+// Time (in us) since the start of the check
+static uint64_t sim_time;
+// Time of the start of the current full boot
+static uint64_t boot_start;
+
+static uint64_t
+rtc_ticks(void)
+{
+    return (sim_time << RTC_CLK_CAL_FRACT) / RTC_CAL;
+}
+
+// The same calculation as the esp-idf gettimeofday()
+static uint64_t
+rtc_usecs(void)
+{
+    return RTC_BOOT_TIME + ((rtc_ticks() * RTC_CAL) >> RTC_CLK_CAL_FRACT);
+}
+
+int
+gettimeofday(struct timeval *tv, void *tz)
+{
+    uint64_t now = rtc_usecs();
+    tv->tv_sec = now / 1000000;
+    tv->tv_usec = now % 1000000;
+    return 0;
+}
+
+int64_t
+esp_timer_get_time(void)
+{
+    return sim_time - boot_start;
+}
+
+void
+ets_delay_us(uint32_t us)
+{
+    sim_time += us;
+}
+
+
+/****************************************************************
+ * Registers
+ ****************************************************************/
+
+static jmp_buf sleep_jmp;
+static uint32_t gpio_out, gpio_enable, sda_mux, scl_mux;
+static uint32_t sda_out_sel, scl_out_sel;
+static int sda_level, scl_level;
+static uint32_t time_valid, state0, slp_timer0, slp_timer1, entry_addr;
+static uint64_t time_latch;
+
+// A released line is only pulled high if its pullup is enabled
+static int
+line_level(uint32_t bit, uint32_t mux, uint32_t out_sel)
+{
+    if (!(gpio_enable & bit))
+        return !!(mux & FUN_PU);
+    if (((mux >> MCU_SEL_S) & MCU_SEL) != PIN_FUNC_GPIO
+        || out_sel != SIG_GPIO_OUT_IDX)
+        // Line driven by something other than the gpio output register
+        stats.bus_errors++;
+    return !!(gpio_out & bit);
+}
+
+static void
+update_lines(void)
+{
+    scl_level = line_level(SCL_BIT, scl_mux, scl_out_sel);
+    int sda = line_level(SDA_BIT, sda_mux, sda_out_sel);
+    sda_level = bme280_sim_bus(scl_level, sda);
+}
+
+// The gpio and io mux registers are reset on each wake
+static void
+gpio_reset(void)
+{
+    gpio_out = gpio_enable = sda_mux = scl_mux = 0;
+    sda_out_sel = scl_out_sel = 0;
+    update_lines();
+}
+
+uint32_t
+host_reg_read(uint32_t reg)
+{
+    switch (reg) {
+    case GPIO_IN_REG:
+        return ((sda_mux & FUN_IE && sda_level ? SDA_BIT : 0)
+                | (scl_mux & FUN_IE && scl_level ? SCL_BIT : 0));
+    case MUX_REG(CONFIG_BME280_SDA_GPIO): return sda_mux;
+    case MUX_REG(CONFIG_BME280_SCL_GPIO): return scl_mux;
+    case RTC_CNTL_TIME_UPDATE_REG: return time_valid;
+    case RTC_CNTL_TIME0_REG: return time_latch;
+    case RTC_CNTL_TIME1_REG: return time_latch >> 32;
+    case RTC_CNTL_STATE0_REG: return state0;
+    case RTC_CNTL_INT_CLR_REG: return 0;
+    case RTC_SLOW_CLK_CAL_REG: return RTC_CAL;
+    case RTC_BOOT_TIME_LOW_REG: return (uint32_t)RTC_BOOT_TIME;
+    case RTC_BOOT_TIME_HIGH_REG: return RTC_BOOT_TIME >> 32;
+    }
+    fprintf(stderr, "Read of unknown register %08x\n", reg);
+    stats.bad_regs++;
+    return 0;
+}
+
+void
+host_reg_write(uint32_t reg, uint32_t val)
+{
+    switch (reg) {
+    case GPIO_OUT_W1TS_REG: gpio_out |= val; break;
+    case GPIO_OUT_W1TC_REG: gpio_out &= ~val; break;
+    case GPIO_ENABLE_W1TS_REG: gpio_enable |= val; break;
+    case GPIO_ENABLE_W1TC_REG: gpio_enable &= ~val; break;
+    case MUX_REG(CONFIG_BME280_SDA_GPIO): sda_mux = val; break;
+    case MUX_REG(CONFIG_BME280_SCL_GPIO): scl_mux = val; break;
+    case OUT_SEL_REG(CONFIG_BME280_SDA_GPIO): sda_out_sel = val; break;
+    case OUT_SEL_REG(CONFIG_BME280_SCL_GPIO): scl_out_sel = val; break;
+    case RTC_CNTL_TIME_UPDATE_REG:
+        if (val & RTC_CNTL_TIME_UPDATE) {
+            time_latch = rtc_ticks();
+            time_valid = RTC_CNTL_TIME_VALID;
+        }
+        return;
+    case RTC_CNTL_INT_CLR_REG:
+        if (val & RTC_CNTL_TIME_VALID_INT_CLR)
+            time_valid = 0;
+        return;
+    case RTC_CNTL_SLP_TIMER0_REG: slp_timer0 = val; return;
+    case RTC_CNTL_SLP_TIMER1_REG: slp_timer1 = val; return;
+    case RTC_ENTRY_ADDR_REG: entry_addr = val; return;
+    case RTC_CNTL_STATE0_REG: {
+        uint32_t prev = state0;
+        state0 = val;
+        if (val & RTC_CNTL_SLEEP_EN && !(prev & RTC_CNTL_SLEEP_EN))
+            // Enter deep sleep
+            longjmp(sleep_jmp, 2);
+        return;
+    }
+    default:
+        fprintf(stderr, "Write of unknown register %08x\n", reg);
+        stats.bad_regs++;
+        return;
+    }
+    update_lines();
+}
+
+
+/****************************************************************
+ * Deep sleep
+ ****************************************************************/
+
+static TaskFunction_t sleep_task;
+static uint64_t sleep_timer_us, full_sleep_usecs;
+
+BaseType_t
+xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack
+            , void *param, int prio, TaskHandle_t *handle)
+{
+    sleep_task = fn;
+    return 1;
+}
+
+BaseType_t
+xTaskNotifyGive(TaskHandle_t handle)
+{
+    return 1;
+}
+
+// The deep sleep task is only run after deepsleep_start_sleep()
+uint32_t
+ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    return 1;
+}
+
+int
+esp_sleep_get_wakeup_cause(void)
+{
+    return stats.full_boots > 1 ? ESP_SLEEP_WAKEUP_TIMER : 0;
+}
+
+int
+esp_sleep_enable_timer_wakeup(uint64_t time_in_us)
+{
+    sleep_timer_us = time_in_us;
+    return 0;
+}
+
+int
+esp_sleep_pd_config(esp_sleep_pd_domain_t domain
+                    , esp_sleep_pd_option_t option)
+{
+    return 0;
+}
+
+void
+esp_deep_sleep_disable_rom_logging(void)
+{
+}
+
+int
+esp_wifi_stop(void)
+{
+    return 0;
+}
+
+void
+esp_deep_sleep_start(void)
+{
+    full_sleep_usecs = rtc_usecs();
+    longjmp(sleep_jmp, 1);
+}
+
+void
+esp_default_wake_deep_sleep(void)
+{
+}
+
+
+/****************************************************************
+ * Wakes
+ ****************************************************************/
+
+// Record wake and sleep times (rtc time in us)
+static uint64_t stub_wake_usecs, stub_sleep_usecs;
+
+// Full boot of the application (as app_main() does when no upload is
+// needed) - the stub may handle wakes until boot_time
+static void
+full_boot(uint64_t boot_time)
+{
+    gpio_reset();
+    boot_start = sim_time;
+    stats.full_boots++;
+    if (!setjmp(sleep_jmp)) {
+        deepsleep_init();
+        datalog_init();
+        deepsleep_sense();
+        uint64_t start = sim_time;
+        bme280_sense();
+        stats.boot_sense_time += sim_time - start;
+        datalog_finalize();
+        deepsleep_set_boot_time(boot_time);
+        deepsleep_start_sleep();
+        sleep_task(NULL);
+        abort();
+    }
+    sim_time += sleep_timer_us;
+}
+
+// Run the wake stub - returns 0 if it reentered deep sleep or non-zero
+// if a full boot is needed
+static int
+stub_wake(void)
+{
+    gpio_reset();
+    uint64_t start = sim_time;
+    stub_wake_usecs = rtc_usecs();
+    entry_addr = 0;
+    if (setjmp(sleep_jmp)) {
+        stub_sleep_usecs = rtc_usecs();
+        uint64_t awake = sim_time - start;
+        stats.stub_time += awake;
+        if (awake > stats.stub_time_max)
+            stats.stub_time_max = awake;
+        stats.stub_wakes++;
+        // Wake on the sleep timer
+        uint64_t ticks = ((uint64_t)slp_timer1 << 32) | slp_timer0;
+        sim_time = ((ticks * RTC_CAL) >> RTC_CLK_CAL_FRACT) + 1;
+        while (rtc_ticks() < ticks)
+            sim_time++;
+        return 0;
+    }
+    esp_wake_deep_sleep();
+    return -1;
+}
+
+
+/****************************************************************
+ * Checks
+ ****************************************************************/
+
+static int check_errors;
+
+#define CHECK(cond, fmt, ...) do {                                      \
+        if (!(cond)) {                                                  \
+            check_errors++;                                             \
+            fprintf(stderr, "check failed (%s): " fmt "\n", #cond       \
+                    , ##__VA_ARGS__);                                   \
+            return -1;                                                  \
+        }                                                               \
+    } while (0)
+
+#define MAX_RECORDS 4
+
+static char records[MAX_RECORDS][512];
+
+// Format and expire the records in the log - returns the record count
+static int
+upload(void)
+{
+    int count = 0, pos = -1;
+    char buf[512];
+    while (datalog_format(&pos, buf, sizeof(buf) - 1) >= 0) {
+        if (count < MAX_RECORDS)
+            strcpy(records[count], buf);
+        count++;
+    }
+    while (!datalog_is_end(-1))
+        datalog_expire();
+    return count;
+}
+
+// Find a numeric field in a formatted record
+static int
+get_field(const char *rec, const char *name, double *pv)
+{
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\":", name);
+    const char *p = strstr(rec, key);
+    if (!p)
+        return -1;
+    *pv = strtod(p + strlen(key), NULL);
+    return 0;
+}
+
+// Compare the sensor fields of two records
+static int
+check_sensor(const char *stub, const char *full, double *env)
+{
+    const char *raw = strstr(stub, "\"bme280_raw\":");
+    if (raw) {
+        // Raw registers are uploaded - they must be identical
+        CHECK(strstr(full, "\"bme280_raw\":")
+              && strncmp(raw, strstr(full, "\"bme280_raw\":"), 31) == 0
+              , "stub %s vs full %s", stub, full);
+        return 0;
+    }
+    static const char *names[] = { "temperature", "pressure", "humidity" };
+    // The full boot stores fixed point values (unless raw values are
+    // stored) and the formats round them - allow one digit of error.
+    // The emulated sensor inverts the datasheet floating point formulas
+    // while the firmware uses the integer formulas.
+    static const double stub_err[] = { .011, .11, .11 };
+    static const double env_err[] = { .02, .2, .2 };
+    for (int i=0; i<3; i++) {
+        double s, f;
+        CHECK(!get_field(stub, names[i], &s) && !get_field(full, names[i], &f)
+              , "%s missing: %s / %s", names[i], stub, full);
+        CHECK(fabs(s - f) <= stub_err[i], "%s: stub %f vs full boot %f"
+              , names[i], s, f);
+        CHECK(fabs(f - env[i]) <= env_err[i], "%s: %f vs environment %f"
+              , names[i], f, env[i]);
+    }
+    return 0;
+}
+
+// The stub's sleep must end on the next slot of the measurement grid
+static int
+check_slot(void)
+{
+    uint64_t interval = CONFIG_MEASURE_INTERVAL * 1000000ULL;
+    uint64_t wake = rtc_usecs(), off = wake % interval;
+    double err = off > interval / 2 ? interval - off : off;
+    if (err > stats.slot_error_max)
+        stats.slot_error_max = err;
+    CHECK(err <= 10., "wake %" PRIu64 " is %.0fus from a slot", wake, err);
+    CHECK(wake - stub_sleep_usecs >= interval / 2
+          , "slept only %" PRIu64 "us", wake - stub_sleep_usecs);
+    return 0;
+}
+
+// Wake times of a record and its formatted wake_time/last_sleep_time
+static int
+check_times(const char *rec, uint64_t waketime, uint64_t sleeptime)
+{
+    double w, s;
+    CHECK(!get_field(rec, "wake_time", &w)
+          && !get_field(rec, "last_sleep_time", &s), "no times: %s", rec);
+    CHECK(fabs(w - waketime) <= 10., "wake %.0f vs %" PRIu64, w, waketime);
+    CHECK(fabs(s - sleeptime) <= 10., "sleep %.0f vs %" PRIu64, s, sleeptime);
+    return 0;
+}
+
+static double
+rand_range(double low, double high)
+{
+    return low + (high - low) * rand() / RAND_MAX;
+}
+
+static int
+run_cycle(int fail_sensor)
+{
+    uint64_t interval = CONFIG_MEASURE_INTERVAL * 1000000ULL;
+    double env[3] = {
+        rand_range(-20., 40.), rand_range(900., 1080.), rand_range(5., 95.)
+    };
+    bme280_sim_set(env[0], env[1], env[2]);
+
+    // Full boot - allow the stub to handle only the next wake
+    full_boot(rtc_usecs() + interval * 3 / 2);
+    uint64_t boot_sleep = full_sleep_usecs;
+    CHECK(upload() == 1, "full boot records");
+
+    if (fail_sensor) {
+        // The stub must defer to a full boot (and its unfinished record
+        // must then be discarded)
+        bme280_sim_set_absent(1);
+        int ret = stub_wake();
+        bme280_sim_set_absent(0);
+        CHECK(ret, "stub slept without a sensor");
+        uint64_t waketime = rtc_usecs();
+        full_boot(0);
+        int count = upload();
+        CHECK(count == 1, "%d records after sensor failure", count);
+        CHECK(check_times(records[0], waketime, boot_sleep) == 0, "times");
+        return 0;
+    }
+
+    // Wake handled by the stub
+    CHECK(stub_wake() == 0, "stub requested a full boot");
+    CHECK(entry_addr == (uint32_t)&esp_wake_deep_sleep, "entry %08x"
+          , entry_addr);
+    CHECK(check_slot() == 0, "slot");
+    uint64_t stub_waketime = stub_wake_usecs;
+
+    // Wake at the boot time - the stub must defer to a full boot
+    CHECK(stub_wake(), "stub handled the wake at its boot time");
+    full_boot(0);
+    CHECK(upload() == 2, "records");
+    CHECK(check_times(records[0], stub_waketime, boot_sleep) == 0, "times");
+    CHECK(check_sensor(records[0], records[1], env) == 0, "sensor");
+    return 0;
+}
+
+static int
+run_check(int cycles)
+{
+    for (int i=0; i<cycles; i++) {
+        if (run_cycle(i % 16 == 15)) {
+            fprintf(stderr, "cycle %d failed\n", i);
+            return -1;
+        }
+        stats.cycles++;
+    }
+    CHECK(!stats.bus_errors, "%d i2c lines not driven by gpio"
+          , stats.bus_errors);
+    CHECK(!stats.bad_regs, "%d unknown register accesses", stats.bad_regs);
+    return 0;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "  -c <cycles>       number of check cycles (1000)\n"
+            "  -s <seed>         random seed (time)\n"
+            "  -v                show firmware log messages\n"
+            , prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    int cycles = 1000;
+    unsigned int seed = time(NULL);
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:v")) != -1) {
+        switch (opt) {
+        case 'c': cycles = atoi(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        case 'v': esp_log_verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    printf("Wake stub check: %d cycles (seed %u)\n", cycles, seed);
+    srand(seed);
+    int ret = run_check(cycles);
+    if (stats.stub_wakes)
+        printf("Stub wakes: %d, awake %.2fms average (%.2fms max)\n"
+               "Full boot sensor read: %.2fms average\n"
+               "Max distance of a stub wake from its slot: %.0fus\n"
+               , stats.stub_wakes
+               , stats.stub_time * .001 / stats.stub_wakes
+               , stats.stub_time_max * .001
+               , stats.boot_sense_time * .001 / stats.full_boots
+               , stats.slot_error_max);
+    if (ret) {
+        printf("Wake stub check FAILED\n");
+        return 1;
+    }
+    printf("Wake stub check passed\n");
+    return 0;
+}
@@ -0,0 +1,226 @@
+// Check of TLS session resumption in the built-in publisher
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This tool compiles the built-in publisher with TLS support
+// (fw/main/mqttpub.c and fw/main/mqtttls.c with CONFIG_MQTT_TLS) on a
+// Linux host against the system mbedtls (the mbedtls 2.x api used by
+// esp-idf v4.1 - install the libmbedtls-dev package) and uploads to a
+// TLS broker the way the firmware does on each wake. Build and run it
+// with something like:
+//   gcc -O2 -Wall -DCONFIG_MQTT_TLS=1 -I scripts/host -I fw/main
+//     -o /tmp/tls_check scripts/host/tls_check.c fw/main/mqttpub.c
+//     -lmbedtls -lmbedx509 -lmbedcrypto
+//   /tmp/tls_check -n 20 mqtts://mqtt.local
+// Use the same broker as scripts/tls_handshake.py, which reports the
+// session type and lifetime the broker offers. The first upload must
+// perform a full handshake and each later upload must resume the
+// session stored (in simulated rtc memory) by the previous one. The
+// tool then checks that a session whose ticket has expired is not
+// offered, and that a session the broker rejects (a corrupted master
+// secret) is discarded so that the next upload is a full handshake.
+
+#include <stdio.h> // printf
+#include <stdlib.h> // atoi
+#include <string.h> // strlen
+#include <time.h> // clock_gettime
+#include <unistd.h> // getopt
+#include "mqttpub.h" // mqttpub_connect
+#include "timing.h" // TC_TLS_FULL_HANDSHAKE
+#include "sdkconfig.h" // CONFIG_MQTT_TLS
+
+#if !CONFIG_MQTT_TLS
+#error "Build with -DCONFIG_MQTT_TLS=1"
+#endif
+
+int esp_log_verbose;
+
+#include "mqtttls.c" // saved_session
+
+#define TOPIC "topic/tls_check"
+
+static const char *broker_url;
+static int timeout_ms = 5000;
+
+
+/****************************************************************
+ * Simulated device
+ ****************************************************************/
+
+// Wake time (advanced by the upload interval before each upload)
+static uint64_t wake_time;
+static int full_handshakes;
+
+uint64_t
+deepsleep_get_wake_time(void)
+{
+    return wake_time;
+}
+
+int64_t
+esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void
+esp_fill_random(void *buf, size_t len)
+{
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (!f || fread(buf, 1, len, f) != len) {
+        printf("Unable to read /dev/urandom\n");
+        exit(1);
+    }
+    fclose(f);
+}
+
+void
+timing_count(int counter)
+{
+    if (counter == TC_TLS_FULL_HANDSHAKE)
+        full_handshakes++;
+}
+
+void
+timing_note_deferred(int phase, int64_t start_time)
+{
+}
+
+// Connect, publish a message, and wait for its ack - returns 1 if the
+// handshake resumed the stored session, 0 for a full handshake, or -1
+// on error
+static int
+upload(double *phandshake_time)
+{
+    int full = full_handshakes;
+    int64_t start = esp_timer_get_time();
+    struct mqttpub_s mp;
+    int ret = mqttpub_connect(&mp, broker_url, "tls_check", 1, timeout_ms
+                              , mqttpub_resolve);
+    *phandshake_time = (esp_timer_get_time() - start) * .000001;
+    const char *msg = "tls check";
+    int id = ret ? -1 : mqttpub_publish(&mp, TOPIC, msg, strlen(msg), 1, 0);
+    ret = id < 0 ? -1 : mqttpub_flush(&mp);
+    while (!ret) {
+        struct mqttpub_msg_s m;
+        ret = mqttpub_read(&mp, &m);
+        if (!ret && m.type == MQTTPUB_CONNACK && m.id)
+            ret = -1;
+        if (!ret && m.type == MQTTPUB_PUBACK && m.id == id)
+            break;
+    }
+    mqttpub_close(&mp);
+    if (ret)
+        return -1;
+    return full_handshakes == full;
+}
+
+
+/****************************************************************
+ * Startup
+ ****************************************************************/
+
+static double
+median(double *values, int count)
+{
+    for (int i=1; i<count; i++)
+        for (int j=i; j>0 && values[j-1] > values[j]; j--) {
+            double v = values[j];
+            values[j] = values[j-1];
+            values[j-1] = v;
+        }
+    return count ? values[count / 2] : 0.;
+}
+
+static void
+usage(const char *prog)
+{
+    printf("Usage: %s [-n uploads] [-i interval_secs] [-t timeout_ms] [-v]"
+           " <mqtts://broker>\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    int count = 20, interval = 900, c;
+    while ((c = getopt(argc, argv, "n:i:t:v")) != -1) {
+        switch (c) {
+        case 'n': count = atoi(optarg); break;
+        case 'i': interval = atoi(optarg); break;
+        case 't': timeout_ms = atoi(optarg); break;
+        case 'v': esp_log_verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 || count < 2)
+        usage(argv[0]);
+    broker_url = argv[optind];
+
+    // Uploads with the session stored by the previous upload
+    double *times = calloc(count, sizeof(*times)), full_time = 0.;
+    int resumed_count = 0;
+    for (int i=0; i<count; i++) {
+        wake_time += interval * 1000000ULL;
+        double t;
+        int ret = upload(&t);
+        if (ret < 0) {
+            printf("Upload %d failed\n", i);
+            return 1;
+        }
+        if (!i) {
+            if (ret) {
+                printf("First upload did not perform a full handshake\n");
+                return 1;
+            }
+            full_time = t;
+            printf("Session: %s (ticket lifetime %us)\n"
+                   , saved_session.ticket_len ? "ticket" : "session id"
+                   , saved_session.ticket_lifetime);
+            continue;
+        }
+        times[resumed_count] = t;
+        resumed_count += ret;
+    }
+    printf("Resumed %d of %d sessions\n", resumed_count, count - 1);
+    printf("Connect with full handshake: %.2fms, resumed: median %.2fms\n"
+           , full_time * 1000., median(times, resumed_count) * 1000.);
+    if (resumed_count != count - 1) {
+        printf("Stored session was not resumed\n");
+        return 1;
+    }
+
+    // An expired ticket must not be offered
+    if (saved_session.ticket_lifetime) {
+        wake_time += (saved_session.ticket_lifetime + 1) * 1000000ULL;
+        double t;
+        if (upload(&t)) {
+            printf("Expired ticket was offered\n");
+            return 1;
+        }
+    }
+
+    // A session the broker rejects must be discarded
+    saved_session.master[0] ^= 0xff;
+    double t;
+    int ret = upload(&t);
+    if (ret > 0) {
+        printf("Corrupted session was resumed\n");
+        return 1;
+    }
+    if (ret < 0 && saved_session.valid) {
+        printf("Failed session was not discarded\n");
+        return 1;
+    }
+    if (upload(&t)) {
+        printf("Upload after a failed session did not perform a full"
+               " handshake\n");
+        return 1;
+    }
+    printf("TLS check passed\n");
+    return 0;
+}
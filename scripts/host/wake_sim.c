@@ -0,0 +1,711 @@
+// Simulate device sleep/wake cycles to estimate radio time and data loss
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This tool compiles the firmware's wake code (app_main(), the wake
+// scheduling and deep sleep task, the upload scheduler, the datalog,
+// the flash spool, and the sensor code) on a Linux host and runs it
+// against a virtual clock. The bme280 is emulated (see bme280_sim.c),
+// and the network and broker are modeled. Build it with something
+// like:
+//   gcc -O2 -Wall -I scripts/host -I fw/main -o /tmp/wake_sim
+//     scripts/host/wake_sim.c scripts/host/bme280_sim.c fw/main/main.c
+//     fw/main/deepsleep.c fw/main/schedule.c fw/main/datalog.c
+//     fw/main/spool.c fw/main/bme280.c fw/main/battery.c
+//     fw/main/timing.c -lm
+// The firmware options in scripts/host/sdkconfig.h may be changed with
+// -D (for example, -DCONFIG_UPLOAD_MAX_INTERVAL=3600 or
+// -DCONFIG_MQTT_LITE=1) as they would be with "make menuconfig". Then
+// run it with something like:
+//   /tmp/wake_sim -d 30 -o 48:36 -t sensor_trace.csv
+// A sensor trace has lines of "seconds,temperature,humidity" and is
+// replayed in a loop.
+
+#include <math.h> // fmod
+#include <setjmp.h> // setjmp
+#include <stdio.h> // printf
+#include <stdlib.h> // atof
+#include <string.h> // memset
+#include <sys/time.h> // struct timeval
+#include <unistd.h> // getopt
+#include "bme280_sim.h" // bme280_sim_set
+#include "datalog.h" // datalog_format_stream
+#include "driver/adc.h" // adc2_get_raw
+#include "esp_partition.h" // esp_partition_t
+#include "esp_sleep.h" // esp_deep_sleep_start
+#include "freertos/FreeRTOS.h" // portTICK_PERIOD_MS
+#include "freertos/task.h" // xTaskCreate
+#include "deepsleep.h" // deepsleep_note_wall_time
+#include "mqtt.h" // mqtt_start
+#include "network.h" // network_start
+#include "spool.h" // spool_format_stream
+#include "timing.h" // timing_count
+#include "sdkconfig.h" // CONFIG_MAX_RUN_TIME
+
+int esp_log_verbose;
+void app_main(void);
+
+// Wake costs (in seconds)
+#define BOOT_TIME .25 // from wake to app_main
+#define WIFI_INIT_TIME .1 // wifi init and rf calibration
+#define ASSOC_TIME .35 // access point association
+#define DHCP_TIME .8 // ip address request
+#define DHCP_LEASE (48 * 3600.)
+#define RTT .01 // network round trip time to the broker
+#define THROUGHPUT 200000. // bytes per second
+#define ESP_PUBLISH_TIME .003 // per message cost of the esp-idf client
+#define LITE_PUBLISH_TIME .0005 // per message cost of mqttpub.c
+#define FLASH_WRITE_TIME .015 // per spool chunk
+#define FLASH_ERASE_TIME .045 // per sector
+
+// Power use
+#define CPU_MA 40.
+#define RADIO_MA 130.
+#define SLEEP_UA 10.
+#define FLASH_ENDURANCE 100000
+
+#define SECS_PER_DAY (24. * 60. * 60.)
+// Wall time (in seconds) at the start of the simulation
+#define WALL_START 1600000123.
+
+
+/****************************************************************
+ * Virtual clock
+ ****************************************************************/
+
+// Time (in us) since the start of the simulation
+static double sim_time;
+// The rtc clock runs fast by rtc_drift ppm
+static double rtc_drift;
+// Rtc time of the current boot
+static uint64_t boot_rtc;
+
+static double
+rtc_rate(void)
+{
+    return 1. + rtc_drift * 1e-6;
+}
+
+static uint64_t
+rtc_now(void)
+{
+    return sim_time * rtc_rate();
+}
+
+// Advance the clock by the given number of seconds
+static void
+sim_advance(double secs)
+{
+    sim_time += secs * 1000000.;
+}
+
+// Advance the clock to the given rtc time
+static void
+sim_advance_rtc(uint64_t rtc)
+{
+    if (rtc > rtc_now())
+        sim_time = rtc / rtc_rate();
+}
+
+// The firmware's system time is the rtc clock. (This replaces the C
+// library function for the firmware code linked into this tool.)
+int
+gettimeofday(struct timeval *tv, void *tz)
+{
+    uint64_t now = rtc_now();
+    tv->tv_sec = now / 1000000;
+    tv->tv_usec = now % 1000000;
+    return 0;
+}
+
+int64_t
+esp_timer_get_time(void)
+{
+    return rtc_now() - boot_rtc;
+}
+
+void
+ets_delay_us(uint32_t us)
+{
+    sim_advance(us * .000001);
+}
+
+
+/****************************************************************
+ * Statistics
+ ****************************************************************/
+
+static struct {
+    int wakes, uploads, upload_failures, timeouts, publishes;
+    int records_uploaded, flash_writes, flash_erases, flash_bytes;
+    double cpu_time, radio_time;
+    // Distance (in seconds) of each wake from the wall clock grid
+    double slot_error_sum, slot_error_max;
+    int slot_count;
+} stats;
+
+
+/****************************************************************
+ * Deep sleep
+ ****************************************************************/
+
+static jmp_buf sleep_jmp;
+static TaskFunction_t sleep_task;
+static int sleep_notified, sleep_timer_set;
+static uint64_t sleep_timer_us, sleep_wait_start;
+
+// Only the deep sleep task is created during a wake
+BaseType_t
+xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack
+            , void *param, int prio, TaskHandle_t *handle)
+{
+    sleep_task = fn;
+    sleep_notified = 0;
+    sleep_wait_start = rtc_now();
+    return 1;
+}
+
+BaseType_t
+xTaskNotifyGive(TaskHandle_t handle)
+{
+    sleep_notified = 1;
+    return 1;
+}
+
+// The deep sleep task waits from when it is created (or last woke)
+uint32_t
+ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    uint32_t ret = sleep_notified;
+    if (!ret)
+        sim_advance_rtc(sleep_wait_start
+                        + (uint64_t)ticks * portTICK_PERIOD_MS * 1000);
+    sleep_notified = 0;
+    sleep_wait_start = rtc_now();
+    return ret;
+}
+
+// Run the deep sleep task (it does not return)
+static void
+run_sleep_task(void)
+{
+    sleep_task(NULL);
+    abort();
+}
+
+int
+esp_sleep_get_wakeup_cause(void)
+{
+    return stats.wakes > 1 ? ESP_SLEEP_WAKEUP_TIMER : 0;
+}
+
+int
+esp_sleep_enable_timer_wakeup(uint64_t time_in_us)
+{
+    sleep_timer_us = time_in_us;
+    sleep_timer_set = 1;
+    return 0;
+}
+
+int
+esp_sleep_pd_config(esp_sleep_pd_domain_t domain
+                    , esp_sleep_pd_option_t option)
+{
+    return 0;
+}
+
+void
+esp_deep_sleep_disable_rom_logging(void)
+{
+}
+
+int
+esp_wifi_stop(void)
+{
+    return 0;
+}
+
+void
+esp_deep_sleep_start(void)
+{
+    longjmp(sleep_jmp, 1);
+}
+
+
+/****************************************************************
+ * Battery and flash
+ ****************************************************************/
+
+#define BATTERY_VOLTAGE 3.3
+
+int
+adc2_config_channel_atten(int channel, int atten)
+{
+    return 0;
+}
+
+int
+adc2_pad_get_io_num(int channel, gpio_num_t *gpio)
+{
+    *gpio = 15;
+    return 0;
+}
+
+int
+adc2_get_raw(int channel, int width, int *raw)
+{
+    float scale = atof(CONFIG_BATTERY_SCALE) * (2.2f / 4095.0f);
+    *raw = (BATTERY_VOLTAGE - atof(CONFIG_BATTERY_OFFSET)) / scale + .5;
+    return 0;
+}
+
+int gpio_pullup_en(gpio_num_t gpio) { return 0; }
+int gpio_pullup_dis(gpio_num_t gpio) { return 0; }
+int gpio_pulldown_en(gpio_num_t gpio) { return 0; }
+int gpio_pulldown_dis(gpio_num_t gpio) { return 0; }
+
+// Flash partition used by the spool (see fw/partitions.csv)
+#define SPOOL_SIZE 0xf000
+#define SECTOR_SIZE 4096
+
+static uint8_t spool_flash[SPOOL_SIZE];
+static int sector_erases[SPOOL_SIZE / SECTOR_SIZE];
+static const esp_partition_t spool_partition = {
+    .address = 0x391000, .size = SPOOL_SIZE, .label = "spiffs",
+};
+
+const esp_partition_t *
+esp_partition_find_first(int type, int subtype, const char *label)
+{
+    if (type != ESP_PARTITION_TYPE_DATA
+        || subtype != ESP_PARTITION_SUBTYPE_DATA_SPIFFS)
+        return NULL;
+    return &spool_partition;
+}
+
+int
+esp_partition_read(const esp_partition_t *partition, size_t src_offset
+                   , void *dst, size_t size)
+{
+    if (src_offset + size > partition->size)
+        return -1;
+    memcpy(dst, &spool_flash[src_offset], size);
+    return 0;
+}
+
+// Like flash, a write can only clear bits (the sector must be erased)
+int
+esp_partition_write(const esp_partition_t *partition, size_t dst_offset
+                    , const void *src, size_t size)
+{
+    if (dst_offset + size > partition->size)
+        return -1;
+    const uint8_t *s = src;
+    for (int i=0; i<size; i++)
+        spool_flash[dst_offset + i] &= s[i];
+    stats.flash_writes++;
+    stats.flash_bytes += size;
+    sim_advance(FLASH_WRITE_TIME);
+    return 0;
+}
+
+int
+esp_partition_erase_range(const esp_partition_t *partition
+                          , size_t offset, size_t size)
+{
+    if (offset % SECTOR_SIZE || size % SECTOR_SIZE
+        || offset + size > partition->size)
+        return -1;
+    memset(&spool_flash[offset], 0xff, size);
+    for (int i=0; i<size / SECTOR_SIZE; i++) {
+        sector_erases[offset / SECTOR_SIZE + i]++;
+        stats.flash_erases++;
+        sim_advance(FLASH_ERASE_TIME);
+    }
+    return 0;
+}
+
+// No mqtt firmware transfer is simulated
+int
+otamqtt_is_pending(void)
+{
+    return 0;
+}
+
+
+/****************************************************************
+ * Sensor trace
+ ****************************************************************/
+
+struct sample_s {
+    double time, temperature, humidity;
+};
+
+static struct sample_s *trace;
+static int trace_count;
+
+static int
+load_trace(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f)
+        return -1;
+    char line[256];
+    int size = 0;
+    while (fgets(line, sizeof(line), f)) {
+        struct sample_s s;
+        if (sscanf(line, "%lf,%lf,%lf", &s.time, &s.temperature
+                   , &s.humidity) != 3)
+            continue;
+        if (trace_count >= size) {
+            size = size ? size * 2 : 1024;
+            trace = realloc(trace, size * sizeof(*trace));
+            if (!trace) {
+                fclose(f);
+                return -1;
+            }
+        }
+        if (trace_count && s.time < trace[trace_count - 1].time)
+            continue;
+        trace[trace_count++] = s;
+    }
+    fclose(f);
+    return trace_count ? 0 : -1;
+}
+
+// Set the emulated sensor to the trace reading at the current time
+static void
+update_sensor(void)
+{
+    if (!trace_count) {
+        bme280_sim_set(20., 1013.25, 50.);
+        return;
+    }
+    double start = trace[0].time;
+    double duration = trace[trace_count - 1].time - start + 1.;
+    double t = start + fmod(sim_time * .000001, duration);
+    int lo = 0, hi = trace_count;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (trace[mid].time <= t)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    bme280_sim_set(trace[lo].temperature, 1013.25, trace[lo].humidity);
+}
+
+
+/****************************************************************
+ * Network model
+ ****************************************************************/
+
+#define MAX_OUTAGES 16
+
+static struct {
+    double start, end;
+} outages[MAX_OUTAGES];
+static int outage_count;
+static double ap_fail = .01, lease_end = -1., radio_start, sim_start;
+static unsigned int seed;
+static int radio_on;
+
+static int
+network_available(void)
+{
+    double now = (sim_time - sim_start) * .000001;
+    for (int i=0; i<outage_count; i++)
+        if (now >= outages[i].start && now < outages[i].end)
+            return 0;
+    return rand_r(&seed) >= ap_fail * RAND_MAX;
+}
+
+static void
+radio_off(void)
+{
+    if (!radio_on)
+        return;
+    stats.radio_time += (sim_time - radio_start) * .000001;
+    radio_on = 0;
+}
+
+int
+network_start(void)
+{
+    stats.uploads++;
+    radio_on = 1;
+    radio_start = sim_time;
+    sim_advance(WIFI_INIT_TIME);
+    return 0;
+}
+
+void
+network_disconnect(void)
+{
+    radio_off();
+}
+
+// Wait for the deep sleep task to end the wake at its timeout
+static void
+wait_timeout(void)
+{
+    stats.upload_failures++;
+    run_sleep_task();
+}
+
+// Format the next record for upload (returns length, or -1 at the end)
+static int
+next_record(int *pspool, int *ppos)
+{
+    char buf[1024];
+    struct datalog_stream_s ds = { .buf = buf, .size = sizeof(buf) };
+    int ret;
+    // Records stored in flash are the oldest - they are uploaded first
+    while (*pspool) {
+        ret = spool_format_stream(ppos, &ds);
+        if (ret > 0)
+            return ds.len;
+        if (ret < 0) {
+            *pspool = 0;
+            *ppos = -1;
+        }
+    }
+    do {
+        ret = datalog_format_stream(ppos, &ds);
+    } while (!ret);
+    return ret > 0 ? ds.len : -1;
+}
+
+// Upload the pending records (see fw/main/mqtt.c). The device wakes
+// with its deep sleep task already waiting on the run time limit.
+int
+mqtt_start(void)
+{
+    double now = sim_time * .000001;
+    sim_advance(ASSOC_TIME * (.8 + .4 * rand_r(&seed) / RAND_MAX));
+    if (!network_available()) {
+        timing_count(TC_WIFI_FAIL);
+        wait_timeout();
+    }
+    if (now >= lease_end) {
+        sim_advance(DHCP_TIME * (.8 + .4 * rand_r(&seed) / RAND_MAX));
+        lease_end = now + DHCP_LEASE;
+    }
+#if CONFIG_SNTP_SYNC
+    deepsleep_note_wall_time((WALL_START + sim_time * .000001) * 1000000.);
+#endif
+
+#if CONFIG_MQTT_LITE
+    // tcp connect, then one pipelined burst and the stream of acks
+    double start = sim_time + 2. * RTT * 1000000.;
+    double per_msg = LITE_PUBLISH_TIME;
+#else
+    // tcp connect, connect/connack, subscribe/suback, ota publish/puback
+    double start = sim_time + 4. * RTT * 1000000.;
+    double per_msg = ESP_PUBLISH_TIME;
+#endif
+    double deadline = (boot_rtc + CONFIG_MAX_RUN_TIME * 1000000.) / rtc_rate();
+    double bytes = 0., done = start;
+    int spool = 1, pos = -1, acked = 0, pending = 0, batch_len = 0, len;
+    for (;;) {
+        len = next_record(&spool, &pos);
+        if (len >= 0 && CONFIG_MQTT_BATCH_SIZE && pending
+            && batch_len + len + 1 <= CONFIG_MQTT_BATCH_SIZE) {
+            // Add to the current batch
+            pending++;
+            batch_len += len + 1;
+            continue;
+        }
+        if (pending) {
+            // Send the publish
+            bytes += batch_len;
+            done = start + (bytes / THROUGHPUT + RTT + per_msg) * 1000000.;
+            if (done > deadline)
+                break;
+            stats.publishes++;
+            acked += pending;
+            start += per_msg * 1000000.;
+        }
+        if (len < 0)
+            break;
+        pending = 1;
+        batch_len = len + 2;
+    }
+    // Each acked record is removed as its ack arrives
+    stats.records_uploaded += acked;
+    while (acked--)
+        if (spool_expire())
+            datalog_expire();
+    if (done > deadline)
+        wait_timeout();
+    sim_time = done;
+    return 0;
+}
+
+
+/****************************************************************
+ * Wake loop
+ ****************************************************************/
+
+#if CONFIG_SNTP_SYNC
+// Note how far the wake is from the wall clock measurement grid
+static void
+note_slot_error(void)
+{
+    double wall = WALL_START + sim_time * .000001;
+    double err = fmod(wall, CONFIG_MEASURE_INTERVAL);
+    if (err > CONFIG_MEASURE_INTERVAL / 2.)
+        err = CONFIG_MEASURE_INTERVAL - err;
+    stats.slot_error_sum += err;
+    stats.slot_count++;
+    if (err > stats.slot_error_max)
+        stats.slot_error_max = err;
+}
+#endif
+
+// Count the records that were not uploaded by the end of the test
+static int
+count_pending(void)
+{
+    int spool = 1, pos = -1, count = 0;
+    while (next_record(&spool, &pos) >= 0)
+        count++;
+    return count;
+}
+
+static void
+simulate(double days)
+{
+    double end_time = days * SECS_PER_DAY * 1000000.;
+    // Start with a random (not grid aligned) wall time
+    sim_start = (rand_r(&seed) % CONFIG_MEASURE_INTERVAL) * 1000000.;
+    sim_time = sim_start;
+    end_time += sim_time;
+    while (sim_time < end_time) {
+        double wake_time = sim_time;
+        stats.wakes++;
+#if CONFIG_SNTP_SYNC
+        if (stats.wakes > 2)
+            note_slot_error();
+#endif
+        update_sensor();
+        sim_advance(BOOT_TIME);
+        boot_rtc = rtc_now();
+        sleep_timer_set = 0;
+        if (!setjmp(sleep_jmp)) {
+            app_main();
+            run_sleep_task();
+        }
+        radio_off();
+        stats.cpu_time += (sim_time - wake_time) * .000001;
+        if (!sleep_timer_set) {
+            printf("Device shut down\n");
+            break;
+        }
+        sim_advance_rtc(rtc_now() + sleep_timer_us);
+    }
+}
+
+
+/****************************************************************
+ * Reporting
+ ****************************************************************/
+
+static void
+report(double days, double battery_mah)
+{
+    int pending = count_pending();
+    int lost = stats.wakes - stats.records_uploaded - pending;
+    double cpu_mah = stats.cpu_time * CPU_MA / 3600.;
+    double radio_mah = stats.radio_time * (RADIO_MA - CPU_MA) / 3600.;
+    double sleep_mah = days * SECS_PER_DAY * SLEEP_UA / 1000. / 3600.;
+    double total_mah = cpu_mah + radio_mah + sleep_mah;
+    printf("Simulated %.1f days (%d wakes, %d uploads, %d upload failures)\n"
+           , days, stats.wakes, stats.uploads, stats.upload_failures);
+    printf("Per day:\n");
+    printf("  cpu on time:   %8.1f s\n", stats.cpu_time / days);
+    printf("  radio on time: %8.1f s\n", stats.radio_time / days);
+    printf("  publishes:     %8.1f\n", stats.publishes / days);
+    printf("  records lost:  %8.1f (of %.1f, %d pending at the end)\n"
+           , lost / days, stats.wakes / days, pending);
+    printf("  energy:        %8.2f mAh\n", total_mah / days);
+    printf("Flash spool: %d writes (%d bytes), %d sector erases\n"
+           , stats.flash_writes, stats.flash_bytes, stats.flash_erases);
+    int max_erases = 1;
+    for (int i=0; i<SPOOL_SIZE / SECTOR_SIZE; i++)
+        if (sector_erases[i] > max_erases)
+            max_erases = sector_erases[i];
+    printf("  max sector erases: %d (%.0f years to %d erase cycles)\n"
+           , max_erases, FLASH_ENDURANCE * days / (max_erases * 365.)
+           , FLASH_ENDURANCE);
+    if (stats.slot_count)
+        printf("Wake distance from the wall clock grid: mean %.3fs"
+               " max %.3fs\n", stats.slot_error_sum / stats.slot_count
+               , stats.slot_error_max);
+    if (battery_mah > 0.)
+        printf("Estimated battery life: %.1f days\n"
+               , battery_mah / (total_mah / days));
+}
+
+
+/****************************************************************
+ * Startup
+ ****************************************************************/
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "  -d <days>         number of days to simulate (30)\n"
+            "  -s <seed>         random seed (0)\n"
+            "  -t <file>         sensor trace (seconds,temperature,humidity)\n"
+            "  -o <start:hours>  network outage (start and duration in"
+            " hours)\n"
+            "  -f <fraction>     chance an upload can not connect (0.01)\n"
+            "  -r <ppm>          rtc clock drift (0)\n"
+            "  -b <mAh>          battery capacity for a life estimate\n"
+            "  -v                show firmware log messages\n"
+            , prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    double days = 30., battery_mah = 0.;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:s:t:o:f:r:b:v")) != -1) {
+        switch (opt) {
+        case 'd': days = atof(optarg); break;
+        case 's': seed = atoi(optarg); break;
+        case 't':
+            if (load_trace(optarg)) {
+                fprintf(stderr, "Unable to read trace %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o': {
+            double start, duration;
+            if (outage_count >= MAX_OUTAGES
+                || sscanf(optarg, "%lf:%lf", &start, &duration) != 2)
+                usage(argv[0]);
+            outages[outage_count].start = start * 3600.;
+            outages[outage_count].end = (start + duration) * 3600.;
+            outage_count++;
+            break;
+        }
+        case 'f': ap_fail = atof(optarg); break;
+        case 'r': rtc_drift = atof(optarg); break;
+        case 'b': battery_mah = atof(optarg); break;
+        case 'v': esp_log_verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || days <= 0.)
+        usage(argv[0]);
+    simulate(days);
+    report(days, battery_mah);
+    return 0;
+}
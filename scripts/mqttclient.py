@@ -0,0 +1,248 @@
+# Minimal MQTT 3.1.1 client for the host tools
+#
+# Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import socket, ssl, struct, time, urllib.parse
+
+# This module only uses the standard python library (like
+# fw/main/mqttpub.c it implements just enough of MQTT for these tools).
+
+CONNECT, CONNACK, PUBLISH, PUBACK = 1, 2, 3, 4
+SUBSCRIBE, SUBACK, PINGREQ, PINGRESP, DISCONNECT = 8, 9, 12, 13, 14
+
+class error(Exception):
+    pass
+
+class Message:
+    def __init__(self, topic, payload, qos, retain, pid):
+        self.topic = topic
+        self.payload = payload
+        self.qos = qos
+        self.retain = retain
+        self.pid = pid
+
+def parse_url(url):
+    # Parse a "mqtt://[user[:pass]@]host[:port]" (or "mqtts://") url
+    u = urllib.parse.urlsplit(url)
+    if u.scheme not in ('mqtt', 'mqtts') or not u.hostname:
+        raise error("Invalid broker url '%s'" % (url,))
+    tls = u.scheme == 'mqtts'
+    port = u.port or (8883 if tls else 1883)
+    return u.hostname, port, u.username, u.password, tls
+
+def make_ssl_context(version=None):
+    # Like the firmware, the broker certificate is not verified
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    context.check_hostname = False
+    context.verify_mode = ssl.CERT_NONE
+    if version is not None:
+        context.minimum_version = context.maximum_version = version
+    return context
+
+def encode_str(s):
+    if isinstance(s, str):
+        s = s.encode()
+    return struct.pack('>H', len(s)) + s
+
+def encode_len(length):
+    out = bytearray()
+    while 1:
+        b = length & 0x7f
+        length >>= 7
+        out.append(b | (0x80 if length else 0))
+        if not length:
+            return bytes(out)
+
+class MQTTClient:
+    def __init__(self, url, client_id="", clean_session=True, keepalive=60,
+                 ssl_context=None, manual_ack=False):
+        (self.host, self.port, self.user, self.password,
+         tls) = parse_url(url)
+        self.ssl_context = None
+        if tls:
+            self.ssl_context = ssl_context or make_ssl_context()
+        # TLS session offered on the next connect (and handshake time)
+        self.tls_session = None
+        self.tls_resumed = False
+        self.handshake_time = 0.
+        self.client_id = client_id
+        self.clean_session = clean_session
+        self.keepalive = keepalive
+        self.sock = None
+        self.inbuf = bytearray()
+        self.outbuf = bytearray()
+        self.next_id = 0
+        self.last_send = 0.
+        # Packet ids of acknowledged publishes and subscribes
+        self.acked = set()
+        self.messages = []
+        # Received qos 1 messages are acknowledged immediately unless
+        # manual_ack is set (the caller then calls puback() once it has
+        # handled the message, and the broker resends it if not acked)
+        self.manual_ack = manual_ack
+    # Connection handling
+    def connect(self, timeout=10.):
+        self.sock = socket.create_connection((self.host, self.port),
+                                             timeout)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        if self.ssl_context is not None:
+            start = time.time()
+            self.sock = self.ssl_context.wrap_socket(
+                self.sock, server_hostname=self.host,
+                session=self.tls_session)
+            self.handshake_time = time.time() - start
+            self.tls_resumed = self.sock.session_reused
+            self.tls_session = self.sock.session
+        flags = 0x02 if self.clean_session else 0x00
+        payload = encode_str(self.client_id)
+        if self.user is not None:
+            flags |= 0x80
+            payload += encode_str(self.user)
+            if self.password is not None:
+                flags |= 0x40
+                payload += encode_str(self.password)
+        body = (encode_str("MQTT") + struct.pack('>BBH', 4, flags,
+                                                  self.keepalive) + payload)
+        self.send_packet(CONNECT << 4, body)
+        self.flush()
+        ptype, flags, body = self.read_packet(timeout)
+        if ptype != CONNACK or len(body) < 2:
+            raise error("Unexpected response to connect")
+        if body[1]:
+            raise error("Connection refused (%d)" % (body[1],))
+        return body[0] & 0x01
+    def close(self):
+        if self.sock is None:
+            return
+        try:
+            self.send_packet(DISCONNECT << 4, b"")
+            self.flush()
+        except (socket.error, error):
+            pass
+        if self.ssl_context is not None:
+            # A TLS 1.3 session ticket arrives after the handshake
+            self.tls_session = self.sock.session
+            # Send a close_notify (as the firmware does) - servers may
+            # not resume a session that was not shut down cleanly
+            try:
+                self.sock.unwrap()
+            except (socket.error, ssl.SSLError):
+                pass
+        self.sock.close()
+        self.sock = None
+    # Packet output
+    def alloc_id(self):
+        self.next_id = (self.next_id % 0xffff) + 1
+        return self.next_id
+    def send_packet(self, type_flags, body):
+        self.outbuf += bytes([type_flags]) + encode_len(len(body)) + body
+    def flush(self):
+        if self.outbuf:
+            self.sock.sendall(self.outbuf)
+            self.outbuf = bytearray()
+            self.last_send = time.time()
+    def subscribe(self, topics, qos=1):
+        pid = self.alloc_id()
+        body = struct.pack('>H', pid)
+        for topic in topics:
+            body += encode_str(topic) + bytes([qos])
+        self.send_packet((SUBSCRIBE << 4) | 0x02, body)
+        return pid
+    def publish(self, topic, payload, qos=0, retain=False):
+        if isinstance(payload, str):
+            payload = payload.encode()
+        body = encode_str(topic)
+        pid = 0
+        if qos:
+            pid = self.alloc_id()
+            body += struct.pack('>H', pid)
+        flags = (PUBLISH << 4) | (qos << 1) | (1 if retain else 0)
+        self.send_packet(flags, body + payload)
+        return pid
+    def puback(self, pid):
+        self.send_packet(PUBACK << 4, struct.pack('>H', pid))
+    # Packet input
+    def parse_packet(self):
+        # Returns (type, flags, body) of a complete packet (or None)
+        length = shift = 0
+        pos = 1
+        while 1:
+            if pos >= len(self.inbuf) or pos > 4:
+                return None
+            c = self.inbuf[pos]
+            pos += 1
+            length |= (c & 0x7f) << shift
+            if not c & 0x80:
+                break
+            shift += 7
+        if pos + length > len(self.inbuf):
+            return None
+        hdr = self.inbuf[0]
+        body = bytes(self.inbuf[pos:pos+length])
+        del self.inbuf[:pos+length]
+        return hdr >> 4, hdr & 0x0f, body
+    def read_packet(self, timeout):
+        # Wait for the next packet (returns None on timeout)
+        end = time.time() + timeout
+        while 1:
+            pkt = self.parse_packet()
+            if pkt is not None:
+                return pkt
+            wait = end - time.time()
+            if wait <= 0.:
+                return None
+            self.sock.settimeout(wait)
+            try:
+                data = self.sock.recv(65536)
+            except socket.timeout:
+                return None
+            if not data:
+                raise error("Connection closed by broker")
+            self.inbuf += data
+    def handle_packet(self, ptype, flags, body):
+        if ptype == PUBLISH:
+            tlen, = struct.unpack_from('>H', body)
+            topic = body[2:2+tlen].decode('utf-8', 'replace')
+            pos = 2 + tlen
+            qos = (flags >> 1) & 0x03
+            pid = 0
+            if qos:
+                pid, = struct.unpack_from('>H', body, pos)
+                pos += 2
+                if not self.manual_ack:
+                    self.puback(pid)
+            self.messages.append(Message(topic, body[pos:], qos,
+                                         flags & 0x01, pid))
+        elif ptype in (PUBACK, SUBACK):
+            pid, = struct.unpack_from('>H', body)
+            self.acked.add(pid)
+    def poll(self, timeout):
+        # Process incoming packets for up to timeout seconds (returns
+        # early once a message or ack is available)
+        if self.keepalive and time.time() - self.last_send > self.keepalive/2:
+            self.send_packet(PINGREQ << 4, b"")
+        self.flush()
+        pkt = self.read_packet(timeout)
+        while pkt is not None:
+            self.handle_packet(*pkt)
+            pkt = self.parse_packet()
+        self.flush()
+    def get_messages(self, timeout):
+        # Return received messages (waiting up to timeout seconds)
+        if not self.messages:
+            self.poll(timeout)
+        messages = self.messages
+        self.messages = []
+        return messages
+    def wait_acks(self, pids, timeout):
+        # Wait for the given packet ids to be acknowledged
+        end = time.time() + timeout
+        pids = set(pids)
+        while not pids <= self.acked:
+            wait = end - time.time()
+            if wait <= 0.:
+                return False
+            self.poll(wait)
+        self.acked -= pids
+        return True
@@ -0,0 +1,230 @@
+#!/usr/bin/env python3
+# Generate compressed or delta images for over-the-air updates
+#
+# Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, struct, hashlib, zlib
+
+# This tool converts a firmware image (fw/build/humidwifi.bin) into an
+# image that the firmware decodes while it is downloaded (see
+# fw/main/otaimage.c). For example:
+#  ota_image.py fw/build/humidwifi.bin humidwifi.img
+# A delta image only contains the differences from the firmware
+# currently running on the device (it is only accepted by devices
+# running exactly that firmware):
+#  ota_image.py --base old/humidwifi.bin fw/build/humidwifi.bin delta.img
+
+MAGIC = b"HWOI"
+VERSION = 1
+OIF_DELTA = 0x01
+HEADER_FORMAT = "<4sBBHII32s32s"
+OP_DATA, OP_COPY, OP_DIFF = 0, 1, 2
+
+# Length of the base strings indexed when searching for matches
+KEY_LENGTH = 8
+# Minimum length of an exact match that is copied from the base
+MIN_MATCH = 16
+
+
+######################################################################
+# Operation encoding
+######################################################################
+
+def encode_varint(v):
+    out = bytearray()
+    while 1:
+        b = v & 0x7f
+        v >>= 7
+        out.append(b | (0x80 if v else 0))
+        if not v:
+            return bytes(out)
+
+def zigzag(v):
+    return (v << 1) if v >= 0 else ((-v << 1) - 1)
+
+class OpWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.base_pos = 0
+        self.counts = {OP_DATA: 0, OP_COPY: 0, OP_DIFF: 0}
+        self.sizes = {OP_DATA: 0, OP_COPY: 0, OP_DIFF: 0}
+    def add(self, op, length):
+        self.counts[op] += 1
+        self.sizes[op] += length
+    def data(self, data):
+        if not data:
+            return
+        self.add(OP_DATA, len(data))
+        self.out += bytes([OP_DATA]) + encode_varint(len(data)) + data
+    def base_op(self, op, offset, length):
+        self.add(op, length)
+        rel = zigzag(offset - self.base_pos)
+        self.out += bytes([op]) + encode_varint(rel) + encode_varint(length)
+        self.base_pos = offset + length
+    def copy(self, offset, length):
+        self.base_op(OP_COPY, offset, length)
+    def diff(self, offset, data, base):
+        self.base_op(OP_DIFF, offset, len(data))
+        self.out += bytes([(d - b) & 0xff for d, b in zip(
+            data, base[offset:offset+len(data)])])
+
+
+######################################################################
+# Delta generation
+######################################################################
+
+def match_length(base, bpos, data, dpos):
+    limit = min(len(base) - bpos, len(data) - dpos)
+    length = 0
+    step = 256
+    while (length + step <= limit and base[bpos+length:bpos+length+step]
+           == data[dpos+length:dpos+length+step]):
+        length += step
+    while length < limit and base[bpos+length] == data[dpos+length]:
+        length += 1
+    return length
+
+# Store data that is not an exact match. Code changes move functions
+# and data, which alters the addresses embedded in otherwise unchanged
+# code. Such regions are sent as differences from the base (which are
+# mostly zero and compress well).
+def add_unmatched(writer, base, data, offset):
+    if not data:
+        return
+    if offset >= 0 and offset + len(data) <= len(base):
+        same = sum([1 for d, b in zip(data, base[offset:offset+len(data)])
+                    if d == b])
+        if same * 2 >= len(data):
+            writer.diff(offset, data, base)
+            return
+    writer.data(data)
+
+def encode_delta(base, data, writer):
+    index = {}
+    for i in range(len(base) - KEY_LENGTH, -1, -1):
+        index[base[i:i+KEY_LENGTH]] = i
+    pos = unmatched = 0
+    # Offset from the data to the base of the last match
+    delta = 0
+    while pos <= len(data) - KEY_LENGTH:
+        key = data[pos:pos+KEY_LENGTH]
+        bpos = pos + delta
+        if bpos < 0 or base[bpos:bpos+KEY_LENGTH] != key:
+            bpos = index.get(key)
+            if bpos is None:
+                pos += 1
+                continue
+        length = match_length(base, bpos, data, pos)
+        if length < MIN_MATCH:
+            pos += 1
+            continue
+        add_unmatched(writer, base, data[unmatched:pos],
+                      unmatched + delta)
+        writer.copy(bpos, length)
+        delta = bpos - pos
+        pos = unmatched = pos + length
+    add_unmatched(writer, base, data[unmatched:], unmatched + delta)
+
+
+######################################################################
+# Image generation
+######################################################################
+
+def build_image(data, base=None):
+    writer = OpWriter()
+    flags = 0
+    base_sha = b"\0" * 32
+    if base is None:
+        writer.data(data)
+        base = b""
+    else:
+        flags |= OIF_DELTA
+        base_sha = hashlib.sha256(base).digest()
+        encode_delta(base, data, writer)
+    header = struct.pack(HEADER_FORMAT, MAGIC, VERSION, flags,
+                         struct.calcsize(HEADER_FORMAT), len(data),
+                         len(base), hashlib.sha256(data).digest(), base_sha)
+    return header + zlib.compress(bytes(writer.out), 9), writer
+
+# Decode an image (a reference for the firmware decoder)
+def decode_image(image, base=b""):
+    hdr_size = struct.calcsize(HEADER_FORMAT)
+    (magic, version, flags, header_size, image_size, base_size,
+     image_sha, base_sha) = struct.unpack_from(HEADER_FORMAT, image)
+    if magic != MAGIC or version != VERSION or header_size != hdr_size:
+        raise ValueError("Unsupported image")
+    # A full image has no base (and a delta image must have one)
+    if (flags & ~OIF_DELTA
+        or (flags & OIF_DELTA and not base_size)
+        or (not flags & OIF_DELTA
+            and (base_size or base_sha != b"\0" * 32))):
+        raise ValueError("Invalid image header")
+    if flags & OIF_DELTA:
+        base = base[:base_size]
+        if hashlib.sha256(base).digest() != base_sha:
+            raise ValueError("Base does not match")
+    ops = zlib.decompress(image[hdr_size:])
+    out = bytearray()
+    pos = base_pos = 0
+    def get_varint():
+        nonlocal pos
+        v = shift = 0
+        while 1:
+            c = ops[pos]
+            pos += 1
+            v |= (c & 0x7f) << shift
+            shift += 7
+            if not c & 0x80:
+                return v
+    while pos < len(ops):
+        op = ops[pos]
+        pos += 1
+        if op == OP_DATA:
+            length = get_varint()
+            out += ops[pos:pos+length]
+            pos += length
+            continue
+        v = get_varint()
+        base_pos += (v >> 1) ^ -(v & 1)
+        length = get_varint()
+        chunk = base[base_pos:base_pos+length]
+        if op == OP_DIFF:
+            chunk = bytes([(b + d) & 0xff for b, d in zip(
+                chunk, ops[pos:pos+length])])
+            pos += length
+        out += chunk
+        base_pos += length
+    if len(out) != image_size or hashlib.sha256(out).digest() != image_sha:
+        raise ValueError("Image checksum mismatch")
+    return bytes(out)
+
+def main():
+    usage = "%prog [options] <firmware.bin> <output.img>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-b", "--base", type="string", dest="base",
+                    help="generate a delta from the given running firmware")
+    options, args = opts.parse_args()
+    if len(args) != 2:
+        opts.error("Incorrect number of arguments")
+    data = open(args[0], 'rb').read()
+    base = None
+    if options.base:
+        base = open(options.base, 'rb').read()
+    image, writer = build_image(data, base)
+    # Verify the image before writing it
+    decode_image(image, base or b"")
+    f = open(args[1], 'wb')
+    f.write(image)
+    f.close()
+    if base is not None:
+        c, s = writer.counts, writer.sizes
+        print("Delta: %d bytes copied (%d ops), %d bytes differenced"
+              " (%d ops), %d new bytes (%d ops)" % (
+                  s[OP_COPY], c[OP_COPY], s[OP_DIFF], c[OP_DIFF],
+                  s[OP_DATA], c[OP_DATA]))
+    print("Wrote %s: %d bytes (%.1f%% of the %d byte firmware)" % (
+        args[1], len(image), 100. * len(image) / len(data), len(data)))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+# Deliver a firmware update to a device over its mqtt connection
+#
+# Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, optparse, time, struct, hashlib, socket
+import mqttclient
+
+# This script offers a firmware image to a device (by publishing a
+# retained "mqtt:<size>:<sha256>" request to its ota topic) and then
+# serves the chunks the device requests (see fw/main/otamqtt.c). Run it
+# with something like:
+#  ota_publish.py --broker mqtt://mqtt.local fw/build/humidwifi.bin
+# and leave it running until the device reports the update is
+# installed. The device requests chunks while it is awake and resumes
+# the transfer on later wakes if it runs out of time.
+
+RECONNECT_DELAY = 5.
+# Chunks are resent if the device does not acknowledge them in time
+RETRANSMIT_TIME = 2.
+
+
+######################################################################
+# Chunk server
+######################################################################
+
+class ChunkServer:
+    def __init__(self, data, prefix):
+        self.data = data
+        self.data_topic = prefix + "/ota_data"
+        self.last_ack = -1
+        self.session = None
+        self.last_ack_time = 0.
+        self.chunk_size = self.window = 0
+        # End of the chunks sent in the current window
+        self.sent = 0
+        self.sessions = 0
+        self.start_time = self.session_offset = None
+        self.status = None
+    def handle_ack(self, client, payload):
+        payload = payload.decode('ascii', 'replace')
+        if payload in ("done", "fail"):
+            self.status = payload
+            return
+        try:
+            offset, chunk_size, window, session = [
+                int(v) for v in payload.split(',')]
+        except ValueError:
+            return
+        if session != self.session:
+            # Device (re)started the transfer from this offset
+            self.session = session
+            self.sessions += 1
+            self.sent = offset
+            self.start_time = time.time()
+            self.session_offset = offset
+            sys.stdout.write("Transfer %s at offset %d\n" % (
+                "started" if self.sessions == 1 else "resumed", offset))
+        self.last_ack = offset
+        self.last_ack_time = time.time()
+        self.chunk_size, self.window = chunk_size, window
+        self.send_window(client)
+    def send_window(self, client):
+        end = min(self.last_ack + self.chunk_size * self.window,
+                  len(self.data))
+        while self.sent < end:
+            chunk = self.data[self.sent:self.sent+self.chunk_size]
+            client.publish(self.data_topic,
+                           struct.pack('<I', self.sent) + chunk)
+            self.sent += len(chunk)
+    def check_retransmit(self, client):
+        # Chunks are published with qos 0 and may be dropped
+        if (self.start_time is None or self.status is not None
+            or time.time() - self.last_ack_time < RETRANSMIT_TIME):
+            return
+        self.last_ack_time = time.time()
+        self.sent = self.last_ack
+        self.send_window(client)
+    def report(self):
+        if self.start_time is None:
+            return
+        elapsed = max(time.time() - self.start_time, .001)
+        rate = (self.last_ack - self.session_offset) / elapsed
+        sys.stdout.write("%d of %d bytes (%.1f%%) %.1f KiB/s\n" % (
+            self.last_ack, len(self.data),
+            100. * self.last_ack / len(self.data), rate / 1024.))
+        sys.stdout.flush()
+
+
+######################################################################
+# Startup
+######################################################################
+
+def run(options, data):
+    # Offer the digest appended to the image (the device compares it
+    # with the digest of its running image)
+    offer = "mqtt:%d:%s" % (len(data), data[-32:].hex())
+    ota_topic = options.prefix + "/ota_url"
+    server = ChunkServer(data, options.prefix)
+    end_time = None
+    if options.timeout:
+        end_time = time.time() + options.timeout
+    report_time = 0.
+    offered = False
+    while server.status is None:
+        if end_time is not None and time.time() > end_time:
+            sys.stdout.write("Timeout waiting for the device\n")
+            break
+        client = mqttclient.MQTTClient(options.broker, options.client_id)
+        try:
+            client.connect()
+            pid = client.subscribe([options.prefix + "/ota_ack"], qos=0)
+            if not client.wait_acks([pid], 10.):
+                raise mqttclient.error("No response to subscribe")
+            if not offered:
+                pid = client.publish(ota_topic, offer, qos=1, retain=True)
+                if not client.wait_acks([pid], 10.):
+                    raise mqttclient.error("No response to offer")
+                sys.stdout.write("Offered %s\n" % (offer,))
+                offered = True
+            while server.status is None:
+                if end_time is not None and time.time() > end_time:
+                    break
+                for msg in client.get_messages(.250):
+                    server.handle_ack(client, msg.payload)
+                server.check_retransmit(client)
+                client.flush()
+                if time.time() >= report_time:
+                    report_time = time.time() + options.report_interval
+                    server.report()
+        except (socket.error, mqttclient.error) as e:
+            sys.stderr.write("Broker connection error: %s\n" % (e,))
+            client.close()
+            time.sleep(RECONNECT_DELAY)
+            continue
+        client.close()
+    # Remove the offer so the device does not request it again
+    client = mqttclient.MQTTClient(options.broker, options.client_id)
+    client.connect()
+    client.wait_acks([client.publish(ota_topic, "", qos=1, retain=True)],
+                     10.)
+    client.close()
+    server.report()
+    if server.status is None:
+        return 1
+    sys.stdout.write("Device reports update %s (%d sessions)\n" % (
+        "installed" if server.status == "done" else "failed",
+        server.sessions))
+    return server.status != "done"
+
+def main():
+    usage = "%prog [options] <firmware.bin>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-b", "--broker", type="string", dest="broker",
+                    default="mqtt://localhost", help="broker url"
+                    " (default %default)")
+    opts.add_option("-p", "--prefix", type="string", dest="prefix",
+                    default="topic", help="device topic prefix"
+                    " (CONFIG_MQTT_TOPIC_PREFIX, default %default)")
+    opts.add_option("-c", "--client-id", type="string", dest="client_id",
+                    default="humidwifi-ota",
+                    help="MQTT client id (default %default)")
+    opts.add_option("-t", "--timeout", type="float", dest="timeout",
+                    default=0., help="seconds to wait for the update to"
+                    " complete (default no limit)")
+    opts.add_option("-r", "--report-interval", type="float",
+                    dest="report_interval", default=5.,
+                    help="seconds between progress reports")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    try:
+        mqttclient.parse_url(options.broker)
+    except mqttclient.error as e:
+        opts.error(str(e))
+    data = open(args[0], 'rb').read()
+    if (len(data) <= 32
+        or hashlib.sha256(data[:-32]).digest() != data[-32:]):
+        opts.error("Firmware image does not end with its SHA-256 digest")
+    sys.exit(run(options, data))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+# Compare full and resumed TLS handshake times with an MQTT broker
+#
+# Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, optparse, time, ssl, socket
+import mqttclient
+
+# This tool connects to a TLS broker the way the firmware does on each
+# upload (see fw/main/mqtttls.c). Each round performs a full handshake
+# and then reconnects offering the session from that handshake. Run it
+# with something like:
+#  tls_handshake.py mqtts://mqtt.local
+# Use --delay to wait between the two connections (for example, the
+# upload interval) to check that the broker still accepts the session
+# after that time. The firmware uses TLS 1.2, which is also the
+# default here.
+
+
+######################################################################
+# Measurement
+######################################################################
+
+def connect(broker, context, session):
+    client = mqttclient.MQTTClient(broker, ssl_context=context)
+    client.tls_session = session
+    start = time.time()
+    client.connect()
+    connack_time = time.time() - start
+    client.close()
+    return client, connack_time
+
+def median(values):
+    values = sorted(values)
+    return values[len(values) // 2] if values else 0.
+
+def run(options, broker):
+    version = ssl.TLSVersion.TLSv1_2
+    if options.tls13:
+        version = None
+    context = mqttclient.make_ssl_context(version)
+    full, resumed, full_total, resumed_total = [], [], [], []
+    reused = 0
+    for i in range(options.count):
+        client, total = connect(broker, context, None)
+        full.append(client.handshake_time)
+        full_total.append(total)
+        session = client.tls_session
+        if i == 0:
+            sys.stdout.write("Session: %s, ticket lifetime hint %ds,"
+                             " timeout %ds\n" % (
+                                 "ticket" if session.has_ticket
+                                 else "session id",
+                                 session.ticket_lifetime_hint,
+                                 session.timeout))
+        time.sleep(options.delay)
+        client, total = connect(broker, context, session)
+        resumed.append(client.handshake_time)
+        resumed_total.append(total)
+        if client.tls_resumed:
+            reused += 1
+    sys.stdout.write("Resumed %d of %d sessions\n" % (reused, options.count))
+    sys.stdout.write("Full handshake:    median %.2fms (connack %.2fms)\n"
+                     % (median(full) * 1000., median(full_total) * 1000.))
+    sys.stdout.write("Resumed handshake: median %.2fms (connack %.2fms)\n"
+                     % (median(resumed) * 1000.,
+                        median(resumed_total) * 1000.))
+    return reused != options.count
+
+def main():
+    usage = "%prog [options] <mqtts://broker>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-n", "--count", type="int", dest="count", default=20,
+                    help="number of full/resumed connection pairs"
+                    " (default %default)")
+    opts.add_option("-d", "--delay", type="float", dest="delay",
+                    default=0., help="seconds to wait before resuming"
+                    " a session (default %default)")
+    opts.add_option("--tls13", action="store_true", dest="tls13",
+                    help="allow TLS 1.3 (not supported by the firmware)")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    try:
+        if not mqttclient.parse_url(args[0])[4]:
+            opts.error("Broker url must start with mqtts://")
+    except mqttclient.error as e:
+        opts.error(str(e))
+    try:
+        sys.exit(run(options, args[0]))
+    except (socket.error, mqttclient.error) as e:
+        sys.stderr.write("Broker connection error: %s\n" % (e,))
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()